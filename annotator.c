@@ -144,6 +144,7 @@ bool annotate(// input
               // assumed to be stored densely.
               const uint8_t* image_bgr,
               const float*   range_image,
+              const double*  latlon,
               const int width,
               const int height,
               const int cut_off_bottom_px,
@@ -238,14 +239,23 @@ bool annotate(// input
         continue;
 
       float lat_cell,lon_cell;
-      if(!horizonator_unproject(&lat_cell, &lon_cell,
-                                x+cell_width/2, y+cell_height/2,
-                                // have range_enh, not range_en
-                                range, -1.,
-                                lat, cos_lat,
-                                lon,
-                                az_deg0, az_deg1,
-                                width, height))
+      if(latlon != NULL)
+      {
+        // The render gave me the position of each pixel
+        const double* p = &latlon[(width*(y+cell_height/2) + x+cell_width/2)*2];
+        if(isnan(p[0]))
+          continue;
+        lat_cell = (float)p[0];
+        lon_cell = (float)p[1];
+      }
+      else if(!horizonator_unproject(&lat_cell, &lon_cell,
+                                     x+cell_width/2, y+cell_height/2,
+                                     // have range_enh, not range_en
+                                     range, -1.,
+                                     lat, cos_lat,
+                                     lon,
+                                     az_deg0, az_deg1,
+                                     width, height))
         continue;
 
       char url[256];
@@ -12,6 +12,9 @@ bool annotate(// input
               // assumed to be stored densely.
               const uint8_t* image_bgr,
               const float*   range_image,
+              // (lat,lon) of each pixel, from horizonator_render_offscreen().
+              // May be NULL; then they're computed from range_image
+              const double*  latlon,
               const int width,
               const int height,
               const int cut_off_bottom_px,
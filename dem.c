@@ -8,8 +8,11 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "dem.h"
+#include "hzdem.h"
 #include "util.h"
 
 
@@ -19,13 +22,18 @@
 #define CELLS_PER_DEM_WIDTH_SRTM1          3601
 #define CELLS_PER_DEM_WIDTH_SRTM3          1201
 
+// When loading an azimuth wedge, I widen it by this much on each side
+#define WEDGE_MARGIN_DEG                   2.0f
+
 static
 bool dem_filename(// output
                   char* path, int bufsize,
 
                   // input
                   int demfileN, int demfileE,
-                  const char* datadir )
+                  const char* datadir,
+                  // ".hgt" or one of the compressed variants
+                  const char* extension )
 {
     char ns;
     char we;
@@ -59,22 +67,811 @@ bool dem_filename(// output
             MSG("User asked for ~, but the 'HOME' env var isn't defined");
             return false;
         }
-        if( snprintf(path, bufsize, "%s/%s/%c%.2d%c%.3d.hgt",
+        if( snprintf(path, bufsize, "%s/%s/%c%.2d%c%.3d%s",
                      home,
                      &datadir[2],
-                     ns, demfileN, we, demfileE) >= bufsize )
+                     ns, demfileN, we, demfileE, extension) >= bufsize )
             return false;
     }
     else
     {
-        if( snprintf(path, bufsize, "%s/%c%.2d%c%.3d.hgt",
+        if( snprintf(path, bufsize, "%s/%c%.2d%c%.3d%s",
                      datadir,
-                     ns, demfileN, we, demfileE) >= bufsize )
+                     ns, demfileN, we, demfileE, extension) >= bufsize )
             return false;
     }
     return true;
 }
 
+// Compressed DEMs (.hgt.zip or .hgt.gz) are decompressed into anonymous
+// mappings. All the files are opened first, and then the decompression runs in
+// a small pool of worker threads
+typedef struct
+{
+    char           filename[1024];
+    int            fd;
+    // .hgt.zip if true; .hgt.gz otherwise
+    bool           zip;
+
+    unsigned char* out;
+    size_t         size;
+
+    bool           result;
+} decompress_job_t;
+
+typedef struct
+{
+    decompress_job_t* jobs;
+    int               Njobs;
+    int               ijob_next;
+} decompress_pool_t;
+
+static uint32_t read_le(const unsigned char* p, int Nbytes)
+{
+    uint32_t x = 0;
+    for(int i=Nbytes-1; i>=0; i--)
+        x = (x << 8) | p[i];
+    return x;
+}
+
+// viewfinderpanoramas and others distribute zip archives. I look for the first
+// .hgt member, and inflate it. Stored (uncompressed) members are supported too
+static bool decompress_zip(decompress_job_t* job)
+{
+    bool result = false;
+
+    struct stat sb;
+    if(0 != fstat(job->fd, &sb) || sb.st_size < 22)
+    {
+        MSG("'%s' is too small to be a zip archive", job->filename);
+        return false;
+    }
+
+    const unsigned char* zip = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, job->fd, 0);
+    if(zip == MAP_FAILED)
+    {
+        MSG("Couldn't mmap '%s'", job->filename);
+        return false;
+    }
+
+    // The End Of Central Directory record is at the end of the file, followed by
+    // an optional comment of up to 64KB
+    const unsigned char* eocd = NULL;
+    for(off_t i = sb.st_size-22; i >= 0 && i >= sb.st_size-22-65535; i--)
+        if(read_le(&zip[i],4) == 0x06054b50)
+        {
+            eocd = &zip[i];
+            break;
+        }
+    if(eocd == NULL)
+    {
+        MSG("'%s' isn't a zip archive: no end-of-central-directory record", job->filename);
+        goto done;
+    }
+
+    int   Nentries = (int)read_le(&eocd[10], 2);
+    off_t icd      = (off_t)read_le(&eocd[16], 4);
+
+    for(int ientry=0; ientry<Nentries; ientry++)
+    {
+        if(icd + 46 > sb.st_size || read_le(&zip[icd],4) != 0x02014b50)
+        {
+            MSG("'%s' has a corrupt central directory", job->filename);
+            goto done;
+        }
+        const unsigned char* cd = &zip[icd];
+
+        int      method        = (int)read_le(&cd[10],2);
+        uint32_t Ncompressed   =      read_le(&cd[20],4);
+        uint32_t Nuncompressed =      read_le(&cd[24],4);
+        int      Nname         = (int)read_le(&cd[28],2);
+        off_t    ilocal        = (off_t)read_le(&cd[42],4);
+        const char* name       = (const char*)&cd[46];
+
+        icd += 46 + Nname + read_le(&cd[30],2) + read_le(&cd[32],2);
+        if(icd > sb.st_size)
+        {
+            MSG("'%s' has a corrupt central directory", job->filename);
+            goto done;
+        }
+
+        if( !(Nname >= 4 && 0 == strncasecmp(&name[Nname-4], ".hgt", 4)) )
+            continue;
+
+        if(Nuncompressed != job->size)
+        {
+            MSG("'%s' contains '%.*s' with unexpected size. Is this the right SRTM resolution?",
+                job->filename, Nname, name);
+            goto done;
+        }
+
+        if(ilocal + 30 > sb.st_size || read_le(&zip[ilocal],4) != 0x04034b50)
+        {
+            MSG("'%s' has a corrupt local header", job->filename);
+            goto done;
+        }
+        off_t idata = ilocal + 30 + read_le(&zip[ilocal+26],2) + read_le(&zip[ilocal+28],2);
+        if(idata > sb.st_size || idata + Ncompressed > sb.st_size)
+        {
+            MSG("'%s' is truncated", job->filename);
+            goto done;
+        }
+
+        if(method == 0)
+        {
+            // stored
+            if(Ncompressed != Nuncompressed)
+            {
+                MSG("'%s' has a corrupt stored member '%.*s'", job->filename, Nname, name);
+                goto done;
+            }
+            memcpy(job->out, &zip[idata], job->size);
+            result = true;
+            goto done;
+        }
+        if(method != 8)
+        {
+            MSG("'%s' uses unsupported zip compression method %d. Only deflate is supported",
+                job->filename, method);
+            goto done;
+        }
+
+        z_stream zs = { .next_in   = (Bytef*)&zip[idata],
+                        .avail_in  = Ncompressed,
+                        .next_out  = job->out,
+                        .avail_out = job->size };
+        // Negative window bits: raw deflate data without a zlib header, as zip
+        // archives store it
+        if(Z_OK != inflateInit2(&zs, -MAX_WBITS))
+        {
+            MSG("inflateInit2() failed");
+            goto done;
+        }
+        int res = inflate(&zs, Z_FINISH);
+        inflateEnd(&zs);
+        if(res != Z_STREAM_END || zs.total_out != job->size)
+        {
+            MSG("Couldn't inflate '%.*s' in '%s'", Nname, name, job->filename);
+            goto done;
+        }
+
+        result = true;
+        goto done;
+    }
+
+    MSG("'%s' doesn't contain any .hgt files", job->filename);
+
+ done:
+    munmap((void*)zip, sb.st_size);
+    return result;
+}
+
+static bool decompress_gz(decompress_job_t* job)
+{
+    // gzdopen() takes ownership of the fd on success
+    gzFile gz = gzdopen(job->fd, "rb");
+    if(gz == NULL)
+    {
+        MSG("gzdopen('%s') failed", job->filename);
+        return false;
+    }
+    job->fd = -1;
+
+    bool result =
+        gzread(gz, job->out, job->size) == (int)job->size &&
+        gzgetc(gz) == -1;
+    gzclose(gz);
+
+    if(!result)
+        MSG("Couldn't decompress '%s' or it has unexpected size. Is this the right SRTM resolution?",
+            job->filename);
+    return result;
+}
+
+static void* decompress_worker(void* cookie)
+{
+    decompress_pool_t* pool = (decompress_pool_t*)cookie;
+    while(true)
+    {
+        int ijob = __sync_fetch_and_add(&pool->ijob_next, 1);
+        if(ijob >= pool->Njobs)
+            return NULL;
+
+        decompress_job_t* job = &pool->jobs[ijob];
+        job->result = job->zip ? decompress_zip(job) : decompress_gz(job);
+        if(job->fd >= 0)
+        {
+            close(job->fd);
+            job->fd = -1;
+        }
+    }
+}
+
+static bool decompress_all(decompress_job_t* jobs, int Njobs)
+{
+    decompress_pool_t pool = {.jobs  = jobs,
+                              .Njobs = Njobs};
+
+    int  Nthreads = Njobs;
+    long Ncpus    = sysconf(_SC_NPROCESSORS_ONLN);
+    if(Ncpus > 0 && Nthreads > Ncpus)
+        Nthreads = (int)Ncpus;
+
+    // This thread does some of the work too, so I start one fewer worker
+    pthread_t threads[max_Ndems_ij*max_Ndems_ij];
+    int Nthreads_started = 0;
+    while(Nthreads_started < Nthreads-1 &&
+          0 == pthread_create(&threads[Nthreads_started], NULL,
+                              decompress_worker, &pool))
+        Nthreads_started++;
+
+    decompress_worker(&pool);
+
+    for(int i=0; i<Nthreads_started; i++)
+        pthread_join(threads[i], NULL);
+
+    for(int i=0; i<Njobs; i++)
+        if(!jobs[i].result)
+            return false;
+    return true;
+}
+
+// Tries to map the .hzdem container for DEM (i,j). Returns 1 on success, 0 if
+// the file doesn't exist and -1 on error
+static int map_hzdem(horizonator_dem_context_t* ctx,
+                     int i, int j,
+                     const char* filename)
+{
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 )
+        return 0;
+
+    struct stat sb;
+    int res = fstat(fd, &sb);
+    assert( res == 0 );
+
+    if( sb.st_size < (off_t)sizeof(hzdem_header_t) )
+    {
+        close(fd);
+        MSG("The DEM file '%s' is too small to be a .hzdem container", filename );
+        return -1;
+    }
+
+    ctx->dems      [i][j] = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ctx->mmap_sizes[i][j] = sb.st_size;
+    ctx->mmap_fd   [i][j] = fd;
+    ctx->formats   [i][j] = HORIZONATOR_DEM_FORMAT_HZDEM;
+    if( ctx->dems[i][j] == MAP_FAILED )
+    {
+        MSG("Couldn't mmap the DEM file '%s'", filename );
+        return -1;
+    }
+
+    const hzdem_header_t* header = (const hzdem_header_t*)ctx->dems[i][j];
+    if( 0 != memcmp(header->magic, HZDEM_MAGIC, sizeof(HZDEM_MAGIC)) ||
+        header->block_width != HZDEM_BLOCK_WIDTH ||
+        header->Nlevels     != HZDEM_NLEVELS )
+    {
+        MSG("The DEM file '%s' isn't a .hzdem container of a version we know", filename );
+        return -1;
+    }
+    if( (int)header->cells_per_deg != ctx->cells_per_deg )
+    {
+        MSG("The DEM file '%s' has %d cells per degree, but we expected %d. Is this the right SRTM resolution?",
+            filename, (int)header->cells_per_deg, ctx->cells_per_deg );
+        return -1;
+    }
+
+    const int Nblocks = hzdem_iblock0(ctx->cells_per_deg, HZDEM_NLEVELS);
+    if( (off_t)(sizeof(hzdem_header_t) + Nblocks*sizeof(hzdem_block_t)) > sb.st_size )
+    {
+        MSG("The DEM file '%s' is truncated", filename );
+        return -1;
+    }
+    for(int k=0; k<Nblocks; k++)
+    {
+        const hzdem_block_t* block = &header->blocks[k];
+        if( block->offset > (uint64_t)sb.st_size ||
+            (off_t)(block->offset +
+                    HZDEM_BLOCK_WIDTH*HZDEM_BLOCK_WIDTH*sizeof(int16_t)) > sb.st_size )
+        {
+            MSG("The DEM file '%s' is truncated", filename );
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+// Maps the .hztin simplified mesh for DEM (i,j), if it exists. Returns false
+// on error; a missing file isn't an error
+static bool map_hztin(horizonator_dem_context_t* ctx,
+                      int i, int j,
+                      const char* filename)
+{
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 )
+        return true;
+
+    struct stat sb;
+    int res = fstat(fd, &sb);
+    assert( res == 0 );
+
+    if( sb.st_size < (off_t)sizeof(hztin_header_t) )
+    {
+        close(fd);
+        MSG("The mesh file '%s' is too small to be a .hztin file", filename );
+        return false;
+    }
+
+    // The mapping stays valid after the fd is closed
+    ctx->tins          [i][j] = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ctx->tin_mmap_sizes[i][j] = sb.st_size;
+    close(fd);
+    if( ctx->tins[i][j] == MAP_FAILED )
+    {
+        ctx->tins[i][j] = NULL;
+        MSG("Couldn't mmap the mesh file '%s'", filename );
+        return false;
+    }
+
+    const hztin_header_t* header = (const hztin_header_t*)ctx->tins[i][j];
+    if( 0 != memcmp(header->magic, HZTIN_MAGIC, sizeof(HZTIN_MAGIC)) ||
+        header->block_cells != HZTIN_BLOCK_CELLS )
+    {
+        MSG("The mesh file '%s' isn't a .hztin file of a version we know", filename );
+        return false;
+    }
+    if( (int)header->cells_per_deg != ctx->cells_per_deg )
+    {
+        MSG("The mesh file '%s' has %d cells per degree, but we expected %d. Is this the right SRTM resolution?",
+            filename, (int)header->cells_per_deg, ctx->cells_per_deg );
+        return false;
+    }
+
+    const int Nblocks_side = hztin_Nblocks(ctx->cells_per_deg);
+    if( (off_t)(sizeof(hztin_header_t) + Nblocks_side*Nblocks_side*sizeof(hztin_block_t)) > sb.st_size )
+    {
+        MSG("The mesh file '%s' is truncated", filename );
+        return false;
+    }
+    for(int k=0; k<Nblocks_side*Nblocks_side; k++)
+    {
+        const hztin_block_t* block = &header->blocks[k];
+        if( (off_t)(block->offset +
+                    block->Nvertices     *sizeof(hztin_vertex_t) +
+                    block->Ntriangles * 3*sizeof(uint16_t)) > sb.st_size )
+        {
+            MSG("The mesh file '%s' is truncated", filename );
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Loads DEM (i,j) of ctx. Its SW corner is at demN,demE. Raw and .hzdem files
+// are mmap-ed directly. Compressed files get a buffer, and a job to fill it is
+// added to jobs[]; the caller must run these with decompress_all(). Missing
+// DEMs are left as NULL, and read as elevation 0. Returns false on error
+static bool load_tile(horizonator_dem_context_t* ctx,
+                      int i, int j,
+                      int demN, int demE,
+                      const char* datadir,
+                      int DEM_expected_file_size,
+                      decompress_job_t* jobs, int* Njobs)
+{
+    char filename[1024];
+
+    // The simplified mesh, if we have it, is an addition to the DEM
+    if( !dem_filename( filename, sizeof(filename),
+                       demN, demE,
+                       datadir, ".hztin") )
+    {
+        MSG("Couldn't construct DEM filename" );
+        return false;
+    }
+    if( !map_hztin(ctx, i, j, filename) )
+        return false;
+
+    if( !dem_filename( filename, sizeof(filename),
+                       demN, demE,
+                       datadir, ".hzdem") )
+    {
+        MSG("Couldn't construct DEM filename" );
+        return false;
+    }
+
+    // The native container is preferred, if we have it
+    int res_hzdem = map_hzdem(ctx, i, j, filename);
+    if(res_hzdem < 0)
+        return false;
+    if(res_hzdem > 0)
+        return true;
+
+    if( !dem_filename( filename, sizeof(filename),
+                       demN, demE,
+                       datadir, ".hgt") )
+    {
+        MSG("Couldn't construct DEM filename" );
+        return false;
+    }
+
+    struct stat sb;
+    ctx->mmap_fd[i][j] = open( filename, O_RDONLY );
+    if( ctx->mmap_fd[i][j] <= 0 )
+    {
+        ctx->mmap_fd[i][j] = 0;
+
+        // No raw DEM. Look for a compressed one
+        const char* compressed_extensions[] = {".hgt.zip", ".hgt.gz"};
+        decompress_job_t* job = &jobs[*Njobs];
+        job->fd = -1;
+        for(int iext=0;
+            iext < (int)(sizeof(compressed_extensions)/sizeof(compressed_extensions[0])) &&
+                job->fd < 0;
+            iext++)
+        {
+            if( !dem_filename( job->filename, sizeof(job->filename),
+                               demN, demE,
+                               datadir, compressed_extensions[iext]) )
+            {
+                MSG("Couldn't construct DEM filename" );
+                return false;
+            }
+            job->fd  = open( job->filename, O_RDONLY );
+            job->zip = (iext == 0);
+        }
+
+        if( job->fd < 0 )
+        {
+            MSG("Warning: couldn't open DEM file '%s' or its compressed variants. Assuming elevation=0 (sea surface?)", filename );
+            ctx->dems      [i][j] = NULL;
+            ctx->mmap_sizes[i][j] = 0;
+            return true;
+        }
+
+        ctx->dems      [i][j] = mmap(NULL, DEM_expected_file_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ctx->mmap_sizes[i][j] = DEM_expected_file_size;
+        if( ctx->dems[i][j] == MAP_FAILED )
+        {
+            close(job->fd);
+            MSG("Couldn't allocate the buffer to decompress '%s'", job->filename );
+            return false;
+        }
+
+        job->out  = ctx->dems[i][j];
+        job->size = DEM_expected_file_size;
+        (*Njobs)++;
+        return true;
+    }
+
+    int res = fstat(ctx->mmap_fd[i][j], &sb);
+    assert( res == 0 );
+    if(sb.st_size == 0)
+    {
+        // DEM file exists and has size 0: assume it's in the sea. This
+        // does the same thing as if the DEM file didn't exist at all,
+        // except no warning is generated
+        close(ctx->mmap_fd[i][j]);
+
+        ctx->dems      [i][j] = NULL;
+        ctx->mmap_sizes[i][j] = 0;
+        ctx->mmap_fd   [i][j] = 0;
+        return true;
+
+    }
+
+    ctx->dems      [i][j] = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, ctx->mmap_fd[i][j], 0);
+    ctx->mmap_sizes[i][j] = sb.st_size;
+
+    if( ctx->dems[i][j] == MAP_FAILED )
+    {
+        MSG("Couldn't mmap the DEM file '%s'", filename );
+        return false;
+    }
+
+    if( DEM_expected_file_size != sb.st_size )
+    {
+        MSG("The DEM file '%s' has unexpected size. Is this a 3-arc-sec SRTM DEM?", filename );
+        return false;
+    }
+
+    return true;
+}
+
+static int16_t read_dem(const horizonator_dem_context_t* ctx,
+                        const int* dem_ij,
+                        int x, int y, int level);
+
+static bool rect_in_wedge_relative(const horizonator_dem_context_t* ctx,
+                                   float x0, float y0,
+                                   float x1, float y1);
+
+// The most blocks along each side of a .hzdem container
+#define max_Nblocks_side ((CELLS_PER_DEM_WIDTH_SRTM1 + HZDEM_BLOCK_WIDTH-1) / HZDEM_BLOCK_WIDTH)
+
+// A DEM loaded by auto_radius(). horizonator_dem_init() takes it over instead
+// of loading it again
+typedef struct
+{
+    // The DEM, in dems[0][0] of a one-DEM context
+    horizonator_dem_context_t dem;
+
+    // The highest sample in each block of HZDEM_BLOCK_WIDTH x HZDEM_BLOCK_WIDTH
+    // samples, in the order of the level-0 blocks of a .hzdem container. These
+    // come from the .hzdem index if we have it, so the samples aren't read
+    bool    have_block_zmax;
+    int16_t block_zmax[max_Nblocks_side*max_Nblocks_side];
+} preloaded_tile_t;
+
+// The DEMs near the viewer: element [di+max_Ndems_ij][dj+max_Ndems_ij] is the
+// one di DEMs East and dj DEMs North of the viewer's DEM, or NULL if it wasn't
+// loaded. Anything further is out of reach
+typedef preloaded_tile_t* preloaded_tiles_t[2*max_Ndems_ij+1][2*max_Ndems_ij+1];
+
+static void set_block_zmax(preloaded_tile_t* tile)
+{
+    const int            cells_per_deg = tile->dem.cells_per_deg;
+    const int            Nblocks_side  = hzdem_Nblocks(cells_per_deg, 0);
+    const unsigned char* dem           = tile->dem.dems[0][0];
+
+    tile->have_block_zmax = true;
+    if(dem != NULL && tile->dem.formats[0][0] == HORIZONATOR_DEM_FORMAT_HZDEM)
+    {
+        const hzdem_header_t* header = (const hzdem_header_t*)dem;
+        for(int k=0; k<Nblocks_side*Nblocks_side; k++)
+            tile->block_zmax[k] = header->blocks[k].zmax;
+        return;
+    }
+
+    // A missing DEM has elevation 0 everywhere. .hgt files don't store the
+    // bounds, so I scan all the samples
+    for(int k=0; k<Nblocks_side*Nblocks_side; k++)
+        tile->block_zmax[k] = 0;
+    if(dem == NULL)
+        return;
+
+    // Each row of the .hgt runs W to E, and the rows run N to S. The values
+    // are big-endian
+    for(int y=0; y<=cells_per_deg; y++)
+    {
+        const unsigned char* row = &dem[2*(cells_per_deg - y)*(cells_per_deg+1)];
+        int16_t*             b   = &tile->block_zmax[(y / HZDEM_BLOCK_WIDTH)*Nblocks_side];
+        for(int x=0; x<=cells_per_deg; x++)
+        {
+            const int16_t z = (int16_t) ((row[2*x] << 8) | row[2*x + 1]);
+            if(z > b[x / HZDEM_BLOCK_WIDTH]) b[x / HZDEM_BLOCK_WIDTH] = z;
+        }
+    }
+}
+
+static void free_preloaded_tiles(preloaded_tiles_t preloaded)
+{
+    for(int i=0; i<2*max_Ndems_ij+1; i++)
+        for(int j=0; j<2*max_Ndems_ij+1; j++)
+            if(preloaded[i][j] != NULL)
+            {
+                horizonator_dem_deinit(&preloaded[i][j]->dem);
+                free(preloaded[i][j]);
+                preloaded[i][j] = NULL;
+            }
+}
+
+// Computes the render radius automatically. Terrain of height H at a distance
+// d from a viewer at height h0 can poke above the horizon of the curved earth
+// only if
+//
+//   d < sqrt(2 Rearth h0) + sqrt(2 Rearth H)
+//
+// I don't know H ahead of time, so I iterate: I find the highest terrain
+// within the current radius, compute the radius from that, and repeat until no
+// higher terrain comes into range. The radius only grows. I look only at the
+// DEMs in the azimuth wedge of ctx, which horizonator_dem_init() would load
+// anyway, and I give them to it in preloaded[]. The elevation bounds are kept
+// per block, so the parts of a DEM further than the radius don't count
+static bool auto_radius(// output
+                        float* radius_m,
+                        preloaded_tiles_t preloaded,
+
+                        // input
+                        const horizonator_dem_context_t* ctx,
+                        float viewer_lat, float viewer_lon,
+                        float viewer_z,
+                        const char* datadir,
+                        int DEM_expected_file_size)
+{
+    const double Rearth         = 6371000.0;
+    const double m_per_deg_lat  = Rearth * M_PI/180.;
+    const double m_per_deg_lon  = m_per_deg_lat * cos( M_PI / 180.0 * viewer_lat );
+    const int    cells_per_deg  = ctx->cells_per_deg;
+
+    // The largest radius we can load. In the worst case the square of
+    // 2*radius_cells cells straddles max_Ndems_ij DEMs. The E-W direction is
+    // the short one in meters
+    const double radius_max_m =
+        (double)((max_Ndems_ij-1)*cells_per_deg/2) / (double)cells_per_deg * m_per_deg_lon;
+
+    const int demN_viewer = (int)floorf(viewer_lat);
+    const int demE_viewer = (int)floorf(viewer_lon);
+
+    // Could any of this lat,lon rectangle be within d of the viewer, in the
+    // wedge? The wedge test wants cells relative to the viewer, grown by one
+    // cell, like horizonator_dem_rect_in_wedge()
+    bool rect_in_range(double lon0, double lat0, double lon1, double lat1,
+                       double d)
+    {
+        const double dlon = fmax(lon0 - viewer_lon, fmax(0., viewer_lon - lon1));
+        const double dlat = fmax(lat0 - viewer_lat, fmax(0., viewer_lat - lat1));
+        if( hypot(dlon*m_per_deg_lon, dlat*m_per_deg_lat) > d )
+            return false;
+        return
+            rect_in_wedge_relative(ctx,
+                                   (float)((lon0 - viewer_lon) * cells_per_deg) - 1.f,
+                                   (float)((lat0 - viewer_lat) * cells_per_deg) - 1.f,
+                                   (float)((lon1 - viewer_lon) * cells_per_deg) + 1.f,
+                                   (float)((lat1 - viewer_lat) * cells_per_deg) + 1.f);
+    }
+
+    // Loads the DEMs in range that aren't loaded yet. The compressed ones are
+    // decompressed in parallel, in batches that decompress_all() can take
+    bool load_in_range(double d)
+    {
+        decompress_job_t jobs[max_Ndems_ij*max_Ndems_ij];
+        int              Njobs = 0;
+
+        for(int di=-max_Ndems_ij; di<=max_Ndems_ij; di++)
+            for(int dj=-max_Ndems_ij; dj<=max_Ndems_ij; dj++)
+            {
+                preloaded_tile_t** tile = &preloaded[di+max_Ndems_ij][dj+max_Ndems_ij];
+                const int demE = demE_viewer + di;
+                const int demN = demN_viewer + dj;
+                if(*tile != NULL ||
+                   !( (di == 0 && dj == 0) ||
+                      rect_in_range(demE, demN, demE+1, demN+1, d)))
+                    continue;
+
+                *tile = malloc(sizeof(**tile));
+                if(*tile == NULL)
+                {
+                    MSG("malloc() failed");
+                    goto fail;
+                }
+                **tile = (preloaded_tile_t){.dem = {.cells_per_deg = cells_per_deg,
+                                                    .Ndems_ij      = {1,1}}};
+                if(!load_tile(&(*tile)->dem, 0, 0, demN, demE,
+                              datadir, DEM_expected_file_size,
+                              jobs, &Njobs))
+                    goto fail;
+
+                if(Njobs == max_Ndems_ij*max_Ndems_ij)
+                {
+                    const bool result = decompress_all(jobs, Njobs);
+                    // decompress_all() closed all the fds
+                    Njobs = 0;
+                    if(!result)
+                        return false;
+                }
+            }
+
+        if( Njobs > 0 &&
+            !decompress_all(jobs, Njobs) )
+            return false;
+
+        for(int i=0; i<2*max_Ndems_ij+1; i++)
+            for(int j=0; j<2*max_Ndems_ij+1; j++)
+                if(preloaded[i][j] != NULL && !preloaded[i][j]->have_block_zmax)
+                    set_block_zmax(preloaded[i][j]);
+        return true;
+
+    fail:
+        for(int i=0; i<Njobs; i++)
+            close(jobs[i].fd);
+        return false;
+    }
+
+    if(!load_in_range(0.))
+        return false;
+
+    double h0 = viewer_z;
+    if(h0 < 0)
+    {
+        const preloaded_tile_t* tile = preloaded[max_Ndems_ij][max_Ndems_ij];
+        int x = (int)roundf( (viewer_lon - (float)demE_viewer) * (float)cells_per_deg );
+        int y = (int)roundf( (viewer_lat - (float)demN_viewer) * (float)cells_per_deg );
+        if(x < 0)             x = 0;
+        if(x > cells_per_deg) x = cells_per_deg;
+        if(y < 0)             y = 0;
+        if(y > cells_per_deg) y = cells_per_deg;
+        const int dem_ij[2] = {};
+        h0 = (tile->dem.dems[0][0] == NULL) ? 0. : (double)read_dem(&tile->dem, dem_ij, x, y, 0);
+    }
+
+    const int Nblocks_side = hzdem_Nblocks(cells_per_deg, 0);
+    double    H            = 0.;
+    double    d;
+    while(true)
+    {
+        d = sqrt(2.*Rearth*h0) + sqrt(2.*Rearth*H);
+        if(d >= radius_max_m)
+        {
+            MSG("Warning: terrain up to %.0fm away could be visible, but I can only load %.0fm. Increase the compile-time-constant max_Ndems_ij from the current value of %d to load more",
+                d, radius_max_m, max_Ndems_ij);
+            d = radius_max_m;
+            break;
+        }
+
+        if(!load_in_range(d))
+            return false;
+
+        // The highest block with any part within d of the viewer
+        double H_new = H;
+        for(int di=-max_Ndems_ij; di<=max_Ndems_ij; di++)
+            for(int dj=-max_Ndems_ij; dj<=max_Ndems_ij; dj++)
+            {
+                const preloaded_tile_t* tile = preloaded[di+max_Ndems_ij][dj+max_Ndems_ij];
+                if(tile == NULL)
+                    continue;
+                const int demE = demE_viewer + di;
+                const int demN = demN_viewer + dj;
+
+                for(int by=0; by<Nblocks_side; by++)
+                    for(int bx=0; bx<Nblocks_side; bx++)
+                    {
+                        const double z = tile->block_zmax[by*Nblocks_side + bx];
+                        if(z <= H_new)
+                            continue;
+
+                        const int x0 = bx*HZDEM_BLOCK_WIDTH;
+                        const int y0 = by*HZDEM_BLOCK_WIDTH;
+                        int       x1 = x0 + HZDEM_BLOCK_WIDTH-1;
+                        int       y1 = y0 + HZDEM_BLOCK_WIDTH-1;
+                        if(x1 > cells_per_deg) x1 = cells_per_deg;
+                        if(y1 > cells_per_deg) y1 = cells_per_deg;
+                        if(rect_in_range(demE + (double)x0/cells_per_deg,
+                                         demN + (double)y0/cells_per_deg,
+                                         demE + (double)x1/cells_per_deg,
+                                         demN + (double)y1/cells_per_deg,
+                                         d))
+                            H_new = z;
+                    }
+            }
+
+        if(H_new <= H)
+            break;
+        H = H_new;
+    }
+
+    *radius_m = (float)d;
+    return true;
+}
+
+// Computes Ndems_ij[i] from the origin and the radius. Returns false if we need
+// more DEMs than we can store
+static bool set_Ndems(horizonator_dem_context_t* ctx, int i)
+{
+    // I will have 2*ctx->radius_cells
+    int cellij_last = ctx->origin_dem_cellij[i] + ctx->radius_cells*2-1;
+    int idem_last   = cellij_last / ctx->cells_per_deg;
+    ctx->Ndems_ij[i] = idem_last + 1;
+    if( cellij_last == idem_last*ctx->cells_per_deg )
+    {
+        // The last cell in my render is the first cell in the DEM. But
+        // adjacent DEMs have one row/col of overlap, so I can use the last
+        // row of the previous DEM
+        ctx->Ndems_ij[i]--;
+    }
+
+    if( ctx->Ndems_ij[i] > max_Ndems_ij )
+    {
+        MSG("Requested radius too large. Increase the compile-time-constant max_Ndems_ij from the current value of %d", max_Ndems_ij);
+        return false;
+    }
+    return true;
+}
+
 bool horizonator_dem_init(// output
               horizonator_dem_context_t* ctx,
 
@@ -84,17 +881,14 @@ bool horizonator_dem_init(// output
 
               int render_radius_cells, // This should be given >0
               float render_radius_m,   // or this, but not both
+              float viewer_z,
+              float az_deg0, float az_deg1,
               const char* datadir,
               bool SRTM1)
 {
-    if(render_radius_cells < 0 && render_radius_m < 0)
-    {
-        MSG("Exactly one of (render_radius_cells,render_radius_m) should be >0. Both were <0");
-        return false;
-    }
     if(render_radius_cells > 0 && render_radius_m > 0)
     {
-        MSG("Exactly one of (render_radius_cells,render_radius_m) should be >0. Both were >0");
+        MSG("At most one of (render_radius_cells,render_radius_m) should be >0. Both were >0");
         return false;
     }
 
@@ -103,6 +897,39 @@ bool horizonator_dem_init(// output
                                        (CELLS_PER_DEM_WIDTH_SRTM1 - 1) :
                                        (CELLS_PER_DEM_WIDTH_SRTM3 - 1)};
 
+    if(snprintf(ctx->datadir, sizeof(ctx->datadir), "%s", datadir) >= (int)sizeof(ctx->datadir))
+    {
+        MSG("static buffer overflow: datadir");
+        return false;
+    }
+
+    const int DEM_expected_file_size =
+        SRTM1 ?
+        (CELLS_PER_DEM_WIDTH_SRTM1*CELLS_PER_DEM_WIDTH_SRTM1*2) :
+        (CELLS_PER_DEM_WIDTH_SRTM3*CELLS_PER_DEM_WIDTH_SRTM3*2);
+
+    if(az_deg1 > az_deg0 && az_deg1 - az_deg0 < 360.f)
+    {
+        ctx->have_wedge    = true;
+        ctx->wedge_az_rad0 = az_deg0 * (float)M_PI/180.f;
+        ctx->wedge_az_rad1 = az_deg1 * (float)M_PI/180.f;
+        ctx->wedge_cos_lat = cosf( (float)M_PI / 180.0f * viewer_lat );
+    }
+
+    // The DEMs read to compute the radius automatically. These are used below
+    // instead of being loaded again
+    preloaded_tiles_t preloaded = {};
+
+    if(render_radius_cells <= 0 && render_radius_m <= 0 &&
+       !auto_radius(&render_radius_m, preloaded,
+                    ctx,
+                    viewer_lat, viewer_lon, viewer_z,
+                    datadir, DEM_expected_file_size))
+    {
+        free_preloaded_tiles(preloaded);
+        return false;
+    }
+
     if(render_radius_cells > 0)
     {
         ctx->radius_cells = render_radius_cells;
@@ -126,10 +953,9 @@ bool horizonator_dem_init(// output
         ctx->radius_cells = (int)(0.5 + (double)render_radius_m / (Rearth * M_PI/180. * cos_viewer_lat / (double)ctx->cells_per_deg));
     }
 
-    const int DEM_expected_file_size =
-        SRTM1 ?
-        (CELLS_PER_DEM_WIDTH_SRTM1*CELLS_PER_DEM_WIDTH_SRTM1*2) :
-        (CELLS_PER_DEM_WIDTH_SRTM3*CELLS_PER_DEM_WIDTH_SRTM3*2);
+    ctx->radius_m =
+        (float)( (double)ctx->radius_cells / (double)ctx->cells_per_deg *
+                 6371000.0 * M_PI/180. * cos( M_PI / 180.0 * viewer_lat ) );
 
     const float viewer_lon_lat[] = {viewer_lon, viewer_lat};
 
@@ -158,88 +984,182 @@ bool horizonator_dem_init(// output
         // assert( ctx->radius_cells-1 < (viewer_lon_lat[i] - (float)ctx->origin_dem_lon_lat [i]) * (float)cells_per_deg - (float)ctx->origin_dem_cellij [i]);
         // assert( ctx->radius_cells   > (viewer_lon_lat[i] - (float)ctx->origin_dem_lon_lat [i]) * (float)cells_per_deg - (float)ctx->origin_dem_cellij [i]);
 
-        // I will have 2*ctx->radius_cells
-        int cellij_last = ctx->origin_dem_cellij[i] + ctx->radius_cells*2-1;
-        int idem_last   = cellij_last / ctx->cells_per_deg;
-        ctx->Ndems_ij[i] = idem_last + 1;
-        if( cellij_last == idem_last*ctx->cells_per_deg )
-        {
-            // The last cell in my render is the first cell in the DEM. But
-            // adjacent DEMs have one row/col of overlap, so I can use the last
-            // row of the previous DEM
-            ctx->Ndems_ij[i]--;
-        }
-
-        if( ctx->Ndems_ij[i] > max_Ndems_ij )
+        if(!set_Ndems(ctx, i))
         {
+            free_preloaded_tiles(preloaded);
             horizonator_dem_deinit(ctx);
-            MSG("Requested radius too large. Increase the compile-time-constant max_Ndems_ij from the current value of %d", max_Ndems_ij);
             return false;
         }
+
+        ctx->wedge_viewer_cell[i] =
+            (viewer_lon_lat[i] - (float)ctx->origin_dem_lon_lat[i]) * (float)ctx->cells_per_deg -
+            (float)ctx->origin_dem_cellij[i];
     }
 
-    // I now load my DEMs. Each dems[] is a pointer to an mmap-ed source file.
-    // The ordering of dems[] is increasing latlon, with lon varying faster
+    // I now load my DEMs. Each dems[] is a pointer to an mmap-ed source file,
+    // or to an anonymous mapping containing a decompressed file. The ordering
+    // of dems[] is increasing latlon, with lon varying faster
+    decompress_job_t decompress_jobs[max_Ndems_ij*max_Ndems_ij];
+    int              Ndecompress_jobs = 0;
+
     for( int j = 0; j < ctx->Ndems_ij[1]; j++ )
         for( int i = 0; i < ctx->Ndems_ij[0]; i++ )
         {
-            char filename[1024];
-            if( !dem_filename( filename, sizeof(filename),
-                               j + ctx->origin_dem_lon_lat[1],
-                               i + ctx->origin_dem_lon_lat[0],
-                               datadir) )
-            {
-                horizonator_dem_deinit(ctx);
-                MSG("Couldn't construct DEM filename" );
-                return false;
-            }
+            ctx->formats[i][j] = HORIZONATOR_DEM_FORMAT_HGT;
 
-            struct stat sb;
-            ctx->mmap_fd[i][j] = open( filename, O_RDONLY );
-            if( ctx->mmap_fd[i][j] <= 0 )
+            // DEMs outside the view wedge aren't needed. I don't load them,
+            // and they read as elevation 0
+            const int i0 = i*ctx->cells_per_deg - ctx->origin_dem_cellij[0];
+            const int j0 = j*ctx->cells_per_deg - ctx->origin_dem_cellij[1];
+            if(!horizonator_dem_rect_in_wedge(ctx,
+                                              i0, j0,
+                                              i0 + ctx->cells_per_deg,
+                                              j0 + ctx->cells_per_deg))
             {
-                MSG("Warning: couldn't open DEM file '%s'. Assuming elevation=0 (sea surface?)", filename );
                 ctx->dems      [i][j] = NULL;
                 ctx->mmap_sizes[i][j] = 0;
-                ctx->mmap_fd   [i][j] = 0;
                 continue;
             }
 
-            int res = fstat(ctx->mmap_fd[i][j], &sb);
-            assert( res == 0 );
-            if(sb.st_size == 0)
+            // If auto_radius() read this DEM already, I take it over
+            const int di = i + ctx->origin_dem_lon_lat[0] - (int)floorf(viewer_lon);
+            const int dj = j + ctx->origin_dem_lon_lat[1] - (int)floorf(viewer_lat);
+            if(abs(di) <= max_Ndems_ij && abs(dj) <= max_Ndems_ij &&
+               preloaded[di+max_Ndems_ij][dj+max_Ndems_ij] != NULL)
             {
-                // DEM file exists and has size 0: assume it's in the sea. This
-                // does the same thing as if the DEM file didn't exist at all,
-                // except no warning is generated
-                close(ctx->mmap_fd[i][j]);
-
-                ctx->dems      [i][j] = NULL;
-                ctx->mmap_sizes[i][j] = 0;
-                ctx->mmap_fd   [i][j] = 0;
+                horizonator_dem_context_t* tile = &preloaded[di+max_Ndems_ij][dj+max_Ndems_ij]->dem;
+                ctx->dems          [i][j] = tile->dems          [0][0];
+                ctx->mmap_sizes    [i][j] = tile->mmap_sizes    [0][0];
+                ctx->mmap_fd       [i][j] = tile->mmap_fd       [0][0];
+                ctx->formats       [i][j] = tile->formats       [0][0];
+                ctx->tins          [i][j] = tile->tins          [0][0];
+                ctx->tin_mmap_sizes[i][j] = tile->tin_mmap_sizes[0][0];
+                tile->dems   [0][0] = NULL;
+                tile->mmap_fd[0][0] = 0;
+                tile->tins   [0][0] = NULL;
                 continue;
-
             }
 
-            ctx->dems      [i][j] = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, ctx->mmap_fd[i][j], 0);
-            ctx->mmap_sizes[i][j] = sb.st_size;
+            if(!load_tile(ctx, i, j,
+                          j + ctx->origin_dem_lon_lat[1],
+                          i + ctx->origin_dem_lon_lat[0],
+                          datadir, DEM_expected_file_size,
+                          decompress_jobs, &Ndecompress_jobs))
+                goto fail;
+        }
+
+    // The preloaded DEMs I didn't take over aren't needed
+    free_preloaded_tiles(preloaded);
+
+    if( Ndecompress_jobs > 0 &&
+        !decompress_all(decompress_jobs, Ndecompress_jobs) )
+    {
+        // decompress_all() closed all the fds already
+        horizonator_dem_deinit(ctx);
+        return false;
+    }
+
+    return true;
+
+ fail:
+    for(int i=0; i<Ndecompress_jobs; i++)
+        close(decompress_jobs[i].fd);
+    free_preloaded_tiles(preloaded);
+    horizonator_dem_deinit(ctx);
+    return false;
+}
+
+bool horizonator_dem_shift(horizonator_dem_context_t* ctx,
+                           int di, int dj)
+{
+    horizonator_dem_context_t ctx_old = *ctx;
+
+    const int DEM_expected_file_size =
+        (ctx->cells_per_deg+1)*(ctx->cells_per_deg+1)*2;
+
+    const int d[] = {di, dj};
+    for(int i=0; i<2; i++)
+    {
+        const int icell_origin =
+            ctx_old.origin_dem_lon_lat[i]*ctx->cells_per_deg +
+            ctx_old.origin_dem_cellij [i] +
+            d[i];
+        ctx->origin_dem_lon_lat[i] = (int)floor( (double)icell_origin / (double)ctx->cells_per_deg );
+        ctx->origin_dem_cellij [i] = icell_origin - ctx->origin_dem_lon_lat[i]*ctx->cells_per_deg;
+        ctx->wedge_viewer_cell [i] -= (float)d[i];
+
+        if(!set_Ndems(ctx, i))
+        {
+            horizonator_dem_deinit(&ctx_old);
+            *ctx = (horizonator_dem_context_t){};
+            return false;
+        }
+    }
+
+    for( int i=0; i<max_Ndems_ij; i++)
+        for( int j=0; j<max_Ndems_ij; j++)
+        {
+            ctx->dems      [i][j] = NULL;
+            ctx->mmap_sizes[i][j] = 0;
+            ctx->mmap_fd   [i][j] = 0;
+            ctx->formats   [i][j] = HORIZONATOR_DEM_FORMAT_HGT;
+            ctx->tins          [i][j] = NULL;
+            ctx->tin_mmap_sizes[i][j] = 0;
+        }
+
+    // The DEMs we had already are moved over. Only the newly-exposed ones are
+    // loaded
+    decompress_job_t decompress_jobs[max_Ndems_ij*max_Ndems_ij];
+    int              Ndecompress_jobs = 0;
 
-            if( ctx->dems[i][j] == MAP_FAILED )
+    for( int j = 0; j < ctx->Ndems_ij[1]; j++ )
+        for( int i = 0; i < ctx->Ndems_ij[0]; i++ )
+        {
+            const int i_old = i + ctx->origin_dem_lon_lat[0] - ctx_old.origin_dem_lon_lat[0];
+            const int j_old = j + ctx->origin_dem_lon_lat[1] - ctx_old.origin_dem_lon_lat[1];
+            if(i_old >= 0 && i_old < ctx_old.Ndems_ij[0] &&
+               j_old >= 0 && j_old < ctx_old.Ndems_ij[1])
             {
-                horizonator_dem_deinit(ctx);
-                MSG("Couldn't mmap the DEM file '%s'", filename );
-                return false;
+                ctx->dems      [i][j] = ctx_old.dems      [i_old][j_old];
+                ctx->mmap_sizes[i][j] = ctx_old.mmap_sizes[i_old][j_old];
+                ctx->mmap_fd   [i][j] = ctx_old.mmap_fd   [i_old][j_old];
+                ctx->formats   [i][j] = ctx_old.formats   [i_old][j_old];
+                ctx->tins          [i][j] = ctx_old.tins          [i_old][j_old];
+                ctx->tin_mmap_sizes[i][j] = ctx_old.tin_mmap_sizes[i_old][j_old];
+
+                ctx_old.dems   [i_old][j_old] = NULL;
+                ctx_old.mmap_fd[i_old][j_old] = 0;
+                ctx_old.tins   [i_old][j_old] = NULL;
+                continue;
             }
 
-            if( DEM_expected_file_size != sb.st_size )
+            if(!load_tile(ctx, i, j,
+                          j + ctx->origin_dem_lon_lat[1],
+                          i + ctx->origin_dem_lon_lat[0],
+                          ctx->datadir, DEM_expected_file_size,
+                          decompress_jobs, &Ndecompress_jobs))
             {
-                horizonator_dem_deinit(ctx);
-                MSG("The DEM file '%s' has unexpected size. Is this a 3-arc-sec SRTM DEM?", filename );
-                return false;
+                for(int k=0; k<Ndecompress_jobs; k++)
+                    close(decompress_jobs[k].fd);
+                goto fail;
             }
         }
 
+    // Whatever wasn't moved over is no longer needed
+    horizonator_dem_deinit(&ctx_old);
+
+    if( Ndecompress_jobs > 0 &&
+        !decompress_all(decompress_jobs, Ndecompress_jobs) )
+    {
+        horizonator_dem_deinit(ctx);
+        return false;
+    }
     return true;
+
+ fail:
+    horizonator_dem_deinit(&ctx_old);
+    horizonator_dem_deinit(ctx);
+    return false;
 }
 
 void horizonator_dem_deinit( horizonator_dem_context_t* ctx )
@@ -257,24 +1177,31 @@ void horizonator_dem_deinit( horizonator_dem_context_t* ctx )
                 close( ctx->mmap_fd[i][j] );
                 ctx->mmap_fd[i][j] = 0;
             }
+            if( ctx->tins[i][j] != NULL )
+            {
+                munmap( ctx->tins[i][j], ctx->tin_mmap_sizes[i][j] );
+                ctx->tins[i][j] = NULL;
+            }
         }
 }
 
-// Given coordinates index cells, in respect to the origin cell
-int16_t horizonator_dem_sample(const horizonator_dem_context_t* ctx,
-                   // Positive = towards East
-                   int i,
-                   // Positive = towards North
-                   int j)
+// Finds the DEM containing cell (i,j), and the coordinates of that cell inside
+// that DEM: from the SW corner of the DEM. Returns false if (i,j) is outside of
+// the loaded area
+static bool locate_cell(// output
+                        int* dem_ij,
+                        int* cell_ij,
+
+                        // input
+                        const horizonator_dem_context_t* ctx,
+                        int i, int j)
 {
-    if(i < 0 || j < 0) return -1;
+    if(i < 0 || j < 0) return false;
 
     // Cell coordinates inside my whole render area. Across multiple DEMs
-    int cell_ij[2] = {
-        i + ctx->origin_dem_cellij[0],
-        j + ctx->origin_dem_cellij[1] };
+    cell_ij[0] = i + ctx->origin_dem_cellij[0];
+    cell_ij[1] = j + ctx->origin_dem_cellij[1];
 
-    int dem_ij[2];
     for(int i=0; i<2; i++)
     {
         dem_ij[i]  = cell_ij[i] / ctx->cells_per_deg;
@@ -290,24 +1217,173 @@ int16_t horizonator_dem_sample(const horizonator_dem_context_t* ctx,
             cell_ij[i] = ctx->cells_per_deg;
         }
 
-        if( dem_ij[i] >= ctx->Ndems_ij[i] ) return -1;
+        if( dem_ij[i] >= ctx->Ndems_ij[i] ) return false;
     }
+    return true;
+}
 
+// Reads sample (x,y) at the given level in the given DEM. x,y are in units of
+// that level
+static int16_t read_dem(const horizonator_dem_context_t* ctx,
+                        const int* dem_ij,
+                        int x, int y, int level)
+{
     const unsigned char* dem = ctx->dems[dem_ij[0]][dem_ij[1]];
     if(dem == NULL)
         return 0;
 
+    if(ctx->formats[dem_ij[0]][dem_ij[1]] == HORIZONATOR_DEM_FORMAT_HZDEM)
+    {
+        const hzdem_header_t* header = (const hzdem_header_t*)dem;
+        const hzdem_block_t*  block  = hzdem_block(header, x, y, level);
+        const int16_t*        data   = (const int16_t*)&dem[block->offset];
+        return data[ (y % HZDEM_BLOCK_WIDTH)*HZDEM_BLOCK_WIDTH +
+                     (x % HZDEM_BLOCK_WIDTH) ];
+    }
+
+    // .hgt files have the full-res data only
+    x <<= level;
+    y <<= level;
+
     uint32_t p =
-        cell_ij[0] +
+        x +
         // DEM starts at NW corner. I flip it around to start my data at the SW
         // corner. The DEMs store an extra row/col on the edges, so I +1
-        (ctx->cells_per_deg - cell_ij[1])*(ctx->cells_per_deg+1);
+        (ctx->cells_per_deg - y)*(ctx->cells_per_deg+1);
 
     // Each value is big-endian, so I flip the bytes
     int16_t  z = (int16_t) ((dem[2*p] << 8) | dem[2*p + 1]);
     return (z < 0) ? 0 : z;
 }
 
+// Given coordinates index cells, in respect to the origin cell
+int16_t horizonator_dem_sample(const horizonator_dem_context_t* ctx,
+                   // Positive = towards East
+                   int i,
+                   // Positive = towards North
+                   int j)
+{
+    int dem_ij[2], cell_ij[2];
+    if(!locate_cell(dem_ij, cell_ij, ctx, i, j))
+        return -1;
+    return read_dem(ctx, dem_ij, cell_ij[0], cell_ij[1], 0);
+}
+
+int16_t horizonator_dem_sample_level(const horizonator_dem_context_t* ctx,
+                                     // Positive = towards East
+                                     int i,
+                                     // Positive = towards North
+                                     int j,
+                                     int level)
+{
+    int dem_ij[2], cell_ij[2];
+    if(!locate_cell(dem_ij, cell_ij, ctx, i, j))
+        return -1;
+    if(level == 0)
+        return read_dem(ctx, dem_ij, cell_ij[0], cell_ij[1], 0);
+
+    // The overview samples around (i,j), and how far (i,j) is from the first
+    // one. cells_per_deg is divisible by 2^(HZDEM_NLEVELS-1), so the last
+    // sample of the DEM is an overview sample too, and I never run off the
+    // edge. I read the second sample in each direction only if I need it
+    const int s  = 1 << level;
+    const int x0 = cell_ij[0] >> level;
+    const int y0 = cell_ij[1] >> level;
+    const int fx = cell_ij[0] & (s-1);
+    const int fy = cell_ij[1] & (s-1);
+    const int x1 = fx ? x0+1 : x0;
+    const int y1 = fy ? y0+1 : y0;
+
+    const int32_t z00 = read_dem(ctx, dem_ij, x0, y0, level);
+    const int32_t z10 = read_dem(ctx, dem_ij, x1, y0, level);
+    const int32_t z01 = read_dem(ctx, dem_ij, x0, y1, level);
+    const int32_t z11 = read_dem(ctx, dem_ij, x1, y1, level);
+    return (int16_t)
+        ( ( (z00*(s-fx) + z10*fx) * (s-fy) +
+            (z01*(s-fx) + z11*fx) * fy +
+            s*s/2 ) / (s*s) );
+}
+
+
+// Unwraps an angle x to lie within pi of an angle near. All angles in radians
+static float unwrap_near_rad(float x, float near)
+{
+    float d = (x - near) / (2.f*(float)M_PI);
+    return (d - roundf(d)) * 2.f*(float)M_PI + near;
+}
+
+bool horizonator_dem_rect_in_wedge(const horizonator_dem_context_t* ctx,
+                                   int i0, int j0,
+                                   int i1, int j1)
+{
+    // The triangles touching the rectangle extend one cell past it, so I grow
+    // the rectangle by that much. Coordinates relative to the viewer
+    return
+        rect_in_wedge_relative(ctx,
+                               (float)(i0-1) - ctx->wedge_viewer_cell[0],
+                               (float)(j0-1) - ctx->wedge_viewer_cell[1],
+                               (float)(i1+1) - ctx->wedge_viewer_cell[0],
+                               (float)(j1+1) - ctx->wedge_viewer_cell[1]);
+}
+
+// Like horizonator_dem_rect_in_wedge(), but the rectangle is given in cells
+// relative to the viewer, and it isn't grown
+static bool rect_in_wedge_relative(const horizonator_dem_context_t* ctx,
+                                   float x0, float y0,
+                                   float x1, float y1)
+{
+    if(!ctx->have_wedge)
+        return true;
+
+    // Anything containing the viewer is visible
+    if(x0 <= 0.f && x1 >= 0.f && y0 <= 0.f && y1 >= 0.f)
+        return true;
+
+    // The viewer is outside the rectangle, so the rectangle spans <pi in
+    // azimuth. I find that span from the 4 corners. The az convention matches
+    // vertex.glsl: 0 is North, 90deg is East
+    const float corners[4][2] = { {x0,y0}, {x1,y0}, {x0,y1}, {x1,y1} };
+    float az_min = 0.f, az_max = 0.f;
+    for(int k=0; k<4; k++)
+    {
+        float az = atan2f(corners[k][0]*ctx->wedge_cos_lat, corners[k][1]);
+        if(k == 0)
+        {
+            az_min = az_max = az;
+            continue;
+        }
+        az = unwrap_near_rad(az, az_min);
+        if(az < az_min) az_min = az;
+        if(az > az_max) az_max = az;
+    }
+
+    const float margin      = WEDGE_MARGIN_DEG * (float)M_PI/180.f;
+    const float rect_half   = (az_max - az_min) / 2.f;
+    const float wedge_half  = (ctx->wedge_az_rad1 - ctx->wedge_az_rad0) / 2.f + margin;
+    const float d =
+        unwrap_near_rad( (az_max + az_min)/2.f -
+                         (ctx->wedge_az_rad1 + ctx->wedge_az_rad0)/2.f,
+                         0.f );
+    return fabsf(d) <= rect_half + wedge_half;
+}
+
+const hztin_header_t* horizonator_dem_tin(const horizonator_dem_context_t* ctx,
+                                          int i, int j)
+{
+    if(i < 0 || i >= ctx->Ndems_ij[0] ||
+       j < 0 || j >= ctx->Ndems_ij[1])
+        return NULL;
+    return (const hztin_header_t*)ctx->tins[i][j];
+}
+
+bool horizonator_dem_have_tins(const horizonator_dem_context_t* ctx)
+{
+    for( int j = 0; j < ctx->Ndems_ij[1]; j++ )
+        for( int i = 0; i < ctx->Ndems_ij[0]; i++ )
+            if(ctx->tins[i][j] != NULL)
+                return true;
+    return false;
+}
 
 // Reports the lat/lon of the first and last cells. These are INCLUSIVE
 void horizonator_dem_bounds_latlon_deg(const horizonator_dem_context_t* ctx,
@@ -3,15 +3,33 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "hztin.h"
+
 // at most I allow a grid of this many DEMs. I can malloc the exact number, but
 // this is easier
-#define max_Ndems_ij 4
+#define max_Ndems_ij 8
+
+typedef enum
+{
+    // Big-endian SRTM .hgt data: either an mmap-ed .hgt file or a decompressed
+    // .hgt.zip or .hgt.gz
+    HORIZONATOR_DEM_FORMAT_HGT = 0,
+
+    // An mmap-ed .hzdem container. See hzdem.h
+    HORIZONATOR_DEM_FORMAT_HZDEM
+} horizonator_dem_format_t;
 
 typedef struct
 {
-    unsigned char* dems      [max_Ndems_ij][max_Ndems_ij];
-    size_t         mmap_sizes[max_Ndems_ij][max_Ndems_ij];
-    int            mmap_fd   [max_Ndems_ij][max_Ndems_ij];
+    unsigned char*           dems      [max_Ndems_ij][max_Ndems_ij];
+    size_t                   mmap_sizes[max_Ndems_ij][max_Ndems_ij];
+    int                      mmap_fd   [max_Ndems_ij][max_Ndems_ij];
+    horizonator_dem_format_t formats   [max_Ndems_ij][max_Ndems_ij];
+
+    // The simplified meshes of the DEMs: mmap-ed .hztin files. NULL for the
+    // DEMs that don't have one. See hztin.h
+    unsigned char*           tins          [max_Ndems_ij][max_Ndems_ij];
+    size_t                   tin_mmap_sizes[max_Ndems_ij][max_Ndems_ij];
 
     // Which DEM contains the SW corner of the render data
     int            origin_dem_lon_lat[2];
@@ -25,7 +43,21 @@ typedef struct
     // Copy of RENDER_RADIUS
     int radius_cells;
 
+    // The same radius, in meters. This is the distance to the nearest (E or W)
+    // edge of the loaded area
+    float radius_m;
+
     int cells_per_deg;
+
+    // Where the DEM files live. horizonator_dem_shift() loads more from here
+    char datadir[1024];
+
+    // If have_wedge, only the data inside this azimuth wedge around the viewer
+    // was loaded. See horizonator_dem_rect_in_wedge()
+    bool  have_wedge;
+    float wedge_az_rad0, wedge_az_rad1;
+    float wedge_viewer_cell[2];
+    float wedge_cos_lat;
 } horizonator_dem_context_t;
 
 
@@ -40,6 +72,18 @@ typedef struct
 // The grid starts at the SW corner. DEM tiles are named from the SW point
 //
 // The viewer sits between cell radius_cells-1 and radius_cells
+//
+// If both render_radius_cells and render_radius_m are <= 0, the radius is
+// selected automatically: we load out to the furthest distance where terrain
+// could still poke above the horizon of the curved earth. This uses the
+// elevation bounds of the DEMs in the azimuth wedge (below), block by block, and
+// the viewer height. The DEMs read for this aren't read again to load the
+// data. viewer_z is the viewer elevation in meters, or <0 to use the ground
+// elevation at the viewer. It is used only for the automatic radius
+//
+// If az_deg1 > az_deg0, only the DEM tiles that intersect that azimuth wedge
+// (plus a small margin) are loaded. The others read as elevation 0. If az_deg1
+// <= az_deg0, the whole area is loaded
 bool horizonator_dem_init(// output
               horizonator_dem_context_t* ctx,
 
@@ -49,11 +93,19 @@ bool horizonator_dem_init(// output
 
               int render_radius_cells, // This should be given >0
               float render_radius_m,   // or this, but not both
+              float viewer_z,
+              float az_deg0, float az_deg1,
               const char* datadir,
               bool SRTM1);
 
 void horizonator_dem_deinit( horizonator_dem_context_t* ctx );
 
+// Moves the loaded square by (di,dj) cells: the origin cell moves by that much.
+// The DEMs that are still needed are kept, and only the newly-exposed ones are
+// loaded. On failure, the context is deinit-ed
+bool horizonator_dem_shift(horizonator_dem_context_t* ctx,
+                           int di, int dj);
+
 // Given coordinates index cells, in respect to the origin cell
 int16_t horizonator_dem_sample(const horizonator_dem_context_t* ctx,
                    // Positive = towards East
@@ -61,6 +113,35 @@ int16_t horizonator_dem_sample(const horizonator_dem_context_t* ctx,
                    // Positive = towards North
                    int j);
 
+// Like horizonator_dem_sample(), but reads a decimated overview. Level 0 is the
+// full-res data; each subsequent level is decimated by 2x in each direction.
+// The overview samples lie at DEM-tile coordinates that are multiples of
+// 2^level, and the elevation at (i,j) is interpolated bilinearly from the ones
+// around it. .hzdem tiles store these overviews, so only the blocks of that
+// level are read from disk. level must be in [0,HZDEM_NLEVELS)
+int16_t horizonator_dem_sample_level(const horizonator_dem_context_t* ctx,
+                                     // Positive = towards East
+                                     int i,
+                                     // Positive = towards North
+                                     int j,
+                                     int level);
+
+// Returns true if any part of the rectangle of cells [i0,i1] x [j0,j1] (inclusive)
+// could be visible through the azimuth wedge passed to horizonator_dem_init().
+// This is conservative: a margin is applied. Always true if no wedge was given
+bool horizonator_dem_rect_in_wedge(const horizonator_dem_context_t* ctx,
+                                   int i0, int j0,
+                                   int i1, int j1);
+
+// Returns the simplified mesh of DEM (i,j), or NULL if it doesn't have one. The
+// SW corner of that DEM is at cell (i*cells_per_deg - origin_dem_cellij[0],
+// j*cells_per_deg - origin_dem_cellij[1])
+const hztin_header_t* horizonator_dem_tin(const horizonator_dem_context_t* ctx,
+                                          int i, int j);
+
+// Returns true if any of the loaded DEMs has a simplified mesh
+bool horizonator_dem_have_tins(const horizonator_dem_context_t* ctx);
+
 void horizonator_dem_bounds_latlon_deg(const horizonator_dem_context_t* ctx,
                                        float* lat0, float* lon0,
                                        float* lat1, float* lon1);
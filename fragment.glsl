@@ -1,23 +1,100 @@
 /* -*- c -*- */
 
-#version 420
+// The #version and the #defines selecting the variant are prepended by
+// compile_program() in horizonator-lib.c. See vertex.glsl
 
+#ifndef HORIZONATOR_DEPTH_ONLY
 layout(location = 0) out vec4 frag_color;
 in vec3 rgb_fragment;
+#endif
+
+#ifdef HORIZONATOR_TEXTURED
 in vec2 tex_fragment;
 uniform sampler2D tex;
+#endif
+
+#ifdef HORIZONATOR_RESAMPLE
+in vec2 resample_ndc;
+
+// Must match the block in vertex.glsl
+layout (std140, binding = 0) uniform horizonator_view
+{
+    float az_deg0, az_deg1;
+    float aspect;
+    float viewer_z;
+    float viewer_lat, cos_viewer_lat;
+    float texturemap_lon0,  texturemap_lon1;
+    float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
+    float znear, zfar;
+    float znear_color, zfar_color;
+    int   NtilesX, NtilesY;
+    int   osmtile_lowestX, osmtile_lowestY;
+    float el_deg_center;
+};
+
+// The layers of the panorama framebuffer. See horizonator_render_panorama()
+layout(binding = 1) uniform sampler2DArray panorama_color;
+layout(binding = 2) uniform sampler2DArray panorama_depth;
+
+// (az_deg0 of the panorama, degrees per sector, sector_width, height). The
+// panorama is centered at el_deg_center, like the view
+uniform vec4 panorama_cache;
+#endif
 
-uniform int NtilesX, NtilesY;
+#ifdef HORIZONATOR_GEO
+layout(location = 1) out vec4 geo_color;
+in vec3 geo_fragment;
+flat in vec2 geo_viewer;
+
+const float Rearth = 6371000.0;
+#endif
 
 
 void main(void)
 {
-    if(NtilesX == 0)
-        frag_color = vec4(rgb_fragment, 1.0);
-    else
-    {
-        vec4 texcolor     = texture( tex, tex_fragment.xy);
-        vec4 shadingcolor = vec4(rgb_fragment, 0.0);
-        frag_color = 0.7*texcolor + 0.3*shadingcolor;
-    }
+#ifdef HORIZONATOR_RESAMPLE
+    // The inverse of the projection in vertex.glsl. The azimuth in this pixel,
+    // and the elevation relative to el_deg_center
+    float deg_per_ndc = (az_deg1 - az_deg0) / 2.;
+    float az          = (az_deg0 + az_deg1) / 2. + resample_ndc.x * deg_per_ndc;
+    float el          = resample_ndc.y * deg_per_ndc / aspect;
+
+    // And the projection in geometry.glsl. Sector k covers the whole width of
+    // layer k
+    float sector_deg = panorama_cache.y;
+    int   Nsectors   = textureSize(panorama_color, 0).z;
+    float u          = mod(az - panorama_cache.x, 360.) / sector_deg;
+    int   k          = min(int(u), Nsectors-1);
+    vec3  p          = vec3(u - float(k),
+                            0.5 + el / sector_deg * panorama_cache.z / panorama_cache.w,
+                            float(k));
+
+    frag_color   = texture(panorama_color, p);
+    gl_FragDepth = texelFetch(panorama_depth,
+                              ivec3(min(ivec2(p.xy * panorama_cache.zw),
+                                        ivec2(panorama_cache.zw) - 1),
+                                    k),
+                              0).r;
+    return;
+#endif
+
+#if defined HORIZONATOR_TEXTURED
+    vec4 texcolor     = texture( tex, tex_fragment.xy);
+    vec4 shadingcolor = vec4(rgb_fragment, 0.0);
+    frag_color = 0.7*texcolor + 0.3*shadingcolor;
+#elif !defined HORIZONATOR_DEPTH_ONLY
+    frag_color = vec4(rgb_fragment, 1.0);
+#endif
+
+#ifdef HORIZONATOR_GEO
+    // Same as horizonator_unproject(). The lat, lon are offsets from the
+    // viewer, to keep the precision of the floats
+    float az       = geo_fragment.x;
+    float el       = geo_fragment.y;
+    float range_en = geo_fragment.z;
+    geo_color = vec4( degrees(range_en * cos(az) / Rearth),
+                      degrees(range_en * sin(az) / Rearth / geo_viewer.x),
+                      geo_viewer.y + range_en * tan(el),
+                      0.0 );
+#endif
 }
@@ -1,37 +1,126 @@
 /* -*- c -*- */
 
-#version 420
+// Used only by the HORIZONATOR_PANORAMA variants. The #version and the
+// #defines are prepended by compile_program() in horizonator-lib.c, like for
+// vertex.glsl
+//
+// The panorama covers the full circle, split into HORIZONATOR_PANORAMA_NSECTORS
+// sectors of equal width. Each sector is a layer of the framebuffer. Each
+// triangle is projected into the sector it lies in, like vertex.glsl projects
+// the vertices into the view, and emitted into that layer. A triangle on the
+// boundary of two sectors is emitted into both. The view state describes the
+// first sector: az_deg0,az_deg1 are its bounds, and aspect is its aspect ratio.
+// The others follow it. The sectors together may be a bit wider than the full
+// circle; the overhang isn't read back
 
 layout (triangles) in;
-layout (triangle_strip, max_vertices=3) out;
+layout (triangle_strip, max_vertices = 9) out;
 
-in  vec3 rgb[];
+// Must match the block in vertex.glsl
+layout (std140, binding = 0) uniform horizonator_view
+{
+    float az_deg0, az_deg1;
+    float aspect;
+    float viewer_z;
+    float viewer_lat, cos_viewer_lat;
+    float texturemap_lon0,  texturemap_lon1;
+    float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
+    float znear, zfar;
+    float znear_color, zfar_color;
+    int   NtilesX, NtilesY;
+    int   osmtile_lowestX, osmtile_lowestY;
+    float el_deg_center;
+};
+
+// (azimuth, elevation angle, range, horizontal range) of each vertex
+in vec4 polar_vertex[];
+
+#ifndef HORIZONATOR_DEPTH_ONLY
+in  vec3 rgb_vertex[];
 out vec3 rgb_fragment;
-in  vec2 tex[];
+#endif
+
+#ifdef HORIZONATOR_TEXTURED
+in  vec2 tex_vertex[];
 out vec2 tex_fragment;
+#endif
 
-void main()
+const float pi = 3.14159265358979;
+
+// Unwraps an angle x to lie within pi of an angle near. All angles in radians
+float unwrap_near_rad(float x, float near)
 {
-    // The azimuth is gl_Position.x. Any triangles on the seam (some vertices
-    // off on the left, and some off on the right) need to be thrown out. Those
-    // triangle will have max-az > 1 and min-az < -1 for max-min > 2. But I can
-    // be even more general. Any triangles that have max-min > 0.5 span more
-    // that 1/4 of the width of the viewport. This is never what we want, so I
-    // throw those out too.
-    if( max(max(gl_in[0].gl_Position.x,
-                gl_in[1].gl_Position.x),
-            gl_in[2].gl_Position.x) -
-        min(min(gl_in[0].gl_Position.x,
-                gl_in[1].gl_Position.x),
-            gl_in[2].gl_Position.x) > 0.5 )
-        return;
+    float d = (x - near) / (2.*pi);
+    return (d - round(d)) * 2.*pi + near;
+}
 
+// Emits the triangle into sector k, with its azimuths shifted by s
+void emit(int k, float s, float az[3],
+          float az_rad0, float sector_rad, float az_ndc_per_rad)
+{
+    float az_rad_center = az_rad0 + (float(k) + 0.5) * sector_rad;
     for(int i=0; i<3; i++)
     {
-        rgb_fragment = rgb[i];
-        tex_fragment = tex[i];
-        gl_Position  = gl_in[i].gl_Position;
+        vec4 polar = polar_vertex[i];
+        gl_Layer    = k;
+        gl_Position = vec4( (az[i] + s - az_rad_center) * az_ndc_per_rad,
+                            (polar.y - radians(el_deg_center)) * aspect * az_ndc_per_rad,
+                            ((polar.z - znear) / (zfar - znear) * 2. - 1.),
+                            1.0 );
+#ifndef HORIZONATOR_DEPTH_ONLY
+        rgb_fragment = rgb_vertex[i];
+#endif
+#ifdef HORIZONATOR_TEXTURED
+        tex_fragment = tex_vertex[i];
+#endif
         EmitVertex();
     }
     EndPrimitive();
 }
+
+void main()
+{
+    float sector_rad     = radians(az_deg1 - az_deg0);
+    float az_rad0        = radians(az_deg0);
+    float az_ndc_per_rad = 2.0 / sector_rad;
+
+    // I unwrap the whole triangle at once: relative to its first vertex, and
+    // then by a whole turn to put its middle into [az_rad0, az_rad0 + 2pi). So
+    // there's no seam: a triangle behind the viewer is unwrapped the same way
+    // for all 3 vertices. Triangles spanning more than a quarter of a sector
+    // are left out, like split_at_seam() does for a regular view. These are
+    // near the viewer, and would be badly distorted
+    float az[3];
+    az[0] = polar_vertex[0].x;
+    az[1] = unwrap_near_rad(polar_vertex[1].x, az[0]);
+    az[2] = unwrap_near_rad(polar_vertex[2].x, az[0]);
+    float az_lo = min(min(az[0], az[1]), az[2]);
+    float az_hi = max(max(az[0], az[1]), az[2]);
+    if(az_hi - az_lo > sector_rad / 4.)
+        return;
+
+    float az_mid = (az_lo + az_hi) / 2.;
+    float s      = unwrap_near_rad(az_mid, az_rad0 + pi) - az_mid;
+
+    // The triangle is narrow, so it touches at most 2 sectors. If it starts
+    // before az_rad0, the first one is sector 0, and it may end there too
+    int k0 = int(floor((az_lo + s - az_rad0) / sector_rad));
+    int k1 = int(floor((az_hi + s - az_rad0) / sector_rad));
+    int ka = max(k0, 0);
+    emit(ka, s, az, az_rad0, sector_rad, az_ndc_per_rad);
+    if(k1 != ka && k1 < HORIZONATOR_PANORAMA_NSECTORS)
+        emit(k1, s, az, az_rad0, sector_rad, az_ndc_per_rad);
+
+    // A triangle sticking out of either end of the circle is also drawn a turn
+    // over, at the other end. The sectors may extend past the end of the
+    // circle, so the copy at the end lands in the sector covering
+    // az_rad0 + 2pi
+    if(k0 < 0)
+    {
+        int k = int(floor((az_lo + s + 2.*pi - az_rad0) / sector_rad));
+        emit(min(k, HORIZONATOR_PANORAMA_NSECTORS-1), s + 2.*pi,
+             az, az_rad0, sector_rad, az_ndc_per_rad);
+    }
+    else if(az_hi + s >= az_rad0 + 2.*pi)
+        emit(0, s - 2.*pi, az, az_rad0, sector_rad, az_ndc_per_rad);
+}
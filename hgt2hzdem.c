@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <string.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hzdem.h"
+#include "util.h"
+
+// Each SRTM file is a grid of 1201x1201 samples (SRTM3) or 3601x3601 samples
+// (SRTM1). Duplicated in dem.c
+#define CELLS_PER_DEM_WIDTH_SRTM1          3601
+#define CELLS_PER_DEM_WIDTH_SRTM3          1201
+
+// Reads full-res sample (x,y) from the big-endian .hgt data. y=0 is the S edge
+static int16_t hgt_sample(const uint8_t* hgt, int cells_per_deg, int x, int y)
+{
+    uint32_t p = x + (cells_per_deg - y)*(cells_per_deg+1);
+    int16_t  z = (int16_t) ((hgt[2*p] << 8) | hgt[2*p + 1]);
+    return (z < 0) ? 0 : z;
+}
+
+static bool convert(const char* filename_hgt, const char* outdir)
+{
+    bool            result = false;
+    int             fd     = -1;
+    uint8_t*        hgt    = MAP_FAILED;
+    FILE*           fp     = NULL;
+    size_t          size   = 0;
+    hzdem_header_t* header = NULL;
+    int16_t*        block  = NULL;
+    char            filename_out[1024];
+
+    fd = open(filename_hgt, O_RDONLY);
+    if(fd < 0)
+    {
+        MSG("Couldn't open '%s'", filename_hgt);
+        goto done;
+    }
+    struct stat sb;
+    if(0 != fstat(fd, &sb))
+    {
+        MSG("Couldn't stat '%s'", filename_hgt);
+        goto done;
+    }
+    size = sb.st_size;
+
+    int cells_per_deg;
+    if(     size == CELLS_PER_DEM_WIDTH_SRTM1*CELLS_PER_DEM_WIDTH_SRTM1*2)
+        cells_per_deg = CELLS_PER_DEM_WIDTH_SRTM1 - 1;
+    else if(size == CELLS_PER_DEM_WIDTH_SRTM3*CELLS_PER_DEM_WIDTH_SRTM3*2)
+        cells_per_deg = CELLS_PER_DEM_WIDTH_SRTM3 - 1;
+    else
+    {
+        MSG("'%s' has unexpected size. It is neither a 1\" nor a 3\" SRTM tile", filename_hgt);
+        goto done;
+    }
+
+    hgt = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(hgt == MAP_FAILED)
+    {
+        MSG("Couldn't mmap '%s'", filename_hgt);
+        goto done;
+    }
+
+    // N34W118.hgt -> OUTDIR/N34W118.hzdem
+    {
+        char path[1024];
+        if(snprintf(path, sizeof(path), "%s", filename_hgt) >= (int)sizeof(path))
+        {
+            MSG("static buffer overflow: path");
+            goto done;
+        }
+        const char* base = basename(path);
+        int len_base = (int)strlen(base);
+        if(len_base > 4 && 0 == strcasecmp(&base[len_base-4], ".hgt"))
+            len_base -= 4;
+
+        char dir[1024];
+        if(outdir == NULL)
+        {
+            if(snprintf(dir, sizeof(dir), "%s", filename_hgt) >= (int)sizeof(dir))
+            {
+                MSG("static buffer overflow: dir");
+                goto done;
+            }
+            outdir = dirname(dir);
+        }
+
+        if(snprintf(filename_out, sizeof(filename_out), "%s/%.*s.hzdem",
+                    outdir, len_base, base) >= (int)sizeof(filename_out))
+        {
+            MSG("static buffer overflow: filename_out");
+            goto done;
+        }
+    }
+
+    const int    Nblocks       = hzdem_iblock0(cells_per_deg, HZDEM_NLEVELS);
+    const size_t size_header   = sizeof(hzdem_header_t) + Nblocks*sizeof(hzdem_block_t);
+    const size_t size_block    = HZDEM_BLOCK_WIDTH*HZDEM_BLOCK_WIDTH*sizeof(int16_t);
+    const size_t offset_blocks = (size_header + HZDEM_ALIGNMENT-1) / HZDEM_ALIGNMENT * HZDEM_ALIGNMENT;
+
+    header = calloc(1, offset_blocks);
+    block  = malloc(size_block);
+    if(header == NULL || block == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+
+    memcpy(header->magic, HZDEM_MAGIC, sizeof(HZDEM_MAGIC));
+    header->cells_per_deg = cells_per_deg;
+    header->block_width   = HZDEM_BLOCK_WIDTH;
+    header->Nlevels       = HZDEM_NLEVELS;
+    header->zmin          = INT16_MAX;
+    header->zmax          = INT16_MIN;
+
+    fp = fopen(filename_out, "w");
+    if(fp == NULL)
+    {
+        MSG("Couldn't open '%s' for writing", filename_out);
+        goto done;
+    }
+
+    // I write the blocks first, and then go back and write the header, which
+    // is complete at that point
+    if(0 != fseek(fp, offset_blocks, SEEK_SET))
+    {
+        MSG("Couldn't seek in '%s'", filename_out);
+        goto done;
+    }
+
+    int iblock = 0;
+    for(int level=0; level<HZDEM_NLEVELS; level++)
+    {
+        const int Nsamples         = hzdem_Nsamples(cells_per_deg, level);
+        const int Nblocks_in_level = hzdem_Nblocks (cells_per_deg, level);
+
+        for(int by=0; by<Nblocks_in_level; by++)
+            for(int bx=0; bx<Nblocks_in_level; bx++)
+            {
+                hzdem_block_t* b = &header->blocks[iblock++];
+                b->offset = offset_blocks + (iblock-1)*size_block;
+                b->zmin   = INT16_MAX;
+                b->zmax   = INT16_MIN;
+
+                for(int y=0; y<HZDEM_BLOCK_WIDTH; y++)
+                    for(int x=0; x<HZDEM_BLOCK_WIDTH; x++)
+                    {
+                        // The padding past the N and E edges replicates the
+                        // edge samples
+                        int xl = bx*HZDEM_BLOCK_WIDTH + x;
+                        int yl = by*HZDEM_BLOCK_WIDTH + y;
+                        if(xl >= Nsamples) xl = Nsamples-1;
+                        if(yl >= Nsamples) yl = Nsamples-1;
+
+                        block[y*HZDEM_BLOCK_WIDTH + x] =
+                            hgt_sample(hgt, cells_per_deg, xl << level, yl << level);
+                    }
+
+                // The extents of ALL the full-res samples in this block, not
+                // just the decimated ones
+                int x0 = ( bx   *HZDEM_BLOCK_WIDTH    ) << level;
+                int y0 = ( by   *HZDEM_BLOCK_WIDTH    ) << level;
+                int x1 = ((bx+1)*HZDEM_BLOCK_WIDTH - 1) << level;
+                int y1 = ((by+1)*HZDEM_BLOCK_WIDTH - 1) << level;
+                if(x1 > cells_per_deg) x1 = cells_per_deg;
+                if(y1 > cells_per_deg) y1 = cells_per_deg;
+                for(int y=y0; y<=y1; y++)
+                    for(int x=x0; x<=x1; x++)
+                    {
+                        int16_t z = hgt_sample(hgt, cells_per_deg, x, y);
+                        if(z < b->zmin) b->zmin = z;
+                        if(z > b->zmax) b->zmax = z;
+                    }
+
+                if(b->zmin < header->zmin) header->zmin = b->zmin;
+                if(b->zmax > header->zmax) header->zmax = b->zmax;
+
+                if(1 != fwrite(block, size_block, 1, fp))
+                {
+                    MSG("Couldn't write to '%s'", filename_out);
+                    goto done;
+                }
+            }
+    }
+
+    if( !(0 == fseek(fp, 0, SEEK_SET) &&
+          1 == fwrite(header, offset_blocks, 1, fp)) )
+    {
+        MSG("Couldn't write the header to '%s'", filename_out);
+        goto done;
+    }
+
+    result = true;
+
+ done:
+    if(fp != NULL)
+    {
+        if(0 != fclose(fp))
+        {
+            MSG("Couldn't close '%s'", filename_out);
+            result = false;
+        }
+    }
+    free(header);
+    free(block);
+    if(hgt != MAP_FAILED)
+        munmap(hgt, size);
+    if(fd >= 0)
+        close(fd);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "%s [--outdir DIRECTORY] FILE.hgt [FILE.hgt ...]\n"
+        "\n"
+        "Converts SRTM .hgt tiles to the horizonator-native .hzdem container.\n"
+        "Each N34W118.hgt produces an N34W118.hzdem. These are written to the\n"
+        "directory given by --outdir, or next to each .hgt file if omitted.\n"
+        "\n"
+        "The horizonator reads the .hzdem files in preference to the .hgt files,\n"
+        "if both exist. The .hzdem files are tiled, and contain decimated\n"
+        "overviews and per-block elevation bounds. See hzdem.h for details.\n"
+        "Both 1\" and 3\" SRTM tiles are supported; the resolution is detected\n"
+        "from the file size\n";
+
+    struct option opts[] = {
+        { "outdir",            required_argument, NULL, 'o' },
+        { "help",              no_argument,       NULL, 'h' },
+        {}
+    };
+
+    const char* outdir = NULL;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "+h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'o':
+            outdir = optarg;
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( argc-optind < 1 )
+    {
+        fprintf(stderr, "Need at least one .hgt file\n\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    for(int i=optind; i<argc; i++)
+        if(!convert(argv[i], outdir))
+            return 1;
+
+    return 0;
+}
@@ -0,0 +1,481 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <string.h>
+#include <math.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hztin.h"
+#include "util.h"
+
+// Each SRTM file is a grid of 1201x1201 samples (SRTM3) or 3601x3601 samples
+// (SRTM1). Duplicated in dem.c
+#define CELLS_PER_DEM_WIDTH_SRTM1          3601
+#define CELLS_PER_DEM_WIDTH_SRTM3          1201
+
+// Each block is simplified on a grid of GRID_WIDTH x GRID_WIDTH samples. The
+// RTIN needs 2^n + 1 of them, so HZTIN_BLOCK_CELLS must be a power of 2. The
+// vertex indices are 16-bit, so it can't be larger than 255
+#define GRID_WIDTH      (HZTIN_BLOCK_CELLS+1)
+#define GRID_NVERTICES  (GRID_WIDTH*GRID_WIDTH)
+#define GRID_NTRIANGLES (HZTIN_BLOCK_CELLS*HZTIN_BLOCK_CELLS*2)
+
+// Reads full-res sample (x,y) from the big-endian .hgt data. y=0 is the S edge
+static int16_t hgt_sample(const uint8_t* hgt, int cells_per_deg, int x, int y)
+{
+    uint32_t p = x + (cells_per_deg - y)*(cells_per_deg+1);
+    int16_t  z = (int16_t) ((hgt[2*p] << 8) | hgt[2*p + 1]);
+    return (z < 0) ? 0 : z;
+}
+
+// The RTIN is a binary tree of right triangles. Each triangle is split into two
+// by a line from its right-angle vertex to the midpoint of its hypotenuse. I
+// identify each triangle by the two ends of its hypotenuse (a,b), going
+// counter-clockwise around the right-angle vertex c. The error of each grid
+// point is the worst vertical error we'd get by not splitting any of the
+// triangles whose hypotenuse midpoint that point is, or any of their
+// descendants. This is the algorithm in Martini:
+//
+//   https://github.com/mapbox/martini
+//
+// The tree is stored implicitly, like a heap: triangle id has children 2*id and
+// 2*id+1. The two roots are ids 2 and 3. Only the triangles that have a grid
+// point at the hypotenuse midpoint are stored; the finest level is implied
+#define RTIN_NTRIANGLES (GRID_NTRIANGLES - 2)
+#define RTIN_NPARENTS   (RTIN_NTRIANGLES - HZTIN_BLOCK_CELLS*HZTIN_BLOCK_CELLS)
+
+// The hypotenuse ends (ax,ay,bx,by) of each triangle in the tree
+static void rtin_coords(// output
+                        uint16_t* coords)
+{
+    const int w = HZTIN_BLOCK_CELLS;
+    for(int i=0; i<RTIN_NTRIANGLES; i++)
+    {
+        int id = i+2;
+        int ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+        if(id & 1) { bx = by = cx = w; }
+        else       { ax = ay = cy = w; }
+
+        while((id >>= 1) > 1)
+        {
+            const int mx = (ax + bx) / 2;
+            const int my = (ay + by) / 2;
+            if(id & 1)
+            {
+                bx = ax; by = ay;
+                ax = cx; ay = cy;
+            }
+            else
+            {
+                ax = bx; ay = by;
+                bx = cx; by = cy;
+            }
+            cx = mx; cy = my;
+        }
+
+        coords[4*i + 0] = ax;
+        coords[4*i + 1] = ay;
+        coords[4*i + 2] = bx;
+        coords[4*i + 3] = by;
+    }
+}
+
+typedef struct
+{
+    // The samples and their errors. GRID_NVERTICES of each
+    int16_t z     [GRID_NVERTICES];
+    float   errors[GRID_NVERTICES];
+
+    // How many cells of this block lie inside the tile, in each direction.
+    // The rest is padding
+    int Ncells[2];
+
+    float max_error_m;
+
+    // The output. vertex_index[] maps each grid point to its index in
+    // vertices[], or -1 if it isn't used
+    int            vertex_index[GRID_NVERTICES];
+    hztin_vertex_t vertices    [GRID_NVERTICES];
+    uint16_t       indices     [GRID_NTRIANGLES*3];
+    int            Nvertices, Ntriangles;
+} rtin_block_t;
+
+static void emit_triangle(rtin_block_t* b,
+                          int x0, int y0,
+                          int ax, int ay, int bx, int by, int cx, int cy)
+{
+    // The padding past the N and E edges of the tile is thrown out. The edges
+    // of the tile are kept at full resolution, so no triangle straddles them
+    if(ax > b->Ncells[0] || bx > b->Ncells[0] || cx > b->Ncells[0] ||
+       ay > b->Ncells[1] || by > b->Ncells[1] || cy > b->Ncells[1])
+        return;
+
+    // counter-clockwise, looking down from above
+    if((bx-ax)*(cy-ay) - (by-ay)*(cx-ax) < 0)
+    {
+        int t;
+        t = bx; bx = cx; cx = t;
+        t = by; by = cy; cy = t;
+    }
+
+    const int xy[3][2] = { {ax,ay}, {bx,by}, {cx,cy} };
+    for(int k=0; k<3; k++)
+    {
+        const int p = xy[k][1]*GRID_WIDTH + xy[k][0];
+        if(b->vertex_index[p] < 0)
+        {
+            b->vertex_index[p] = b->Nvertices;
+            b->vertices[b->Nvertices++] =
+                (hztin_vertex_t){ .x = x0 + xy[k][0],
+                                  .y = y0 + xy[k][1],
+                                  .z = b->z[p] };
+        }
+        b->indices[3*b->Ntriangles + k] = b->vertex_index[p];
+    }
+    b->Ntriangles++;
+}
+
+// Splits the triangle with the hypotenuse a,b and the right-angle vertex c,
+// while the error is too large
+static void process_triangle(rtin_block_t* b,
+                             int x0, int y0,
+                             int ax, int ay, int bx, int by, int cx, int cy)
+{
+    const int mx = (ax + bx) / 2;
+    const int my = (ay + by) / 2;
+    if(abs(ax - cx) + abs(ay - cy) > 1 &&
+       b->errors[my*GRID_WIDTH + mx] > b->max_error_m)
+    {
+        process_triangle(b, x0, y0, cx, cy, ax, ay, mx, my);
+        process_triangle(b, x0, y0, bx, by, cx, cy, mx, my);
+    }
+    else
+        emit_triangle(b, x0, y0, ax, ay, bx, by, cx, cy);
+}
+
+// Simplifies the block whose SW corner is at sample (x0,y0) of the tile
+static void simplify_block(// output
+                           rtin_block_t* b,
+                           // input
+                           const uint16_t* coords,
+                           const uint8_t* hgt, int cells_per_deg,
+                           int x0, int y0,
+                           float max_error_m)
+{
+    const int w = HZTIN_BLOCK_CELLS;
+
+    b->max_error_m = max_error_m;
+    b->Ncells[0]   = cells_per_deg - x0 < w ? cells_per_deg - x0 : w;
+    b->Ncells[1]   = cells_per_deg - y0 < w ? cells_per_deg - y0 : w;
+    b->Nvertices   = 0;
+    b->Ntriangles  = 0;
+
+    for(int y=0; y<GRID_WIDTH; y++)
+        for(int x=0; x<GRID_WIDTH; x++)
+        {
+            const int p = y*GRID_WIDTH + x;
+
+            // The padding past the N and E edges replicates the edge samples
+            const int xl = x <= b->Ncells[0] ? x : b->Ncells[0];
+            const int yl = y <= b->Ncells[1] ? y : b->Ncells[1];
+            b->z[p] = hgt_sample(hgt, cells_per_deg, x0+xl, y0+yl);
+
+            // The edges of the block and the edges of the tile are kept at
+            // full resolution. These points are always used
+            b->errors[p] =
+                (x == 0 || y == 0 || x == w || y == w ||
+                 x == b->Ncells[0] || y == b->Ncells[1]) ?
+                INFINITY : 0.0f;
+
+            b->vertex_index[p] = -1;
+        }
+
+    // Finest-to-coarsest, so the children are done before their parents
+    for(int i=RTIN_NTRIANGLES-1; i>=0; i--)
+    {
+        const int ax = coords[4*i + 0];
+        const int ay = coords[4*i + 1];
+        const int bx = coords[4*i + 2];
+        const int by = coords[4*i + 3];
+        const int mx = (ax + bx) / 2;
+        const int my = (ay + by) / 2;
+        const int cx = mx + my - ay;
+        const int cy = my + ax - mx;
+
+        const int   im    = my*GRID_WIDTH + mx;
+        const float error =
+            fabsf( ((float)b->z[ay*GRID_WIDTH + ax] + (float)b->z[by*GRID_WIDTH + bx]) / 2.0f -
+                   (float)b->z[im] );
+        if(error > b->errors[im])
+            b->errors[im] = error;
+
+        // Large triangles are always split
+        if(abs(ax - bx) > HZTIN_MAX_TRIANGLE_CELLS ||
+           abs(ay - by) > HZTIN_MAX_TRIANGLE_CELLS)
+            b->errors[im] = INFINITY;
+
+        if(i < RTIN_NPARENTS)
+        {
+            const float error_left  = b->errors[ ((ay + cy)/2)*GRID_WIDTH + (ax + cx)/2 ];
+            const float error_right = b->errors[ ((by + cy)/2)*GRID_WIDTH + (bx + cx)/2 ];
+            if(error_left  > b->errors[im]) b->errors[im] = error_left;
+            if(error_right > b->errors[im]) b->errors[im] = error_right;
+        }
+    }
+
+    process_triangle(b, x0, y0, 0, 0, w, w, w, 0);
+    process_triangle(b, x0, y0, w, w, 0, 0, 0, w);
+}
+
+static bool convert(const char* filename_hgt, const char* outdir,
+                    float max_error_m)
+{
+    bool            result = false;
+    int             fd     = -1;
+    uint8_t*        hgt    = MAP_FAILED;
+    FILE*           fp     = NULL;
+    size_t          size   = 0;
+    hztin_header_t* header = NULL;
+    uint16_t*       coords = NULL;
+    rtin_block_t*   block  = NULL;
+    char            filename_out[1024];
+
+    fd = open(filename_hgt, O_RDONLY);
+    if(fd < 0)
+    {
+        MSG("Couldn't open '%s'", filename_hgt);
+        goto done;
+    }
+    struct stat sb;
+    if(0 != fstat(fd, &sb))
+    {
+        MSG("Couldn't stat '%s'", filename_hgt);
+        goto done;
+    }
+    size = sb.st_size;
+
+    int cells_per_deg;
+    if(     size == CELLS_PER_DEM_WIDTH_SRTM1*CELLS_PER_DEM_WIDTH_SRTM1*2)
+        cells_per_deg = CELLS_PER_DEM_WIDTH_SRTM1 - 1;
+    else if(size == CELLS_PER_DEM_WIDTH_SRTM3*CELLS_PER_DEM_WIDTH_SRTM3*2)
+        cells_per_deg = CELLS_PER_DEM_WIDTH_SRTM3 - 1;
+    else
+    {
+        MSG("'%s' has unexpected size. It is neither a 1\" nor a 3\" SRTM tile", filename_hgt);
+        goto done;
+    }
+
+    hgt = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(hgt == MAP_FAILED)
+    {
+        MSG("Couldn't mmap '%s'", filename_hgt);
+        goto done;
+    }
+
+    // N34W118.hgt -> OUTDIR/N34W118.hztin
+    {
+        char path[1024];
+        if(snprintf(path, sizeof(path), "%s", filename_hgt) >= (int)sizeof(path))
+        {
+            MSG("static buffer overflow: path");
+            goto done;
+        }
+        const char* base = basename(path);
+        int len_base = (int)strlen(base);
+        if(len_base > 4 && 0 == strcasecmp(&base[len_base-4], ".hgt"))
+            len_base -= 4;
+
+        char dir[1024];
+        if(outdir == NULL)
+        {
+            if(snprintf(dir, sizeof(dir), "%s", filename_hgt) >= (int)sizeof(dir))
+            {
+                MSG("static buffer overflow: dir");
+                goto done;
+            }
+            outdir = dirname(dir);
+        }
+
+        if(snprintf(filename_out, sizeof(filename_out), "%s/%.*s.hztin",
+                    outdir, len_base, base) >= (int)sizeof(filename_out))
+        {
+            MSG("static buffer overflow: filename_out");
+            goto done;
+        }
+    }
+
+    const int    Nblocks_side  = hztin_Nblocks(cells_per_deg);
+    const size_t size_header   = sizeof(hztin_header_t) + Nblocks_side*Nblocks_side*sizeof(hztin_block_t);
+    const size_t offset_blocks = (size_header + HZTIN_ALIGNMENT-1) / HZTIN_ALIGNMENT * HZTIN_ALIGNMENT;
+
+    header = calloc(1, offset_blocks);
+    coords = malloc(RTIN_NTRIANGLES*4*sizeof(coords[0]));
+    block  = malloc(sizeof(*block));
+    if(header == NULL || coords == NULL || block == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+    rtin_coords(coords);
+
+    memcpy(header->magic, HZTIN_MAGIC, sizeof(HZTIN_MAGIC));
+    header->cells_per_deg = cells_per_deg;
+    header->block_cells   = HZTIN_BLOCK_CELLS;
+    header->max_error_m   = max_error_m;
+
+    fp = fopen(filename_out, "w");
+    if(fp == NULL)
+    {
+        MSG("Couldn't open '%s' for writing", filename_out);
+        goto done;
+    }
+
+    // I write the blocks first, and then go back and write the header, which
+    // is complete at that point
+    size_t offset = offset_blocks;
+    int    iblock = 0;
+    for(int by=0; by<Nblocks_side; by++)
+        for(int bx=0; bx<Nblocks_side; bx++)
+        {
+            simplify_block(block, coords,
+                           hgt, cells_per_deg,
+                           bx*HZTIN_BLOCK_CELLS, by*HZTIN_BLOCK_CELLS,
+                           max_error_m);
+
+            hztin_block_t* b = &header->blocks[iblock++];
+            b->offset     = offset;
+            b->Nvertices  = block->Nvertices;
+            b->Ntriangles = block->Ntriangles;
+            b->zmin       = INT16_MAX;
+            b->zmax       = INT16_MIN;
+            for(int i=0; i<block->Nvertices; i++)
+            {
+                if(block->vertices[i].z < b->zmin) b->zmin = block->vertices[i].z;
+                if(block->vertices[i].z > b->zmax) b->zmax = block->vertices[i].z;
+            }
+
+            if( !(0 == fseek(fp, offset, SEEK_SET) &&
+                  1 == fwrite(block->vertices,
+                              block->Nvertices*sizeof(block->vertices[0]), 1, fp) &&
+                  1 == fwrite(block->indices,
+                              block->Ntriangles*3*sizeof(block->indices[0]), 1, fp)) )
+            {
+                MSG("Couldn't write to '%s'", filename_out);
+                goto done;
+            }
+
+            const size_t size_block =
+                block->Nvertices   *sizeof(block->vertices[0]) +
+                block->Ntriangles*3*sizeof(block->indices [0]);
+            offset += (size_block + HZTIN_ALIGNMENT-1) / HZTIN_ALIGNMENT * HZTIN_ALIGNMENT;
+        }
+
+    if( !(0 == fseek(fp, 0, SEEK_SET) &&
+          1 == fwrite(header, offset_blocks, 1, fp)) )
+    {
+        MSG("Couldn't write the header to '%s'", filename_out);
+        goto done;
+    }
+
+    result = true;
+
+ done:
+    if(fp != NULL)
+    {
+        if(0 != fclose(fp))
+        {
+            MSG("Couldn't close '%s'", filename_out);
+            result = false;
+        }
+    }
+    free(header);
+    free(coords);
+    free(block);
+    if(hgt != MAP_FAILED)
+        munmap(hgt, size);
+    if(fd >= 0)
+        close(fd);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "%s [--outdir DIRECTORY] [--max-error METERS] FILE.hgt [FILE.hgt ...]\n"
+        "\n"
+        "Converts SRTM .hgt tiles to simplified meshes in the horizonator-native\n"
+        ".hztin format. Each N34W118.hgt produces an N34W118.hztin. These are\n"
+        "written to the directory given by --outdir, or next to each .hgt file if\n"
+        "omitted.\n"
+        "\n"
+        "Each tile is triangulated with an RTIN: the triangles are split until\n"
+        "the mesh is within --max-error meters of the DEM, vertically. Flat areas\n"
+        "thus need far fewer triangles than the dense grid. The default error\n"
+        "bound is 5m. If the .hztin files are found next to the DEMs, the\n"
+        "horizonator draws them instead of the dense grid. See hztin.h for\n"
+        "details. Both 1\" and 3\" SRTM tiles are supported; the resolution is\n"
+        "detected from the file size\n";
+
+    struct option opts[] = {
+        { "outdir",            required_argument, NULL, 'o' },
+        { "max-error",         required_argument, NULL, 'e' },
+        { "help",              no_argument,       NULL, 'h' },
+        {}
+    };
+
+    const char* outdir      = NULL;
+    float       max_error_m = 5.0f;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "+h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'o':
+            outdir = optarg;
+            break;
+
+        case 'e':
+            max_error_m = (float)atof(optarg);
+            if(max_error_m < 0.0f)
+            {
+                fprintf(stderr, "--max-error must be >= 0\n");
+                return 1;
+            }
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( argc-optind < 1 )
+    {
+        fprintf(stderr, "Need at least one .hgt file\n\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    for(int i=optind; i<argc; i++)
+        if(!convert(argv[i], outdir, max_error_m))
+            return 1;
+
+    return 0;
+}
@@ -8,6 +8,11 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include <epoxy/gl.h>
 #include <epoxy/glx.h>
@@ -18,6 +23,7 @@
 #include "horizonator.h"
 #include "bench.h"
 #include "dem.h"
+#include "hzdem.h"
 #include "util.h"
 
 
@@ -26,6 +32,11 @@
 #define OSM_TILE_WIDTH      256
 #define OSM_TILE_HEIGHT     256
 
+// glGetError() waits for the GL to catch up, so the release builds don't
+// check
+#ifdef NDEBUG
+#define assert_opengl() do {} while(0)
+#else
 #define assert_opengl()                                 \
     do {                                                \
         int error = glGetError();                       \
@@ -35,856 +46,5247 @@
             assert(0);                                  \
         }                                               \
     } while(0)
+#endif
 
 
-// The main init routine. We support 3 modes:
-//
-// - GLUT: static window    (use_glut = true, offscreen_width <= 0)
-// - GLUT: offscreen render (use_glut = true, offscreen_width > 0)
-// - no GLUT: higher-level application (use_glut = false)
-//
-// This routine loads the DEMs around the viewer (viewer is at the center of the
-// DEMs). The render can then be updated by calling any of
-// - horizonator_move()
-// - horizonator_pan_zoom()
-// - horizonator_resized()
-// and then
-// - horizonator_redraw()
-//
-// If rendering off-screen, horizonator_resized() is not allowed.
-// horizonator_pan_zoom() must be called to update the azimuth extents.
-// Completely arbitrarily, these are set to -45deg - 45deg initially
-//
-// SRTM1 selects between 1" SRTM and 3" SRTM. Currently every triangle is
-// rendered, so 1" SRTM tiles can easily overload the machine. Unless you need
-// the extra resolution, stick with 3" SRTM tiles for now
-bool horizonator_init( // output
-                       horizonator_context_t* ctx,
+// Each chunk is a grid of CHUNK_WIDTH x CHUNK_WIDTH vertices, stored with the
+// E-W direction varying faster
+#define CHUNK_WIDTH      (HORIZONATOR_CHUNK_CELLS+1)
+#define CHUNK_NVERTICES  (CHUNK_WIDTH*CHUNK_WIDTH)
+#define CHUNK_NTRIANGLES (HORIZONATOR_CHUNK_CELLS*HORIZONATOR_CHUNK_CELLS*2)
 
-                       // input
-                       float viewer_lat, float viewer_lon,
-                       // output/input
-                       // if viewer_z==NULL, auto-select a value; if *viewer_z >=
-                       // 0, use that; if *viewer_z < 0, auto-select a value, and
-                       // report it here
-                       float* viewer_z,
-                       int offscreen_width, int offscreen_height,
-                       int render_radius_cells, // This should be given >0
-                       float render_radius_m,   // or this, but not both
+static_assert(CHUNK_NVERTICES <= 65536,
+              "The chunk indices must fit into a GLushort");
 
-                       bool use_glut,
-                       bool render_texture,
-                       bool SRTM1,
-                       const char* dir_dems,
-                       const char* dir_tiles,
-                       const char* tiles_name,
-                       const char* tiles_url_fmt,
-                       bool allow_downloads)
+// Makes the index buffer shared by all the chunks. The element-array binding is
+// part of the VAO state, so I fill the buffer through a different binding point
+// here, and bind it as GL_ELEMENT_ARRAY_BUFFER into each VAO later
+//
+// The buffer holds the pattern of each level of detail, one after the other;
+// their sizes and byte offsets are returned in lod_counts, lod_offsets. Level k
+// triangulates cells of s = 2^k x 2^k vertices. The interior cells are split
+// into two triangles, like the full pattern. The cells on the edge of the chunk
+// are drawn as fans around their center, to keep every vertex along the edge
+// of the chunk: the neighboring chunk may be drawn at a different level, and
+// the two must meet without cracks
+static GLuint make_chunk_index_buffer(// output
+                                      int32_t*     lod_counts,
+                                      const void** lod_offsets)
 {
-    *ctx = (horizonator_context_t){};
-
-    bool result             = false;
-    bool dem_context_inited = false;
-
+    // The full pattern is the largest, and each coarser one is at most half
+    // as large as the one before it
+    const int Nmax = CHUNK_NTRIANGLES*3*2;
+    GLushort* indices = malloc(Nmax*sizeof(indices[0]));
+    if(indices == NULL)
+    {
+        MSG("malloc() failed");
+        return 0;
+    }
 
-    if(tiles_name == NULL)
-        tiles_name = "mapnik";
-    if(tiles_url_fmt == NULL)
-        tiles_url_fmt = "https://a.tile.openstreetmap.org/%d/%d/%d.png";
-    if(dir_dems  == NULL)
-        dir_dems  = SRTM1 ?
-            "~/.horizonator/DEMs_SRTM1" :
-            "~/.horizonator/DEMs_SRTM3";
+    int idx = 0;
+    void add_triangle(int i0, int j0, int i1, int j1, int i2, int j2)
+    {
+        indices[idx++] = j0*CHUNK_WIDTH + i0;
+        indices[idx++] = j1*CHUNK_WIDTH + i1;
+        indices[idx++] = j2*CHUNK_WIDTH + i2;
+    }
 
-    char _dir_tiles[256];
-    if(dir_tiles == NULL)
-        dir_tiles = "~/.horizonator/tiles";
-    if(dir_tiles[0] == '~' && dir_tiles[1] == '/' )
+    for(int k=0; k<HORIZONATOR_NLODS; k++)
     {
-        const char* home = getenv("HOME");
-        if(home == NULL)
+        const int s  = 1 << k;
+        const int n  = HORIZONATOR_CHUNK_CELLS / s;
+        const int istart = idx;
+        for( int cj=0; cj<n; cj++ )
         {
-            MSG("User asked for ~, but the 'HOME' env var isn't defined");
-            return false;
-        }
+            for( int ci=0; ci<n; ci++ )
+            {
+                const int ia = ci*s, ib = ia + s;
+                const int ja = cj*s, jb = ja + s;
+                if(k == 0 || (ci > 0 && ci < n-1 && cj > 0 && cj < n-1))
+                {
+                    add_triangle(ia,ja, ib,jb, ia,jb);
+                    add_triangle(ia,ja, ib,ja, ib,jb);
+                    continue;
+                }
 
-        int len = snprintf(_dir_tiles, sizeof(_dir_tiles),
-                           "%s/%s",
-                           home, &dir_tiles[2]);
-        if(len >= (int)sizeof(_dir_tiles))
-        {
-            MSG("static buffer overflow: _dir_tiles");
-            return false;
+                // A cell on the edge of the chunk. I walk its boundary
+                // counterclockwise, in steps of 1 along the edge of the chunk,
+                // and corner-to-corner elsewhere
+                const int ic = ia + s/2, jc = ja + s/2;
+                int i = ia, j = ja;
+                void walk(int di, int dj, bool chunk_edge)
+                {
+                    const int step = chunk_edge ? 1 : s;
+                    for(int t=0; t<s; t+=step)
+                    {
+                        add_triangle(ic,jc, i,j, i+di*step,j+dj*step);
+                        i += di*step;
+                        j += dj*step;
+                    }
+                }
+                walk( 1, 0, ja == 0);
+                walk( 0, 1, ib == HORIZONATOR_CHUNK_CELLS);
+                walk(-1, 0, jb == HORIZONATOR_CHUNK_CELLS);
+                walk( 0,-1, ia == 0);
+            }
         }
-        dir_tiles = _dir_tiles;
+        lod_counts [k] = idx - istart;
+        lod_offsets[k] = (const void*)((intptr_t)istart*sizeof(indices[0]));
     }
+    assert(lod_counts[0] == CHUNK_NTRIANGLES*3);
+    assert(idx <= Nmax);
 
-    ctx->use_glut = use_glut;
-    if(use_glut)
-    {
-        bool double_buffered = offscreen_width <= 0;
+    GLuint indexBufID;
+    glGenBuffers(1, &indexBufID);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, indexBufID);
+    glBufferData(GL_COPY_WRITE_BUFFER, idx*sizeof(indices[0]), indices, GL_STATIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 
-        static bool global_inited = false;
-        if(!global_inited)
-        {
-            glutInitContextFlags(GLUT_FORWARD_COMPATIBLE);
-            glutInitContextVersion(4,2);
-            glutInitContextProfile(GLUT_CORE_PROFILE);
-            glutInit(&(int){1}, &(char*){"exec"});
-            global_inited = true;
-        }
+    free(indices);
+    return indexBufID;
+}
 
-        glutInitDisplayMode( GLUT_RGB | GLUT_DEPTH |
-                             (double_buffered ? GLUT_DOUBLE : 0) );
-        glutInitWindowSize(1024,1024);
+#define VBO_USES_INTEGERS 1
 
-        // when offscreen, I really don't want to glutCreateWindow(), but for some
-        // reason not doing this causes glewInit() to segfault...
-        ctx->glut_window = glutCreateWindow("horizonator");
-        if(offscreen_width > 0)
-        {
-            glutHideWindow();
+#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
+// 16-bit integers
+typedef GLshort vertex_t;
+#define VERTEX_GLTYPE GL_SHORT
+#else
+// 32-bit floats. These take more space
+typedef GLfloat vertex_t;
+#define VERTEX_GLTYPE GL_FLOAT
+#endif
 
-            // Needed to get unpadded images from glReadPixels(). Otherwise
-            // images with width not divisible by 4 come out distorted
-            glPixelStorei(GL_PACK_ALIGNMENT,  1);
-            assert_opengl();
-        }
+// Each vertex in a feedback cache is the vec4 polar_feedback in vertex.glsl
+#define FEEDBACK_VERTEX_SIZE (4*sizeof(GLfloat))
+
+// Makes the feedback cache of a mesh: see horizonator_feedback_t. Its vertex
+// arrays read the vertices from vertexBufID, and the indices from indexBufID
+// and near_indexBufID, like the vertex arrays of the mesh. near_indexBufID may
+// be 0 if the mesh doesn't have one. The cache itself is allocated when it's
+// first captured, in update_feedback()
+static void init_feedback(horizonator_feedback_t* fb,
+                          GLuint vertexBufID, GLenum vertex_gltype,
+                          GLuint indexBufID, GLuint near_indexBufID)
+{
+    static_assert(sizeof(GLuint) == sizeof(fb->bufID),
+                  "horizonator_feedback_t.bufID must be a GLuint");
 
-        const char* version = (const char*)glGetString(GL_VERSION);
+    glGenBuffers(1, &fb->bufID);
 
-        // MSG("glGetString(GL_VERSION) says we're using GL %s", version);
-        // MSG("Epoxy says we're using GL %d", epoxy_gl_version());
+    GLuint make_vertex_array(GLuint elementBufID)
+    {
+        GLuint vertexArrayID;
+        glGenVertexArrays(1, &vertexArrayID);
+        glBindVertexArray(vertexArrayID);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBufID);
 
-        if (version[0] == '1')
-        {
-            if (!glutExtensionSupported("GL_ARB_vertex_shader")) {
-                MSG("Sorry, GL_ARB_vertex_shader is required.");
-                goto done;
-            }
-            if (!glutExtensionSupported("GL_ARB_fragment_shader")) {
-                MSG("Sorry, GL_ARB_fragment_shader is required.");
-                goto done;
-            }
-            if (!glutExtensionSupported("GL_ARB_vertex_buffer_object")) {
-                MSG("Sorry, GL_ARB_vertex_buffer_object is required.");
-                goto done;
-            }
-            if (!glutExtensionSupported("GL_EXT_framebuffer_object")) {
-                MSG("GL_EXT_framebuffer_object not found!");
-                goto done;
-            }
-        }
+        // The vertices are still needed for the texture coordinates
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBufID);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, vertex_gltype, GL_FALSE, 0, NULL);
+
+        glBindBuffer(GL_ARRAY_BUFFER, fb->bufID);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return vertexArrayID;
     }
 
-    static_assert(sizeof(GLint) == sizeof(ctx->uniform_aspect),
-                  "horizonator_context_t.uniform_... must be a GLint");
+    fb->vertexArrayID = make_vertex_array(indexBufID);
+    if(near_indexBufID != 0)
+        fb->near_vertexArrayID = make_vertex_array(near_indexBufID);
+}
 
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_CULL_FACE);
-    glClearColor(0, 0, 1, 0);
+static void deinit_feedback(horizonator_feedback_t* fb)
+{
+    if(fb->bufID != 0)
+        glDeleteBuffers(1, &fb->bufID);
+    if(fb->vertexArrayID != 0)
+        glDeleteVertexArrays(1, &fb->vertexArrayID);
+    if(fb->near_vertexArrayID != 0)
+        glDeleteVertexArrays(1, &fb->near_vertexArrayID);
+    *fb = (horizonator_feedback_t){};
+}
 
-    if( !horizonator_dem_init( &ctx->dems,
-                   viewer_lat, viewer_lon,
-                   render_radius_cells,
-                   render_radius_m,
-                   dir_dems,
-                   SRTM1) )
+// Marks the vertices [i0,i1) of a mesh as changed. Their cached coordinates are
+// recaptured by the next update_feedback()
+static void invalidate_feedback(horizonator_feedback_t* fb, int i0, int i1)
+{
+    if(fb->dirty1 <= fb->dirty0)
     {
-        MSG("Couldn't init DEMs. Giving up");
-        goto done;
+        fb->dirty0 = i0;
+        fb->dirty1 = i1;
+        return;
     }
-    dem_context_inited = true;
-
-    render_radius_cells = ctx->dems.radius_cells;
+    if(i0 < fb->dirty0) fb->dirty0 = i0;
+    if(i1 > fb->dirty1) fb->dirty1 = i1;
+}
 
-    // Dense triangulation. This may be adjusted below
-    int Nvertices   = (2*render_radius_cells) * (2*render_radius_cells);
-    ctx->Ntriangles = (2*render_radius_cells - 1)*(2*render_radius_cells - 1) * 2;
+// Sets the per-draw uniforms of a program for drawing a layer, or the polar
+// mesh, which is in the cell coordinates of layers[0]. The vertices are
+// relative to the anchor of the layer
+static void set_layer_uniforms(const horizonator_program_t* program,
+                               const horizonator_layer_t*   layer)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
+    const GLuint id = program->id;
+
+    glProgramUniform1f(id, program->uniform_DEG_PER_CELL,
+                       1.0f / (float)dems->cells_per_deg);
+    glProgramUniform1f(id, program->uniform_origin_cell_lon_deg,
+                       (float)((double)layer->anchor_cell[0] / (double)dems->cells_per_deg));
+    glProgramUniform1f(id, program->uniform_origin_cell_lat_deg,
+                       (float)((double)layer->anchor_cell[1] / (double)dems->cells_per_deg));
+    glProgramUniform1f(id, program->uniform_viewer_cell_i, layer->viewer_cell_i);
+    glProgramUniform1f(id, program->uniform_viewer_cell_j, layer->viewer_cell_j);
+}
 
-    typedef struct
+// Recaptures the out-of-date part of the feedback cache of a mesh with
+// Nvertices vertices. vertexArrayID is the mesh's own vertex array, and layer
+// is the one whose cell coordinates it uses. Called from horizonator_redraw().
+// This leaves the capture program bound
+static void update_feedback(horizonator_context_t* ctx,
+                            horizonator_feedback_t* fb,
+                            GLuint vertexArrayID,
+                            int Nvertices,
+                            const horizonator_layer_t* layer)
+{
+    if(Nvertices != fb->Nvertices)
     {
-        // How many tiles we have in each direction
-        int NtilesXY[2];
+        glBindBuffer(GL_COPY_WRITE_BUFFER, fb->bufID);
+        glBufferData(GL_COPY_WRITE_BUFFER,
+                     (GLsizeiptr)Nvertices*FEEDBACK_VERTEX_SIZE, NULL,
+                     GL_DYNAMIC_COPY);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        fb->Nvertices = Nvertices;
+        invalidate_feedback(fb, 0, Nvertices);
+    }
 
-        // Lowest and highest OSM tile indices. These increase towards E and
-        // towards S (i.e. in the opposite direction as latitude)
-        int osmtile_lowestXY [2];
-        int osmtile_highestXY[2];
+    const int i0 = fb->dirty0 > 0         ? fb->dirty0 : 0;
+    const int i1 = fb->dirty1 < Nvertices ? fb->dirty1 : Nvertices;
+    fb->dirty0 = fb->dirty1 = 0;
+    if(i1 <= i0)
+        return;
+
+    // Each vertex is a point, and the transform feedback writes the outputs
+    // of the vertex shader into the bound range of the cache. Nothing is
+    // rasterized
+    const horizonator_program_t* program = &ctx->programs[HORIZONATOR_PROGRAM_CAPTURE];
+    glUseProgram(program->id);
+    set_layer_uniforms(program, layer);
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBindVertexArray(vertexArrayID);
+    glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, fb->bufID,
+                      (GLintptr)i0*FEEDBACK_VERTEX_SIZE,
+                      (GLsizeiptr)(i1-i0)*FEEDBACK_VERTEX_SIZE);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, i0, i1-i0);
+    glEndTransformFeedback();
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glDisable(GL_RASTERIZER_DISCARD);
+    assert_opengl();
+}
 
-    } texture_ctx_t;
-    texture_ctx_t texture_ctx = {};
+// The cell offset from the anchor of this layer to the origin of its DEMs. The
+// vertices are stored relative to the anchor, so the chunks that have already
+// been built remain valid when the DEMs move
+static void layer_anchor_offset(// output
+                                int* offset,
+                                // input
+                                const horizonator_layer_t* layer)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
+    for(int k=0; k<2; k++)
+        offset[k] =
+            dems->origin_dem_lon_lat[k]*dems->cells_per_deg +
+            dems->origin_dem_cellij [k] -
+            layer->anchor_cell[k];
+}
 
-    ctx->render_texture = render_texture;
+// How far the viewer may get from the center of the DEMs of a sliding layer, in
+// cells in each direction, before horizonator_move() moves them: a quarter of
+// the radius, but at least one chunk. horizonator_dem_init() puts the viewer
+// at the center: cell radius_cells-1 relative to the DEM origin
+static int slide_threshold_cells(const horizonator_dem_context_t* dems)
+{
+    return
+        dems->radius_cells/4 > HORIZONATOR_CHUNK_CELLS ?
+        dems->radius_cells/4 : HORIZONATOR_CHUNK_CELLS;
+}
+
+// The far-off terrain is sampled from the decimated overviews of the DEMs (see
+// hzdem.h), so the full-resolution .hzdem blocks are read from disk only near
+// the viewer. Level L is used where its samples, 2^L cells apart, subtend at
+// most OVERVIEW_MAX_RAD as seen by the viewer: well under a pixel in the usual
+// views
+#define OVERVIEW_MAX_RAD 1e-3f
+
+// The coarsest overview level that can be used d_m from the viewer, in DEMs
+// whose cells are m_per_cell apart N-S. That's their widest spacing
+static int overview_level(float d_m, float m_per_cell)
+{
+    int level = 0;
+    while(level+1 < HZDEM_NLEVELS &&
+          (float)(1 << (level+1)) * m_per_cell <= OVERVIEW_MAX_RAD * d_m)
+        level++;
+    return level;
+}
 
-    if(render_texture)
+// The overview levels at the nearest and furthest points of the rectangle of
+// cells [i0,i1] x [j0,j1] of a layer, relative to its DEM origin. The chunks
+// are built once for each position of the DEMs, and the viewer can then be
+// anywhere within slide_threshold_cells() of their center. So I use the
+// distances from that area. The layers that don't slide assume that the viewer
+// stays there too, like their wedge or texture do. The simplified meshes and
+// the blocks between them are always at full resolution
+static void rect_overview_levels(// output
+                                 int* level_min, int* level_max,
+                                 // input
+                                 const horizonator_layer_t* layer,
+                                 int i0, int j0, int i1, int j1)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
+    if(layer->tin)
     {
-        GLuint texID;
-        glGenTextures(1, &texID);
+        *level_min = *level_max = 0;
+        return;
+    }
 
-        void getOSMTileID( // output tile indices
-                          int* x, int* y,
+    const float Rearth = 6371000.0f;
+    const int   c      = dems->radius_cells - 1;
+    const int   t      = slide_threshold_cells(dems);
+
+    // The DEMs span a few degrees at most, so I use the scale at their center
+    const float lat =
+        (float)dems->origin_dem_lon_lat[1] +
+        (float)(dems->origin_dem_cellij[1] + c) / (float)dems->cells_per_deg;
+    float m_per_cell[2];
+    m_per_cell[1] = Rearth * (float)M_PI / 180.0f / (float)dems->cells_per_deg;
+    m_per_cell[0] = m_per_cell[1] * cosf(lat * (float)M_PI / 180.0f);
+
+    // The gaps between the rectangle and [c-t, c+t] x [c-t, c+t] along each
+    // axis, at its nearest and furthest points
+    int near[2], far[2];
+    const int lo[2] = {i0, j0};
+    const int hi[2] = {i1, j1};
+    for(int k=0; k<2; k++)
+    {
+        near[k] = lo[k] - (c+t);
+        if(near[k] < (c-t) - hi[k]) near[k] = (c-t) - hi[k];
+        if(near[k] < 0)             near[k] = 0;
+
+        far[k] = abs(lo[k] - c);
+        if(far[k] < abs(hi[k] - c)) far[k] = abs(hi[k] - c);
+        far[k] -= t;
+        if(far[k] < 0)              far[k] = 0;
+    }
 
-                          // input
-                          // latlon, in degrees
-                          float E, float N)
-        {
-            // from https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
-            float n = (float)( 1 << OSM_RENDER_ZOOM);
+    *level_min = overview_level(hypotf((float)near[0] * m_per_cell[0],
+                                       (float)near[1] * m_per_cell[1]),
+                                m_per_cell[1]);
+    *level_max = overview_level(hypotf((float)far[0] * m_per_cell[0],
+                                       (float)far[1] * m_per_cell[1]),
+                                m_per_cell[1]);
+}
 
-            // convert E,N to radians. The interpolation coefficients assume this
-            E *= (float)M_PI/180.0f;
-            N *= (float)M_PI/180.0f;
+// The elevation of vertex (i,j) of a layer, relative to its DEM origin, from
+// the overview level that rect_overview_levels() picks for it. If level >= 0,
+// I use that level instead: the caller knows it already
+static int16_t layer_sample(const horizonator_layer_t* layer,
+                            int i, int j, int level)
+{
+    if(level < 0)
+        rect_overview_levels(&level, &level, layer, i, j, i, j);
+    return horizonator_dem_sample_level(&layer->dems, i, j, level);
+}
 
-            float lon0 = n / 2.0f;
-            float lon1 = n / ((float)M_PI * 2.0f);
-            *x = (int)( fminf( n, fmaxf( 0.0f, E*lon1 + lon0 )));
-            *y = (int)( n/2.0f * (1.0f -
-                                  logf( (sinf(N) + 1.0f)/cosf(N) ) /
-                                  (float)M_PI) );
+// Fills in the vertices of one chunk: CHUNK_NVERTICES (i,j,z) tuples. i0,j0 is
+// the SW cell of the chunk, in the cell coordinates of the DEMs
+static void build_chunk(// output
+                        vertex_t* vertices,
+                        // input
+                        const horizonator_layer_t* layer,
+                        int i0, int j0)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
+    const int Ncells = 2*dems->radius_cells - 1;
+
+    int offset[2];
+    layer_anchor_offset(offset, layer);
+
+    // If the whole chunk uses the same overview level, I look it up once
+    int i1 = i0 + HORIZONATOR_CHUNK_CELLS;
+    int j1 = j0 + HORIZONATOR_CHUNK_CELLS;
+    if(i1 > Ncells) i1 = Ncells;
+    if(j1 > Ncells) j1 = Ncells;
+    int level_min, level_max;
+    rect_overview_levels(&level_min, &level_max, layer, i0, j0, i1, j1);
+    const int level = level_min == level_max ? level_min : -1;
+
+    int vertex_buf_idx = 0;
+    for( int v=0; v<CHUNK_WIDTH; v++ )
+    {
+        for( int u=0; u<CHUNK_WIDTH; u++ )
+        {
+            // Past the edge I duplicate the edge vertices. The triangles
+            // there are degenerate, and are never rasterized
+            int i = i0 + u;
+            int j = j0 + v;
+            if(i > Ncells) i = Ncells;
+            if(j > Ncells) j = Ncells;
+
+            // Integers into the VBO. All the work is done in the GPU
+            vertices[vertex_buf_idx++] = i + offset[0];
+            vertices[vertex_buf_idx++] = j + offset[1];
+            vertices[vertex_buf_idx++] = layer_sample(layer, i,j, level);
         }
+    }
+    assert( vertex_buf_idx == CHUNK_NVERTICES*3 );
+}
 
-        void initOSMtexture(const texture_ctx_t* texture_ctx)
-        {
-            glActiveTextureARB( GL_TEXTURE0_ARB ); assert_opengl();
-            glBindTexture( GL_TEXTURE_2D, texID ); assert_opengl();
+// Returns true if the rectangle of cells [i0,i1] x [j0,j1] of a layer lies
+// entirely inside the area of the "covered" layer, which then renders it
+// instead. False if covered is NULL
+static bool rect_is_covered(const horizonator_layer_t* layer,
+                            const horizonator_layer_t* covered,
+                            int i0, int j0, int i1, int j1)
+{
+    if(covered == NULL)
+        return false;
 
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_REPEAT);
-            glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_REPEAT);
+    const horizonator_dem_context_t* dems = &layer->dems;
 
-            // Init the whole texture with 0. Then later I'll fill it in tile by
-            // tile
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
-                         texture_ctx->NtilesXY[0]*OSM_TILE_WIDTH,
-                         texture_ctx->NtilesXY[1]*OSM_TILE_HEIGHT,
-                         0, GL_BGR,
-                         GL_UNSIGNED_BYTE, (const GLvoid *)NULL);
+    float lat0, lon0, lat1, lon1;
+    horizonator_dem_bounds_latlon_deg(dems, &lat0, &lon0, &lat1, &lon1);
 
-            assert_opengl();
-        }
+    float covered_lat0, covered_lon0, covered_lat1, covered_lon1;
+    horizonator_dem_bounds_latlon_deg(&covered->dems,
+                                      &covered_lat0, &covered_lon0,
+                                      &covered_lat1, &covered_lon1);
 
-        bool setOSMtextureTile( int osmTileX, int osmTileY,
-                                const texture_ctx_t* texture_ctx)
-        {
-            char filename[256];
-            char directory[256];
-            int len = snprintf(filename, sizeof(filename),
-                               "%s/%s/%d/%d/%d.png",
-                               dir_tiles, tiles_name, OSM_RENDER_ZOOM, osmTileX, osmTileY);
-            if(len >= (int)sizeof(filename))
-            {
-                MSG("static buffer overflow: filename");
-                return false;
-            }
+    // I shrink the covered area by one of my cells to make sure the two
+    // meshes overlap a bit, and no cracks appear between them
+    const float d = 1.0f / (float)dems->cells_per_deg;
+    covered_lat0 += d;
+    covered_lon0 += d;
+    covered_lat1 -= d;
+    covered_lon1 -= d;
 
+    return
+        lon0 + (float)i0/(float)dems->cells_per_deg >= covered_lon0 &&
+        lon0 + (float)i1/(float)dems->cells_per_deg <= covered_lon1 &&
+        lat0 + (float)j0/(float)dems->cells_per_deg >= covered_lat0 &&
+        lat0 + (float)j1/(float)dems->cells_per_deg <= covered_lat1;
+}
 
-            if( access( filename, R_OK ) != 0 )
-            {
-                if(!allow_downloads)
-                {
-                    MSG("Tile '%s' doesn't exist on disk, and downloads aren't allowed. Giving up", filename);
-                    return false;
-                }
+// Finds the chunks of a layer that should be drawn. Writes their (ci,cj) chunk
+// indices into cij, and returns how many there are. If "covered" is not NULL,
+// the chunks lying entirely inside that layer's area are omitted: that layer
+// renders them instead
+static int select_layer_chunks(// output
+                               int* cij,
+                               // input
+                               const horizonator_layer_t* layer,
+                               const horizonator_layer_t* covered)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
 
-                // tile doesn't exist. Make a directory for it and try to download
-                len = snprintf(directory, sizeof(directory),
-                               "%s/%s/%d/%d",
-                               dir_tiles, tiles_name,
-                               OSM_RENDER_ZOOM, osmTileX);
-                if(len >= (int)sizeof(filename))
-                {
-                    MSG("static buffer overflow: directory");
-                    return false;
-                }
+    // The grid has Ncells cells and Ncells+1 vertices on each side. As before,
+    // the last row/column of vertices isn't used
+    const int Ncells = 2*dems->radius_cells - 1;
 
-                char url[256];
-                len = snprintf(url, sizeof(url),
-                               tiles_url_fmt,
-                               OSM_RENDER_ZOOM, osmTileX, osmTileY);
-                if(len >= (int)sizeof(filename))
-                {
-                    MSG("static buffer overflow: url");
-                    return false;
-                }
+    int N = 0;
+    for(int cj=0; cj<layer->Nchunks_side; cj++)
+        for(int ci=0; ci<layer->Nchunks_side; ci++)
+        {
+            const int i0 = ci*HORIZONATOR_CHUNK_CELLS;
+            const int j0 = cj*HORIZONATOR_CHUNK_CELLS;
+            int       i1 = i0 + HORIZONATOR_CHUNK_CELLS;
+            int       j1 = j0 + HORIZONATOR_CHUNK_CELLS;
+            if(i1 > Ncells) i1 = Ncells;
+            if(j1 > Ncells) j1 = Ncells;
+
+            // Chunks outside the view wedge (if any) aren't visible
+            if(!horizonator_dem_rect_in_wedge(dems, i0, j0, i1, j1))
+                continue;
+
+            if(rect_is_covered(layer, covered, i0, j0, i1, j1))
+                continue;
+
+            cij[2*N + 0] = ci;
+            cij[2*N + 1] = cj;
+            N++;
+        }
+    return N;
+}
 
-                char cmd[1024];
-                len = snprintf( cmd, sizeof(cmd),
-                                "mkdir -p %s && wget --user-agent=horizonator -O %s %s", directory, filename, url  );
-                assert(len < (int)sizeof(cmd));
-                if(0 != system(cmd))
-                {
-                    MSG("mkdir && wget failed");
-                    return false;
-                }
-            }
+static int posmod(int x, int n)
+{
+    int r = x % n;
+    return r < 0 ? r+n : r;
+}
 
-            FREE_IMAGE_FORMAT format = FreeImage_GetFileType(filename,0);
-            if(format == FIF_UNKNOWN)
-            {
-                MSG("Couldn't load '%s'", filename);
-                assert(0);
-            }
+// Puts the vertices of chunk (ci,cj) of a layer into its slot in the VBO, if
+// they're not there already, and adds the chunk to the draw list. ichunk is the
+// index of this chunk in the select_layer_chunks() list. If vertices is NULL, I
+// build them here; otherwise they must come from build_chunk() with the same
+// anchor offset. The VBO must be bound to GL_ARRAY_BUFFER
+//
+// In a sliding layer each chunk has a fixed slot in the VBO, determined by its
+// position relative to the anchor, wrapping around toroidally. When the DEMs
+// move by a whole number of chunks, most chunks stay where they are, and only
+// the newly-exposed ones are built. In other layers the slots are assigned in
+// order
+static void add_chunk(horizonator_layer_t* layer,
+                      int ichunk, int ci, int cj,
+                      const vertex_t* vertices)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
+    const int Ncells = 2*dems->radius_cells - 1;
+
+    int offset[2];
+    layer_anchor_offset(offset, layer);
+
+    const int i0 = ci*HORIZONATOR_CHUNK_CELLS;
+    const int j0 = cj*HORIZONATOR_CHUNK_CELLS;
+    int       i1 = i0 + HORIZONATOR_CHUNK_CELLS;
+    int       j1 = j0 + HORIZONATOR_CHUNK_CELLS;
+    if(i1 > Ncells) i1 = Ncells;
+    if(j1 > Ncells) j1 = Ncells;
+
+    // The DEMs of a sliding layer only ever move by whole chunks, so the
+    // offset is a multiple of HORIZONATOR_CHUNK_CELLS
+    const int islot =
+        !layer->sliding ? ichunk :
+        posmod(ci + offset[0]/HORIZONATOR_CHUNK_CELLS, layer->Nchunks_side) +
+        posmod(cj + offset[1]/HORIZONATOR_CHUNK_CELLS, layer->Nchunks_side) *
+        layer->Nchunks_side;
+
+    // The chunk is identified by its extents relative to the anchor. The
+    // chunks on the edge are clamped, so they're rebuilt when they stop being
+    // on the edge. The overview levels of the vertices depend on where the
+    // center of the DEMs is. If the chunk uses a single level, it's still
+    // valid if that level hasn't changed; otherwise the center must not have
+    // moved
+    int level_min, level_max;
+    rect_overview_levels(&level_min, &level_max, layer, i0, j0, i1, j1);
+    const int c_dems = dems->radius_cells - 1;
+    const horizonator_chunk_t chunk = {.i0       = i0 + offset[0],
+                                       .j0       = j0 + offset[1],
+                                       .i1       = i1 + offset[0],
+                                       .j1       = j1 + offset[1],
+                                       .level    = level_min == level_max ? level_min : -1,
+                                       .center_i = c_dems + offset[0],
+                                       .center_j = c_dems + offset[1],
+                                       .built    = true};
+    horizonator_chunk_t* c = &layer->chunks[islot];
+    if(!(c->built &&
+         c->i0 == chunk.i0 && c->j0 == chunk.j0 &&
+         c->i1 == chunk.i1 && c->j1 == chunk.j1 &&
+         c->level == chunk.level &&
+         (chunk.level >= 0 ||
+          (c->center_i == chunk.center_i && c->center_j == chunk.center_j))))
+    {
+        vertex_t _vertices[CHUNK_NVERTICES*3];
+        if(vertices == NULL)
+        {
+            build_chunk(_vertices, layer, i0, j0);
+            vertices = _vertices;
+        }
+        glBufferSubData(GL_ARRAY_BUFFER,
+                        (GLintptr)islot*sizeof(_vertices),
+                        sizeof(_vertices), vertices);
+        invalidate_feedback(&layer->feedback,
+                            islot*CHUNK_NVERTICES, (islot+1)*CHUNK_NVERTICES);
+        *c = chunk;
+
+        c->zmin = INT16_MAX;
+        c->zmax = INT16_MIN;
+        for(int k=0; k<CHUNK_NVERTICES; k++)
+        {
+            const int16_t z = (int16_t)vertices[3*k + 2];
+            if(z < c->zmin) c->zmin = z;
+            if(z > c->zmax) c->zmax = z;
+        }
+    }
 
-            FIBITMAP* fib = FreeImage_Load(format,
-                                           filename,
-                                           0);
-            if(fib == NULL)
-            {
-                MSG("Couldn't load '%s'", filename);
-                assert(0);
-            }
+    layer->draw_counts    [layer->Nchunks] = CHUNK_NTRIANGLES*3;
+    layer->draw_offsets   [layer->Nchunks] = NULL;
+    layer->draw_basevertex[layer->Nchunks] = islot*CHUNK_NVERTICES;
+    layer->draw_bounds    [layer->Nchunks] =
+        (horizonator_draw_bounds_t){.i0             = c->i0,
+                                    .j0             = c->j0,
+                                    .i1             = c->i1,
+                                    .j1             = c->j1,
+                                    .zmin           = c->zmin,
+                                    .zmax           = c->zmax,
+                                    .triangle_cells = 1};
+    layer->Nchunks++;
+}
 
-            if(FreeImage_GetColorType(fib) == FIC_PALETTE)
-            {
-                // OSM tiles are palettized, and I must explicitly handle that in
-                // FreeImage
-                FIBITMAP* fib24 = FreeImage_ConvertTo24Bits(fib);
-                FreeImage_Unload(fib);
-                fib = fib24;
+// Makes sure the VBO of a layer contains every chunk we should draw, and
+// rebuilds the draw list. Only the chunks that aren't already in the VBO are
+// built and uploaded
+static bool update_layer_chunks(horizonator_layer_t* layer,
+                                const horizonator_layer_t* covered)
+{
+    int* cij = malloc(layer->Nchunks_side*layer->Nchunks_side*2*sizeof(int));
+    if(cij == NULL)
+    {
+        MSG("malloc() failed");
+        return false;
+    }
+    const int N = select_layer_chunks(cij, layer, covered);
 
-                if(fib == NULL)
-                {
-                    MSG("Couldn't unpalettize '%s'", filename);
-                    assert(0);
-                }
-            }
+    glBindBuffer(GL_ARRAY_BUFFER, layer->vertexBufID);
+    layer->Nchunks = 0;
+    for(int ichunk=0; ichunk<N; ichunk++)
+        add_chunk(layer, ichunk, cij[2*ichunk + 0], cij[2*ichunk + 1], NULL);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-            assert( FreeImage_GetWidth(fib)  == OSM_TILE_WIDTH );
-            assert( FreeImage_GetHeight(fib) == OSM_TILE_HEIGHT );
-            assert( FreeImage_GetBPP(fib)    == 8*3 );
-            assert( FreeImage_GetPitch(fib)  == OSM_TILE_WIDTH*3 );
-
-            // GL stores its textures upside down, so I flipt the y index of the
-            // tile
-            glTexSubImage2D(GL_TEXTURE_2D, 0,
-                            (osmTileX - texture_ctx->osmtile_lowestXY[0] )*OSM_TILE_WIDTH,
-                            (texture_ctx->osmtile_highestXY[1] - osmTileY)*OSM_TILE_HEIGHT,
-                            OSM_TILE_WIDTH, OSM_TILE_HEIGHT,
-                            GL_BGR, GL_UNSIGNED_BYTE,
-                            (const GLvoid *)FreeImage_GetBits(fib));
-            assert_opengl();
+    free(cij);
+    return true;
+}
 
-            FreeImage_Unload(fib);
-            return true;
-        }
+// (Re)allocates the draw order, and the visible and split subsets of the draw
+// list of a layer, to hold up to N entries. I allocate at least one, so that realloc()
+// never frees anything
+static bool alloc_visible_list(horizonator_layer_t* layer, int N)
+{
+    void* draw_order         = realloc(layer->draw_order,         (N+1)*sizeof(layer->draw_order[0]));
+    if(draw_order         != NULL) layer->draw_order         = draw_order;
+    void* visible_counts     = realloc(layer->visible_counts,     (N+1)*sizeof(layer->visible_counts[0]));
+    if(visible_counts     != NULL) layer->visible_counts     = visible_counts;
+    void* visible_offsets    = realloc(layer->visible_offsets,    (N+1)*sizeof(layer->visible_offsets[0]));
+    if(visible_offsets    != NULL) layer->visible_offsets    = visible_offsets;
+    void* visible_basevertex = realloc(layer->visible_basevertex, (N+1)*sizeof(layer->visible_basevertex[0]));
+    if(visible_basevertex != NULL) layer->visible_basevertex = visible_basevertex;
+    void* visible_entry      = realloc(layer->visible_entry,      (N+1)*sizeof(layer->visible_entry[0]));
+    if(visible_entry      != NULL) layer->visible_entry      = visible_entry;
+    void* split_counts       = realloc(layer->split_counts,       (N+1)*sizeof(layer->split_counts[0]));
+    if(split_counts       != NULL) layer->split_counts       = split_counts;
+    void* split_offsets      = realloc(layer->split_offsets,      (N+1)*sizeof(layer->split_offsets[0]));
+    if(split_offsets      != NULL) layer->split_offsets      = split_offsets;
+    void* split_basevertex   = realloc(layer->split_basevertex,   (N+1)*sizeof(layer->split_basevertex[0]));
+    if(split_basevertex   != NULL) layer->split_basevertex   = split_basevertex;
+    layer->Nchunks_visible = 0;
+    layer->Nchunks_once    = 0;
+    layer->Nchunks_seam    = 0;
+    layer->Nnear_once      = 0;
+    layer->Nnear_seam      = 0;
+    return
+        draw_order         != NULL &&
+        visible_counts     != NULL &&
+        visible_offsets    != NULL &&
+        visible_basevertex != NULL &&
+        visible_entry      != NULL &&
+        split_counts       != NULL &&
+        split_offsets      != NULL &&
+        split_basevertex   != NULL;
+}
 
-        // My render data is in a grid centered on viewer_lat/viewer_lon, branching
-        // render_radius_cells*DEG_PER_CELL degrees in all 4 directions
-        float lowest_E  = viewer_lon - (float)render_radius_cells/ctx->dems.cells_per_deg;
-        float lowest_N  = viewer_lat - (float)render_radius_cells/ctx->dems.cells_per_deg;
-        float highest_E = viewer_lon + (float)render_radius_cells/ctx->dems.cells_per_deg;
-        float highest_N = viewer_lat + (float)render_radius_cells/ctx->dems.cells_per_deg;
+// Makes the vertex array for the entries near the viewer. These are drawn
+// triangle-by-triangle from their own index buffer, which is filled in by
+// split_at_seam(). The vertex buffer is shared with the main vertex array
+static void init_layer_near(horizonator_layer_t* layer)
+{
+    glGenVertexArrays(1, &layer->near_vertexArrayID);
+    glBindVertexArray(layer->near_vertexArrayID);
 
-        // ytile decreases with lat, so I treat it backwards
-        getOSMTileID( &texture_ctx.osmtile_lowestXY[0],
-                      &texture_ctx.osmtile_lowestXY[1],
-                      lowest_E, highest_N);
-        getOSMTileID( &texture_ctx.osmtile_highestXY[0],
-                      &texture_ctx.osmtile_highestXY[1],
-                      highest_E, lowest_N);
+    glGenBuffers(1, &layer->near_indexBufID);
+    glBindBuffer(GL_ARRAY_BUFFER,         layer->vertexBufID);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, layer->near_indexBufID);
 
-        texture_ctx.NtilesXY[0] = texture_ctx.osmtile_highestXY[0] - texture_ctx.osmtile_lowestXY[0] + 1;
-        texture_ctx.NtilesXY[1] = texture_ctx.osmtile_highestXY[1] - texture_ctx.osmtile_lowestXY[1] + 1;
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, VERTEX_GLTYPE, GL_FALSE, 0, NULL);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-        initOSMtexture(&texture_ctx);
+// Sets up the chunk grid of a layer, whose DEMs have already been loaded. The
+// anchor is the current DEM origin
+static void init_layer_grid(horizonator_layer_t* layer)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
 
-        for( int osmTileY = texture_ctx.osmtile_lowestXY[1];
-             osmTileY <= texture_ctx.osmtile_highestXY[1];
-             osmTileY++)
-            for( int osmTileX = texture_ctx.osmtile_lowestXY[0];
-                 osmTileX <= texture_ctx.osmtile_highestXY[0];
-                 osmTileX++ )
-                if(!setOSMtextureTile( osmTileX, osmTileY, &texture_ctx ))
-                    return false;
+    const int Ncells = 2*dems->radius_cells - 1;
+    layer->Nchunks_side = (Ncells + HORIZONATOR_CHUNK_CELLS-1) / HORIZONATOR_CHUNK_CELLS;
+
+    for(int k=0; k<2; k++)
+        layer->anchor_cell[k] =
+            dems->origin_dem_lon_lat[k]*dems->cells_per_deg +
+            dems->origin_dem_cellij [k];
+}
+
+// Makes the VBO for one layer, whose DEMs have already been loaded. The chunks
+// are added later, with add_chunk(). If "covered" is not NULL, the chunks lying
+// entirely inside that layer's area are omitted: that layer renders them
+// instead. If sliding, the layer can later follow the viewer: see
+// horizonator_move()
+static bool init_layer_mesh(horizonator_layer_t* layer,
+                            const horizonator_layer_t* covered,
+                            GLuint indexBufID,
+                            bool sliding)
+{
+    bool result = false;
+    int* cij    = NULL;
+
+    init_layer_grid(layer);
+    layer->sliding = sliding;
+
+    // A sliding layer needs a slot for every chunk, since any of them could
+    // become visible. Otherwise I need slots only for the chunks that are
+    // drawn
+    const int Nchunks_max = layer->Nchunks_side*layer->Nchunks_side;
+    int       Nslots      = Nchunks_max;
+    if(!sliding)
+    {
+        cij = malloc(Nchunks_max*2*sizeof(int));
+        if(cij == NULL)
+        {
+            MSG("malloc() failed");
+            goto done;
+        }
+        Nslots = select_layer_chunks(cij, layer, covered);
+    }
+
+    layer->Nslots          = Nslots;
+    layer->Nchunks         = 0;
+    layer->chunks          = calloc(Nslots, sizeof(layer->chunks[0]));
+    layer->draw_counts     = malloc(Nslots*sizeof(layer->draw_counts[0]));
+    layer->draw_offsets    = malloc(Nslots*sizeof(layer->draw_offsets[0]));
+    layer->draw_basevertex = malloc(Nslots*sizeof(layer->draw_basevertex[0]));
+    layer->draw_bounds     = malloc(Nslots*sizeof(layer->draw_bounds[0]));
+    if(layer->chunks       == NULL || layer->draw_counts     == NULL ||
+       layer->draw_offsets == NULL || layer->draw_basevertex == NULL ||
+       layer->draw_bounds  == NULL ||
+       !alloc_visible_list(layer, Nslots))
+    {
+        MSG("malloc() failed");
+        goto done;
     }
 
     // vertices
     //
-    // I fill in the VBO. Each point is a 16-bit integer tuple
-    // (ilon,ilat,height). The first 2 args are indices into the virtual DEM
-    // (accessed with horizonator_dem_sample). The height is in meters
+    // Each point in the VBO is a 16-bit integer tuple (ilon,ilat,height). The
+    // first 2 args are cell indices relative to the anchor; the height is in
+    // meters
+    static_assert(sizeof(GLuint) == sizeof(layer->vertexArrayID),
+                  "horizonator_layer_t.vertex... must be a GLuint");
+
+    glGenVertexArrays(1, &layer->vertexArrayID);
+    glBindVertexArray(layer->vertexArrayID);
+
+    glGenBuffers(1, &layer->vertexBufID);
+    glBindBuffer(GL_ARRAY_BUFFER, layer->vertexBufID);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufID);
+
+    glEnableVertexAttribArray(0);
+
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)Nslots*CHUNK_NVERTICES*3*sizeof(vertex_t), NULL,
+                 sliding ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, VERTEX_GLTYPE, GL_FALSE, 0, NULL);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    layer->Nvertices = Nslots*CHUNK_NVERTICES;
+
+    init_layer_near(layer);
+    init_feedback(&layer->feedback,
+                  layer->vertexBufID, VERTEX_GLTYPE,
+                  indexBufID, layer->near_indexBufID);
+
+    result = true;
+
+ done:
+    free(cij);
+    return result;
+}
+
+// The simplified mesh. The layer is drawn in blocks of HZTIN_BLOCK_CELLS cells,
+// aligned with the DEM tiles. Each block is either the simplified mesh read
+// from the .hztin file of its tile, or the dense grid. The edges of the
+// simplified blocks are at full resolution, so the two kinds fit together
+// without cracks
+//
+// The simplified triangles are up to HZTIN_MAX_TRIANGLE_CELLS across. Close to
+// the viewer these would span a large azimuth range: they would be badly
+// distorted, or would even surround the viewer. So the blocks within
+// TIN_DENSE_RADIUS_CELLS of tin_center always use the dense grid, and the mesh
+// is rebuilt when the viewer moves more than TIN_RECENTER_CELLS from
+// tin_center
+#define TIN_DENSE_RADIUS_CELLS HZTIN_BLOCK_CELLS
+#define TIN_RECENTER_CELLS     (HZTIN_BLOCK_CELLS/4)
+
+// Makes the buffers for a layer drawn from simplified blocks, whose DEMs have
+// already been loaded. The blocks are filled in later, by update_layer_tin()
+static void init_layer_tin(horizonator_layer_t* layer,
+                           bool sliding)
+{
+    init_layer_grid(layer);
+    layer->sliding   = sliding;
+    layer->tin       = true;
+    layer->tin_built = false;
+
+    glGenVertexArrays(1, &layer->vertexArrayID);
+    glBindVertexArray(layer->vertexArrayID);
+
+    glGenBuffers(1, &layer->vertexBufID);
+    glGenBuffers(1, &layer->tin_indexBufID);
+    glBindBuffer(GL_ARRAY_BUFFER,         layer->vertexBufID);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, layer->tin_indexBufID);
+
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, VERTEX_GLTYPE, GL_FALSE, 0, NULL);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    init_layer_near(layer);
+    init_feedback(&layer->feedback,
+                  layer->vertexBufID, VERTEX_GLTYPE,
+                  layer->tin_indexBufID, layer->near_indexBufID);
+}
+
+// Rebuilds the whole mesh of a layer drawn from simplified blocks, with the
+// dense blocks around the current viewer position. If "covered" is not NULL,
+// the blocks lying entirely inside that layer's area are omitted: that layer
+// renders them instead
+static bool update_layer_tin(horizonator_layer_t* layer,
+                             const horizonator_layer_t* covered)
+{
+    bool result = false;
+
+    typedef struct
     {
-        GLuint vertexArrayID;
-        glGenVertexArrays(1, &vertexArrayID);
-        glBindVertexArray(vertexArrayID);
+        // The cells of this block, relative to the DEM origin. Dense blocks
+        // are clipped to the loaded area
+        int i0, j0, i1, j1;
+        // NULL if this is a dense block
+        const hztin_block_t* tin_block;
+        const unsigned char* tin;
+        // The SW corner of the tile, relative to the DEM origin
+        int tile_i0, tile_j0;
+    } block_t;
+
+    const horizonator_dem_context_t* dems = &layer->dems;
+    const int cells_per_deg = dems->cells_per_deg;
+    const int Ncells        = 2*dems->radius_cells - 1;
+    const int Nblocks_side  = hztin_Nblocks(cells_per_deg);
+
+    block_t*  blocks   = malloc(dems->Ndems_ij[0]*dems->Ndems_ij[1]*
+                                Nblocks_side*Nblocks_side*sizeof(blocks[0]));
+    vertex_t* vertices = NULL;
+    GLushort* indices  = NULL;
+    if(blocks == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
 
-        GLuint vertexBufID;
-        glGenBuffers(1, &vertexBufID);
-        glBindBuffer(GL_ARRAY_BUFFER, vertexBufID);
+    int offset[2];
+    layer_anchor_offset(offset, layer);
 
-        glEnableVertexAttribArray(0);
+    layer->tin_center[0] = layer->viewer_cell_i;
+    layer->tin_center[1] = layer->viewer_cell_j;
+    const float center[2] = { layer->tin_center[0] - (float)offset[0],
+                              layer->tin_center[1] - (float)offset[1] };
 
-#define VBO_USES_INTEGERS 1
+    // The blocks, and how big they are
+    int    Nblocks    = 0;
+    int    Nvertices  = 0;
+    size_t Nindices   = 0;
+    for(int jdem=0; jdem<dems->Ndems_ij[1]; jdem++)
+        for(int idem=0; idem<dems->Ndems_ij[0]; idem++)
+        {
+            const hztin_header_t* header = horizonator_dem_tin(dems, idem, jdem);
+            const int tile_i0 = idem*cells_per_deg - dems->origin_dem_cellij[0];
+            const int tile_j0 = jdem*cells_per_deg - dems->origin_dem_cellij[1];
 
-#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
-        // 16-bit integers. Only one of the paths below work with these
-        glBufferData(GL_ARRAY_BUFFER, Nvertices*3*sizeof(GLshort), NULL, GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_SHORT, GL_FALSE, 0, NULL);
-        GLshort* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-#else
-        // 32-bit floats. These take more space, but work with all the paths below
-        glBufferData(GL_ARRAY_BUFFER, Nvertices*3*sizeof(GLshort), NULL, GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-        GLshort* vertices = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-#endif
+            for(int bj=0; bj<Nblocks_side; bj++)
+                for(int bi=0; bi<Nblocks_side; bi++)
+                {
+                    block_t b = {.i0      = tile_i0 + bi*HZTIN_BLOCK_CELLS,
+                                 .j0      = tile_j0 + bj*HZTIN_BLOCK_CELLS,
+                                 .i1      = tile_i0 + (bi+1)*HZTIN_BLOCK_CELLS,
+                                 .j1      = tile_j0 + (bj+1)*HZTIN_BLOCK_CELLS,
+                                 .tile_i0 = tile_i0,
+                                 .tile_j0 = tile_j0};
+                    if(b.i1 > tile_i0 + cells_per_deg) b.i1 = tile_i0 + cells_per_deg;
+                    if(b.j1 > tile_j0 + cells_per_deg) b.j1 = tile_j0 + cells_per_deg;
+
+                    // Blocks outside the loaded area or outside the view wedge
+                    // (if any) aren't drawn
+                    if(b.i1 <= 0 || b.i0 >= Ncells ||
+                       b.j1 <= 0 || b.j0 >= Ncells)
+                        continue;
+                    if(!horizonator_dem_rect_in_wedge(dems, b.i0, b.j0, b.i1, b.j1))
+                        continue;
+                    if(rect_is_covered(layer, covered, b.i0, b.j0, b.i1, b.j1))
+                        continue;
+
+                    const float dx = fmaxf(fmaxf((float)b.i0 - center[0],
+                                                 center[0] - (float)b.i1), 0.0f);
+                    const float dy = fmaxf(fmaxf((float)b.j0 - center[1],
+                                                 center[1] - (float)b.j1), 0.0f);
+                    if(header != NULL &&
+                       fmaxf(dx,dy) >= (float)TIN_DENSE_RADIUS_CELLS)
+                    {
+                        b.tin       = (const unsigned char*)header;
+                        b.tin_block = &header->blocks[bj*Nblocks_side + bi];
+                        Nvertices  += b.tin_block->Nvertices;
+                        Nindices   += b.tin_block->Ntriangles*3;
+                    }
+                    else
+                    {
+                        if(b.i0 < 0)      b.i0 = 0;
+                        if(b.j0 < 0)      b.j0 = 0;
+                        if(b.i1 > Ncells) b.i1 = Ncells;
+                        if(b.j1 > Ncells) b.j1 = Ncells;
+                        Nvertices += (b.i1-b.i0+1)*(b.j1-b.j0+1);
+                        Nindices  += (b.i1-b.i0)*(b.j1-b.j0)*6;
+                    }
+                    blocks[Nblocks++] = b;
+                }
+        }
+
+    vertices = malloc((size_t)Nvertices*3*sizeof(vertices[0]));
+    indices  = malloc(Nindices*sizeof(indices[0]));
+    // The draw list. I allocate at least one entry, so that realloc() never
+    // frees anything
+    void* draw_counts     = realloc(layer->draw_counts,     (Nblocks+1)*sizeof(layer->draw_counts[0]));
+    if(draw_counts     != NULL) layer->draw_counts     = draw_counts;
+    void* draw_offsets    = realloc(layer->draw_offsets,    (Nblocks+1)*sizeof(layer->draw_offsets[0]));
+    if(draw_offsets    != NULL) layer->draw_offsets    = draw_offsets;
+    void* draw_basevertex = realloc(layer->draw_basevertex, (Nblocks+1)*sizeof(layer->draw_basevertex[0]));
+    if(draw_basevertex != NULL) layer->draw_basevertex = draw_basevertex;
+    void* draw_bounds     = realloc(layer->draw_bounds,     (Nblocks+1)*sizeof(layer->draw_bounds[0]));
+    if(draw_bounds     != NULL) layer->draw_bounds     = draw_bounds;
+    if((Nvertices > 0 && vertices == NULL) ||
+       (Nindices  > 0 && indices  == NULL) ||
+       draw_counts == NULL || draw_offsets == NULL || draw_basevertex == NULL ||
+       draw_bounds == NULL ||
+       !alloc_visible_list(layer, Nblocks))
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+
+    int    ivertex = 0;
+    size_t iindex  = 0;
+    layer->tin_Ntriangles = 0;
+    for(int iblock=0; iblock<Nblocks; iblock++)
+    {
+        const block_t* b = &blocks[iblock];
 
-        int vertex_buf_idx = 0;
+        layer->draw_offsets   [iblock] = (const void*)(iindex*sizeof(indices[0]));
+        layer->draw_basevertex[iblock] = ivertex;
 
-        for( int j=0; j<2*render_radius_cells; j++ )
+        if(b->tin_block != NULL)
         {
-            for( int i=0; i<2*render_radius_cells; i++ )
-            {
-                int32_t z = horizonator_dem_sample(&ctx->dems, i,j);
+            const hztin_vertex_t* v =
+                (const hztin_vertex_t*)&b->tin[b->tin_block->offset];
+            const uint16_t* idx =
+                (const uint16_t*)&v[b->tin_block->Nvertices];
 
-                // Several paths are available. These require corresponding
-                // updates in the GLSL, and exist for testing
-#if 0
-                // The CPU does all the math for the data procesing.
-#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
-#error "This path requires floating-point vertices"
-#endif
-                const float Rearth = 6371000.0;
-                const float cos_viewer_lat = cosf( M_PI / 180.0f * viewer_lat );
-                float e = ((float)i - viewer_cell[0]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f * cos_viewer_lat;
-                float n = ((float)j - viewer_cell[1]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f;
-                float h = (float)z - viewer_z;
-
-                float d_ne = hypotf(e,n);
-                vertices[vertex_buf_idx++] = atan2f(e,n   ) / M_PI;
-                vertices[vertex_buf_idx++] = atan2f(h,d_ne) / M_PI;
-                vertices[vertex_buf_idx++] = d_ne;
-#elif 0
-                // The CPU does some of the math for the data procesing.
-                // Requires 32-bit floats for the vertices (selected above).
-#if defined VBO_USES_INTEGERS && VBO_USES_INTEGERS
-#error "This path requires floating-point vertices"
-#endif
-                const float Rearth = 6371000.0;
-                const float cos_viewer_lat = cosf( M_PI / 180.0f * viewer_lat );
-                float e = ((float)i - viewer_cell[0]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f * cos_viewer_lat;
-                float n = ((float)j - viewer_cell[1]) / ctx->dems.cells_per_deg * Rearth * M_PI/180.f;
-                float h = (float)z - viewer_z;
-
-                vertices[vertex_buf_idx++] = e;
-                vertices[vertex_buf_idx++] = n;
-                vertices[vertex_buf_idx++] = h;
-#else
-                // Integers into the VBO. All the work done in the GPU
-                vertices[vertex_buf_idx++] = i;
-                vertices[vertex_buf_idx++] = j;
-                vertices[vertex_buf_idx++] = z;
-#endif
+            for(int k=0; k<(int)b->tin_block->Nvertices; k++)
+            {
+                vertices[3*(ivertex+k) + 0] = b->tile_i0 + v[k].x + offset[0];
+                vertices[3*(ivertex+k) + 1] = b->tile_j0 + v[k].y + offset[1];
+                vertices[3*(ivertex+k) + 2] = v[k].z;
             }
+            memcpy(&indices[iindex], idx,
+                   b->tin_block->Ntriangles*3*sizeof(indices[0]));
+
+            ivertex += b->tin_block->Nvertices;
+            layer->draw_counts[iblock] = b->tin_block->Ntriangles*3;
+            layer->draw_bounds[iblock] =
+                (horizonator_draw_bounds_t){.i0             = b->i0 + offset[0],
+                                            .j0             = b->j0 + offset[1],
+                                            .i1             = b->i1 + offset[0],
+                                            .j1             = b->j1 + offset[1],
+                                            .zmin           = b->tin_block->zmin,
+                                            .zmax           = b->tin_block->zmax,
+                                            .triangle_cells = HZTIN_MAX_TRIANGLE_CELLS,
+                                            .zerror_m       =
+                                            ((const hztin_header_t*)b->tin)->max_error_m};
+        }
+        else
+        {
+            // The dense grid, triangulated like make_chunk_index_buffer()
+            const int w = b->i1 - b->i0 + 1;
+            const int h = b->j1 - b->j0 + 1;
+            horizonator_draw_bounds_t bounds = {.i0             = b->i0 + offset[0],
+                                                .j0             = b->j0 + offset[1],
+                                                .i1             = b->i1 + offset[0],
+                                                .j1             = b->j1 + offset[1],
+                                                .zmin           = INT16_MAX,
+                                                .zmax           = INT16_MIN,
+                                                .triangle_cells = 1};
+            for(int v=0; v<h; v++)
+                for(int u=0; u<w; u++)
+                {
+                    const int i = b->i0 + u;
+                    const int j = b->j0 + v;
+                    const int16_t z = horizonator_dem_sample(dems, i,j);
+                    vertices[3*(ivertex + v*w + u) + 0] = i + offset[0];
+                    vertices[3*(ivertex + v*w + u) + 1] = j + offset[1];
+                    vertices[3*(ivertex + v*w + u) + 2] = z;
+                    if(z < bounds.zmin) bounds.zmin = z;
+                    if(z > bounds.zmax) bounds.zmax = z;
+                }
+            layer->draw_bounds[iblock] = bounds;
+
+            GLushort* idx = &indices[iindex];
+            int       n   = 0;
+            for(int v=0; v<h-1; v++)
+                for(int u=0; u<w-1; u++)
+                {
+                    idx[n++] = (v + 0)*w + (u + 0);
+                    idx[n++] = (v + 1)*w + (u + 1);
+                    idx[n++] = (v + 1)*w + (u + 0);
+
+                    idx[n++] = (v + 0)*w + (u + 0);
+                    idx[n++] = (v + 0)*w + (u + 1);
+                    idx[n++] = (v + 1)*w + (u + 1);
+                }
+
+            ivertex += w*h;
+            layer->draw_counts[iblock] = n;
         }
 
-        int res = glUnmapBuffer(GL_ARRAY_BUFFER);
-        assert( res == GL_TRUE );
-        assert( vertex_buf_idx == Nvertices*3 );
+        iindex                += layer->draw_counts[iblock];
+        layer->tin_Ntriangles += layer->draw_counts[iblock] / 3;
+    }
+    assert(ivertex == Nvertices && iindex == Nindices);
+
+    glBindBuffer(GL_ARRAY_BUFFER, layer->vertexBufID);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)Nvertices*3*sizeof(vertices[0]), vertices,
+                 GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // The element-array binding is part of the VAO state, so I fill the index
+    // buffer through a different binding point
+    glBindBuffer(GL_COPY_WRITE_BUFFER, layer->tin_indexBufID);
+    glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)Nindices*sizeof(indices[0]), indices,
+                 GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    layer->Nchunks   = Nblocks;
+    layer->Nvertices = Nvertices;
+    layer->tin_built = true;
+    invalidate_feedback(&layer->feedback, 0, Nvertices);
+    result = true;
+
+ done:
+    free(blocks);
+    free(vertices);
+    free(indices);
+    return result;
+}
+
+// Occlusion culling. In mountainous terrain most of the far mesh is hidden
+// behind the nearest ridge, but it would still be transformed and rasterized.
+// So before drawing, I sweep the draw list outwards from the viewer, keeping
+// a conservative horizon: for each azimuth bin, a lower bound on the elevation
+// of the terrain drawn so far. An entry whose highest point is below this
+// horizon across its whole azimuth span is hidden, and I don't draw it
+//
+// The horizon comes from the min pyramid of each layer's DEMs: the lowest
+// elevation in each block of 2^k cells. I use small blocks near the viewer and
+// large ones far away, so that each block spans about OCCLUDER_SPAN_BINS bins.
+// A block raises the horizon only in the bins it covers completely: any ray in
+// those bins crosses the block, at or above its lowest point. Elevations are
+// tracked as tan(elevation) = (z - viewer_z) / distance
+//
+// Not everything near the viewer is drawn: znear clips the nearest terrain, and
+// split_at_seam() leaves out the triangles spanning more than a quarter of the
+// view. A ray passing under the terrain there can see things that would otherwise be
+// hidden. So I find the distance R beyond which everything is drawn, and a
+// "ground" bound for each bin: the highest the terrain could be at that
+// distance. A ray above the ground at R and below the horizon at some
+// occluder has to hit the terrain in between, where it's drawn. So an entry is
+// hidden if it lies between the ground and the horizon in all its bins, and
+// the occluders are the blocks beyond R. A block counts as an occluder only
+// for the entries entirely beyond it. The rendering ignores the curvature of
+// the earth, and so do I
+#define HORIZON_NBINS            2048
+#define OCCLUDER_SPAN_BINS       16
+#define OCCLUSION_PYRAMID_LEVELS 6
+#define OCCLUDER_NBUCKETS        4096
+
+// Returns level k (1 <= k <= OCCLUSION_PYRAMID_LEVELS) of the min pyramid of a
+// layer, and the number of blocks along each side of it. Block (bi,bj) is the
+// lowest of the samples in cells [bi*2^k, (bi+1)*2^k] x [bj*2^k, (bj+1)*2^k],
+// relative to the DEM origin, including the samples on its edges. These are
+// sampled like the vertices of the chunks, from the same overview levels
+static int16_t* pyramid_level(// output
+                              int* Nblocks_side,
+                              // input
+                              const horizonator_layer_t* layer,
+                              int k)
+{
+    const int Ncells = 2*layer->dems.radius_cells - 1;
+
+    int16_t* p = layer->zmin_pyramid;
+    for(int kk=1; kk<k; kk++)
+    {
+        const int n = (Ncells + (1<<kk)-1) >> kk;
+        p += n*n;
+    }
+    *Nblocks_side = (Ncells + (1<<k)-1) >> k;
+    return p;
+}
+
+static bool build_pyramid(horizonator_layer_t* layer)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
+    const int Ncells = 2*dems->radius_cells - 1;
+
+    size_t N = 0;
+    for(int k=1; k<=OCCLUSION_PYRAMID_LEVELS; k++)
+    {
+        const size_t n = (Ncells + (1<<k)-1) >> k;
+        N += n*n;
+    }
+    layer->zmin_pyramid = malloc(N*sizeof(layer->zmin_pyramid[0]));
+    if(layer->zmin_pyramid == NULL)
+    {
+        MSG("malloc() failed");
+        return false;
     }
 
-    // indices
+    // Level 1 from the DEMs. Each sample is on the edge of 2 blocks if its
+    // index is even
+    int      n1;
+    int16_t* p1 = pyramid_level(&n1, layer, 1);
+    for(int bj=0; bj<n1; bj++)
     {
-        GLuint indexBufID;
-        glGenBuffers(1, &indexBufID);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufID);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, ctx->Ntriangles*3*sizeof(GLuint), NULL, GL_STATIC_DRAW);
+        int16_t* row = &p1[bj*n1];
+        for(int bi=0; bi<n1; bi++)
+            row[bi] = INT16_MAX;
 
-        GLuint* indices = glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY);
-        int idx = 0;
-        for( int j=0; j<(2*render_radius_cells-1); j++ )
+        for(int j=2*bj; j<=2*bj+2 && j<=Ncells; j++)
         {
-            for( int i=0; i<(2*render_radius_cells-1); i++ )
+            // I look up the overview level for a chunk's width at a time
+            int level = -1;
+            for(int i=0; i<=Ncells; i++)
             {
-                indices[idx++] = (j + 0)*(2*render_radius_cells) + (i + 0);
-                indices[idx++] = (j + 1)*(2*render_radius_cells) + (i + 1);
-                indices[idx++] = (j + 1)*(2*render_radius_cells) + (i + 0);
+                if(i % HORIZONATOR_CHUNK_CELLS == 0)
+                {
+                    int level_min, level_max;
+                    rect_overview_levels(&level_min, &level_max, layer,
+                                         i, j,
+                                         i + HORIZONATOR_CHUNK_CELLS < Ncells ?
+                                         i + HORIZONATOR_CHUNK_CELLS : Ncells,
+                                         j);
+                    level = level_min == level_max ? level_min : -1;
+                }
+                const int16_t z  = layer_sample(layer, i,j, level);
+                const int     bi = i/2;
+                if(bi < n1 && z < row[bi])
+                    row[bi] = z;
+                if(!(i&1) && bi > 0 && z < row[bi-1])
+                    row[bi-1] = z;
+            }
+        }
+    }
 
-                indices[idx++] = (j + 0)*(2*render_radius_cells) + (i + 0);
-                indices[idx++] = (j + 0)*(2*render_radius_cells) + (i + 1);
-                indices[idx++] = (j + 1)*(2*render_radius_cells) + (i + 1);
+    // The higher levels from the lower ones
+    for(int k=2; k<=OCCLUSION_PYRAMID_LEVELS; k++)
+    {
+        int n, nprev;
+        int16_t*       p     = pyramid_level(&n,     layer, k);
+        const int16_t* pprev = pyramid_level(&nprev, layer, k-1);
+        for(int bj=0; bj<n; bj++)
+            for(int bi=0; bi<n; bi++)
+            {
+                int16_t z = INT16_MAX;
+                for(int dj=0; dj<2; dj++)
+                    for(int di=0; di<2; di++)
+                    {
+                        const int ci = 2*bi + di;
+                        const int cj = 2*bj + dj;
+                        if(ci < nprev && cj < nprev && pprev[cj*nprev + ci] < z)
+                            z = pprev[cj*nprev + ci];
+                    }
+                p[bj*n + bi] = z;
             }
+    }
+    return true;
+}
+
+typedef struct
+{
+    float dmin;
+    float tanel_min, tanel_max;
+    // The bins this entry touches. bin1 may be beyond HORIZON_NBINS; these
+    // wrap around
+    int   bin0, bin1;
+    // Where this entry is in the visible_...[] list of its layer
+    int   ilayer, ivisible;
+} occludee_t;
+
+typedef struct
+{
+    float dmax;
+    float tanel_min;
+    // The bins this block covers completely. bin1 may be beyond HORIZON_NBINS;
+    // these wrap around
+    int   bin0, bin1;
+} occluder_t;
+
+static int compare_occludee(const void* _a, const void* _b)
+{
+    const occludee_t* a = (const occludee_t*)_a;
+    const occludee_t* b = (const occludee_t*)_b;
+    if(a->dmin < b->dmin) return -1;
+    if(a->dmin > b->dmin) return  1;
+    return 0;
+}
+
+// The horizontal distance from the viewer to the nearest point of a rectangle
+// of cells of a layer; 0 if the viewer is inside it. The cells are relative to
+// the anchor of the layer
+static float rect_min_distance(const horizonator_layer_t* layer,
+                               const float* m_per_cell,
+                               float i0, float j0, float i1, float j1)
+{
+    const float vi = layer->viewer_cell_i;
+    const float vj = layer->viewer_cell_j;
+
+    const float dx = fmaxf(fmaxf(i0 - vi, vi - i1), 0.0f) * m_per_cell[0];
+    const float dy = fmaxf(fmaxf(j0 - vj, vj - j1), 0.0f) * m_per_cell[1];
+    return hypotf(dx, dy);
+}
+
+// The extents of a rectangle of cells of a layer, as seen from the viewer: the
+// horizontal distances to its nearest and furthest points, and its azimuth span
+// in bins, with bin0 <= bin1. Returns false if the viewer is inside the
+// rectangle. The cells are relative to the anchor of the layer
+static bool rect_view_extents(// output
+                              float* dmin, float* dmax,
+                              float* bin0, float* bin1,
+                              // input
+                              const horizonator_layer_t* layer,
+                              const float* m_per_cell,
+                              float i0, float j0, float i1, float j1)
+{
+    const float vi = layer->viewer_cell_i;
+    const float vj = layer->viewer_cell_j;
+
+    *dmin = rect_min_distance(layer, m_per_cell, i0, j0, i1, j1);
+    if(*dmin == 0.0f)
+        return false;
+    *dmax = hypotf(fmaxf(fabsf(i0 - vi), fabsf(i1 - vi)) * m_per_cell[0],
+                   fmaxf(fabsf(j0 - vj), fabsf(j1 - vj)) * m_per_cell[1]);
+
+    // The viewer is outside the rectangle, so its azimuth span is < 180deg,
+    // and I can unwrap relative to any corner
+    const float corners[4][2] = { {i0,j0}, {i1,j0}, {i0,j1}, {i1,j1} };
+    float az0 = 0.0f, az_lo = 0.0f, az_hi = 0.0f;
+    for(int k=0; k<4; k++)
+    {
+        float az = atan2f((corners[k][0] - vi) * m_per_cell[0],
+                          (corners[k][1] - vj) * m_per_cell[1]);
+        if(k == 0)
+        {
+            if(az < 0.0f) az += 2.0f*(float)M_PI;
+            az0 = az_lo = az_hi = az;
+            continue;
         }
-        int res = glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
-        assert( res == GL_TRUE );
-        assert(idx == ctx->Ntriangles*3);
+        float d = (az - az0) / (2.0f*(float)M_PI);
+        az = (d - roundf(d)) * 2.0f*(float)M_PI + az0;
+        if(az < az_lo) az_lo = az;
+        if(az > az_hi) az_hi = az;
     }
+    *bin0 = az_lo / (2.0f*(float)M_PI) * (float)HORIZON_NBINS;
+    *bin1 = az_hi / (2.0f*(float)M_PI) * (float)HORIZON_NBINS;
+    return true;
+}
+
+// The distance from the viewer beyond which triangles of the given size are
+// narrow enough to be drawn: they span at most a quarter of the view
+static float triangle_min_distance(float triangle_m, float fov_rad)
+{
+    return triangle_m * (1.0f + 0.5f / sinf(fminf(fov_rad, 2.0f*(float)M_PI) / 8.0f));
+}
+
+// The entries nearer than this are drawn triangle-by-triangle by
+// split_at_seam(), and the triangles that are too wide are left out. Only the
+// dense entries are handled this way. The simplified blocks are kept far
+// enough from the viewer (see TIN_DENSE_RADIUS_CELLS), and they're always drawn
+// whole
+static float near_distance(const horizonator_draw_bounds_t* b,
+                           const float* m_per_cell,
+                           float fov_rad)
+{
+    if(b->triangle_cells > 1)
+        return 0.0f;
+    return triangle_min_distance((float)M_SQRT2 * m_per_cell[1], fov_rad);
+}
+
+// The field of view that decides which triangles near the viewer are too wide
+// to draw. This is the width of the view, unless near_fov_deg overrides it
+static float near_fov_rad(const horizonator_context_t* ctx)
+{
+    const float fov_deg =
+        ctx->near_fov_deg > 0.0f ?
+        ctx->near_fov_deg :
+        ctx->view.az_deg1 - ctx->view.az_deg0;
+    return fov_deg * (float)M_PI / 180.0f;
+}
+
+typedef struct
+{
+    float   d;
+    int32_t ientry;
+} entry_distance_t;
+
+static int compare_entry_distance(const void* _a, const void* _b)
+{
+    const entry_distance_t* a = (const entry_distance_t*)_a;
+    const entry_distance_t* b = (const entry_distance_t*)_b;
+    if(a->d < b->d) return -1;
+    if(a->d > b->d) return  1;
+    return 0;
+}
+
+// Puts the draw list of each layer in front-to-back order, by the distance to
+// the nearest point of each entry. Without this the entries are drawn in the
+// order of the grid, and depending on the view direction, the far terrain is
+// often shaded first, and then painted over. If something fails, I keep the
+// order I had: that's just slower
+static void sort_front_to_back(horizonator_context_t* ctx)
+{
+    const float Rearth = 6371000.0f;
 
-    // shaders
+    for(int l=0; l<ctx->Nlayers; l++)
     {
-        // The shader transforms the VBO vertices into the view coord system. Each VBO
-        // point is a 16-bit integer tuple (ilon,ilat,height). The first 2 args are
-        // indices into the DEM. The height is in meters
-        const GLchar* vertexShaderSource =
-#include "vertex.glsl.h"
-            ;
+        horizonator_layer_t* layer = &ctx->layers[l];
 
-        const GLchar* geometryShaderSource =
-#include "geometry.glsl.h"
-            ;
+        entry_distance_t* order = malloc((layer->Nchunks+1)*sizeof(order[0]));
+        if(order == NULL)
+        {
+            MSG("malloc() failed");
+            for(int i=0; i<layer->Nchunks; i++)
+                layer->draw_order[i] = i;
+            continue;
+        }
 
-        const GLchar* fragmentShaderSource =
-#include "fragment.glsl.h"
-            ;
+        float m_per_cell[2];
+        m_per_cell[1] = Rearth * (float)M_PI / 180.0f / (float)layer->dems.cells_per_deg;
+        m_per_cell[0] = m_per_cell[1] * cosf(ctx->viewer_lat * (float)M_PI / 180.0f);
 
-        char msg[1024];
-        int len;
-        ctx->program = glCreateProgram();
-        assert_opengl();
+        for(int i=0; i<layer->Nchunks; i++)
+        {
+            const horizonator_draw_bounds_t* b = &layer->draw_bounds[i];
+            order[i] = (entry_distance_t)
+                {.d      = rect_min_distance(layer, m_per_cell,
+                                             (float)b->i0, (float)b->j0,
+                                             (float)b->i1, (float)b->j1),
+                 .ientry = i};
+        }
+        qsort(order, layer->Nchunks, sizeof(order[0]), compare_entry_distance);
 
+        for(int i=0; i<layer->Nchunks; i++)
+            layer->draw_order[i] = order[i].ientry;
+        free(order);
+    }
+}
 
-#define install_shader(type,TYPE)                                       \
-        GLuint type ## Shader = glCreateShader(GL_ ## TYPE ## _SHADER); \
-        assert_opengl();                                                \
-                                                                        \
-        glShaderSource(type ## Shader, 1, (const GLchar**)&type ## ShaderSource, NULL); \
-        assert_opengl();                                                \
-                                                                        \
-        glCompileShader(type ## Shader);                                \
-        assert_opengl();                                                \
-        glGetShaderInfoLog( type ## Shader, sizeof(msg), &len, msg );   \
-        if( strlen(msg) )                                               \
-            printf(#type " shader info: %s\n", msg);                    \
-                                                                        \
-        glAttachShader(ctx->program, type ##Shader);                         \
-        assert_opengl();
+// Fills in the visible subsets of the draw lists of all the layers, in the
+// draw_order
+static void cull_occluded(horizonator_context_t* ctx)
+{
+    occludee_t* occludees        = NULL;
+    occluder_t* occluders        = NULL;
+    occluder_t* occluders_sorted = NULL;
+    int*        bucket_start     = NULL;
+    float*      horizon   = NULL;
+    float*      ground    = NULL;
+    int         Noccluders     = 0;
+    int         Noccluders_max = 0;
+    bool        result = false;
+
+    const float Rearth   = 6371000.0f;
+    const float viewer_z = ctx->view.viewer_z;
+    const float fov_rad  = near_fov_rad(ctx);
+
+    // Everything is visible until shown otherwise
+    void show_all(void)
+    {
+        for(int l=0; l<ctx->Nlayers; l++)
+        {
+            horizonator_layer_t* layer = &ctx->layers[l];
+            for(int i=0; i<layer->Nchunks; i++)
+            {
+                const int ientry = layer->draw_order[i];
+                layer->visible_counts    [i] = layer->draw_counts    [ientry];
+                layer->visible_offsets   [i] = layer->draw_offsets   [ientry];
+                layer->visible_basevertex[i] = layer->draw_basevertex[ientry];
+                layer->visible_entry     [i] = ientry;
+            }
+            layer->Nchunks_visible = layer->Nchunks;
+        }
+    }
+    show_all();
+
+    int Nentries = 0;
+    for(int l=0; l<ctx->Nlayers; l++)
+        Nentries += ctx->layers[l].Nchunks;
+    if(!ctx->occlusion_culling || ctx->polar_mesh || fov_rad <= 0.0f)
+        return;
+
+    occludees = malloc(Nentries*sizeof(occludees[0]));
+    horizon   = malloc(HORIZON_NBINS*sizeof(horizon[0]));
+    ground    = malloc(HORIZON_NBINS*sizeof(ground[0]));
+    if(occludees == NULL || horizon == NULL || ground == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
 
+    void get_m_per_cell(float* m_per_cell, const horizonator_layer_t* layer)
+    {
+        m_per_cell[1] = Rearth * (float)M_PI / 180.0f / (float)layer->dems.cells_per_deg;
+        m_per_cell[0] = m_per_cell[1] * cosf(ctx->viewer_lat * (float)M_PI / 180.0f);
+    }
 
+    // The entries, and the distance R beyond which everything is drawn
+    float R          = ctx->view.znear;
+    int   Noccludees = 0;
+    for(int l=0; l<ctx->Nlayers; l++)
+    {
+        const horizonator_layer_t* layer = &ctx->layers[l];
+        float m_per_cell[2];
+        get_m_per_cell(m_per_cell, layer);
 
-        install_shader(vertex,   VERTEX);
-        install_shader(fragment, FRAGMENT);
-        install_shader(geometry, GEOMETRY);
+        for(int ivisible=0; ivisible<layer->Nchunks; ivisible++)
+        {
+            const horizonator_draw_bounds_t* b =
+                &layer->draw_bounds[layer->draw_order[ivisible]];
 
-        glLinkProgram(ctx->program); assert_opengl();
-        glGetProgramInfoLog( ctx->program, sizeof(msg), &len, msg );
-        if( strlen(msg) )
-            printf("program info after glLinkProgram(): %s\n", msg);
+            const float dmin_drawn = near_distance(b, m_per_cell, fov_rad);
 
-        glUseProgram(ctx->program);  assert_opengl();
-        glGetProgramInfoLog( ctx->program, sizeof(msg), &len, msg );
-        if( strlen(msg) )
-            printf("program info after glUseProgram: %s\n", msg);
-
-
-#define make_and_set_uniform(gltype, name, expr) do {                   \
-            GLint uniform_ ## name = glGetUniformLocation(ctx->program, #name); \
-            assert_opengl();                                            \
-            glUniform1 ## gltype ( uniform_ ## name, expr);             \
-            assert_opengl();                                            \
-        } while(0)
-
-        make_and_set_uniform(f, DEG_PER_CELL,   1.0f/ (float)ctx->dems.cells_per_deg );
-
-        make_and_set_uniform(f, origin_cell_lon_deg,
-                     (float)ctx->dems.origin_dem_lon_lat[0] +
-                     (float)ctx->dems.origin_dem_cellij[0] / (float)ctx->dems.cells_per_deg);
-        make_and_set_uniform(f, origin_cell_lat_deg,
-                     (float)ctx->dems.origin_dem_lon_lat[1] +
-                     (float)ctx->dems.origin_dem_cellij[1] / (float)ctx->dems.cells_per_deg);
-        make_and_set_uniform(i, NtilesX,         texture_ctx.NtilesXY[0]);
-        make_and_set_uniform(i, NtilesY,         texture_ctx.NtilesXY[1]);
-        make_and_set_uniform(i, osmtile_lowestX, texture_ctx.osmtile_lowestXY[0]);
-        make_and_set_uniform(i, osmtile_lowestY, texture_ctx.osmtile_lowestXY[1]);
-
-        // These may be modified at runtime, so I make, but don't set
-        ctx->uniform_aspect           = glGetUniformLocation(ctx->program, "aspect");           assert_opengl();
-        ctx->uniform_az_deg0          = glGetUniformLocation(ctx->program, "az_deg0");          assert_opengl();
-        ctx->uniform_az_deg1          = glGetUniformLocation(ctx->program, "az_deg1");          assert_opengl();
-        ctx->uniform_viewer_cell_i    = glGetUniformLocation(ctx->program, "viewer_cell_i");    assert_opengl();
-        ctx->uniform_viewer_cell_j    = glGetUniformLocation(ctx->program, "viewer_cell_j");    assert_opengl();
-        ctx->uniform_viewer_z         = glGetUniformLocation(ctx->program, "viewer_z");         assert_opengl();
-        ctx->uniform_viewer_lat       = glGetUniformLocation(ctx->program, "viewer_lat");       assert_opengl();
-        ctx->uniform_cos_viewer_lat   = glGetUniformLocation(ctx->program, "cos_viewer_lat");   assert_opengl();
-        ctx->uniform_texturemap_lon0  = glGetUniformLocation(ctx->program, "texturemap_lon0");  assert_opengl();
-        ctx->uniform_texturemap_lon1  = glGetUniformLocation(ctx->program, "texturemap_lon1");  assert_opengl();
-        ctx->uniform_texturemap_dlat0 = glGetUniformLocation(ctx->program, "texturemap_dlat0"); assert_opengl();
-        ctx->uniform_texturemap_dlat1 = glGetUniformLocation(ctx->program, "texturemap_dlat1"); assert_opengl();
-        ctx->uniform_texturemap_dlat2 = glGetUniformLocation(ctx->program, "texturemap_dlat2"); assert_opengl();
-        ctx->uniform_znear            = glGetUniformLocation(ctx->program, "znear");            assert_opengl();
-        ctx->uniform_zfar             = glGetUniformLocation(ctx->program, "zfar");             assert_opengl();
-        ctx->uniform_znear_color      = glGetUniformLocation(ctx->program, "znear_color");      assert_opengl();
-        ctx->uniform_zfar_color       = glGetUniformLocation(ctx->program, "zfar_color");       assert_opengl();
-#undef make_and_set_uniform
-
-        // And I set the other uniforms
-        horizonator_move(ctx, viewer_z, viewer_lat, viewer_lon);
-        horizonator_set_zextents(ctx,
-                                 HORIZONATOR_ZNEAR_DEFAULT, HORIZONATOR_ZFAR_DEFAULT,
-                                 HORIZONATOR_ZNEAR_DEFAULT, HORIZONATOR_ZFAR_DEFAULT);
+            float dmin, dmax, bin0, bin1;
+            if(!rect_view_extents(&dmin, &dmax, &bin0, &bin1,
+                                  layer, m_per_cell,
+                                  (float)b->i0, (float)b->j0, (float)b->i1, (float)b->j1))
+            {
+                // The viewer is in this entry
+                if(dmin_drawn > R) R = dmin_drawn;
+                continue;
+            }
+            if(dmin < dmin_drawn && fminf(dmax, dmin_drawn) > R)
+                R = fminf(dmax, dmin_drawn);
+
+            occludees[Noccludees++] =
+                (occludee_t){.dmin      = dmin,
+                             .tanel_min = ((float)b->zmin - b->zerror_m - viewer_z) /
+                                          ((float)b->zmin - b->zerror_m > viewer_z ? dmax : dmin),
+                             .tanel_max = ((float)b->zmax - viewer_z) /
+                                          ((float)b->zmax > viewer_z ? dmin : dmax),
+                             .bin0      = (int)floorf(bin0),
+                             .bin1      = (int)floorf(bin1),
+                             .ilayer    = l,
+                             .ivisible  = ivisible};
+        }
     }
 
-    if(offscreen_width > 0)
+    // The ground. I walk around the circle of radius R, in steps of at most
+    // half a cell. Each step stays within the 2x2 cells nearest to its
+    // starting point, and the terrain there is no higher than their highest
+    // sample
+    for(int b=0; b<HORIZON_NBINS; b++)
+        ground[b] = -INFINITY;
+    for(int l=0; l<ctx->Nlayers; l++)
     {
-        static_assert(sizeof(GLuint) == sizeof(ctx->offscreen.frameBufID),
-                      "horizonator_context_t.offscreen.... must be a GLuint");
+        const horizonator_layer_t* layer = &ctx->layers[l];
+        const horizonator_dem_context_t* dems = &layer->dems;
+        const int Ncells = 2*dems->radius_cells - 1;
+        float m_per_cell[2];
+        get_m_per_cell(m_per_cell, layer);
+
+        // The simplified meshes may be a bit higher than the samples
+        float zerror_m = 0.0f;
+        for(int ientry=0; ientry<layer->Nchunks; ientry++)
+            zerror_m = fmaxf(zerror_m, layer->draw_bounds[ientry].zerror_m);
+
+        int offset[2];
+        layer_anchor_offset(offset, layer);
+
+        const float daz   = 0.5f * fminf(m_per_cell[0], m_per_cell[1]) / R;
+        const int   Nstep = (int)ceilf(2.0f*(float)M_PI / daz);
+        for(int istep=0; istep<Nstep; istep++)
+        {
+            const float az = (float)istep * 2.0f*(float)M_PI / (float)Nstep;
+            const float i  = layer->viewer_cell_i - (float)offset[0] + R*sinf(az)/m_per_cell[0];
+            const float j  = layer->viewer_cell_j - (float)offset[1] + R*cosf(az)/m_per_cell[1];
+            const int   i0 = (int)floorf(i - 0.5f);
+            const int   j0 = (int)floorf(j - 0.5f);
+            if(i0+2 < 0 || j0+2 < 0 || i0 > Ncells || j0 > Ncells)
+                continue;
+
+            float zmax = -INFINITY;
+            for(int dj=0; dj<=2; dj++)
+                for(int di=0; di<=2; di++)
+                {
+                    int ii = i0+di, jj = j0+dj;
+                    if(ii < 0) ii = 0; else if(ii > Ncells) ii = Ncells;
+                    if(jj < 0) jj = 0; else if(jj > Ncells) jj = Ncells;
+                    zmax = fmaxf(zmax, (float)layer_sample(layer, ii,jj, -1));
+                }
+            const float tanel = (zmax + zerror_m - viewer_z) / R;
 
-        glGenFramebuffers(1, &ctx->offscreen.frameBufID);
-        assert_opengl();
-        glBindFramebuffer(GL_FRAMEBUFFER, ctx->offscreen.frameBufID);
-        assert_opengl();
+            const int bin0 = (int)floorf((az - daz) / (2.0f*(float)M_PI) * (float)HORIZON_NBINS);
+            const int bin1 = (int)floorf((az + daz) / (2.0f*(float)M_PI) * (float)HORIZON_NBINS);
+            for(int b=bin0; b<=bin1; b++)
+            {
+                float* g = &ground[posmod(b, HORIZON_NBINS)];
+                if(tanel > *g) *g = tanel;
+            }
+        }
+    }
 
-        glGenRenderbuffers(1, &ctx->offscreen.renderBufID);
-        assert_opengl();
-        glBindRenderbuffer(GL_RENDERBUFFER, ctx->offscreen.renderBufID);
-        assert_opengl();
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGB,
-                              offscreen_width, offscreen_height);
-        assert_opengl();
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                                  GL_RENDERBUFFER, ctx->offscreen.renderBufID);
-        assert_opengl();
+    bool push_occluder(const occluder_t* o)
+    {
+        if(Noccluders == Noccluders_max)
         {
-            int res = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-            assert( res == GL_FRAMEBUFFER_COMPLETE );
+            Noccluders_max = Noccluders_max == 0 ? 4096 : Noccluders_max*2;
+            void* p = realloc(occluders, Noccluders_max*sizeof(occluders[0]));
+            if(p == NULL)
+            {
+                MSG("malloc() failed");
+                return false;
+            }
+            occluders = p;
         }
+        occluders[Noccluders++] = *o;
+        return true;
+    }
 
-        glGenRenderbuffers(1, &ctx->offscreen.depthBufID);
-        assert_opengl();
-        glBindRenderbuffer(GL_RENDERBUFFER, ctx->offscreen.depthBufID);
-        assert_opengl();
-        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT,
-                              offscreen_width, offscreen_height);
-        assert_opengl();
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                                  GL_RENDERBUFFER, ctx->offscreen.depthBufID);
-        assert_opengl();
+    // Adds the occluders from block (bi,bj) of level k of the pyramid of a
+    // layer, within draw-list entry b. Blocks that are too large are
+    // subdivided
+    bool add_occluders(const horizonator_layer_t* layer,
+                       const horizonator_draw_bounds_t* b,
+                       const int* offset,
+                       const float* m_per_cell,
+                       int k, int bi, int bj)
+    {
+        const int Ncells = 2*layer->dems.radius_cells - 1;
+
+        int n;
+        const int16_t* p = pyramid_level(&n, layer, k);
+        if(bi < 0 || bj < 0 || bi >= n || bj >= n)
+            return true;
+
+        bool subdivide(void)
         {
-            int res = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-            assert( res == GL_FRAMEBUFFER_COMPLETE );
+            if(k == 1)
+                return true;
+            for(int dj=0; dj<2; dj++)
+                for(int di=0; di<2; di++)
+                    if(!add_occluders(layer, b, offset, m_per_cell,
+                                      k-1, 2*bi+di, 2*bj+dj))
+                        return false;
+            return true;
         }
 
-        glViewport(0, 0, offscreen_width, offscreen_height);
-        glUniform1f(ctx->uniform_aspect,
-                    (float)offscreen_width / (float)offscreen_height);
+        // The cells of this block, relative to the anchor
+        int i0 = (bi << k), i1 = ((bi+1) << k);
+        int j0 = (bj << k), j1 = ((bj+1) << k);
+        if(i1 > Ncells) i1 = Ncells;
+        if(j1 > Ncells) j1 = Ncells;
+        i0 += offset[0]; i1 += offset[0];
+        j0 += offset[1]; j1 += offset[1];
+
+        // Only blocks that this entry draws completely
+        if(i1 <= b->i0 || i0 >= b->i1 ||
+           j1 <= b->j0 || j0 >= b->j1)
+            return true;
+        if(i0 < b->i0 || i1 > b->i1 ||
+           j0 < b->j0 || j1 > b->j1)
+            return subdivide();
+
+        // I look at the distance first: it's cheap, and it tells me whether
+        // this block is small enough. It can't span more than its diagonal
+        // over its distance
+        const float dmin_block =
+            rect_min_distance(layer, m_per_cell,
+                              (float)i0, (float)j0, (float)i1, (float)j1);
+        const float diag       = hypotf((float)(i1-i0) * m_per_cell[0],
+                                        (float)(j1-j0) * m_per_cell[1]);
+        if(dmin_block + diag < R)
+            return true;
+        if(k > 1 &&
+           (dmin_block < R ||
+            diag > dmin_block * (float)OCCLUDER_SPAN_BINS * 2.0f*(float)M_PI / (float)HORIZON_NBINS))
+            return subdivide();
+
+        float dmin, dmax, bin0, bin1;
+        if(dmin_block < R ||
+           !rect_view_extents(&dmin, &dmax, &bin0, &bin1,
+                              layer, m_per_cell,
+                              (float)i0, (float)j0, (float)i1, (float)j1))
+            return true;
+
+        const float zmin = (float)p[bj*n + bi] - b->zerror_m;
+        const float hmax = fmaxf(fabsf(zmin - viewer_z), fabsf((float)b->zmax - viewer_z));
+        if(hypotf(dmax, hmax) > ctx->view.zfar)
+            return true;
 
-        ctx->offscreen.inited = true;
-        ctx->offscreen.width  = offscreen_width;
-        ctx->offscreen.height = offscreen_height;
+        occluder_t o = {.dmax      = dmax,
+                        .tanel_min = (zmin - viewer_z) / (zmin > viewer_z ? dmax : dmin),
+                        .bin0      = (int)ceilf (bin0),
+                        .bin1      = (int)floorf(bin1) - 1};
+        if(o.bin1 < o.bin0)
+            return true;
+        return push_occluder(&o);
+    }
 
-        atexit(glutExit);
+    for(int l=0; l<ctx->Nlayers; l++)
+    {
+        horizonator_layer_t* layer = &ctx->layers[l];
+        if(layer->Nchunks == 0)
+            continue;
+        if(layer->zmin_pyramid == NULL && !build_pyramid(layer))
+            goto done;
+
+        float m_per_cell[2];
+        get_m_per_cell(m_per_cell, layer);
+        int offset[2];
+        layer_anchor_offset(offset, layer);
+
+        // The top-level pyramid blocks overlapping each entry
+        const int top_cells = 1 << OCCLUSION_PYRAMID_LEVELS;
+        for(int ientry=0; ientry<layer->Nchunks; ientry++)
+        {
+            const horizonator_draw_bounds_t* b = &layer->draw_bounds[ientry];
+            const int bi0 = (int)floorf((float)(b->i0 - offset[0])     / (float)top_cells);
+            const int bi1 = (int)floorf((float)(b->i1 - offset[0] - 1) / (float)top_cells);
+            const int bj0 = (int)floorf((float)(b->j0 - offset[1])     / (float)top_cells);
+            const int bj1 = (int)floorf((float)(b->j1 - offset[1] - 1) / (float)top_cells);
+            for(int bj=bj0; bj<=bj1; bj++)
+                for(int bi=bi0; bi<=bi1; bi++)
+                    if(!add_occluders(layer, b, offset, m_per_cell,
+                                      OCCLUSION_PYRAMID_LEVELS, bi, bj))
+                        goto done;
+        }
     }
 
+    qsort(occludees, Noccludees, sizeof(occludees[0]), compare_occludee);
 
-    // arbitrary az bounds initially
-    if(!horizonator_pan_zoom(ctx, -45.f, 45.f))
+    // There are many more occluders than entries, so I don't sort them
+    // exactly: I bucket them by distance instead. Bucket k has the occluders
+    // entirely within (k+1)*bucket_m
+    float dmax_occluders = 0.0f;
+    for(int i=0; i<Noccluders; i++)
+        dmax_occluders = fmaxf(dmax_occluders, occluders[i].dmax);
+    const float bucket_m = dmax_occluders / (float)(OCCLUDER_NBUCKETS-1) + 1.0f;
+
+    bucket_start     = calloc(OCCLUDER_NBUCKETS+1, sizeof(bucket_start[0]));
+    occluders_sorted = malloc((Noccluders+1)*sizeof(occluders_sorted[0]));
+    if(bucket_start == NULL || occluders_sorted == NULL)
+    {
+        MSG("malloc() failed");
         goto done;
+    }
+    for(int i=0; i<Noccluders; i++)
+        bucket_start[(int)(occluders[i].dmax / bucket_m) + 1]++;
+    for(int k=0; k<OCCLUDER_NBUCKETS; k++)
+        bucket_start[k+1] += bucket_start[k];
+    for(int i=0; i<Noccluders; i++)
+        occluders_sorted[bucket_start[(int)(occluders[i].dmax / bucket_m)]++] = occluders[i];
+    // bucket_start[k] is now the end of bucket k
+
+    // The sweep. The occluders go into the horizon once they're entirely
+    // nearer than the entry being tested. Hidden entries are marked with
+    // visible_counts = 0, and thrown out below
+    for(int b=0; b<HORIZON_NBINS; b++)
+        horizon[b] = -INFINITY;
+    int ioccluder = 0;
+    int ibucket   = 0;
+    for(int i=0; i<Noccludees; i++)
+    {
+        const occludee_t* e = &occludees[i];
+        for(; ibucket < OCCLUDER_NBUCKETS && (float)(ibucket+1)*bucket_m <= e->dmin; ibucket++)
+            for(; ioccluder < bucket_start[ibucket]; ioccluder++)
+            {
+                const occluder_t* o = &occluders_sorted[ioccluder];
+                for(int b=o->bin0; b<=o->bin1; b++)
+                {
+                    float* h = &horizon[posmod(b, HORIZON_NBINS)];
+                    if(o->tanel_min > *h)
+                        *h = o->tanel_min;
+                }
+            }
+
+        bool hidden = e->bin1 - e->bin0 < HORIZON_NBINS;
+        for(int b=e->bin0; hidden && b<=e->bin1; b++)
+        {
+            const int bb = posmod(b, HORIZON_NBINS);
+            if(!(horizon[bb] > e->tanel_max && ground[bb] < e->tanel_min))
+                hidden = false;
+        }
+        if(hidden)
+            ctx->layers[e->ilayer].visible_counts[e->ivisible] = 0;
+    }
+
+    for(int l=0; l<ctx->Nlayers; l++)
+    {
+        horizonator_layer_t* layer = &ctx->layers[l];
+        int N = 0;
+        for(int i=0; i<layer->Nchunks; i++)
+        {
+            if(layer->visible_counts[i] == 0)
+                continue;
+            layer->visible_counts    [N] = layer->visible_counts    [i];
+            layer->visible_offsets   [N] = layer->visible_offsets   [i];
+            layer->visible_basevertex[N] = layer->visible_basevertex[i];
+            layer->visible_entry     [N] = layer->visible_entry     [i];
+            N++;
+        }
+        layer->Nchunks_visible = N;
+    }
 
     result = true;
 
  done:
-    if(dem_context_inited && !result)
-        horizonator_dem_deinit(&ctx->dems);
-
-    return result;
+    if(!result)
+        // Something failed. I draw everything
+        show_all();
+    free(occludees);
+    free(occluders);
+    free(occluders_sorted);
+    free(bucket_start);
+    free(horizon);
+    free(ground);
 }
 
-void horizonator_deinit( horizonator_context_t* ctx )
+// Does a ray from the viewer cross a rectangle? The ray points along (e,n), and
+// the rectangle is given in meters east and north of the viewer
+static bool ray_crosses_rect(float e, float n,
+                             float x0, float y0, float x1, float y1)
 {
-    if(ctx->use_glut && ctx->glut_window != 0)
+    float t0 = 0.0f, t1 = INFINITY;
+    bool slab(float d, float lo, float hi)
     {
-        glutDestroyWindow(ctx->glut_window);
-        ctx->glut_window = 0;
+        if(d == 0.0f)
+            return lo <= 0.0f && 0.0f <= hi;
+        float ta = lo / d, tb = hi / d;
+        if(ta > tb) { float t = ta; ta = tb; tb = t; }
+        t0 = fmaxf(t0, ta);
+        t1 = fminf(t1, tb);
+        return t0 <= t1;
     }
+    return slab(e, x0, x1) && slab(n, y0, y1);
 }
 
-bool horizonator_move(horizonator_context_t* ctx,
-                      // output/input
-                      // if viewer_z==NULL, auto-select a value; if *viewer_z >=
-                      // 0, use that; if *viewer_z < 0, auto-select a value, and
-                      // report it here
-                      float* viewer_z,
-                      // input
-                      float viewer_lat, float viewer_lon)
+// Splits the visible lists of all the layers at the azimuth seam behind the
+// viewer, and builds the index lists of the entries near the viewer: see the
+// split_... and near_... members of horizonator_layer_t. This depends on the
+// center of the view, so it's redone after every pan. If something fails, the
+// near entries are drawn whole
+//
+// If strip_az_rad != NULL, only the strip of the view between the azimuths
+// strip_az_rad[0] and strip_az_rad[1] will be drawn, so I leave out the entries
+// drawn once that lie entirely outside it
+//
+// If ctx->lod > 0, the chunks far enough away are drawn with the coarser index
+// pattern of that level: see make_chunk_index_buffer()
+static void split_at_seam(horizonator_context_t* ctx,
+                          const float* strip_az_rad)
 {
-    if(ctx->use_glut)
+    const float Rearth    = 6371000.0f;
+    const float fov_rad   = near_fov_rad(ctx);
+    const int   lod       =
+        ctx->lod < 0                  ? 0 :
+        ctx->lod >= HORIZONATOR_NLODS ? HORIZONATOR_NLODS-1 :
+        ctx->lod;
+    const float center_az = (ctx->view.az_deg0 + ctx->view.az_deg1) / 2.0f * (float)M_PI / 180.0f;
+    const float seam_az   = center_az + (float)M_PI;
+
+    // The triangles spanning more than span_max are left out, and the span
+    // depends on which way I unwrap, like in vertex.glsl. A vertex right
+    // behind az_ref could be unwrapped either way by the GPU, so I also
+    // require the triangle to stay span_max/2 away from there. Each triangle
+    // that isn't too wide then fits around the center or around the seam
+    const float span_max = fov_rad / 4.0f;
+    bool fits(const float* az, float az_ref)
     {
-        if(ctx->glut_window == 0)
-            return false;
-        glutSetWindow(ctx->glut_window);
+        float lo = INFINITY, hi = -INFINITY;
+        for(int k=0; k<3; k++)
+        {
+            const float d = (az[k] - az_ref) / (2.0f*(float)M_PI);
+            const float a = (d - roundf(d)) * 2.0f*(float)M_PI;
+            if(a < lo) lo = a;
+            if(a > hi) hi = a;
+        }
+        return
+            hi - lo <= span_max &&
+            lo > -(float)M_PI + span_max/2.0f &&
+            hi <  (float)M_PI - span_max/2.0f;
     }
 
-    void texture_coeffs(// output
-                        float* lon0,
-                        float* lon1,
-                        float* dlat0,
+    for(int l=0; l<ctx->Nlayers; l++)
+    {
+        horizonator_layer_t* layer = &ctx->layers[l];
+        const float vi = layer->viewer_cell_i;
+        const float vj = layer->viewer_cell_j;
+
+        float m_per_cell[2];
+        m_per_cell[1] = Rearth * (float)M_PI / 180.0f / (float)layer->dems.cells_per_deg;
+        m_per_cell[0] = m_per_cell[1] * cosf(ctx->viewer_lat * (float)M_PI / 180.0f);
+
+        bool in_strip(const horizonator_draw_bounds_t* b)
+        {
+            float dmin, dmax, bin0, bin1;
+            if(!rect_view_extents(&dmin, &dmax, &bin0, &bin1,
+                                  layer, m_per_cell,
+                                  (float)b->i0, (float)b->j0, (float)b->i1, (float)b->j1))
+                // The viewer is in this entry
+                return true;
+
+            // I compare the midpoints of the two azimuth ranges
+            const float az_lo = bin0 / (float)HORIZON_NBINS * 2.0f*(float)M_PI;
+            const float az_hi = bin1 / (float)HORIZON_NBINS * 2.0f*(float)M_PI;
+            const float d     = ((az_lo + az_hi) - (strip_az_rad[0] + strip_az_rad[1])) /
+                                (4.0f*(float)M_PI);
+            return
+                fabsf(d - roundf(d)) * 2.0f*(float)M_PI <=
+                ((az_hi - az_lo) + (strip_az_rad[1] - strip_az_rad[0])) / 2.0f;
+        }
+
+        // Can this entry be drawn at the coarse level? Its triangles are
+        // 2^lod cells across, and they must be narrow enough, like the
+        // triangles of near_distance()
+        bool coarse(const horizonator_draw_bounds_t* b)
+        {
+            if(lod == 0 || layer->tin || !(fov_rad > 0.0f))
+                return false;
+            return
+                rect_min_distance(layer, m_per_cell,
+                                  (float)b->i0, (float)b->j0, (float)b->i1, (float)b->j1) >=
+                triangle_min_distance((float)M_SQRT2 * (float)(1 << lod) * m_per_cell[1],
+                                      fov_rad);
+        }
+
+        const int N     = layer->Nchunks_visible;
+        char*     kind  = malloc(N+1);
+        GLuint*   idx   = NULL;
+        float*    az    = NULL;
+        int Nidx_max    = 0;
+        int Naz_max     = 0;
+        if(kind == NULL)
+        {
+            MSG("malloc() failed");
+            goto done_layer;
+        }
+
+        // Each entry is drawn once ('o'), on both sides of the seam ('s'), or
+        // triangle-by-triangle ('n'). The near entries are padded by half a
+        // cell: the triangles touching the seam need to be split too
+        for(int i=0; i<N; i++)
+        {
+            const horizonator_draw_bounds_t* b = &layer->draw_bounds[layer->visible_entry[i]];
+            const float dmin =
+                rect_min_distance(layer, m_per_cell,
+                                  (float)b->i0, (float)b->j0, (float)b->i1, (float)b->j1);
+            if(fov_rad > 0.0f && dmin < near_distance(b, m_per_cell, fov_rad))
+            {
+                kind[i] = 'n';
+                Nidx_max += (b->i1 - b->i0)*(b->j1 - b->j0)*6;
+                const int Naz = (b->i1 - b->i0 + 1)*(b->j1 - b->j0 + 1);
+                if(Naz > Naz_max) Naz_max = Naz;
+            }
+            else if(ray_crosses_rect(sinf(seam_az), cosf(seam_az),
+                                     ((float)b->i0 - 0.5f - vi) * m_per_cell[0],
+                                     ((float)b->j0 - 0.5f - vj) * m_per_cell[1],
+                                     ((float)b->i1 + 0.5f - vi) * m_per_cell[0],
+                                     ((float)b->j1 + 0.5f - vj) * m_per_cell[1]))
+                kind[i] = 's';
+            else if(strip_az_rad != NULL && !in_strip(b))
+                kind[i] = 'x';
+            else
+                kind[i] = 'o';
+        }
+
+        idx = malloc((Nidx_max+1)*sizeof(idx[0]));
+        az  = malloc((Naz_max +1)*sizeof(az[0]));
+        if(idx == NULL || az == NULL)
+        {
+            MSG("malloc() failed");
+            for(int i=0; i<N; i++)
+                if(kind[i] == 'n')
+                    kind[i] = 'o';
+            Nidx_max = 0;
+        }
+
+        // The near triangles. The ones drawn once are accumulated from the
+        // start of idx, and the ones drawn twice from the end
+        int Nnear_once = 0, Nnear_seam = 0;
+        for(int i=0; i<N; i++)
+        {
+            if(kind[i] != 'n')
+                continue;
+            const horizonator_draw_bounds_t* b = &layer->draw_bounds[layer->visible_entry[i]];
+
+            // The vertices are stored like in build_chunk() or
+            // update_layer_tin(). The chunks at the edge of the grid have
+            // unused columns
+            const int w      = b->i1 - b->i0;
+            const int h      = b->j1 - b->j0;
+            const int stride = layer->tin ? w+1 : CHUNK_WIDTH;
+            for(int v=0; v<=h; v++)
+                for(int u=0; u<=w; u++)
+                    az[v*(w+1) + u] =
+                        atan2f(((float)(b->i0 + u) - vi) * m_per_cell[0],
+                               ((float)(b->j0 + v) - vj) * m_per_cell[1]);
+
+            void add_triangle(int u0, int v0, int u1, int v1, int u2, int v2)
+            {
+                const float a[3] = { az[v0*(w+1) + u0],
+                                     az[v1*(w+1) + u1],
+                                     az[v2*(w+1) + u2] };
+                GLuint* out;
+                if(fits(a, center_az))
+                {
+                    out = &idx[Nnear_once];
+                    Nnear_once += 3;
+                }
+                else if(fits(a, seam_az))
+                {
+                    Nnear_seam += 3;
+                    out = &idx[Nidx_max - Nnear_seam];
+                }
+                else
+                    return;
+
+                const GLuint base = (GLuint)layer->visible_basevertex[i];
+                out[0] = base + v0*stride + u0;
+                out[1] = base + v1*stride + u1;
+                out[2] = base + v2*stride + u2;
+            }
+
+            // Triangulated like make_chunk_index_buffer()
+            for(int v=0; v<h; v++)
+                for(int u=0; u<w; u++)
+                {
+                    add_triangle(u,v, u+1,v+1, u,  v+1);
+                    add_triangle(u,v, u+1,v,   u+1,v+1);
+                }
+        }
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, layer->near_indexBufID);
+        glBufferData(GL_COPY_WRITE_BUFFER,
+                     (GLsizeiptr)(Nnear_once + Nnear_seam)*sizeof(idx[0]), NULL,
+                     GL_STREAM_DRAW);
+        if(Nnear_once > 0)
+            glBufferSubData(GL_COPY_WRITE_BUFFER, 0,
+                            (GLsizeiptr)Nnear_once*sizeof(idx[0]), idx);
+        if(Nnear_seam > 0)
+            glBufferSubData(GL_COPY_WRITE_BUFFER,
+                            (GLintptr)Nnear_once*sizeof(idx[0]),
+                            (GLsizeiptr)Nnear_seam*sizeof(idx[0]),
+                            &idx[Nidx_max - Nnear_seam]);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        layer->Nnear_once = Nnear_once;
+        layer->Nnear_seam = Nnear_seam;
+
+    done_layer:
+        ;
+        // The split list: the entries drawn once, followed by the entries drawn
+        // twice, each in front-to-back order
+        int Nsplit = 0;
+        for(int pass=0; pass<2; pass++)
+        {
+            for(int i=0; i<N; i++)
+            {
+                if(kind != NULL && kind[i] != (pass == 0 ? 'o' : 's'))
+                    continue;
+                layer->split_counts    [Nsplit] = layer->visible_counts    [i];
+                layer->split_offsets   [Nsplit] = layer->visible_offsets   [i];
+                layer->split_basevertex[Nsplit] = layer->visible_basevertex[i];
+                if(coarse(&layer->draw_bounds[layer->visible_entry[i]]))
+                {
+                    layer->split_counts [Nsplit] = ctx->lod_counts [lod];
+                    layer->split_offsets[Nsplit] = ctx->lod_offsets[lod];
+                }
+                Nsplit++;
+            }
+            if(pass == 0)
+                layer->Nchunks_once = Nsplit;
+            else
+                layer->Nchunks_seam = Nsplit - layer->Nchunks_once;
+            if(kind == NULL)
+            {
+                // No memory. I draw everything once
+                layer->Nchunks_seam = 0;
+                layer->Nnear_once   = 0;
+                layer->Nnear_seam   = 0;
+                break;
+            }
+        }
+
+        free(kind);
+        free(idx);
+        free(az);
+    }
+}
+
+// The polar mesh is split at the seam like the layers: see split_at_seam().
+// The quads of each ring are contiguous in the index buffer, and every ring
+// has the same azimuths. So the same few quads of each ring are drawn twice.
+// The rings are sampled around a point within half a quad of the viewer, so I
+// draw twice each quad within a quad of the seam
+static void split_polar_mesh_at_seam(// output
+                                     int* Nonce, int* Nseam,
+                                     // input
+                                     horizonator_context_t* ctx)
+{
+    horizonator_polar_mesh_t* polar = &ctx->polar;
+
+    const int   Nquads_ring = polar->wrap ? polar->Naz : polar->Naz-1;
+    const float seam_az     =
+        (ctx->view.az_deg0 + ctx->view.az_deg1) / 2.0f * (float)M_PI / 180.0f + (float)M_PI;
+
+    // The seam relative to the middle of the ring, in quads
+    const float d = (seam_az - polar->az_rad0) / (2.0f*(float)M_PI) -
+                    (float)Nquads_ring * polar->daz_rad / (4.0f*(float)M_PI);
+    const int a_seam =
+        (int)floorf((d - roundf(d)) * 2.0f*(float)M_PI / polar->daz_rad +
+                    (float)Nquads_ring / 2.0f);
+
+    // The quads [a0,a1) are drawn twice. If wrap, these wrap around
+    int a0 = a_seam - 1;
+    int a1 = a_seam + 2;
+    if(!polar->wrap)
+    {
+        if(a0 < 0)           a0 = 0;
+        if(a0 > Nquads_ring) a0 = Nquads_ring;
+        if(a1 > Nquads_ring) a1 = Nquads_ring;
+        if(a1 < a0)          a1 = a0;
+    }
+    else if(a0 < 0)
+    {
+        a0 += Nquads_ring;
+        a1 += Nquads_ring;
+    }
+
+    // The ranges [a0,a1) of quads of each ring, as draw-list entries
+    int N = 0;
+    void add(int k, int a0, int a1)
+    {
+        if(a1 <= a0)
+            return;
+        polar->split_counts [N] = (a1 - a0) * 6;
+        polar->split_offsets[N] =
+            (const void*)(((size_t)k*Nquads_ring + a0) * 6 * sizeof(GLuint));
+        N++;
+    }
+    for(int k=0; k<polar->Nrings-1; k++)
+        if(a1 <= Nquads_ring)
+        {
+            add(k, 0,  a0);
+            add(k, a1, Nquads_ring);
+        }
+        else
+            add(k, a1 - Nquads_ring, a0);
+    *Nonce = N;
+    for(int k=0; k<polar->Nrings-1; k++)
+        if(a1 <= Nquads_ring)
+            add(k, a0, a1);
+        else
+        {
+            add(k, a0, Nquads_ring);
+            add(k, 0,  a1 - Nquads_ring);
+        }
+    *Nseam = N - *Nonce;
+}
+
+static void deinit_layer(horizonator_layer_t* layer)
+{
+    if(layer->tin_indexBufID != 0)
+        glDeleteBuffers(1, &layer->tin_indexBufID);
+    if(layer->near_indexBufID != 0)
+        glDeleteBuffers(1, &layer->near_indexBufID);
+    if(layer->near_vertexArrayID != 0)
+        glDeleteVertexArrays(1, &layer->near_vertexArrayID);
+    if(layer->vertexBufID != 0)
+        glDeleteBuffers(1, &layer->vertexBufID);
+    if(layer->vertexArrayID != 0)
+        glDeleteVertexArrays(1, &layer->vertexArrayID);
+    deinit_feedback(&layer->feedback);
+
+    free(layer->chunks);
+    free(layer->draw_counts);
+    free(layer->draw_offsets);
+    free(layer->draw_basevertex);
+    free(layer->draw_bounds);
+    free(layer->draw_order);
+    free(layer->visible_counts);
+    free(layer->visible_offsets);
+    free(layer->visible_basevertex);
+    free(layer->visible_entry);
+    free(layer->split_counts);
+    free(layer->split_offsets);
+    free(layer->split_basevertex);
+    free(layer->zmin_pyramid);
+
+    horizonator_dem_deinit(&layer->dems);
+
+    *layer = (horizonator_layer_t){};
+}
+
+// The polar mesh. Instead of drawing the DEM grid directly, I resample the
+// DEMs on rings around the viewer: uniformly in azimuth, and geometrically
+// spaced in range. Each quad then spans roughly the same angle in azimuth and
+// elevation, so the triangle density on the screen is about constant. The grid
+// instead has tiny triangles far away and huge ones nearby
+//
+// The vertices are (i,j,z) like in the grid, but in floating point, in the
+// cell coordinates of layers[0], relative to its anchor. So the same shaders
+// draw both meshes
+
+// The rings are resampled when the viewer moves more than this fraction of the
+// spacing between the vertices of that ring
+#define POLAR_RECENTER_FRACTION 0.5f
+
+// When loading a wedge, the polar mesh covers the wedge plus this margin on
+// each side. This must be smaller than the margin used by dem.c
+#define POLAR_WEDGE_MARGIN_DEG  1.0f
+
+// Bilinear interpolation of the DEM at fractional cell (i,j), relative to the
+// DEM origin, from the given overview level. Points outside the DEM are clamped
+// to its edge
+static float sample_dems_bilinear(const horizonator_dem_context_t* dems,
+                                  double i, double j, int level)
+{
+    const int Ncells = 2*dems->radius_cells - 1;
+    if(i < 0.)              i = 0.;
+    if(j < 0.)              j = 0.;
+    if(i > (double)Ncells)  i = (double)Ncells;
+    if(j > (double)Ncells)  j = (double)Ncells;
+
+    int i0 = (int)floor(i);
+    int j0 = (int)floor(j);
+    if(i0 > Ncells-1) i0 = Ncells-1;
+    if(j0 > Ncells-1) j0 = Ncells-1;
+    const float fi = (float)(i - (double)i0);
+    const float fj = (float)(j - (double)j0);
+
+    float z[2][2];
+    for(int dj=0; dj<2; dj++)
+        for(int di=0; di<2; di++)
+        {
+            // <0 means "no data"
+            int16_t zz = horizonator_dem_sample_level(dems, i0+di, j0+dj, level);
+            z[dj][di] = zz < 0 ? 0.f : (float)zz;
+        }
+    return
+        (z[0][0]*(1.f-fi) + z[0][1]*fi) * (1.f-fj) +
+        (z[1][0]*(1.f-fi) + z[1][1]*fi) * fj;
+}
+
+// The elevation at a point given in the cell coordinates of layers[0],
+// relative to its anchor. I use the finest layer that covers the point. The
+// point is d_m from the viewer, which picks the overview level, like for the
+// chunks: see overview_level()
+static float polar_sample(const horizonator_context_t* ctx,
+                          double i, double j, float d_m)
+{
+    const float Rearth = 6371000.0f;
+    const horizonator_layer_t* layer0 = &ctx->layers[0];
+
+    for(int l=ctx->Nlayers-1; l>=0; l--)
+    {
+        const horizonator_layer_t*       layer = &ctx->layers[l];
+        const horizonator_dem_context_t* dems  = &layer->dems;
+        const int                        Ncells = 2*dems->radius_cells - 1;
+
+        // The point in the cells of this layer, relative to its DEM origin
+        const double scale =
+            (double)dems->cells_per_deg / (double)layer0->dems.cells_per_deg;
+        const double li =
+            ((double)layer0->anchor_cell[0] + i) * scale -
+            (double)(dems->origin_dem_lon_lat[0]*dems->cells_per_deg + dems->origin_dem_cellij[0]);
+        const double lj =
+            ((double)layer0->anchor_cell[1] + j) * scale -
+            (double)(dems->origin_dem_lon_lat[1]*dems->cells_per_deg + dems->origin_dem_cellij[1]);
+
+        if(l > 0 &&
+           !(li >= 0. && li <= (double)Ncells &&
+             lj >= 0. && lj <= (double)Ncells))
+            continue;
+
+        return sample_dems_bilinear(dems, li, lj,
+                                    overview_level(d_m,
+                                                   Rearth * (float)M_PI / 180.0f / (float)dems->cells_per_deg));
+    }
+    return 0.f;
+}
+
+// Makes the buffers for the polar mesh. The DEMs of all the layers must have
+// been loaded, and their grids set up with init_layer_grid(). The vertices are
+// filled in later, by update_polar_mesh()
+static bool init_polar_mesh(horizonator_context_t* ctx)
+{
+    bool     result  = false;
+    GLuint*  indices = NULL;
+
+    horizonator_polar_mesh_t*        polar = &ctx->polar;
+    const horizonator_dem_context_t* dems0 = &ctx->layers[0].dems;
+    const horizonator_dem_context_t* dems_finest =
+        &ctx->layers[ctx->Nlayers-1].dems;
+
+    const float Rearth = 6371000.0f;
+
+    // If we loaded a wedge, the mesh covers only that wedge. Otherwise the
+    // whole circle
+    polar->wrap = true;
+    polar->az_rad0 = 0.0f;
+    polar->Naz = (int)lroundf(2.0f*(float)M_PI / polar->daz_rad);
+    if(dems0->have_wedge)
+    {
+        const float margin = POLAR_WEDGE_MARGIN_DEG * (float)M_PI/180.0f;
+        const float span   = dems0->wedge_az_rad1 - dems0->wedge_az_rad0 + 2.0f*margin;
+        if(span < 2.0f*(float)M_PI)
+        {
+            polar->wrap    = false;
+            polar->az_rad0 = dems0->wedge_az_rad0 - margin;
+            polar->Naz     = (int)ceilf(span / polar->daz_rad) + 1;
+        }
+    }
+    if(polar->wrap)
+        // The azimuths wrap around exactly
+        polar->daz_rad = 2.0f*(float)M_PI / (float)polar->Naz;
+
+    // The rings start one cell of the finest DEMs away from the viewer, and go
+    // out to the edge of the loaded area. Each ring is further out than the
+    // previous one by the azimuth spacing, so the quads are roughly square.
+    // Near the viewer this would be finer than the DEMs, so there I space the
+    // rings by one cell instead
+    const float cell_m = Rearth * (float)M_PI / 180.0f / (float)dems_finest->cells_per_deg;
+    if(dems0->radius_m <= cell_m)
+    {
+        MSG("The render radius is too small for the polar mesh");
+        goto done;
+    }
+    float next_ring_r(float r)
+    {
+        return r + fmaxf(r*polar->daz_rad, cell_m);
+    }
+    polar->Nrings = 1;
+    for(float r = cell_m; r < dems0->radius_m; r = next_ring_r(r))
+        polar->Nrings++;
+
+    polar->ring_r_m     = malloc(polar->Nrings*sizeof(polar->ring_r_m[0]));
+    polar->ring_centers = malloc(polar->Nrings*2*sizeof(polar->ring_centers[0]));
+    if(polar->ring_r_m == NULL || polar->ring_centers == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+    {
+        int k = 0;
+        for(float r = cell_m; r < dems0->radius_m; r = next_ring_r(r))
+            polar->ring_r_m[k++] = r;
+        polar->ring_r_m[k++] = dems0->radius_m;
+        assert(k == polar->Nrings);
+    }
+
+    const int Nvertices = polar->Nrings * polar->Naz;
+    const int Nquads_ring = polar->wrap ? polar->Naz : polar->Naz-1;
+    polar->Nindices = (polar->Nrings-1) * Nquads_ring * 6;
+
+    indices              = malloc(polar->Nindices*sizeof(indices[0]));
+    polar->split_counts  = malloc(polar->Nrings*4*sizeof(polar->split_counts[0]));
+    polar->split_offsets = malloc(polar->Nrings*4*sizeof(polar->split_offsets[0]));
+    if(indices == NULL || polar->split_counts == NULL || polar->split_offsets == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+
+    // Each quad spans rings k,k+1 and azimuths a,a+1. The nearer ring shows up
+    // lower on the screen, and the azimuth increases to the right. So this
+    // winding is counter-clockwise on the screen, like the grid
+    int idx = 0;
+    for(int k=0; k<polar->Nrings-1; k++)
+        for(int a=0; a<Nquads_ring; a++)
+        {
+            const int a1 = (a+1) % polar->Naz;
+            const GLuint v00 = (k  )*polar->Naz + a;
+            const GLuint v01 = (k  )*polar->Naz + a1;
+            const GLuint v10 = (k+1)*polar->Naz + a;
+            const GLuint v11 = (k+1)*polar->Naz + a1;
+
+            indices[idx++] = v00;
+            indices[idx++] = v01;
+            indices[idx++] = v11;
+
+            indices[idx++] = v00;
+            indices[idx++] = v11;
+            indices[idx++] = v10;
+        }
+    assert(idx == polar->Nindices);
+
+    static_assert(sizeof(GLuint) == sizeof(polar->vertexArrayID),
+                  "horizonator_polar_mesh_t.vertex... must be a GLuint");
+
+    glGenVertexArrays(1, &polar->vertexArrayID);
+    glBindVertexArray(polar->vertexArrayID);
+
+    glGenBuffers(1, &polar->indexBufID);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, polar->indexBufID);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 (GLsizeiptr)polar->Nindices*sizeof(indices[0]), indices,
+                 GL_STATIC_DRAW);
+
+    glGenBuffers(1, &polar->vertexBufID);
+    glBindBuffer(GL_ARRAY_BUFFER, polar->vertexBufID);
+    glEnableVertexAttribArray(0);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)Nvertices*3*sizeof(GLfloat), NULL,
+                 GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    init_feedback(&polar->feedback,
+                  polar->vertexBufID, GL_FLOAT,
+                  polar->indexBufID, 0);
+    assert_opengl();
+
+    polar->built = false;
+    result = true;
+
+ done:
+    free(indices);
+    return result;
+}
+
+// Resamples the rings of the polar mesh that are too far off-center from the
+// viewer at (viewer_cell_i,viewer_cell_j) in the cell coordinates of
+// layers[0], relative to its anchor. Near rings need to be resampled even for
+// small moves, while far rings can stay as they are for much longer. The rings
+// that are resampled are always a prefix 0..k, so the rings sharing a center
+// are contiguous. If !polar->built, everything is resampled
+static bool update_polar_mesh(horizonator_context_t* ctx,
+                              float viewer_cell_i, float viewer_cell_j,
+                              float cos_viewer_lat)
+{
+    horizonator_polar_mesh_t*        polar = &ctx->polar;
+    const horizonator_dem_context_t* dems0 = &ctx->layers[0].dems;
+
+    const float Rearth     = 6371000.0f;
+    const float m_per_cell = Rearth * (float)M_PI / 180.0f / (float)dems0->cells_per_deg;
+
+    int Nrings_update = polar->built ? 0 : polar->Nrings;
+    for(int k=polar->Nrings-1; k>=Nrings_update; k--)
+    {
+        const float d_m =
+            hypotf( (viewer_cell_i - polar->ring_centers[2*k + 0]) * cos_viewer_lat,
+                    (viewer_cell_j - polar->ring_centers[2*k + 1]) ) * m_per_cell;
+        if(d_m > POLAR_RECENTER_FRACTION * polar->ring_r_m[k] * polar->daz_rad)
+        {
+            Nrings_update = k+1;
+            break;
+        }
+    }
+    if(Nrings_update == 0)
+        return true;
+
+    GLfloat* vertices = malloc((size_t)Nrings_update*polar->Naz*3*sizeof(GLfloat));
+    if(vertices == NULL)
+    {
+        MSG("malloc() failed");
+        return false;
+    }
+
+    int ivertex = 0;
+    for(int k=0; k<Nrings_update; k++)
+    {
+        const double r_cells = (double)polar->ring_r_m[k] / (double)m_per_cell;
+        for(int a=0; a<polar->Naz; a++)
+        {
+            // az = 0 is North, 90deg is East, like in vertex.glsl
+            const double az = (double)polar->az_rad0 + (double)a * (double)polar->daz_rad;
+            const double i  = (double)viewer_cell_i + r_cells * sin(az) / (double)cos_viewer_lat;
+            const double j  = (double)viewer_cell_j + r_cells * cos(az);
+
+            vertices[ivertex++] = (GLfloat)i;
+            vertices[ivertex++] = (GLfloat)j;
+            vertices[ivertex++] = polar_sample(ctx, i, j, polar->ring_r_m[k]);
+        }
+        polar->ring_centers[2*k + 0] = viewer_cell_i;
+        polar->ring_centers[2*k + 1] = viewer_cell_j;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, polar->vertexBufID);
+    glBufferSubData(GL_ARRAY_BUFFER, 0,
+                    (GLsizeiptr)ivertex*sizeof(GLfloat), vertices);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    assert_opengl();
+    invalidate_feedback(&polar->feedback, 0, ivertex/3);
+
+    free(vertices);
+    polar->built = true;
+    return true;
+}
+
+static void deinit_polar_mesh(horizonator_polar_mesh_t* polar)
+{
+    if(polar->vertexBufID != 0)
+        glDeleteBuffers(1, &polar->vertexBufID);
+    if(polar->indexBufID != 0)
+        glDeleteBuffers(1, &polar->indexBufID);
+    if(polar->vertexArrayID != 0)
+        glDeleteVertexArrays(1, &polar->vertexArrayID);
+    deinit_feedback(&polar->feedback);
+    free(polar->ring_r_m);
+    free(polar->ring_centers);
+    free(polar->split_counts);
+    free(polar->split_offsets);
+
+    *polar = (horizonator_polar_mesh_t){};
+}
+
+typedef struct
+{
+    // How many tiles we have in each direction
+    int NtilesXY[2];
+
+    // Lowest and highest OSM tile indices. These increase towards E and
+    // towards S (i.e. in the opposite direction as latitude)
+    int osmtile_lowestXY [2];
+    int osmtile_highestXY[2];
+
+} texture_ctx_t;
+
+static void getOSMTileID( // output tile indices
+                         int* x, int* y,
+
+                         // input
+                         // latlon, in degrees
+                         float E, float N)
+{
+    // from https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
+    float n = (float)( 1 << OSM_RENDER_ZOOM);
+
+    // convert E,N to radians. The interpolation coefficients assume this
+    E *= (float)M_PI/180.0f;
+    N *= (float)M_PI/180.0f;
+
+    float lon0 = n / 2.0f;
+    float lon1 = n / ((float)M_PI * 2.0f);
+    *x = (int)( fminf( n, fmaxf( 0.0f, E*lon1 + lon0 )));
+    *y = (int)( n/2.0f * (1.0f -
+                          logf( (sinf(N) + 1.0f)/cosf(N) ) /
+                          (float)M_PI) );
+}
+
+// Reads an OSM tile, downloading it first, if needed and allowed. Returns the
+// 24-bit image, or NULL on error
+static FIBITMAP* load_OSM_tile( int osmTileX, int osmTileY,
+                                const char* dir_tiles,
+                                const char* tiles_name,
+                                const char* tiles_url_fmt,
+                                bool allow_downloads)
+{
+    char filename[256];
+    char directory[256];
+    int len = snprintf(filename, sizeof(filename),
+                       "%s/%s/%d/%d/%d.png",
+                       dir_tiles, tiles_name, OSM_RENDER_ZOOM, osmTileX, osmTileY);
+    if(len >= (int)sizeof(filename))
+    {
+        MSG("static buffer overflow: filename");
+        return NULL;
+    }
+
+
+    if( access( filename, R_OK ) != 0 )
+    {
+        if(!allow_downloads)
+        {
+            MSG("Tile '%s' doesn't exist on disk, and downloads aren't allowed. Giving up", filename);
+            return NULL;
+        }
+
+        // tile doesn't exist. Make a directory for it and try to download
+        len = snprintf(directory, sizeof(directory),
+                       "%s/%s/%d/%d",
+                       dir_tiles, tiles_name,
+                       OSM_RENDER_ZOOM, osmTileX);
+        if(len >= (int)sizeof(filename))
+        {
+            MSG("static buffer overflow: directory");
+            return NULL;
+        }
+
+        char url[256];
+        len = snprintf(url, sizeof(url),
+                       tiles_url_fmt,
+                       OSM_RENDER_ZOOM, osmTileX, osmTileY);
+        if(len >= (int)sizeof(filename))
+        {
+            MSG("static buffer overflow: url");
+            return NULL;
+        }
+
+        char cmd[1024];
+        len = snprintf( cmd, sizeof(cmd),
+                        "mkdir -p %s && wget --user-agent=horizonator -O %s %s", directory, filename, url  );
+        assert(len < (int)sizeof(cmd));
+        if(0 != system(cmd))
+        {
+            MSG("mkdir && wget failed");
+            return NULL;
+        }
+    }
+
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileType(filename,0);
+    if(format == FIF_UNKNOWN)
+    {
+        MSG("Couldn't load '%s'", filename);
+        return NULL;
+    }
+
+    FIBITMAP* fib = FreeImage_Load(format,
+                                   filename,
+                                   0);
+    if(fib == NULL)
+    {
+        MSG("Couldn't load '%s'", filename);
+        return NULL;
+    }
+
+    if(FreeImage_GetColorType(fib) == FIC_PALETTE)
+    {
+        // OSM tiles are palettized, and I must explicitly handle that in
+        // FreeImage
+        FIBITMAP* fib24 = FreeImage_ConvertTo24Bits(fib);
+        FreeImage_Unload(fib);
+        fib = fib24;
+
+        if(fib == NULL)
+        {
+            MSG("Couldn't unpalettize '%s'", filename);
+            return NULL;
+        }
+    }
+
+    assert( FreeImage_GetWidth(fib)  == OSM_TILE_WIDTH );
+    assert( FreeImage_GetHeight(fib) == OSM_TILE_HEIGHT );
+    assert( FreeImage_GetBPP(fib)    == 8*3 );
+    assert( FreeImage_GetPitch(fib)  == OSM_TILE_WIDTH*3 );
+
+    return fib;
+}
+
+
+
+// The data is loaded by a separate thread: the DEMs, then the mesh chunks
+// (most urgent first: see chunk_priority()), then the texture tiles. None of
+// that needs OpenGL. The results are passed to the main thread through a queue,
+// and horizonator_update() uploads them, a bounded number at a time. This way
+// we can render something before everything is loaded
+
+// How many items the loader thread may get ahead of the main thread. These
+// were prioritized for the view at the time they were built, so I don't want
+// too many
+#define LOADER_QUEUE_MAX (2*HORIZONATOR_MAX_UPLOADS_PER_UPDATE)
+
+// When the view changes, the loader re-prioritizes the chunks it hasn't built
+// yet. It does this at most once per this many chunks
+#define LOADER_RESORT_INTERVAL 16
+
+// What the chunk scheduler needs to know about the view. Kept up-to-date by
+// horizonator_move() and horizonator_pan_zoom()
+typedef struct
+{
+    float viewer_lat, viewer_lon;
+    float az_deg0, az_deg1;
+} loader_view_t;
+
+typedef struct loader_item_t
+{
+    struct loader_item_t* next;
+
+    // A mesh chunk if vertices != NULL. A texture tile if fib != NULL
+    int       ilayer, ichunk, ci, cj;
+    vertex_t* vertices;
+
+    int       osmTileX, osmTileY;
+    FIBITMAP* fib;
+} loader_item_t;
+
+struct horizonator_loader_t
+{
+    pthread_t       thread;
+    bool            thread_started;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    // The inputs. Set before the thread starts, and not touched after
+    float viewer_lat, viewer_lon, viewer_z;
+    int   render_radius_cells;
+    float render_radius_m;
+    float load_az_deg0, load_az_deg1;
+    bool  render_texture, SRTM1, allow_downloads;
+    float SRTM1_near_radius_m;
+    // If polar_mesh, the main thread builds the mesh from the DEMs, so I don't
+    // build any chunks
+    bool  polar_mesh;
+    char  dir_dems      [1024];
+    char  dir_dems_SRTM1[1024];
+    char  dir_tiles     [256];
+    char  tiles_name    [256];
+    char  tiles_url_fmt [256];
+
+    // Everything here is protected by the mutex. dems_ready says that the
+    // dems, Nlayers and texture_ctx are available
+    horizonator_dem_context_t dems[HORIZONATOR_MAX_NLAYERS];
+    int                       Nlayers;
+    texture_ctx_t             texture_ctx;
+    bool                      dems_ready;
+    loader_item_t*            queue_head;
+    loader_item_t*            queue_tail;
+    int                       Nqueued;
+    bool                      done, failed;
+    // Set by the main thread to stop the loader thread early
+    bool                      cancel;
+    // Set by the main thread. view_version is incremented with each update
+    loader_view_t             view;
+    int                       view_version;
+
+    // Used by the main thread only
+    bool   dems_taken;
+    bool   radius_auto;
+    // The viewer_z from the latest horizonator_move() call before the DEMs
+    // were available. <0 to auto-select
+    float  move_viewer_z;
+    GLuint texID;
+};
+
+static void loader_item_free(loader_item_t* item)
+{
+    free(item->vertices);
+    if(item->fib != NULL)
+        FreeImage_Unload(item->fib);
+    free(item);
+}
+
+// Gives an item to the main thread. Blocks if the main thread is behind.
+// Returns false if we were asked to stop; the item is then freed
+static bool loader_push(struct horizonator_loader_t* L,
+                        loader_item_t* item)
+{
+    pthread_mutex_lock(&L->mutex);
+    while(L->Nqueued >= LOADER_QUEUE_MAX && !L->cancel)
+        pthread_cond_wait(&L->cond, &L->mutex);
+    if(L->cancel)
+    {
+        pthread_mutex_unlock(&L->mutex);
+        loader_item_free(item);
+        return false;
+    }
+
+    item->next = NULL;
+    if(L->queue_tail == NULL) L->queue_head       = item;
+    else                      L->queue_tail->next = item;
+    L->queue_tail = item;
+    L->Nqueued++;
+
+    pthread_cond_broadcast(&L->cond);
+    pthread_mutex_unlock(&L->mutex);
+    return true;
+}
+
+// Called by the main thread to tell the loader about the view, so that it can
+// prioritize the chunks. NULL arguments are left as they were
+static void loader_set_view(struct horizonator_loader_t* L,
+                            const float* viewer_lat, const float* viewer_lon,
+                            const float* az_deg0,    const float* az_deg1)
+{
+    pthread_mutex_lock(&L->mutex);
+    if(viewer_lat != NULL) L->view.viewer_lat = *viewer_lat;
+    if(viewer_lon != NULL) L->view.viewer_lon = *viewer_lon;
+    if(az_deg0    != NULL) L->view.az_deg0    = *az_deg0;
+    if(az_deg1    != NULL) L->view.az_deg1    = *az_deg1;
+    L->view_version++;
+    pthread_mutex_unlock(&L->mutex);
+}
+
+typedef struct
+{
+    int   ilayer, ichunk, ci, cj;
+    // From chunk_priority(). Lower is more urgent
+    float priority;
+} chunk_order_t;
+
+static int compare_chunk_order(const void* _a, const void* _b)
+{
+    const chunk_order_t* a = (const chunk_order_t*)_a;
+    const chunk_order_t* b = (const chunk_order_t*)_b;
+    if(a->priority < b->priority) return -1;
+    if(a->priority > b->priority) return  1;
+    return 0;
+}
+
+// The chunks that overlap the azimuth bounds of the view are loaded first,
+// nearest to the viewer first. Then the rest, also nearest first. The result
+// is a distance in meters. The chunks outside the view are pushed back by a
+// distance larger than any in the mesh
+static float chunk_priority(const horizonator_layer_t* layer,
+                            int ci, int cj,
+                            const loader_view_t* view)
+{
+    const horizonator_dem_context_t* dems = &layer->dems;
+
+    const float Rearth    = 6371000.0f;
+    const float m_per_deg = Rearth * (float)M_PI / 180.0f;
+
+    float lat0, lon0, lat1, lon1;
+    horizonator_dem_bounds_latlon_deg(dems, &lat0, &lon0, &lat1, &lon1);
+
+    // The center of the chunk, relative to the viewer
+    const float chunk_deg = (float)HORIZONATOR_CHUNK_CELLS / (float)dems->cells_per_deg;
+    const float e =
+        (lon0 + ((float)ci + 0.5f)*chunk_deg - view->viewer_lon) * m_per_deg *
+        cosf(view->viewer_lat * (float)M_PI / 180.0f);
+    const float n =
+        (lat0 + ((float)cj + 0.5f)*chunk_deg - view->viewer_lat) * m_per_deg;
+    const float d = hypotf(e,n);
+
+    // Half the azimuth span of the chunk, as seen by the viewer. A chunk
+    // around the viewer spans all azimuths
+    const float r_chunk   = chunk_deg * m_per_deg * (float)M_SQRT1_2;
+    const float daz_chunk = d > r_chunk ? asinf(r_chunk / d) : (float)M_PI;
+
+    const float az_center = (view->az_deg0 + view->az_deg1) / 2.0f * (float)M_PI / 180.0f;
+    const float daz_view  = (view->az_deg1 - view->az_deg0) / 2.0f * (float)M_PI / 180.0f;
+    const float daz       = remainderf(atan2f(e,n) - az_center, 2.0f*(float)M_PI);
+
+    const bool in_view = fabsf(daz) <= daz_view + daz_chunk;
+    return in_view ? d : d + 1e8f;
+}
+
+static void* loader_thread(void* cookie)
+{
+    struct horizonator_loader_t* L = (struct horizonator_loader_t*)cookie;
+
+    bool result    = false;
+    bool published = false;
+
+    horizonator_layer_t layers[HORIZONATOR_MAX_NLAYERS] = {};
+    int                 Nlayers = 0;
+    int*                cij     = NULL;
+    chunk_order_t*      order   = NULL;
+
+    if( !horizonator_dem_init( &layers[0].dems,
+                               L->viewer_lat, L->viewer_lon,
+                               L->render_radius_cells,
+                               L->render_radius_m,
+                               L->viewer_z,
+                               L->load_az_deg0, L->load_az_deg1,
+                               L->dir_dems,
+                               L->SRTM1) )
+    {
+        MSG("Couldn't init DEMs. Giving up");
+        goto done;
+    }
+    Nlayers = 1;
+
+    const int render_radius_cells = layers[0].dems.radius_cells;
+
+    if(L->SRTM1_near_radius_m > 0)
+    {
+        if( !horizonator_dem_init( &layers[1].dems,
+                                   L->viewer_lat, L->viewer_lon,
+                                   -1, L->SRTM1_near_radius_m,
+                                   -1.f,
+                                   L->load_az_deg0, L->load_az_deg1,
+                                   L->dir_dems_SRTM1,
+                                   true) )
+        {
+            MSG("Couldn't init the 1\" DEMs near the viewer. Giving up");
+            goto done;
+        }
+        Nlayers = 2;
+
+        if( (float)layers[1].dems.radius_cells / (float)layers[1].dems.cells_per_deg >=
+            (float)render_radius_cells         / (float)layers[0].dems.cells_per_deg )
+        {
+            MSG("SRTM1_near_radius_m must be smaller than the render radius");
+            goto done;
+        }
+    }
+
+    texture_ctx_t texture_ctx = {};
+    if(L->render_texture)
+    {
+        // My render data is in a grid centered on viewer_lat/viewer_lon, branching
+        // render_radius_cells*DEG_PER_CELL degrees in all 4 directions
+        const int cells_per_deg = layers[0].dems.cells_per_deg;
+        float lowest_E  = L->viewer_lon - (float)render_radius_cells/cells_per_deg;
+        float lowest_N  = L->viewer_lat - (float)render_radius_cells/cells_per_deg;
+        float highest_E = L->viewer_lon + (float)render_radius_cells/cells_per_deg;
+        float highest_N = L->viewer_lat + (float)render_radius_cells/cells_per_deg;
+
+        // ytile decreases with lat, so I treat it backwards
+        getOSMTileID( &texture_ctx.osmtile_lowestXY[0],
+                      &texture_ctx.osmtile_lowestXY[1],
+                      lowest_E, highest_N);
+        getOSMTileID( &texture_ctx.osmtile_highestXY[0],
+                      &texture_ctx.osmtile_highestXY[1],
+                      highest_E, lowest_N);
+
+        texture_ctx.NtilesXY[0] = texture_ctx.osmtile_highestXY[0] - texture_ctx.osmtile_lowestXY[0] + 1;
+        texture_ctx.NtilesXY[1] = texture_ctx.osmtile_highestXY[1] - texture_ctx.osmtile_lowestXY[1] + 1;
+    }
+
+    // The DEMs are ready. The main thread owns them now; I keep using my copy
+    // read-only
+    pthread_mutex_lock(&L->mutex);
+    for(int l=0; l<Nlayers; l++)
+        L->dems[l] = layers[l].dems;
+    L->Nlayers     = Nlayers;
+    L->texture_ctx = texture_ctx;
+    L->dems_ready  = true;
+    pthread_cond_broadcast(&L->cond);
+    pthread_mutex_unlock(&L->mutex);
+    published = true;
+
+    // The chunks. I build them one at a time, most urgent first, so that a
+    // partial render shows the area we're looking at, near the viewer first
+    int Nchunks_max = 0;
+    for(int l=0; l<Nlayers; l++)
+    {
+        init_layer_grid(&layers[l]);
+        Nchunks_max += layers[l].Nchunks_side*layers[l].Nchunks_side;
+    }
+    cij   = malloc(Nchunks_max*2*sizeof(int));
+    order = malloc(Nchunks_max*sizeof(order[0]));
+    if(cij == NULL || order == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+
+    int Norder = 0;
+    for(int l=0; l<Nlayers && !L->polar_mesh; l++)
+    {
+        // The layers that have simplified meshes are built by the main
+        // thread, from the mmap-ed files
+        if(horizonator_dem_have_tins(&layers[l].dems))
+            continue;
+
+        // These must match what init_layer_mesh() uses
+        const int N = select_layer_chunks(cij, &layers[l],
+                                          l+1 < Nlayers ? &layers[l+1] : NULL);
+        for(int ichunk=0; ichunk<N; ichunk++)
+            order[Norder++] = (chunk_order_t){.ilayer = l,
+                                              .ichunk = ichunk,
+                                              .ci     = cij[2*ichunk + 0],
+                                              .cj     = cij[2*ichunk + 1]};
+    }
+
+    // order[i..] are the chunks not yet built. If the view changes, I
+    // re-prioritize these
+    int view_version = -1;
+    int i_sorted     = -LOADER_RESORT_INTERVAL;
+    for(int i=0; i<Norder; i++)
+    {
+        if(i - i_sorted >= LOADER_RESORT_INTERVAL)
+        {
+            pthread_mutex_lock(&L->mutex);
+            const bool          resort = L->view_version != view_version;
+            const loader_view_t view   = L->view;
+            view_version               = L->view_version;
+            pthread_mutex_unlock(&L->mutex);
+
+            if(resort)
+            {
+                for(int k=i; k<Norder; k++)
+                    order[k].priority =
+                        chunk_priority(&layers[order[k].ilayer],
+                                       order[k].ci, order[k].cj,
+                                       &view);
+                qsort(&order[i], Norder-i, sizeof(order[0]), compare_chunk_order);
+                i_sorted = i;
+            }
+        }
+
+        loader_item_t* item = calloc(1, sizeof(*item));
+        if(item == NULL)
+        {
+            MSG("malloc() failed");
+            goto done;
+        }
+        item->vertices = malloc(CHUNK_NVERTICES*3*sizeof(vertex_t));
+        if(item->vertices == NULL)
+        {
+            MSG("malloc() failed");
+            free(item);
+            goto done;
+        }
+        item->ilayer = order[i].ilayer;
+        item->ichunk = order[i].ichunk;
+        item->ci     = order[i].ci;
+        item->cj     = order[i].cj;
+        build_chunk(item->vertices, &layers[item->ilayer],
+                    item->ci*HORIZONATOR_CHUNK_CELLS,
+                    item->cj*HORIZONATOR_CHUNK_CELLS);
+        if(!loader_push(L, item))
+            goto done;
+    }
+
+    // The texture. Slowest, since we might download the tiles
+    if(L->render_texture)
+        for( int osmTileY = texture_ctx.osmtile_lowestXY[1];
+             osmTileY <= texture_ctx.osmtile_highestXY[1];
+             osmTileY++)
+            for( int osmTileX = texture_ctx.osmtile_lowestXY[0];
+                 osmTileX <= texture_ctx.osmtile_highestXY[0];
+                 osmTileX++ )
+            {
+                loader_item_t* item = calloc(1, sizeof(*item));
+                if(item == NULL)
+                {
+                    MSG("malloc() failed");
+                    goto done;
+                }
+                item->osmTileX = osmTileX;
+                item->osmTileY = osmTileY;
+                item->fib      = load_OSM_tile(osmTileX, osmTileY,
+                                               L->dir_tiles, L->tiles_name,
+                                               L->tiles_url_fmt,
+                                               L->allow_downloads);
+                if(item->fib == NULL)
+                {
+                    free(item);
+                    goto done;
+                }
+                if(!loader_push(L, item))
+                    goto done;
+            }
+
+    result = true;
+
+ done:
+    pthread_mutex_lock(&L->mutex);
+    if(!result && !L->cancel)
+        L->failed = true;
+    L->done = true;
+    pthread_cond_broadcast(&L->cond);
+    pthread_mutex_unlock(&L->mutex);
+
+    if(!published)
+        for(int l=0; l<Nlayers; l++)
+            horizonator_dem_deinit(&layers[l].dems);
+    free(cij);
+    free(order);
+    return NULL;
+}
+
+// Stops the loader thread, if it's still running, and frees everything that
+// the main thread didn't take
+static void loader_deinit(horizonator_context_t* ctx)
+{
+    struct horizonator_loader_t* L = ctx->loader;
+    if(L == NULL)
+        return;
+
+    if(L->thread_started)
+    {
+        pthread_mutex_lock(&L->mutex);
+        L->cancel = true;
+        pthread_cond_broadcast(&L->cond);
+        pthread_mutex_unlock(&L->mutex);
+
+        pthread_join(L->thread, NULL);
+    }
+
+    while(L->queue_head != NULL)
+    {
+        loader_item_t* next = L->queue_head->next;
+        loader_item_free(L->queue_head);
+        L->queue_head = next;
+    }
+
+    if(L->dems_ready && !L->dems_taken)
+        for(int l=0; l<L->Nlayers; l++)
+            horizonator_dem_deinit(&L->dems[l]);
+
+    pthread_mutex_destroy(&L->mutex);
+    pthread_cond_destroy(&L->cond);
+    free(L);
+    ctx->loader = NULL;
+}
+
+// The DEMs have been loaded. I make the meshes and the texture, and put the
+// viewer where it was asked to be
+static bool take_dems(horizonator_context_t* ctx)
+{
+    struct horizonator_loader_t* L = ctx->loader;
+
+    for(int l=0; l<L->Nlayers; l++)
+        ctx->layers[l].dems = L->dems[l];
+    ctx->Nlayers  = L->Nlayers;
+    L->dems_taken = true;
+
+    // The meshes follow the viewer in horizonator_move(), unless we're
+    // texturing (the texture covers the initial area only) or loading a wedge
+    // (the wedge is defined relative to the initial position)
+    const bool sliding = !ctx->render_texture && !ctx->layers[0].dems.have_wedge;
+
+    if(ctx->polar_mesh)
+    {
+        // The layers provide the DEMs only. The mesh is sampled in the
+        // horizonator_move() call below
+        for(int l=0; l<ctx->Nlayers; l++)
+        {
+            init_layer_grid(&ctx->layers[l]);
+            ctx->layers[l].sliding = sliding;
+        }
+        if(!init_polar_mesh(ctx))
+            return false;
+        ctx->Ntriangles = ctx->polar.Nindices / 3;
+    }
+    else
+        for(int l=0; l<ctx->Nlayers; l++)
+        {
+            // If we have any simplified meshes, those are drawn. They're built
+            // in the horizonator_move() call below. Otherwise the loader
+            // thread builds the chunks
+            if(horizonator_dem_have_tins(&ctx->layers[l].dems))
+            {
+                init_layer_tin(&ctx->layers[l], sliding);
+                continue;
+            }
+
+            // The far layer omits whatever the near layer covers
+            if(!init_layer_mesh(&ctx->layers[l],
+                                l+1 < ctx->Nlayers ? &ctx->layers[l+1] : NULL,
+                                ctx->indexBufID,
+                                sliding))
+                return false;
+        }
+
+    if(ctx->render_texture)
+    {
+        const texture_ctx_t* texture_ctx = &L->texture_ctx;
+
+        glGenTextures(1, &L->texID);
+        glActiveTextureARB( GL_TEXTURE0_ARB ); assert_opengl();
+        glBindTexture( GL_TEXTURE_2D, L->texID ); assert_opengl();
+
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_REPEAT);
+
+        // Init the whole texture with 0. Then later I'll fill it in tile by
+        // tile, as the tiles come in
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB,
+                     texture_ctx->NtilesXY[0]*OSM_TILE_WIDTH,
+                     texture_ctx->NtilesXY[1]*OSM_TILE_HEIGHT,
+                     0, GL_BGR,
+                     GL_UNSIGNED_BYTE, (const GLvoid *)NULL);
+        assert_opengl();
+
+        ctx->view.NtilesX         = texture_ctx->NtilesXY[0];
+        ctx->view.NtilesY         = texture_ctx->NtilesXY[1];
+        ctx->view.osmtile_lowestX = texture_ctx->osmtile_lowestXY[0];
+        ctx->view.osmtile_lowestY = texture_ctx->osmtile_lowestXY[1];
+        ctx->view_dirty           = true;
+    }
+
+    // If the radius was selected automatically, I render out to that radius by
+    // default
+    if(L->radius_auto)
+        horizonator_set_zextents(ctx,
+                                 HORIZONATOR_ZNEAR_DEFAULT, ctx->layers[0].dems.radius_m,
+                                 HORIZONATOR_ZNEAR_DEFAULT, ctx->layers[0].dems.radius_m);
+
+    float viewer_z = L->move_viewer_z;
+    horizonator_move(ctx, &viewer_z, ctx->viewer_lat, ctx->viewer_lon);
+    return true;
+}
+
+// Uploads an item produced by the loader thread
+static void upload_item(horizonator_context_t* ctx,
+                        const loader_item_t* item)
+{
+    struct horizonator_loader_t* L = ctx->loader;
+
+    if(item->vertices != NULL)
+    {
+        horizonator_layer_t* layer = &ctx->layers[item->ilayer];
+
+        glBindBuffer(GL_ARRAY_BUFFER, layer->vertexBufID);
+        add_chunk(layer, item->ichunk, item->ci, item->cj, item->vertices);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        ctx->Ntriangles     += CHUNK_NTRIANGLES;
+        ctx->visible_dirty = true;
+    }
+    else
+    {
+        // GL stores its textures upside down, so I flip the y index of the
+        // tile
+        glBindTexture( GL_TEXTURE_2D, L->texID );
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        (item->osmTileX - L->texture_ctx.osmtile_lowestXY[0] )*OSM_TILE_WIDTH,
+                        (L->texture_ctx.osmtile_highestXY[1] - item->osmTileY)*OSM_TILE_HEIGHT,
+                        OSM_TILE_WIDTH, OSM_TILE_HEIGHT,
+                        GL_BGR, GL_UNSIGNED_BYTE,
+                        (const GLvoid *)FreeImage_GetBits(item->fib));
+        assert_opengl();
+    }
+}
+
+bool horizonator_update(horizonator_context_t* ctx,
+                        // output
+                        bool* loading,
+                        // input
+                        bool wait)
+{
+    struct horizonator_loader_t* L = ctx->loader;
+    if(L == NULL)
+    {
+        if(loading != NULL) *loading = false;
+        return true;
+    }
+
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    while(true)
+    {
+        pthread_mutex_lock(&L->mutex);
+        if(wait)
+            while(!(L->dems_ready && !L->dems_taken) &&
+                  L->queue_head == NULL &&
+                  !L->done)
+                pthread_cond_wait(&L->cond, &L->mutex);
+
+        // I take everything if we're waiting. Otherwise, a bounded number of
+        // items, to not stall the frame
+        const bool     dems_new = L->dems_ready && !L->dems_taken;
+        loader_item_t* items    = L->queue_head;
+        loader_item_t* last     = NULL;
+        for(int i=0;
+            L->queue_head != NULL && (wait || i < HORIZONATOR_MAX_UPLOADS_PER_UPDATE);
+            i++)
+        {
+            last          = L->queue_head;
+            L->queue_head = L->queue_head->next;
+            L->Nqueued--;
+        }
+        if(last != NULL)
+            last->next = NULL;
+        else
+            items = NULL;
+        if(L->queue_head == NULL)
+            L->queue_tail = NULL;
+
+        const bool     done     = L->done && L->queue_head == NULL;
+        const bool     failed   = L->failed;
+
+        // There's room in the queue now
+        pthread_cond_broadcast(&L->cond);
+        pthread_mutex_unlock(&L->mutex);
+
+        // The scene changes, so the previous renders can't be reused
+        if(dems_new || items != NULL)
+            ctx->scene_serial++;
+
+        bool result = true;
+        if(dems_new && !take_dems(ctx))
+            result = false;
+
+        while(items != NULL)
+        {
+            loader_item_t* next = items->next;
+            if(result)
+                upload_item(ctx, items);
+            loader_item_free(items);
+            items = next;
+        }
+
+        if(failed || !result)
+        {
+            MSG("Loading the data failed");
+            return false;
+        }
+
+        if(done)
+        {
+            // Everything has been loaded
+            loader_deinit(ctx);
+            if(loading != NULL) *loading = false;
+            return true;
+        }
+
+        if(!wait)
+            break;
+    }
+
+    if(loading != NULL) *loading = true;
+    return true;
+}
+
+// The linked shader programs are cached in ~/.horizonator/shaders, as returned
+// by glGetProgramBinary(). Each file is named by a hash of everything that went
+// into it: the GL vendor, renderer and version strings, and the shader sources
+// with the #defines of the variant. So a driver update or a shader change
+// simply produces a new file. The cache is only an optimization: if a binary
+// can't be read, or the driver rejects it, the program is compiled as usual,
+// and the cache is rewritten. Change PROGRAM_CACHE_MAGIC if anything that
+// affects the link is changed in the C code, such as the feedback varyings
+#define PROGRAM_CACHE_MAGIC "hzprog1"
+
+typedef struct
+{
+    char     magic[8];
+    uint64_t key;
+    uint32_t format;
+    uint32_t size;
+} program_cache_header_t;
+
+// FNV-1a. The terminating '\0' is hashed too, so that consecutive strings
+// can't run into each other
+static uint64_t hash_string(uint64_t hash, const char* s)
+{
+    do
+    {
+        hash ^= (uint8_t)*s;
+        hash *= 0x100000001b3ULL;
+    } while(*s++);
+    return hash;
+}
+
+// The path of the cache file for a program with the given key. If mkdirs, the
+// cache directory is created, if needed
+static bool program_cache_path(// output
+                               char* path, int bufsize,
+                               // input
+                               uint64_t key, bool mkdirs)
+{
+    const char* home = getenv("HOME");
+    if(home == NULL)
+        return false;
+
+    if(mkdirs)
+    {
+        if(snprintf(path, bufsize, "%s/.horizonator", home) >= bufsize)
+            return false;
+        mkdir(path, 0755);
+        if(snprintf(path, bufsize, "%s/.horizonator/shaders", home) >= bufsize)
+            return false;
+        mkdir(path, 0755);
+    }
+
+    return
+        snprintf(path, bufsize, "%s/.horizonator/shaders/%016" PRIx64 ".bin",
+                 home, key) < bufsize;
+}
+
+// Loads the program with the given key from the cache into the program object
+// id. Returns true if the result is a usable, linked program
+static bool load_program_binary(GLuint id, uint64_t key)
+{
+    bool  result = false;
+    void* binary = NULL;
+    FILE* fp     = NULL;
+
+    char path[1024];
+    if(!program_cache_path(path, sizeof(path), key, false))
+        goto done;
+    fp = fopen(path, "r");
+    if(fp == NULL)
+        goto done;
+
+    program_cache_header_t header;
+    if(1 != fread(&header, sizeof(header), 1, fp) ||
+       0 != memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) ||
+       header.key != key ||
+       header.size == 0)
+        goto done;
+
+    binary = malloc(header.size);
+    if(binary == NULL ||
+       1 != fread(binary, header.size, 1, fp))
+        goto done;
+
+    glProgramBinary(id, header.format, binary, (GLsizei)header.size);
+
+    // The driver may reject a binary, even one that it made itself. This isn't
+    // an error: I'll compile the program instead. So I clear the error flag,
+    // if it was set
+    while(glGetError() != GL_NO_ERROR)
+        ;
+    GLint linked = GL_FALSE;
+    glGetProgramiv(id, GL_LINK_STATUS, &linked);
+    result = linked == GL_TRUE;
+
+ done:
+    free(binary);
+    if(fp != NULL)
+        fclose(fp);
+    return result;
+}
+
+// Writes the freshly-linked program id to the cache. Failures are silently
+// ignored: the cache is an optimization only. The file is written to a
+// temporary name and renamed, so concurrent processes see either a complete
+// file or none at all
+static void save_program_binary(GLuint id, uint64_t key)
+{
+    GLint size = 0;
+    glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &size);
+    if(size <= 0)
+        return;
+
+    program_cache_header_t header = { .magic = PROGRAM_CACHE_MAGIC,
+                                      .key   = key };
+    void* binary = malloc(size);
+    if(binary == NULL)
+        return;
+
+    GLsizei len    = 0;
+    GLenum  format = 0;
+    glGetProgramBinary(id, size, &len, &format, binary);
+    assert_opengl();
+    header.format = (uint32_t)format;
+    header.size   = (uint32_t)len;
+
+    char path[1024], path_tmp[1100];
+    if(len > 0 &&
+       program_cache_path(path, sizeof(path), key, true) &&
+       snprintf(path_tmp, sizeof(path_tmp), "%s.%d.tmp", path, (int)getpid()) < (int)sizeof(path_tmp))
+    {
+        FILE* fp = fopen(path_tmp, "w");
+        if(fp != NULL)
+        {
+            bool ok =
+                1 == fwrite(&header, sizeof(header), 1, fp) &&
+                1 == fwrite(binary,  len,            1, fp);
+            ok = (0 == fclose(fp)) && ok;
+            if(!ok || 0 != rename(path_tmp, path))
+                unlink(path_tmp);
+        }
+    }
+    free(binary);
+}
+
+// Compiles and links one of the shader program variants: an OR of the
+// HORIZONATOR_PROGRAM_... flags. Each is vertex.glsl and fragment.glsl, with
+// the #version and the #defines of the variant prepended. The capture variant
+// and the plain depth-only variants have no fragment shader: the capture
+// variant only feeds the transform feedback, and the depth-only variants write
+// only the depth. The panorama variants add geometry.glsl. If the program is in
+// the cache, it's loaded from there instead
+static bool compile_program(// output
+                            horizonator_program_t* program,
+                            // input
+                            int variant)
+{
+    // The shader transforms the VBO vertices into the view coord system. Each
+    // VBO point is a tuple (ilon,ilat,height). The first 2 args are indices
+    // into the DEM. The height is in meters
+    static const GLchar* vertexShaderSource =
+#include "vertex.glsl.h"
+        ;
+    static const GLchar* geometryShaderSource =
+#include "geometry.glsl.h"
+        ;
+    static const GLchar* fragmentShaderSource =
+#include "fragment.glsl.h"
+        ;
+
+    // One #define for each flag of the variant
+    static const struct
+    {
+        int         flag;
+        const char* define;
+    } flag_defines[] =
+        { { HORIZONATOR_PROGRAM_TEXTURED,   "#define HORIZONATOR_TEXTURED\n"   },
+          { HORIZONATOR_PROGRAM_CACHED,     "#define HORIZONATOR_CACHED\n"     },
+          { HORIZONATOR_PROGRAM_DEPTH_ONLY, "#define HORIZONATOR_DEPTH_ONLY\n" },
+          { HORIZONATOR_PROGRAM_GEO,        "#define HORIZONATOR_GEO\n"        },
+          { HORIZONATOR_PROGRAM_CAPTURE,    "#define HORIZONATOR_CAPTURE\n"    },
+          { HORIZONATOR_PROGRAM_PANORAMA,   "#define HORIZONATOR_PANORAMA\n"   },
+          { HORIZONATOR_PROGRAM_RESAMPLE,   "#define HORIZONATOR_RESAMPLE\n"   } };
+    char defines[256] = "";
+    for(int i=0; i<(int)(sizeof(flag_defines)/sizeof(flag_defines[0])); i++)
+        if(variant & flag_defines[i].flag)
+            strcat(defines, flag_defines[i].define);
+
+    const bool capture  = variant & HORIZONATOR_PROGRAM_CAPTURE;
+    const bool panorama = variant & HORIZONATOR_PROGRAM_PANORAMA;
+    if(panorama)
+        sprintf(&defines[strlen(defines)],
+                "#define HORIZONATOR_PANORAMA_NSECTORS %d\n",
+                HORIZONATOR_PANORAMA_NSECTORS);
+    // The capture variant and the depth-only variant without GEO write no
+    // color, so they need no fragment stage
+    const bool have_fragment_shader =
+        !capture &&
+        (!(variant & HORIZONATOR_PROGRAM_DEPTH_ONLY) ||
+          (variant & HORIZONATOR_PROGRAM_GEO));
+    static const GLchar* version = "#version 420\n";
+
+    uint64_t key = 0xcbf29ce484222325ULL;
+    key = hash_string(key, PROGRAM_CACHE_MAGIC);
+    key = hash_string(key, (const char*)glGetString(GL_VENDOR));
+    key = hash_string(key, (const char*)glGetString(GL_RENDERER));
+    key = hash_string(key, (const char*)glGetString(GL_VERSION));
+    key = hash_string(key, version);
+    key = hash_string(key, defines);
+    key = hash_string(key, vertexShaderSource);
+    if(panorama)
+        key = hash_string(key, geometryShaderSource);
+    if(have_fragment_shader)
+        key = hash_string(key, fragmentShaderSource);
+
+    char msg[1024];
+    int len;
+
+    GLuint id = glCreateProgram();
+    assert_opengl();
+
+    if(load_program_binary(id, key))
+        goto linked;
+
+    // Not cached. I start over with a clean program object, in case the
+    // failed load left anything behind
+    glDeleteProgram(id);
+    id = glCreateProgram();
+    assert_opengl();
+
+    void install_shader(GLenum type, const GLchar* source, const char* what)
+    {
+        const GLchar* sources[] = { version, defines, source };
+
+        GLuint shader = glCreateShader(type);
+        assert_opengl();
+        glShaderSource(shader, 3, sources, NULL);
+        assert_opengl();
+        glCompileShader(shader);
+        assert_opengl();
+        glGetShaderInfoLog( shader, sizeof(msg), &len, msg );
+        if( strlen(msg) )
+            printf("%s shader info: %s\n", what, msg);
+
+        // The shader is deleted along with the program
+        glAttachShader(id, shader);
+        glDeleteShader(shader);
+        assert_opengl();
+    }
+
+    install_shader(GL_VERTEX_SHADER, vertexShaderSource, "vertex");
+    if(panorama)
+        install_shader(GL_GEOMETRY_SHADER, geometryShaderSource, "geometry");
+    if(have_fragment_shader)
+        install_shader(GL_FRAGMENT_SHADER, fragmentShaderSource, "fragment");
+    if(capture)
+    {
+        // The feedback caches capture this. See update_feedback()
+        const GLchar* feedback_varyings[] = {"polar_feedback"};
+        glTransformFeedbackVaryings(id, 1, feedback_varyings,
+                                    GL_INTERLEAVED_ATTRIBS);
+        assert_opengl();
+    }
+
+    glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(id); assert_opengl();
+    glGetProgramInfoLog( id, sizeof(msg), &len, msg );
+    if( strlen(msg) )
+        printf("program info after glLinkProgram(): %s\n", msg);
+    {
+        GLint linked;
+        glGetProgramiv(id, GL_LINK_STATUS, &linked);
+        if(!linked)
+        {
+            MSG("Couldn't link shader program variant %d", variant);
+            glDeleteProgram(id);
+            return false;
+        }
+    }
+    save_program_binary(id, key);
+
+ linked:
+    ;
+
+    // The view state. vertex.glsl binds its uniform block to binding point 0.
+    // The block must have the layout of horizonator_view_t
+    GLuint iblock = glGetUniformBlockIndex(id, "horizonator_view");
+    if(iblock != GL_INVALID_INDEX)
+    {
+        GLint block_size = -1;
+        glGetActiveUniformBlockiv(id, iblock,
+                                  GL_UNIFORM_BLOCK_DATA_SIZE, &block_size);
+        assert_opengl();
+        if(block_size != (GLint)sizeof(horizonator_view_t))
+        {
+            MSG("The horizonator_view uniform block is %d bytes, but horizonator_view_t is %d bytes. They must match",
+                (int)block_size, (int)sizeof(horizonator_view_t));
+            glDeleteProgram(id);
+            return false;
+        }
+    }
+
+    // These are set per draw, in horizonator_redraw(). A variant that doesn't
+    // use one gets -1, which GL ignores
+    *program = (horizonator_program_t)
+        { .id                          = id,
+          .uniform_DEG_PER_CELL        = glGetUniformLocation(id, "DEG_PER_CELL"),
+          .uniform_origin_cell_lon_deg = glGetUniformLocation(id, "origin_cell_lon_deg"),
+          .uniform_origin_cell_lat_deg = glGetUniformLocation(id, "origin_cell_lat_deg"),
+          .uniform_viewer_cell_i       = glGetUniformLocation(id, "viewer_cell_i"),
+          .uniform_viewer_cell_j       = glGetUniformLocation(id, "viewer_cell_j"),
+          .uniform_seam_side           = glGetUniformLocation(id, "seam_side"),
+          .uniform_panorama_cache      = glGetUniformLocation(id, "panorama_cache") };
+    assert_opengl();
+    return true;
+}
+
+// Returns the given program variant, compiling it if this is the first time
+// it's needed. Returns NULL on error
+static const horizonator_program_t* get_program(horizonator_context_t* ctx,
+                                                int variant)
+{
+    horizonator_program_t* program = &ctx->programs[variant];
+    if(program->id == 0 &&
+       !compile_program(program, variant))
+        return NULL;
+    return program;
+}
+
+static void deinit_programs(horizonator_context_t* ctx)
+{
+    for(int i=0; i<HORIZONATOR_NPROGRAMS; i++)
+        if(ctx->programs[i].id != 0)
+        {
+            glDeleteProgram(ctx->programs[i].id);
+            ctx->programs[i] = (horizonator_program_t){};
+        }
+}
+
+static void deinit_framebuffer(horizonator_framebuffer_t* fb)
+{
+    if(fb->frameBufID != 0)
+        glDeleteFramebuffers(1, &fb->frameBufID);
+    if(fb->depthBufID != 0)
+        glDeleteRenderbuffers(1, &fb->depthBufID);
+    if(fb->renderBufID != 0)
+        glDeleteRenderbuffers(1, &fb->renderBufID);
+    if(fb->geoBufID != 0)
+        glDeleteRenderbuffers(1, &fb->geoBufID);
+    *fb = (horizonator_framebuffer_t){};
+}
+
+// Binds the framebuffer, and sets up its attachments for a render. The depth
+// buffer is always there. The color buffer is attached if !depth_only, and the
+// position buffer if geo. These two are made the first time they're needed
+static void framebuffer_attach(horizonator_framebuffer_t* fb,
+                               bool depth_only, bool geo)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, fb->frameBufID);
+
+    if(!depth_only && fb->renderBufID == 0)
+    {
+        glGenRenderbuffers(1, &fb->renderBufID);
+        glBindRenderbuffer(GL_RENDERBUFFER, fb->renderBufID);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGB, fb->width, fb->height);
+        assert_opengl();
+    }
+    if(geo && fb->geoBufID == 0)
+    {
+        glGenRenderbuffers(1, &fb->geoBufID);
+        glBindRenderbuffer(GL_RENDERBUFFER, fb->geoBufID);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA32F, fb->width, fb->height);
+        assert_opengl();
+    }
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER,
+                              depth_only ? 0 : fb->renderBufID);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                              GL_RENDERBUFFER,
+                              geo ? fb->geoBufID : 0);
+    glDrawBuffers(2, (const GLenum[]){ depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0,
+                                       geo        ? GL_COLOR_ATTACHMENT1 : GL_NONE });
+    assert_opengl();
+    {
+        int res = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        assert( res == GL_FRAMEBUFFER_COMPLETE );
+    }
+}
+
+// Makes a framebuffer with just a depth buffer. The other attachments are made
+// by framebuffer_attach(). Leaves the framebuffer bound
+static void framebuffer_make(horizonator_framebuffer_t* fb,
+                             int width, int height)
+{
+    deinit_framebuffer(fb);
+
+    glGenFramebuffers(1, &fb->frameBufID);
+    assert_opengl();
+    glBindFramebuffer(GL_FRAMEBUFFER, fb->frameBufID);
+    assert_opengl();
+
+    glGenRenderbuffers(1, &fb->depthBufID);
+    assert_opengl();
+    glBindRenderbuffer(GL_RENDERBUFFER, fb->depthBufID);
+    assert_opengl();
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT,
+                          width, height);
+    assert_opengl();
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, fb->depthBufID);
+    assert_opengl();
+    {
+        int res = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        assert( res == GL_FRAMEBUFFER_COMPLETE );
+    }
+
+    fb->width  = width;
+    fb->height = height;
+}
+
+// Selects the offscreen framebuffer of the given size, and makes it current.
+// If the pool doesn't have one of this size, I make it in an unused slot, or
+// in place of the least-recently-used one
+static bool select_offscreen_framebuffer(horizonator_context_t* ctx,
+                                         int width, int height)
+{
+    static_assert(sizeof(GLuint) == sizeof(ctx->offscreen.framebuffers[0].frameBufID),
+                  "horizonator_framebuffer_t.... must be a GLuint");
+
+    if(width <= 0 || height <= 0)
+    {
+        MSG("The offscreen render must have a positive size. Got %dx%d",
+            width, height);
+        return false;
+    }
+
+    horizonator_framebuffer_t* framebuffers = ctx->offscreen.framebuffers;
+    int i     = 0;
+    int i_lru = 0;
+    for(; i<HORIZONATOR_OFFSCREEN_NFRAMEBUFFERS; i++)
+    {
+        if(framebuffers[i].last_used != 0    &&
+           framebuffers[i].width     == width &&
+           framebuffers[i].height    == height)
+            break;
+        if(framebuffers[i].last_used < framebuffers[i_lru].last_used)
+            i_lru = i;
+    }
+
+    if(i == HORIZONATOR_OFFSCREEN_NFRAMEBUFFERS)
+    {
+        GLint max_size;
+        glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+        if(width > max_size || height > max_size)
+        {
+            MSG("The offscreen render is too large: it's %dx%d, but the renderbuffers can be at most %dx%d",
+                width, height, (int)max_size, (int)max_size);
+            return false;
+        }
+
+        // The color buffer is made only if an image is requested. See
+        // horizonator_render_offscreen()
+        i = i_lru;
+        framebuffer_make(&framebuffers[i], width, height);
+    }
+    else
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i].frameBufID);
+
+    framebuffers[i].last_used = ++ctx->offscreen.use_count;
+    ctx->offscreen.current    = i;
+    ctx->offscreen.width      = width;
+    ctx->offscreen.height     = height;
+
+    glViewport(0, 0, width, height);
+    ctx->view.aspect = (float)width / (float)height;
+    ctx->view_dirty  = true;
+    return true;
+}
+
+// The main init routine. We support 3 modes:
+//
+// - GLUT: static window    (use_glut = true, offscreen_width <= 0)
+// - GLUT: offscreen render (use_glut = true, offscreen_width > 0)
+// - no GLUT: higher-level application (use_glut = false)
+//
+// This routine loads the DEMs around the viewer (viewer is at the center of the
+// DEMs). The render can then be updated by calling any of
+// - horizonator_move()
+// - horizonator_pan_zoom()
+// - horizonator_resized()
+// and then
+// - horizonator_redraw()
+//
+// If rendering off-screen, horizonator_resized() picks a framebuffer of the
+// new size from a pool of HORIZONATOR_OFFSCREEN_NFRAMEBUFFERS, so switching
+// between a few sizes is cheap. See select_offscreen_framebuffer().
+// horizonator_pan_zoom() must be called to update the azimuth extents.
+// Completely arbitrarily, these are set to -45deg - 45deg initially
+//
+// SRTM1 selects between 1" SRTM and 3" SRTM. Currently every triangle is
+// rendered, so 1" SRTM tiles can easily overload the machine. Unless you need
+// the extra resolution, stick with 3" SRTM tiles for now
+//
+// If SRTM1_near_radius_m > 0 we use a mixed-resolution mode: 1" data is loaded
+// within this radius of the viewer, and 3" data beyond it, out to the render
+// radius. The two meshes are drawn in two depth-composited passes. This gives
+// us the fidelity of the 1" data near the viewer, where it matters, at close
+// to the cost of the 3" data. In this mode SRTM1 must be false, dir_dems refers
+// to the 3" data, and dir_dems_SRTM1 to the 1" data. dir_dems_SRTM1 may be
+// NULL to use the default
+//
+// If both render_radius_cells and render_radius_m are <= 0, the radius is
+// selected automatically: we load out to the furthest distance where terrain
+// could still poke above the horizon of the curved earth, given the viewer
+// height and the highest terrain in range. zfar is then set to this radius. The
+// rendering itself ignores the curvature
+//
+// If the azimuth bounds of the view are known ahead of time, and won't change,
+// pass them in load_az_deg0, load_az_deg1. Then only the DEM tiles and mesh
+// chunks inside that wedge (plus a margin) are loaded. This is much faster and
+// takes much less memory for narrow fields of view. Anything outside the wedge
+// is not rendered at all
+//
+// If polar_mesh_Naz > 0, the DEMs are resampled on rings around the viewer
+// instead of being drawn as a grid. See horizonator.h
+bool horizonator_init( // output
+                       horizonator_context_t* ctx,
+
+                       // input
+                       float viewer_lat, float viewer_lon,
+                       // output/input
+                       // if viewer_z==NULL, auto-select a value; if *viewer_z >=
+                       // 0, use that; if *viewer_z < 0, auto-select a value, and
+                       // report it here
+                       float* viewer_z,
+                       int offscreen_width, int offscreen_height,
+                       int render_radius_cells, // This should be given >0
+                       float render_radius_m,   // or this, but not both. If
+                                                // neither, the radius is
+                                                // selected automatically
+                       // Load only the data visible through this azimuth
+                       // wedge. If load_az_deg1 <= load_az_deg0, load all
+                       // azimuths
+                       float load_az_deg0, float load_az_deg1,
+
+                       bool use_glut,
+                       bool render_texture,
+                       bool SRTM1,
+                       float SRTM1_near_radius_m,
+                       int polar_mesh_Naz,
+                       const char* dir_dems,
+                       const char* dir_dems_SRTM1,
+                       const char* dir_tiles,
+                       const char* tiles_name,
+                       const char* tiles_url_fmt,
+                       bool allow_downloads,
+                       bool async_load)
+{
+    *ctx = (horizonator_context_t){.occlusion_culling = true,
+                                   .feedback_cache    = true,
+                                   .reuse_pans        = true};
+
+    bool result = false;
+
+
+    if(tiles_name == NULL)
+        tiles_name = "mapnik";
+    if(tiles_url_fmt == NULL)
+        tiles_url_fmt = "https://a.tile.openstreetmap.org/%d/%d/%d.png";
+    if(dir_dems  == NULL)
+        dir_dems  = SRTM1 ?
+            "~/.horizonator/DEMs_SRTM1" :
+            "~/.horizonator/DEMs_SRTM3";
+
+    char _dir_tiles[256];
+    if(dir_tiles == NULL)
+        dir_tiles = "~/.horizonator/tiles";
+    if(dir_tiles[0] == '~' && dir_tiles[1] == '/' )
+    {
+        const char* home = getenv("HOME");
+        if(home == NULL)
+        {
+            MSG("User asked for ~, but the 'HOME' env var isn't defined");
+            return false;
+        }
+
+        int len = snprintf(_dir_tiles, sizeof(_dir_tiles),
+                           "%s/%s",
+                           home, &dir_tiles[2]);
+        if(len >= (int)sizeof(_dir_tiles))
+        {
+            MSG("static buffer overflow: _dir_tiles");
+            return false;
+        }
+        dir_tiles = _dir_tiles;
+    }
+
+    ctx->use_glut = use_glut;
+    if(use_glut)
+    {
+        bool double_buffered = offscreen_width <= 0;
+
+        static bool global_inited = false;
+        if(!global_inited)
+        {
+            glutInitContextFlags(GLUT_FORWARD_COMPATIBLE);
+            glutInitContextVersion(4,2);
+            glutInitContextProfile(GLUT_CORE_PROFILE);
+            glutInit(&(int){1}, &(char*){"exec"});
+            global_inited = true;
+        }
+
+        glutInitDisplayMode( GLUT_RGB | GLUT_DEPTH |
+                             (double_buffered ? GLUT_DOUBLE : 0) );
+        glutInitWindowSize(1024,1024);
+
+        // when offscreen, I really don't want to glutCreateWindow(), but for some
+        // reason not doing this causes glewInit() to segfault...
+        ctx->glut_window = glutCreateWindow("horizonator");
+        if(offscreen_width > 0)
+        {
+            glutHideWindow();
+
+            // Needed to get unpadded images from glReadPixels(). Otherwise
+            // images with width not divisible by 4 come out distorted
+            glPixelStorei(GL_PACK_ALIGNMENT,  1);
+            assert_opengl();
+        }
+
+        const char* version = (const char*)glGetString(GL_VERSION);
+
+        // MSG("glGetString(GL_VERSION) says we're using GL %s", version);
+        // MSG("Epoxy says we're using GL %d", epoxy_gl_version());
+
+        if (version[0] == '1')
+        {
+            if (!glutExtensionSupported("GL_ARB_vertex_shader")) {
+                MSG("Sorry, GL_ARB_vertex_shader is required.");
+                goto done;
+            }
+            if (!glutExtensionSupported("GL_ARB_fragment_shader")) {
+                MSG("Sorry, GL_ARB_fragment_shader is required.");
+                goto done;
+            }
+            if (!glutExtensionSupported("GL_ARB_vertex_buffer_object")) {
+                MSG("Sorry, GL_ARB_vertex_buffer_object is required.");
+                goto done;
+            }
+            if (!glutExtensionSupported("GL_EXT_framebuffer_object")) {
+                MSG("GL_EXT_framebuffer_object not found!");
+                goto done;
+            }
+        }
+    }
+
+    static_assert(sizeof(GLuint) == sizeof(ctx->programs[0].id) &&
+                  sizeof(GLint)  == sizeof(ctx->programs[0].uniform_seam_side),
+                  "horizonator_program_t.id must be a GLuint, and .uniform_... must be a GLint");
+
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    glClearColor(0, 0, 1, 0);
+
+    if(SRTM1_near_radius_m > 0)
+    {
+        if(SRTM1)
+        {
+            MSG("The mixed-resolution mode (SRTM1_near_radius_m > 0) uses 3\" data away from the viewer, so SRTM1 must be false");
+            goto done;
+        }
+        if(dir_dems_SRTM1 == NULL)
+            dir_dems_SRTM1 = "~/.horizonator/DEMs_SRTM1";
+    }
+
+    ctx->render_texture = render_texture;
+    if(polar_mesh_Naz > 0)
+    {
+        ctx->polar_mesh    = true;
+        ctx->polar.daz_rad = 2.0f*(float)M_PI / (float)polar_mesh_Naz;
+    }
+
+    // The data is loaded by the loader thread. I start it after the OpenGL
+    // setup below
+    struct horizonator_loader_t* L = calloc(1, sizeof(*L));
+    if(L == NULL)
+    {
+        MSG("malloc() failed");
+        goto done;
+    }
+    ctx->loader = L;
+    pthread_mutex_init(&L->mutex, NULL);
+    pthread_cond_init (&L->cond,  NULL);
+
+    bool copy_string(char* out, int size, const char* in, const char* what)
+    {
+        if(in == NULL)
+            in = "";
+        if(snprintf(out, size, "%s", in) >= size)
+        {
+            MSG("static buffer overflow: %s", what);
+            return false;
+        }
+        return true;
+    }
+    if(!copy_string(L->dir_dems,       sizeof(L->dir_dems),       dir_dems,       "dir_dems")       ||
+       !copy_string(L->dir_dems_SRTM1, sizeof(L->dir_dems_SRTM1), dir_dems_SRTM1, "dir_dems_SRTM1") ||
+       !copy_string(L->dir_tiles,      sizeof(L->dir_tiles),      dir_tiles,      "dir_tiles")      ||
+       !copy_string(L->tiles_name,     sizeof(L->tiles_name),     tiles_name,     "tiles_name")     ||
+       !copy_string(L->tiles_url_fmt,  sizeof(L->tiles_url_fmt),  tiles_url_fmt,  "tiles_url_fmt"))
+        goto done;
+
+    L->viewer_lat          = viewer_lat;
+    L->viewer_lon          = viewer_lon;
+    L->viewer_z            = viewer_z != NULL ? *viewer_z : -1.f;
+    L->render_radius_cells = render_radius_cells;
+    L->render_radius_m     = render_radius_m;
+    L->load_az_deg0        = load_az_deg0;
+    L->load_az_deg1        = load_az_deg1;
+    L->render_texture      = render_texture;
+    L->SRTM1               = SRTM1;
+    L->allow_downloads     = allow_downloads;
+    L->SRTM1_near_radius_m = SRTM1_near_radius_m;
+    L->polar_mesh          = ctx->polar_mesh;
+    L->move_viewer_z       = L->viewer_z;
+
+    // Where the viewer should be once the DEMs are loaded
+    ctx->viewer_lat = viewer_lat;
+    ctx->viewer_lon = viewer_lon;
+    L->view.viewer_lat = viewer_lat;
+    L->view.viewer_lon = viewer_lon;
+
+    const bool radius_auto = render_radius_cells <= 0 && render_radius_m <= 0;
+    L->radius_auto = radius_auto;
+
+    // The mesh. Each layer gets its own vertex buffer, made when its DEMs are
+    // loaded; all share the index buffer
+    static_assert(sizeof(GLuint) == sizeof(ctx->indexBufID),
+                  "horizonator_context_t.indexBufID must be a GLuint");
+    static_assert(sizeof(GLsizei) == sizeof(*ctx->layers[0].draw_counts) &&
+                  sizeof(GLint)   == sizeof(*ctx->layers[0].draw_basevertex),
+                  "horizonator_layer_t.draw_... must be GLsizei and GLint");
+
+    ctx->indexBufID = make_chunk_index_buffer(ctx->lod_counts, ctx->lod_offsets);
+    if(ctx->indexBufID == 0)
+        goto done;
+
+    // shaders. The rest of the variants are compiled when first needed, but I
+    // make the usual ones now, to catch any problems early
+    if(NULL == get_program(ctx, HORIZONATOR_PROGRAM_CAPTURE) ||
+       NULL == get_program(ctx,
+                           (render_texture ? HORIZONATOR_PROGRAM_TEXTURED : 0) |
+                           (ctx->feedback_cache ? HORIZONATOR_PROGRAM_CACHED : 0)))
+        goto done;
+
+    // The view state, shared by all the programs
+    {
+        static_assert(sizeof(ctx->view) % 16 == 0,
+                      "horizonator_view_t must be padded to a multiple of 16 bytes, like std140 does");
+        static_assert(sizeof(GLuint) == sizeof(ctx->viewBufID),
+                      "horizonator_context_t.viewBufID must be a GLuint");
+        glGenBuffers(1, &ctx->viewBufID);
+        glBindBuffer(GL_UNIFORM_BUFFER, ctx->viewBufID);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(ctx->view), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, 0, ctx->viewBufID);
+        assert_opengl();
+        ctx->view_dirty = true;
+    }
+
+    if(offscreen_width > 0)
+    {
+        if(!select_offscreen_framebuffer(ctx, offscreen_width, offscreen_height))
+            goto done;
+        ctx->offscreen.inited = true;
+
+        atexit(glutExit);
+    }
+
+
+    // arbitrary az bounds initially
+    if(!horizonator_pan_zoom(ctx, -45.f, 45.f))
+        goto done;
+
+    // Start loading. If we're not loading asynchronously, I wait for
+    // everything to load, uploading the pieces as they come in
+    if(0 != pthread_create(&L->thread, NULL, loader_thread, L))
+    {
+        MSG("pthread_create() failed");
+        goto done;
+    }
+    L->thread_started = true;
+
+    if(!async_load &&
+       !horizonator_update(ctx, NULL, true))
+        goto done;
+
+    // And I set the other uniforms. If the radius was selected automatically,
+    // I render out to that radius by default. If we're still loading, the
+    // radius isn't known yet; take_dems() sets it when it is
+    const float zfar =
+        (radius_auto && ctx->Nlayers > 0) ?
+        ctx->layers[0].dems.radius_m :
+        HORIZONATOR_ZFAR_DEFAULT;
+    horizonator_move(ctx, viewer_z, viewer_lat, viewer_lon);
+    horizonator_set_zextents(ctx,
+                             HORIZONATOR_ZNEAR_DEFAULT, zfar,
+                             HORIZONATOR_ZNEAR_DEFAULT, zfar);
+
+    result = true;
+
+ done:
+    if(!result)
+    {
+        loader_deinit(ctx);
+        for(int l=0; l<ctx->Nlayers; l++)
+            deinit_layer(&ctx->layers[l]);
+        deinit_polar_mesh(&ctx->polar);
+        deinit_programs(ctx);
+        ctx->Nlayers    = 0;
+        ctx->Ntriangles = 0;
+    }
+
+    return result;
+}
+
+void horizonator_deinit( horizonator_context_t* ctx )
+{
+    for(int i=0; i<HORIZONATOR_OFFSCREEN_NFRAMEBUFFERS; i++)
+        deinit_framebuffer(&ctx->offscreen.framebuffers[i]);
+    deinit_framebuffer(&ctx->offscreen.pan);
+    free(ctx->offscreen.geo);
+    ctx->offscreen.geo         = NULL;
+    ctx->offscreen.geo_Npixels = 0;
+    if(ctx->panorama.frameBufID != 0)
+    {
+        glDeleteFramebuffers(1, &ctx->panorama.frameBufID);
+        glDeleteFramebuffers(1, &ctx->panorama.readFrameBufID);
+    }
+    if(ctx->panorama.colorTexID != 0)
+        glDeleteTextures(1, &ctx->panorama.colorTexID);
+    if(ctx->panorama.depthTexID != 0)
+        glDeleteTextures(1, &ctx->panorama.depthTexID);
+    memset(&ctx->panorama, 0, sizeof(ctx->panorama));
+    if(ctx->panorama_cache.vertexArrayID != 0)
+        glDeleteVertexArrays(1, &ctx->panorama_cache.vertexArrayID);
+    memset(&ctx->panorama_cache, 0, sizeof(ctx->panorama_cache));
+    if(ctx->tiled.frameBufID != 0)
+        glDeleteFramebuffers(1, &ctx->tiled.frameBufID);
+    if(ctx->tiled.colorBufID != 0)
+        glDeleteRenderbuffers(1, &ctx->tiled.colorBufID);
+    if(ctx->tiled.depthBufID != 0)
+        glDeleteRenderbuffers(1, &ctx->tiled.depthBufID);
+    memset(&ctx->tiled, 0, sizeof(ctx->tiled));
+    loader_deinit(ctx);
+    for(int l=0; l<ctx->Nlayers; l++)
+        deinit_layer(&ctx->layers[l]);
+    deinit_polar_mesh(&ctx->polar);
+    if(ctx->viewBufID != 0)
+    {
+        glDeleteBuffers(1, &ctx->viewBufID);
+        ctx->viewBufID = 0;
+    }
+    deinit_programs(ctx);
+    ctx->Nlayers    = 0;
+    ctx->Ntriangles = 0;
+
+    if(ctx->use_glut && ctx->glut_window != 0)
+    {
+        glutDestroyWindow(ctx->glut_window);
+        ctx->glut_window = 0;
+    }
+}
+
+bool horizonator_move(horizonator_context_t* ctx,
+                      // output/input
+                      // if viewer_z==NULL, auto-select a value; if *viewer_z >=
+                      // 0, use that; if *viewer_z < 0, auto-select a value, and
+                      // report it here
+                      float* viewer_z,
+                      // input
+                      float viewer_lat, float viewer_lon)
+{
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    ctx->scene_serial++;
+
+    void texture_coeffs(// output
+                        float* lon0,
+                        float* lon1,
+                        float* dlat0,
                         float* dlat1,
                         float* dlat2,
 
-                        // input
-                        float lat_center)
+                        // input
+                        float lat_center)
+    {
+        // The spherical equirectangular latlon-to-projection equations
+        // (from https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames):
+        //
+        //    xtile(lon) = n * (lon + pi)/(2pi)
+        //    ytile(lat) = n/2 * (1 - log( (sin(lat) + 1)/cos(lat) ) / pi)
+        //
+        // The lon expression is linear, so I compute the two exact
+        // coefficients. The lat expression is not linear. I compute the
+        // 2nd-order taylor-series approximation (around the viewer
+        // position), and store those coefficients. Let lat,lon be in
+        // radians.
+        //
+        // xtile increases with lon
+        // ytile decreases with lat
+
+        float n = (float)(1 << OSM_RENDER_ZOOM);
+
+        *lon0 = n / 2.0f;
+        *lon1 = n / ((float)M_PI * 2.0f);
+
+        // The derivatives are
+        //
+        //    ytile'(lat)  = -n/(2*pi*cos(lat))
+        //    ytile''(lat) = -n/(2*pi)*tan(lat)/cos(lat)
+        //
+        // Let
+        //    k = -n/(2*pi), c = cos(lat_center), t = tan(lat_center), dlat = lat-lat_center
+        //
+        //    ytile(lat_center)  = n/2 + k*log( t + 1/c )
+        //    ytile'(lat_center) = k / c
+        //    ytile''(lat_center)= k * t / c
+        //
+        // Thus
+        //
+        //    ytile(lat) ~ ytile(lat_center) + ytile'(lat_center)*dlat + 1/2*ytile''(lat_center)*dlat^2
+        lat_center *= (float)M_PI / 180.0f;
+        float k = -n / ((float)M_PI * 2.0f);
+        float t = tanf( lat_center );
+        float c = cosf( lat_center );
+        *dlat0 = n/2.0f + k*logf( t + 1.0f/c );
+        *dlat1 = k / c;
+        *dlat2 = k * t / c / 2.0f;
+    }
+
+    // If we're still loading, the chunks near the viewer are loaded first
+    if(ctx->loader != NULL)
+        loader_set_view(ctx->loader, &viewer_lat, &viewer_lon, NULL, NULL);
+
+    // If the DEMs are still loading, I remember where the viewer should be.
+    // take_dems() moves it there when the DEMs are available
+    if(ctx->Nlayers == 0 && ctx->loader != NULL)
+    {
+        ctx->loader->move_viewer_z = viewer_z != NULL ? *viewer_z : -1.f;
+        ctx->viewer_lat = viewer_lat;
+        ctx->viewer_lon = viewer_lon;
+        return true;
+    }
+
+    float lon0,lon1,dlat0,dlat1,dlat2;
+    texture_coeffs(&lon0,&lon1,&dlat0,&dlat1,&dlat2,
+                   viewer_lat);
+
+    // The viewer position in a layer's cells, relative to the origin of its
+    // DEMs
+    void get_viewer_cell(// output
+                         float* viewer_cell,
+                         // input
+                         const horizonator_dem_context_t* dems)
+    {
+        viewer_cell[0] =
+            (viewer_lon - dems->origin_dem_lon_lat[0]) * dems->cells_per_deg -
+            dems->origin_dem_cellij[0];
+        viewer_cell[1] =
+            (viewer_lat - dems->origin_dem_lon_lat[1]) * dems->cells_per_deg -
+            dems->origin_dem_cellij[1];
+    }
+
+    // If the viewer has wandered far from the center of a sliding layer, I move
+    // its DEMs to follow, by a whole number of chunks. I move all the layers
+    // before touching the meshes: the far layer omits the chunks that the near
+    // layer covers. The loader thread reads the DEMs, so nothing moves until
+    // it's done
+    bool moved = false;
+    for(int l=0; l<ctx->Nlayers; l++)
+    {
+        horizonator_layer_t*       layer = &ctx->layers[l];
+        horizonator_dem_context_t* dems  = &layer->dems;
+        if(!layer->sliding || ctx->loader != NULL)
+            continue;
+
+        float viewer_cell[2];
+        get_viewer_cell(viewer_cell, dems);
+
+        // horizonator_dem_init() puts the viewer into cell radius_cells-1. I
+        // let the viewer get a bit away from that before moving anything
+        const int Ncells    = 2*dems->radius_cells - 1;
+        const int threshold = slide_threshold_cells(dems);
+        int shift[2];
+        bool need_shift = false;
+        for(int k=0; k<2; k++)
+        {
+            const float d = viewer_cell[k] - (float)(dems->radius_cells-1);
+            shift[k] = 0;
+            if(fabsf(d) > (float)threshold)
+            {
+                shift[k] = (int)lroundf(d / (float)HORIZONATOR_CHUNK_CELLS) * HORIZONATOR_CHUNK_CELLS;
+                need_shift = true;
+            }
+        }
+        if(!need_shift)
+            continue;
+
+        if(!horizonator_dem_shift(dems, shift[0], shift[1]))
+        {
+            MSG("Couldn't move the DEMs to follow the viewer");
+            layer->sliding = false;
+            return false;
+        }
+        moved = true;
+
+        // The occlusion culling rebuilds this from the new DEMs
+        free(layer->zmin_pyramid);
+        layer->zmin_pyramid = NULL;
+
+        // The vertices are 16-bit integers relative to the anchor. If they
+        // don't fit anymore, I move the anchor, and rebuild everything. The
+        // simplified blocks may stick out of the loaded area by up to a block
+        const int Nextent = Ncells + 1 + (layer->tin ? HZTIN_BLOCK_CELLS : 0);
+        int offset[2];
+        layer_anchor_offset(offset, layer);
+        if(abs(offset[0]) + Nextent > INT16_MAX ||
+           abs(offset[1]) + Nextent > INT16_MAX)
+        {
+            for(int k=0; k<2; k++)
+                layer->anchor_cell[k] += offset[k];
+            for(int islot=0; islot<layer->Nslots; islot++)
+                layer->chunks[islot].built = false;
+        }
+    }
+    if(moved && ctx->polar_mesh)
+        // The rings are sampled relative to the anchor, which may have moved,
+        // and the DEMs they were sampled from have moved. I resample
+        // everything below
+        ctx->polar.built = false;
+    else if(moved)
+        for(int l=0; l<ctx->Nlayers; l++)
+        {
+            // The simplified meshes are rebuilt below, once we know where the
+            // viewer is
+            if(ctx->layers[l].tin)
+            {
+                ctx->layers[l].tin_built = false;
+                continue;
+            }
+            if(!update_layer_chunks(&ctx->layers[l],
+                                    l+1 < ctx->Nlayers ? &ctx->layers[l+1] : NULL))
+                return false;
+        }
+
+    // The viewer position in each layer's cells. The automatic viewer
+    // elevation comes from the finest layer
+    const horizonator_dem_context_t* dems_z           = NULL;
+    float                            viewer_cell_z[2] = {};
+    for(int l=0; l<ctx->Nlayers; l++)
+    {
+        horizonator_layer_t* layer = &ctx->layers[l];
+        const horizonator_dem_context_t* dems = &layer->dems;
+
+        float viewer_cell[2];
+        get_viewer_cell(viewer_cell, dems);
+
+        // The shader wants the position relative to the anchor
+        int offset[2];
+        layer_anchor_offset(offset, layer);
+        layer->viewer_cell_i = viewer_cell[0] + (float)offset[0];
+        layer->viewer_cell_j = viewer_cell[1] + (float)offset[1];
+
+        if(viewer_cell[0] >= 0 && viewer_cell[0] < 2*dems->radius_cells-1 &&
+           viewer_cell[1] >= 0 && viewer_cell[1] < 2*dems->radius_cells-1)
+        {
+            dems_z           = dems;
+            viewer_cell_z[0] = viewer_cell[0];
+            viewer_cell_z[1] = viewer_cell[1];
+        }
+    }
+
+    // The simplified meshes keep dense blocks around the viewer. If the viewer
+    // moved away from those, I rebuild
+    bool rebuilt = false;
+    for(int l=0; l<ctx->Nlayers; l++)
+    {
+        horizonator_layer_t* layer = &ctx->layers[l];
+        if(!layer->tin ||
+           (layer->tin_built &&
+            fabsf(layer->viewer_cell_i - layer->tin_center[0]) <= (float)TIN_RECENTER_CELLS &&
+            fabsf(layer->viewer_cell_j - layer->tin_center[1]) <= (float)TIN_RECENTER_CELLS))
+            continue;
+
+        if(!update_layer_tin(layer,
+                             l+1 < ctx->Nlayers ? &ctx->layers[l+1] : NULL))
+            return false;
+        rebuilt = true;
+    }
+
+    if(!ctx->polar_mesh && (moved || rebuilt))
+    {
+        ctx->Ntriangles = 0;
+        for(int l=0; l<ctx->Nlayers; l++)
+            ctx->Ntriangles +=
+                ctx->layers[l].tin ?
+                ctx->layers[l].tin_Ntriangles :
+                ctx->layers[l].Nchunks * CHUNK_NTRIANGLES;
+    }
+
+    if(ctx->polar_mesh &&
+       !update_polar_mesh(ctx,
+                          ctx->layers[0].viewer_cell_i,
+                          ctx->layers[0].viewer_cell_j,
+                          cosf( viewer_lat * (float)M_PI / 180.0f )))
+        return false;
+
+    // The viewer elevation. I nudge it up a tiny bit to not see fewer bumps
+    // immediately around me
+    float _viewer_z;
+    if(viewer_z == NULL || *viewer_z < 0)
     {
-        // The spherical equirectangular latlon-to-projection equations
-        // (from https://wiki.openstreetmap.org/wiki/Slippy_map_tilenames):
-        //
-        //    xtile(lon) = n * (lon + pi)/(2pi)
-        //    ytile(lat) = n/2 * (1 - log( (sin(lat) + 1)/cos(lat) ) / pi)
-        //
-        // The lon expression is linear, so I compute the two exact
-        // coefficients. The lat expression is not linear. I compute the
-        // 2nd-order taylor-series approximation (around the viewer
-        // position), and store those coefficients. Let lat,lon be in
-        // radians.
-        //
-        // xtile increases with lon
-        // ytile decreases with lat
+        if(dems_z == NULL)
+        {
+            MSG("The viewer is outside of the loaded DEMs, so I can't pick the elevation");
+            return false;
+        }
 
-        float n = (float)(1 << OSM_RENDER_ZOOM);
+        int i0 = (int)floorf(viewer_cell_z[0]);
+        int j0 = (int)floorf(viewer_cell_z[1]);
+        _viewer_z =
+            fmaxf( fmaxf(horizonator_dem_sample( dems_z, i0,   j0),
+                         horizonator_dem_sample( dems_z, i0+1, j0)),
+                   fmaxf(horizonator_dem_sample( dems_z, i0,   j0+1 ),
+                         horizonator_dem_sample( dems_z, i0+1, j0+1 )) ) + 1.0;
+        if(viewer_z != NULL)
+            *viewer_z = _viewer_z;
+    }
+    else
+        _viewer_z = *viewer_z;
 
-        *lon0 = n / 2.0f;
-        *lon1 = n / ((float)M_PI * 2.0f);
+    ctx->view.viewer_z         = _viewer_z;
+    ctx->view.viewer_lat       = viewer_lat * (float)M_PI / 180.0f;
+    ctx->view.cos_viewer_lat   = cosf( viewer_lat * (float)M_PI / 180.0f );
+    ctx->view.texturemap_lon0  = lon0;
+    ctx->view.texturemap_lon1  = lon1;
+    ctx->view.texturemap_dlat0 = dlat0;
+    ctx->view.texturemap_dlat1 = dlat1;
+    ctx->view.texturemap_dlat2 = dlat2;
+    ctx->view_dirty            = true;
+    ctx->visible_dirty         = true;
+
+    // Everything is relative to the viewer, so all the cached coordinates are
+    // out of date
+    for(int l=0; l<ctx->Nlayers; l++)
+        invalidate_feedback(&ctx->layers[l].feedback, 0, INT_MAX);
+    invalidate_feedback(&ctx->polar.feedback, 0, INT_MAX);
 
-        // The derivatives are
-        //
-        //    ytile'(lat)  = -n/(2*pi*cos(lat))
-        //    ytile''(lat) = -n/(2*pi)*tan(lat)/cos(lat)
-        //
-        // Let
-        //    k = -n/(2*pi), c = cos(lat_center), t = tan(lat_center), dlat = lat-lat_center
-        //
-        //    ytile(lat_center)  = n/2 + k*log( t + 1/c )
-        //    ytile'(lat_center) = k / c
-        //    ytile''(lat_center)= k * t / c
-        //
-        // Thus
-        //
-        //    ytile(lat) ~ ytile(lat_center) + ytile'(lat_center)*dlat + 1/2*ytile''(lat_center)*dlat^2
-        lat_center *= (float)M_PI / 180.0f;
-        float k = -n / ((float)M_PI * 2.0f);
-        float t = tanf( lat_center );
-        float c = cosf( lat_center );
-        *dlat0 = n/2.0f + k*logf( t + 1.0f/c );
-        *dlat1 = k / c;
-        *dlat2 = k * t / c / 2.0f;
+    ctx->viewer_lat = viewer_lat;
+    ctx->viewer_lon = viewer_lon;
+
+    return true;
+}
+
+bool horizonator_pan_zoom(horizonator_context_t* ctx,
+                      // Bounds of the view. We expect az_deg1 > az_deg0. The azimuth
+                      // edges lie at the edges of the image. So for an image that's
+                      // W pixels wide, az0 is at x = -0.5 and az1 is at W-0.5. The
+                      // elevation extents will be chosen to keep the aspect ratio
+                      // square.
+                      float az_deg0, float az_deg1)
+{
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    // The occlusion culling looks at the whole circle, so panning doesn't
+    // affect it. Zooming does
+    if(az_deg1 - az_deg0 != ctx->view.az_deg1 - ctx->view.az_deg0)
+        ctx->visible_dirty = true;
+    ctx->seam_dirty   = true;
+    ctx->view.az_deg0 = az_deg0;
+    ctx->view.az_deg1 = az_deg1;
+    ctx->view_dirty   = true;
+
+    // If we're still loading, the chunks we're looking at are loaded first
+    if(ctx->loader != NULL)
+        loader_set_view(ctx->loader, NULL, NULL, &az_deg0, &az_deg1);
+    return true;
+}
+
+bool horizonator_resized(horizonator_context_t* ctx, int width, int height)
+{
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    if( ctx->offscreen.inited )
+        return select_offscreen_framebuffer(ctx, width, height);
+
+    glViewport(0, 0, width, height);
+    ctx->view.aspect = (float)width / (float)height;
+    ctx->view_dirty  = true;
+    return true;
+}
+
+// set the position of the clipping planes. The horizontal distance from the
+// viewer is compared against these positions. Only points in [znear,zfar] are
+// rendered. The render is color-coded by this distance, using znear_color and
+// zfar_color as the bounds for the color-coding.
+//
+// Any value <0 is untouched by this call
+bool horizonator_set_zextents(horizonator_context_t* ctx,
+                              float znear,       float zfar,
+                              float znear_color, float zfar_color)
+{
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    if( !(znear > 0.0f && znear_color > 0.0f &&
+          zfar  > 0.0f && zfar_color  > 0.0f ))
+        return false;
+
+    if(znear != ctx->view.znear || zfar != ctx->view.zfar)
+        ctx->visible_dirty = true;
+    ctx->view.znear       = znear;
+    ctx->view.zfar        = zfar;
+    ctx->view.znear_color = znear_color;
+    ctx->view.zfar_color  = zfar_color;
+    ctx->view_dirty       = true;
+
+    return true;
+}
+
+// Sends ctx->view to the GPU, if it changed
+static void upload_view(horizonator_context_t* ctx)
+{
+    if(ctx->view_dirty)
+    {
+        glBindBuffer(GL_UNIFORM_BUFFER, ctx->viewBufID);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(ctx->view), &ctx->view);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        ctx->view_dirty = false;
+    }
+}
+
+// variant_flags are HORIZONATOR_PROGRAM_DEPTH_ONLY and/or
+// HORIZONATOR_PROGRAM_GEO, to render no color and/or the positions, from
+// horizonator_render_offscreen(). Or HORIZONATOR_PROGRAM_PANORAMA (maybe with
+// DEPTH_ONLY) from horizonator_render_panorama(): the geometry shader then
+// takes care of the seam, so everything visible is drawn once. The rest of the
+// variant comes from the context
+//
+// If strip_az_rad != NULL, only the strip of the view between these two
+// azimuths is being drawn, through a scissor set by the caller. Only the
+// entries that might touch the strip are drawn then. See split_at_seam()
+static bool redraw(horizonator_context_t* ctx, int variant_flags,
+                   const float* strip_az_rad)
+{
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    const bool depth_only = variant_flags & HORIZONATOR_PROGRAM_DEPTH_ONLY;
+    const bool panorama   = variant_flags & HORIZONATOR_PROGRAM_PANORAMA;
+
+    // The program variant for this configuration
+    const horizonator_program_t* program =
+        get_program(ctx,
+                    variant_flags |
+                    ((ctx->render_texture && !depth_only) ? HORIZONATOR_PROGRAM_TEXTURED : 0) |
+                    (ctx->feedback_cache                  ? HORIZONATOR_PROGRAM_CACHED   : 0));
+    if(program == NULL)
+        return false;
+
+    glClear(depth_only ?
+            GL_DEPTH_BUFFER_BIT :
+            (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+    // Pixels with no terrain have no position
+    if(variant_flags & HORIZONATOR_PROGRAM_GEO)
+        glClearBufferfv(GL_COLOR, 1, (const GLfloat[]){NAN, NAN, NAN, NAN});
+
+    upload_view(ctx);
+
+    if(ctx->count_overdraw)
+    {
+        if(ctx->overdraw_queryID == 0)
+            glGenQueries(1, &ctx->overdraw_queryID);
+        glBeginQuery(GL_SAMPLES_PASSED, ctx->overdraw_queryID);
+    }
+
+    // The polar mesh is in the cell coordinates of layers[0]. Its rings are
+    // stored from the inside out, so it's already drawn front-to-back
+    if(ctx->polar_mesh)
+    {
+        if(ctx->polar.built)
+        {
+            int Nonce = 0, Nseam = 0;
+            if(!panorama)
+                split_polar_mesh_at_seam(&Nonce, &Nseam, ctx);
+
+            if(ctx->feedback_cache)
+            {
+                update_feedback(ctx, &ctx->polar.feedback,
+                                ctx->polar.vertexArrayID,
+                                ctx->polar.Nrings * ctx->polar.Naz,
+                                &ctx->layers[0]);
+                glBindVertexArray(ctx->polar.feedback.vertexArrayID);
+            }
+            else
+                glBindVertexArray(ctx->polar.vertexArrayID);
+            glUseProgram(program->id);
+            set_layer_uniforms(program, &ctx->layers[0]);
+            if(panorama)
+                glDrawElements(GL_TRIANGLES, ctx->polar.Nindices,
+                               GL_UNSIGNED_INT, NULL);
+            else
+                glMultiDrawElements(GL_TRIANGLES,
+                                    ctx->polar.split_counts,
+                                    GL_UNSIGNED_INT,
+                                    (const void*const*)ctx->polar.split_offsets,
+                                    Nonce);
+            for(int seam_side=-1; seam_side<=1 && Nseam>0; seam_side+=2)
+            {
+                glUniform1i(program->uniform_seam_side, seam_side);
+                glMultiDrawElements(GL_TRIANGLES,
+                                    &ctx->polar.split_counts[Nonce],
+                                    GL_UNSIGNED_INT,
+                                    (const void*const*)&ctx->polar.split_offsets[Nonce],
+                                    Nseam);
+            }
+            glUniform1i(program->uniform_seam_side, 0);
+        }
+    }
+    else
+    {
+        if(ctx->visible_dirty)
+        {
+            sort_front_to_back(ctx);
+            cull_occluded(ctx);
+            ctx->visible_dirty = false;
+            ctx->seam_dirty    = true;
+        }
+        if(ctx->lod != ctx->split_lod)
+            ctx->seam_dirty = true;
+        if((ctx->seam_dirty || strip_az_rad != NULL) && !panorama)
+        {
+            split_at_seam(ctx, strip_az_rad);
+            ctx->split_lod = ctx->lod;
+            // The lists of a strip are good only for that strip
+            ctx->seam_dirty = strip_az_rad != NULL;
+        }
+
+        // One pass per layer. The depth test composites them. Each layer has
+        // its own cell coordinates, so I set those uniforms before each pass.
+        // layers[1] is the near one, if it exists, so I draw it first. Within
+        // each layer the seam_side=0 draws come first: they contain the
+        // nearest entries
+        for(int l=ctx->Nlayers-1; l>=0; l--)
+        {
+            horizonator_layer_t* layer = &ctx->layers[l];
+
+            GLuint vertexArrayID      = layer->vertexArrayID;
+            GLuint near_vertexArrayID = layer->near_vertexArrayID;
+            if(ctx->feedback_cache)
+            {
+                update_feedback(ctx, &layer->feedback,
+                                layer->vertexArrayID, layer->Nvertices,
+                                layer);
+                vertexArrayID      = layer->feedback.vertexArrayID;
+                near_vertexArrayID = layer->feedback.near_vertexArrayID;
+            }
+            glUseProgram(program->id);
+            set_layer_uniforms(program, layer);
+
+            if(panorama)
+            {
+                // The near entries are drawn whole too. The geometry shader
+                // leaves out their wide triangles
+                glBindVertexArray(vertexArrayID);
+                glMultiDrawElementsBaseVertex(GL_TRIANGLES,
+                                              layer->visible_counts,
+                                              GL_UNSIGNED_SHORT,
+                                              (const void*const*)layer->visible_offsets,
+                                              layer->Nchunks_visible,
+                                              layer->visible_basevertex);
+                continue;
+            }
+
+            const int seam_sides[] = {0, -1, 1};
+            for(int k=0; k<3; k++)
+            {
+                const int  seam_side = seam_sides[k];
+                const int  Nchunks = seam_side == 0 ? layer->Nchunks_once : layer->Nchunks_seam;
+                const int  Nnear   = seam_side == 0 ? layer->Nnear_once   : layer->Nnear_seam;
+                const int  i0      = seam_side == 0 ? 0                   : layer->Nchunks_once;
+                const size_t near0 = seam_side == 0 ? 0                   : (size_t)layer->Nnear_once;
+                if(Nchunks == 0 && Nnear == 0)
+                    continue;
+
+                glUniform1i(program->uniform_seam_side, seam_side);
+                if(Nnear > 0)
+                {
+                    glBindVertexArray(near_vertexArrayID);
+                    glDrawElements(GL_TRIANGLES, Nnear, GL_UNSIGNED_INT,
+                                   (const void*)(near0*sizeof(GLuint)));
+                }
+                glBindVertexArray(vertexArrayID);
+                glMultiDrawElementsBaseVertex(GL_TRIANGLES,
+                                              &layer->split_counts[i0],
+                                              GL_UNSIGNED_SHORT,
+                                              (const void*const*)&layer->split_offsets[i0],
+                                              Nchunks,
+                                              &layer->split_basevertex[i0]);
+            }
+            glUniform1i(program->uniform_seam_side, 0);
+        }
+    }
+
+    if(ctx->count_overdraw)
+    {
+        GLuint64 samples;
+        glEndQuery(GL_SAMPLES_PASSED);
+        glGetQueryObjectui64v(ctx->overdraw_queryID, GL_QUERY_RESULT, &samples);
+        ctx->overdraw_samples = samples;
+    }
+    return true;
+}
+
+// Flips a BGR image read with glReadPixels() to compensate for OpenGL giving me
+// upside-down images
+static void flip_image(char* image, int width, int height)
+{
+    void swap(int i0, int i1)
+    {
+        char t = image[i0];
+        image[i0] = image[i1];
+        image[i1] = t;
+    }
+    for(int y=0; y<height/2; y++)
+        for(int x=0; x<width; x++)
+        {
+            swap((x + y             *width)*3 + 0,
+                 (x + (height-1 - y)*width)*3 + 0);
+            swap((x + y             *width)*3 + 1,
+                 (x + (height-1 - y)*width)*3 + 1);
+            swap((x + y             *width)*3 + 2,
+                 (x + (height-1 - y)*width)*3 + 2);
+        }
+}
+
+// Converts a depth image read with glReadPixels() to ranges, in place. The
+// image spans fov_deg horizontally, with square pixels, is centered vertically
+// at el_deg_center, and was rendered with the given clipping planes. The rows
+// are flipped like in flip_image()
+static void ranges_from_depth(// input/output
+                              float* ranges,
+                              // input
+                              int width, int height,
+                              float fov_deg, float el_deg_center,
+                              float znear, float zfar)
+{
+    // I just read the depth buffer. depth is in [0,1] and it describes
+    // gl_Position.z/gl_Position.w in the vertex shader, except THAT
+    // quantity is in [-1,1]. I convert each "depth" value to a "range"
+
+    // In vertex.glsl we have:
+    //
+    // az = 0:     North
+    // az = 90deg: East
+    // xy coords are (e,n)
+    /*
+      en = { (lon - lon0) * Rearth * pi/180. * cos_viewer_lat,
+             (lat - lat0) * Rearth * pi/180. };
+
+      az = atan(en.x, en.y);
+
+      az_center = (az0 + az1)/2.;
+      az_ndc    = (az - az_center) * 2 / (az1 - az0);
+
+      aspect = width / height
+      el_ndc = (atan(z, length(en)) - el_center) * aspect * 2 / (az1 - az0);
+
+      depth = ((length(en) - znear) / (zfar - znear))
+    */
+
+    // The viewport is "width" pixels wide. The center of the first pixel is
+    // at x=0.5. The center of the last pixel is at x=width-0.5
+    //
+    // I also flip the image vertically here
+    float aspect = (float)width / (float)height;
+    float get_el_ndc(int y)
+    {
+        return ((float)y + 0.5f) / (float)height * 2.f - 1.f;
+    }
+    float get_tanel(float el_ndc)
+    {
+        float el = el_ndc * fov_deg / 2.f / aspect * M_PI/180.0f +
+                   el_deg_center * M_PI/180.0f;
+        return tanf(el);
+    }
+    float range(int x, int y, float tanel)
+    {
+        float depth = ranges[y*width + x];
+        if(depth == 1.0f) return -1.0f;
+
+        float length_en = depth * (zfar-znear) + znear;
+
+        float z = tanel * length_en;
+        return hypotf(length_en, z);
+    }
+    for(int y=0; y<height/2; y++)
+    {
+        // el_ndc in the opposite row is negative
+        float el_ndc = get_el_ndc(y);
+        float tanel0 = get_tanel( el_ndc);
+        float tanel1 = get_tanel(-el_ndc);
+        for(int x=0; x<width; x++)
+        {
+            float depth0 = range(x, y,          tanel0);
+            float depth1 = range(x, height-1-y, tanel1);
+            ranges[y           *width + x] = depth1;
+            ranges[(height-1-y)*width + x] = depth0;
+        }
+    }
+    if(height&1)
+    {
+        // height is odd, so I need the depth->range for the center row
+        // separately
+        int y = height/2;
+        float tanel = get_tanel(get_el_ndc(y));
+        for(int x=0; x<width; x++)
+            ranges[y*width + x] = range(x, y, tanel);
+    }
+}
+
+// Renders a given scene to an RGB image and/or a range image.
+// horizonator_init() must have been called first with use_glut=true and
+// offscreen_width,height > 0. Then the viewer and camera must have been
+// configured with horizonator_move() and horizonator_pan_zoom()
+//
+// Returns true on success. The image and ranges buffers must be large-enough to
+// contain packed 24-bits-per-pixel BGR data and 32-bit floats respectively. The
+// images are returned using the usual convention: the top row is stored first.
+// This is opposite of the OpenGL convention: bottom row is first. Invisible
+// points have ranges <0
+bool horizonator_render_offscreen(horizonator_context_t* ctx,
+
+                                  // output
+                                  // any of these may be NULL
+                                  char* image, float* ranges,
+                                  double* latlon, float* elevation)
+{
+    if(ctx->use_glut)
+    {
+        if(ctx->glut_window == 0)
+            return false;
+        glutSetWindow(ctx->glut_window);
+    }
+
+    if(!ctx->offscreen.inited)
+    {
+        MSG("Prior to calling horizonator_render_offscreen(), the context must have been inited for offscreen rendering with horizonator_init(use_glut=true, offscreen_width,height > 0)");
+        return false;
+    }
+
+    horizonator_framebuffer_t* fb =
+        &ctx->offscreen.framebuffers[ctx->offscreen.current];
+    int width  = fb->width;
+    int height = fb->height;
+
+    // If no image is requested, I render no color: no color buffer is
+    // attached, and the programs skip the color. The color buffer is made the
+    // first time an image is requested. If positions are requested, the same
+    // draw writes them into a second render target, made the first time
+    // they're requested
+    const bool depth_only = image == NULL;
+    const bool geo        = latlon != NULL || elevation != NULL;
+    if(geo && width*height > ctx->offscreen.geo_Npixels)
+    {
+        float* geo_new = realloc(ctx->offscreen.geo,
+                                 (size_t)width*height*2*sizeof(float));
+        if(geo_new == NULL)
+        {
+            MSG("realloc() failed");
+            return false;
+        }
+        ctx->offscreen.geo         = geo_new;
+        ctx->offscreen.geo_Npixels = width*height;
+    }
+
+    // If the previous render into this framebuffer differs from this one only
+    // by a pan of a whole number of pixels, I shift it over, and draw only the
+    // newly-exposed strip. The shift is dx pixels: the pixel at x in the new
+    // render is at x+dx in the old one. Which triangles near the viewer are
+    // drawn depends on the center of the view (see split_at_seam()), so the
+    // shifted depths differ a bit from a fresh render's. That's invisible in
+    // the image, but not in the ranges and positions, so I don't reuse a
+    // render if any of those are requested
+    int  dx    = 0;
+    bool reuse = false;
+    if(ctx->reuse_pans              &&
+       ranges == NULL && !geo       &&
+       fb->frame_valid              &&
+       fb->frame_serial == ctx->scene_serial &&
+       fb->frame_lod    == ctx->lod &&
+       (depth_only || fb->frame_has_color))
+    {
+        horizonator_view_t v = fb->frame_view;
+        v.az_deg0 = ctx->view.az_deg0;
+        v.az_deg1 = ctx->view.az_deg1;
+
+        const float fov_deg  = ctx->view.az_deg1 - ctx->view.az_deg0;
+        const float fov_prev = fb->frame_view.az_deg1 - fb->frame_view.az_deg0;
+        const float dx_float =
+            (ctx->view.az_deg0 - fb->frame_view.az_deg0) / fov_deg * (float)width;
+        dx = (int)roundf(dx_float);
+
+        reuse =
+            0 == memcmp(&v, &ctx->view, sizeof(v)) &&
+            fabsf(fov_deg - fov_prev) <= 1e-6f * fabsf(fov_deg) &&
+            fabsf(dx_float - (float)dx) < 1e-3f &&
+            abs(dx) < width;
+    }
+    // Until this render is finished, the framebuffer has nothing reusable
+    fb->frame_valid = false;
+
+    if(reuse && dx != 0)
+    {
+        // Overlapping blits within one framebuffer are undefined, so I blit
+        // into the scratch framebuffer, and then swap it with this one
+        horizonator_framebuffer_t* pan = &ctx->offscreen.pan;
+        if(pan->frameBufID == 0 ||
+           pan->width  != width ||
+           pan->height != height)
+            framebuffer_make(pan, width, height);
+        framebuffer_attach(pan, depth_only, false);
+
+        const int x0 = dx > 0 ? dx    : 0;
+        const int x1 = dx > 0 ? width : width + dx;
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fb->frameBufID);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, pan->frameBufID);
+        glReadBuffer(depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0);
+        glDrawBuffers(2, (const GLenum[]){ depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0,
+                                           GL_NONE });
+        glBlitFramebuffer(x0,      0, x1,      height,
+                          x0 - dx, 0, x1 - dx, height,
+                          GL_DEPTH_BUFFER_BIT |
+                          (depth_only ? 0 : GL_COLOR_BUFFER_BIT),
+                          GL_NEAREST);
+        assert_opengl();
+
+        horizonator_framebuffer_t t = *fb;
+        *fb  = *pan;
+        *pan = t;
+        fb->last_used = pan->last_used;
     }
 
-    float lon0,lon1,dlat0,dlat1,dlat2;
-    texture_coeffs(&lon0,&lon1,&dlat0,&dlat1,&dlat2,
-                   viewer_lat);
+    framebuffer_attach(fb, depth_only, geo);
 
-    float viewer_cell_i =
-        (viewer_lon - ctx->dems.origin_dem_lon_lat[0]) * ctx->dems.cells_per_deg -
-        ctx->dems.origin_dem_cellij[0];
-    float viewer_cell_j =
-        (viewer_lat - ctx->dems.origin_dem_lon_lat[1]) * ctx->dems.cells_per_deg -
-        ctx->dems.origin_dem_cellij[1];
+    if(!reuse)
+    {
+        if(!redraw(ctx,
+                   (depth_only ? HORIZONATOR_PROGRAM_DEPTH_ONLY : 0) |
+                   (geo        ? HORIZONATOR_PROGRAM_GEO        : 0),
+                   NULL))
+            return false;
+    }
+    else if(dx != 0)
+    {
+        // I draw only the exposed strip, and the entries that could touch it.
+        // I pad the strip by a pixel on each side to not lose any edge
+        // triangles
+        const int x0 = dx > 0 ? width - dx : 0;
+        const int x1 = dx > 0 ? width      : -dx;
+
+        const float rad_per_px =
+            (ctx->view.az_deg1 - ctx->view.az_deg0) / (float)width * (float)M_PI / 180.0f;
+        const float az0_rad = ctx->view.az_deg0 * (float)M_PI / 180.0f;
+        const float strip_az_rad[2] =
+            { az0_rad + (float)(x0 - 1) * rad_per_px,
+              az0_rad + (float)(x1 + 1) * rad_per_px };
+
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(x0, 0, x1-x0, height);
+        bool result =
+            redraw(ctx,
+                   (depth_only ? HORIZONATOR_PROGRAM_DEPTH_ONLY : 0) |
+                   (geo        ? HORIZONATOR_PROGRAM_GEO        : 0),
+                   strip_az_rad);
+        glDisable(GL_SCISSOR_TEST);
+        if(!result)
+            return false;
+    }
 
+    fb->frame_valid     = true;
+    fb->frame_has_color = !depth_only;
+    fb->frame_lod       = ctx->lod;
+    fb->frame_serial    = ctx->scene_serial;
+    fb->frame_view      = ctx->view;
 
-    // The viewer elevation. I nudge it up a tiny bit to not see fewer bumps
-    // immediately around me
-    int i0 = (int)floorf(viewer_cell_i);
-    int j0 = (int)floorf(viewer_cell_j);
-    float _viewer_z;
-    if(viewer_z == NULL || *viewer_z < 0)
+    if(geo)
     {
-        _viewer_z =
-            fmaxf( fmaxf(horizonator_dem_sample( &ctx->dems, i0,   j0),
-                         horizonator_dem_sample( &ctx->dems, i0+1, j0)),
-                   fmaxf(horizonator_dem_sample( &ctx->dems, i0,   j0+1 ),
-                         horizonator_dem_sample( &ctx->dems, i0+1, j0+1 )) ) + 1.0;
-        if(viewer_z != NULL)
-            *viewer_z = _viewer_z;
+        // The positions are offsets from the viewer. I flip the rows, like the
+        // image
+        float* geo_rg = ctx->offscreen.geo;
+        glReadBuffer(GL_COLOR_ATTACHMENT1);
+        if(latlon != NULL)
+        {
+            glReadPixels(0,0, width, height,
+                         GL_RG, GL_FLOAT, geo_rg);
+            for(int y=0; y<height; y++)
+                for(int x=0; x<width; x++)
+                {
+                    const float* p = &geo_rg[((height-1 - y)*width + x)*2];
+                    double*      q = &latlon[(y*width + x)*2];
+                    q[0] = (double)ctx->viewer_lat + (double)p[0];
+                    q[1] = (double)ctx->viewer_lon + (double)p[1];
+                }
+        }
+        if(elevation != NULL)
+        {
+            glReadPixels(0,0, width, height,
+                         GL_BLUE, GL_FLOAT, geo_rg);
+            for(int y=0; y<height; y++)
+                memcpy(&elevation[y*width],
+                       &geo_rg[(height-1 - y)*width],
+                       width*sizeof(float));
+        }
+        assert_opengl();
     }
-    else
-        _viewer_z = *viewer_z;
 
-    glUniform1f(ctx->uniform_viewer_cell_i,    viewer_cell_i);
-    assert_opengl();
-    glUniform1f(ctx->uniform_viewer_cell_j,    viewer_cell_j);
-    assert_opengl();
-    glUniform1f(ctx->uniform_viewer_z,         _viewer_z);
-    assert_opengl();
-    glUniform1f(ctx->uniform_viewer_lat,             viewer_lat * M_PI / 180.0f );
-    assert_opengl();
-    glUniform1f(ctx->uniform_cos_viewer_lat,   cosf( viewer_lat * M_PI / 180.0f ));
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_lon0,  lon0);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_lon1,  lon1);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_dlat0, dlat0);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_dlat1, dlat1);
-    assert_opengl();
-    glUniform1f(ctx->uniform_texturemap_dlat2, dlat2);
-    assert_opengl();
+    glReadBuffer(depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0);
 
-    ctx->viewer_lat = viewer_lat;
-    ctx->viewer_lon = viewer_lon;
+    if(image != NULL)
+    {
+        glReadPixels(0,0, width, height,
+                     GL_BGR, GL_UNSIGNED_BYTE, image);
+        flip_image(image, width, height);
+    }
+    if(ranges != NULL)
+    {
+        glReadPixels(0,0, width, height,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, ranges);
+        ranges_from_depth(ranges, width, height,
+                          ctx->view.az_deg1 - ctx->view.az_deg0, 0.0f,
+                          ctx->view.znear, ctx->view.zfar);
+    }
 
     return true;
 }
 
-bool horizonator_pan_zoom(const horizonator_context_t* ctx,
-                      // Bounds of the view. We expect az_deg1 > az_deg0. The azimuth
-                      // edges lie at the edges of the image. So for an image that's
-                      // W pixels wide, az0 is at x = -0.5 and az1 is at W-0.5. The
-                      // elevation extents will be chosen to keep the aspect ratio
-                      // square.
-                      float az_deg0, float az_deg1)
+// Draws the full 360deg panorama into the layered framebuffer in
+// ctx->panorama: the first HORIZONATOR_PANORAMA_NSECTORS sectors of
+// sector_width pixels of a panorama width pixels wide. Only the depth is drawn
+// if depth_only. The framebuffer bindings, the viewport and the view are
+// restored when I'm done
+static bool draw_panorama(horizonator_context_t* ctx,
+                          int width, int height,
+                          float az_deg0,
+                          bool depth_only)
 {
-    if(ctx->use_glut)
+    static_assert(sizeof(GLuint) == sizeof(ctx->panorama.frameBufID),
+                  "horizonator_context_t.panorama.... must be a GLuint");
+
+    if(width <= 0 || height <= 0)
     {
-        if(ctx->glut_window == 0)
-            return false;
-        glutSetWindow(ctx->glut_window);
+        MSG("The panorama must have a positive size. Got %dx%d", width, height);
+        return false;
     }
 
-    glUniform1f( ctx->uniform_az_deg0, az_deg0); assert_opengl();
-    glUniform1f( ctx->uniform_az_deg1, az_deg1); assert_opengl();
-    return true;
-}
-
-bool horizonator_resized(const horizonator_context_t* ctx, int width, int height)
-{
-    if(ctx->use_glut)
+    const int Nsectors     = HORIZONATOR_PANORAMA_NSECTORS;
+    const int sector_width = (width + Nsectors-1) / Nsectors;
     {
-        if(ctx->glut_window == 0)
+        GLint max_size;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        if(sector_width > max_size || height > max_size)
+        {
+            MSG("The panorama is too large: each of its %d sectors would be %dx%d, but the textures can be at most %dx%d",
+                Nsectors, sector_width, height, (int)max_size, (int)max_size);
             return false;
-        glutSetWindow(ctx->glut_window);
+        }
     }
 
-    if( ctx->offscreen.inited )
+    bool result = false;
+
+    // The state of the regular renders. I restore it when I'm done
+    GLint draw_frameBufID_prev, read_frameBufID_prev;
+    GLint viewport_prev[4];
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw_frameBufID_prev);
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_frameBufID_prev);
+    glGetIntegerv(GL_VIEWPORT,                 viewport_prev);
+    const horizonator_view_t view_prev = ctx->view;
+
+    // The view state describes the first sector. geometry.glsl puts the others
+    // next to it. The occlusion culling depends on the width of the view, like
+    // in horizonator_pan_zoom()
+    const float sector_deg = 360.0f * (float)sector_width / (float)width;
+    if(sector_deg != view_prev.az_deg1 - view_prev.az_deg0)
+        ctx->visible_dirty = true;
+    ctx->view.az_deg0 = az_deg0;
+    ctx->view.az_deg1 = az_deg0 + sector_deg;
+    ctx->view.aspect  = (float)sector_width / (float)height;
+    ctx->view_dirty   = true;
+
+    // The layered framebuffer: one layer per sector. The textures have
+    // immutable storage, so if the size changed, I make new ones
+    if(ctx->panorama.frameBufID == 0)
+    {
+        glGenFramebuffers(1, &ctx->panorama.frameBufID);
+        glGenFramebuffers(1, &ctx->panorama.readFrameBufID);
+        assert_opengl();
+    }
+    if(sector_width != ctx->panorama.sector_width ||
+       height       != ctx->panorama.height)
+    {
+        if(ctx->panorama.colorTexID != 0)
+            glDeleteTextures(1, &ctx->panorama.colorTexID);
+        if(ctx->panorama.depthTexID != 0)
+            glDeleteTextures(1, &ctx->panorama.depthTexID);
+        ctx->panorama.colorTexID   = 0;
+        ctx->panorama.depthTexID   = 0;
+        ctx->panorama.sector_width = sector_width;
+        ctx->panorama.height       = height;
+    }
+    // The filtering is for the panorama cache: see redraw_from_panorama_cache()
+    void make_texture(GLuint* id, GLenum format, GLint filter)
+    {
+        glGenTextures(1, id);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, *id);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, format,
+                       sector_width, height, Nsectors);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+        assert_opengl();
+    }
+    if(ctx->panorama.depthTexID == 0)
+        make_texture(&ctx->panorama.depthTexID, GL_DEPTH_COMPONENT24, GL_NEAREST);
+    if(!depth_only && ctx->panorama.colorTexID == 0)
+        make_texture(&ctx->panorama.colorTexID, GL_RGB8, GL_LINEAR);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->panorama.frameBufID);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                         ctx->panorama.depthTexID, 0);
+    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                         depth_only ? 0 : ctx->panorama.colorTexID, 0);
+    glDrawBuffer(depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0);
+    glReadBuffer(GL_NONE);
+    assert_opengl();
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
     {
-        MSG("Resising an offscreen window is not yet supported");
-        assert(0);
+        MSG("The panorama framebuffer is incomplete");
+        goto done;
     }
+    glViewport(0, 0, sector_width, height);
 
-    glViewport(0, 0, width, height);
-    glUniform1f(ctx->uniform_aspect, (float)width / (float)height);
-    return true;
+    if(!redraw(ctx,
+               HORIZONATOR_PROGRAM_PANORAMA |
+               (depth_only ? HORIZONATOR_PROGRAM_DEPTH_ONLY : 0),
+               NULL))
+        goto done;
+
+    result = true;
+
+ done:
+    if(sector_deg != view_prev.az_deg1 - view_prev.az_deg0)
+        ctx->visible_dirty = true;
+    ctx->view.az_deg0 = view_prev.az_deg0;
+    ctx->view.az_deg1 = view_prev.az_deg1;
+    ctx->view.aspect  = view_prev.aspect;
+    ctx->view_dirty   = true;
+
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_frameBufID_prev);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, read_frameBufID_prev);
+    glViewport(viewport_prev[0], viewport_prev[1],
+               viewport_prev[2], viewport_prev[3]);
+    return result;
 }
 
-// set the position of the clipping planes. The horizontal distance from the
-// viewer is compared against these positions. Only points in [znear,zfar] are
-// rendered. The render is color-coded by this distance, using znear_color and
-// zfar_color as the bounds for the color-coding.
-//
-// Any value <0 is untouched by this call
-bool horizonator_set_zextents(horizonator_context_t* ctx,
-                              float znear,       float zfar,
-                              float znear_color, float zfar_color)
+// Draws the view by resampling the panorama cache, making the cache first if
+// it's out of date. Returns false if the view should be drawn from the mesh
+// instead: if the cache can't represent it, if the scene is still changing, or
+// if something failed. See use_panorama_cache in horizonator.h
+static bool redraw_from_panorama_cache(horizonator_context_t* ctx)
 {
-    if(ctx->use_glut)
+    const uint64_t redraw_serial_prev = ctx->panorama_cache.redraw_serial;
+    ctx->panorama_cache.redraw_serial = ctx->scene_serial;
+
+    GLint viewport[4];
+    GLint max_size;
+    glGetIntegerv(GL_VIEWPORT,         viewport);
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+
+    const float fov_deg     = ctx->view.az_deg1 - ctx->view.az_deg0;
+    const float deg_per_px  = fov_deg / (float)viewport[2];
+    const float el_half_deg = fov_deg / 2.0f / ctx->view.aspect;
+
+    int width = HORIZONATOR_PANORAMA_CACHE_WIDTH;
+    if(width > HORIZONATOR_PANORAMA_NSECTORS*max_size)
+        width = HORIZONATOR_PANORAMA_NSECTORS*max_size;
+
+    // Zoomed in past what the cache could resolve
+    if(fov_deg > 360.0f || deg_per_px < 360.0f / (float)width)
+        return false;
+
+    bool usable(void)
     {
-        if(ctx->glut_window == 0)
+        if(!ctx->panorama_cache.valid ||
+           ctx->panorama_cache.scene_serial != ctx->scene_serial)
             return false;
-        glutSetWindow(ctx->glut_window);
+
+        horizonator_view_t v = ctx->panorama_cache.view;
+        v.az_deg0 = ctx->view.az_deg0;
+        v.az_deg1 = ctx->view.az_deg1;
+        v.aspect  = ctx->view.aspect;
+        if(0 != memcmp(&v, &ctx->view, sizeof(v)))
+            return false;
+
+        const float cache_deg_per_px = 360.0f / (float)ctx->panorama_cache.width;
+        return
+            deg_per_px  >= cache_deg_per_px &&
+            el_half_deg <= (float)ctx->panorama.height * cache_deg_per_px / 2.0f;
     }
 
-    if( !(znear > 0.0f && znear_color > 0.0f &&
-          zfar  > 0.0f && zfar_color  > 0.0f ))
+    if(!usable())
+    {
+        // I make the cache only when the scene has settled: if it changed
+        // since the previous redraw, the viewer just moved, or the data is
+        // still coming in, and the cache would be thrown out right away
+        if(redraw_serial_prev != ctx->scene_serial)
+            return false;
+
+        // The cache is twice as tall as the view, to leave room for zooming
+        // out
+        const float cache_el_half_deg = fminf(fmaxf(2.0f*el_half_deg, 10.0f), 90.0f);
+        int height = (int)ceilf(2.0f*cache_el_half_deg / (360.0f / (float)width));
+        if(height > max_size)
+            height = max_size;
+
+        ctx->panorama_cache.valid = false;
+        if(!draw_panorama(ctx, width, height, 0.0f, false))
+            return false;
+        ctx->panorama_cache.valid        = true;
+        ctx->panorama_cache.scene_serial = ctx->scene_serial;
+        ctx->panorama_cache.view         = ctx->view;
+        ctx->panorama_cache.az_deg0      = 0.0f;
+        ctx->panorama_cache.width        = width;
+
+        if(!usable())
+            return false;
+    }
+
+    const horizonator_program_t* program =
+        get_program(ctx, HORIZONATOR_PROGRAM_RESAMPLE);
+    if(program == NULL)
         return false;
 
-    glUniform1f( ctx->uniform_znear,       znear);       assert_opengl();
-    glUniform1f( ctx->uniform_zfar,        zfar);        assert_opengl();
-    glUniform1f( ctx->uniform_znear_color, znear_color); assert_opengl();
-    glUniform1f( ctx->uniform_zfar_color,  zfar_color);  assert_opengl();
+    if(ctx->panorama_cache.vertexArrayID == 0)
+        glGenVertexArrays(1, &ctx->panorama_cache.vertexArrayID);
 
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    upload_view(ctx);
+
+    // The one triangle covering the viewport must be filled, and must not be
+    // culled or depth-tested away, whatever the state is for the mesh
+    GLint polygon_mode[2];
+    GLint depth_func;
+    glGetIntegerv(GL_POLYGON_MODE, polygon_mode);
+    glGetIntegerv(GL_DEPTH_FUNC,   &depth_func);
+    const GLboolean cull_face = glIsEnabled(GL_CULL_FACE);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glDepthFunc(GL_ALWAYS);
+    glDisable(GL_CULL_FACE);
+
+    // fragment.glsl samples these from texture units 1 and 2
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, ctx->panorama.colorTexID);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, ctx->panorama.depthTexID);
+    glActiveTexture(GL_TEXTURE0);
+
+    glUseProgram(program->id);
+    glUniform4f(program->uniform_panorama_cache,
+                ctx->panorama_cache.az_deg0,
+                360.0f * (float)ctx->panorama.sector_width / (float)ctx->panorama_cache.width,
+                (float)ctx->panorama.sector_width,
+                (float)ctx->panorama.height);
+    glBindVertexArray(ctx->panorama_cache.vertexArrayID);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glBindVertexArray(0);
+
+    glPolygonMode(GL_FRONT_AND_BACK, polygon_mode[0]);
+    glDepthFunc(depth_func);
+    if(cull_face)
+        glEnable(GL_CULL_FACE);
+    assert_opengl();
     return true;
 }
 
-bool horizonator_redraw(const horizonator_context_t* ctx)
+bool horizonator_redraw(horizonator_context_t* ctx)
+{
+    // This draws into whatever framebuffer is bound. If it's an offscreen one,
+    // horizonator_render_offscreen() can't reuse what was there
+    if(ctx->offscreen.inited)
+        ctx->offscreen.framebuffers[ctx->offscreen.current].frame_valid = false;
+
+    if(ctx->use_panorama_cache &&
+       redraw_from_panorama_cache(ctx))
+        return true;
+    return redraw(ctx, 0, NULL);
+}
+
+bool horizonator_render_panorama(horizonator_context_t* ctx,
+
+                                 // output
+                                 // any of these may be NULL
+                                 char* image, float* ranges,
+
+                                 // input
+                                 int width, int height,
+                                 float az_deg0)
 {
     if(ctx->use_glut)
     {
@@ -893,26 +5295,69 @@ bool horizonator_redraw(const horizonator_context_t* ctx)
         glutSetWindow(ctx->glut_window);
     }
 
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glDrawElements(GL_TRIANGLES, ctx->Ntriangles*3, GL_UNSIGNED_INT, NULL);
+    // This overwrites the panorama cache
+    ctx->panorama_cache.valid = false;
+
+    const bool depth_only = image == NULL;
+    if(!draw_panorama(ctx, width, height, az_deg0, depth_only))
+        return false;
+
+    const int Nsectors     = HORIZONATOR_PANORAMA_NSECTORS;
+    const int sector_width = ctx->panorama.sector_width;
+
+    GLint read_frameBufID_prev;
+    GLint pack_alignment_prev, pack_row_length_prev;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_frameBufID_prev);
+    glGetIntegerv(GL_PACK_ALIGNMENT,           &pack_alignment_prev);
+    glGetIntegerv(GL_PACK_ROW_LENGTH,          &pack_row_length_prev);
+
+    // I read each sector straight into its columns of the output, one layer
+    // at a time. The last sector may extend past the end of the panorama
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, ctx->panorama.readFrameBufID);
+    glReadBuffer(depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT,  1);
+    glPixelStorei(GL_PACK_ROW_LENGTH, width);
+    for(int k=0; k<Nsectors && k*sector_width < width; k++)
+    {
+        const int x0 = k*sector_width;
+        const int w  = width - x0 < sector_width ? width - x0 : sector_width;
+        if(image != NULL)
+        {
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                      ctx->panorama.colorTexID, 0, k);
+            glReadPixels(0,0, w, height,
+                         GL_BGR, GL_UNSIGNED_BYTE, &image[x0*3]);
+        }
+        if(ranges != NULL)
+        {
+            glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                      ctx->panorama.depthTexID, 0, k);
+            glReadPixels(0,0, w, height,
+                         GL_DEPTH_COMPONENT, GL_FLOAT, &ranges[x0]);
+        }
+    }
+    assert_opengl();
+
+    glPixelStorei(GL_PACK_ALIGNMENT,  pack_alignment_prev);
+    glPixelStorei(GL_PACK_ROW_LENGTH, pack_row_length_prev);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, read_frameBufID_prev);
+
+    if(image != NULL)
+        flip_image(image, width, height);
+    if(ranges != NULL)
+        ranges_from_depth(ranges, width, height, 360.0f, 0.0f,
+                          ctx->view.znear, ctx->view.zfar);
     return true;
 }
 
-// Renders a given scene to an RGB image and/or a range image.
-// horizonator_init() must have been called first with use_glut=true and
-// offscreen_width,height > 0. Then the viewer and camera must have been
-// configured with horizonator_move() and horizonator_pan_zoom()
-//
-// Returns true on success. The image and ranges buffers must be large-enough to
-// contain packed 24-bits-per-pixel BGR data and 32-bit floats respectively. The
-// images are returned using the usual convention: the top row is stored first.
-// This is opposite of the OpenGL convention: bottom row is first. Invisible
-// points have ranges <0
-bool horizonator_render_offscreen(const horizonator_context_t* ctx,
+bool horizonator_render_tiled(horizonator_context_t* ctx,
 
-                                  // output
-                                  // either may be NULL
-                                  char* image, float* ranges)
+                              // input
+                              int width, int height,
+                              float az_deg0, float az_deg1,
+                              int tile_width, int tile_height,
+                              bool render_image, bool render_ranges,
+                              horizonator_tile_sink_t* sink, void* cookie)
 {
     if(ctx->use_glut)
     {
@@ -921,133 +5366,343 @@ bool horizonator_render_offscreen(const horizonator_context_t* ctx,
         glutSetWindow(ctx->glut_window);
     }
 
-    if(!ctx->offscreen.inited)
+    static_assert(sizeof(GLuint) == sizeof(ctx->tiled.frameBufID),
+                  "horizonator_context_t.tiled.... must be a GLuint");
+
+    if(width <= 0 || height <= 0 || tile_width <= 0 || tile_height <= 0)
     {
-        MSG("Prior to calling horizonator_render_offscreen(), the context must have been inited for offscreen rendering with horizonator_init(use_glut=true, offscreen_width,height > 0)");
+        MSG("The render and its tiles must have a positive size. Got %dx%d and %dx%d",
+            width, height, tile_width, tile_height);
+        return false;
+    }
+    if(!(az_deg0 < az_deg1 && az_deg1 - az_deg0 <= 360.0f))
+    {
+        MSG("The render must span (0,360] degrees. Got az_deg0 = %f, az_deg1 = %f",
+            az_deg0, az_deg1);
         return false;
     }
 
-    int width  = ctx->offscreen.width;
-    int height = ctx->offscreen.height;
-
-    horizonator_redraw(ctx);
-
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
-    if(image != NULL)
+    // No tile needs to be larger than the render
+    if(tile_width  > width)  tile_width  = width;
+    if(tile_height > height) tile_height = height;
     {
-        glReadPixels(0,0, width, height,
-                     GL_BGR, GL_UNSIGNED_BYTE, image);
+        GLint max_size;
+        glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &max_size);
+        if(tile_width > max_size || tile_height > max_size)
+        {
+            MSG("The tiles are too large: they're %dx%d, but the renderbuffers can be at most %dx%d",
+                tile_width, tile_height, (int)max_size, (int)max_size);
+            return false;
+        }
+    }
 
-        // Flip the image around to compensate for OpenGL giving me upside-down
-        // images
-        void swap(int i0, int i1)
+    const bool depth_only = !render_image;
+    char*      image      = NULL;
+    float*     ranges     = NULL;
+    bool       result     = false;
+
+    // The state of the regular renders. I restore it when I'm done
+    GLint draw_frameBufID_prev, read_frameBufID_prev;
+    GLint viewport_prev[4];
+    GLint pack_alignment_prev, pack_row_length_prev;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &draw_frameBufID_prev);
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read_frameBufID_prev);
+    glGetIntegerv(GL_VIEWPORT,                 viewport_prev);
+    glGetIntegerv(GL_PACK_ALIGNMENT,           &pack_alignment_prev);
+    glGetIntegerv(GL_PACK_ROW_LENGTH,          &pack_row_length_prev);
+    const horizonator_view_t view_prev         = ctx->view;
+    const float              near_fov_deg_prev = ctx->near_fov_deg;
+    const float              near_fov_rad_prev = near_fov_rad(ctx);
+
+    // Each tile is a view of its own, but the near triangles are left out
+    // based on the whole render. So the tiles agree with each other, and the
+    // culling isn't redone for each tile
+    ctx->near_fov_deg = az_deg1 - az_deg0;
+    if(near_fov_rad(ctx) != near_fov_rad_prev)
+        ctx->visible_dirty = true;
+
+    if(render_image)
+    {
+        image = malloc((size_t)tile_width*tile_height*3);
+        if(image == NULL)
         {
-            char t = image[i0];
-            image[i0] = image[i1];
-            image[i1] = t;
+            MSG("malloc() failed");
+            goto done;
         }
-        for(int y=0; y<height/2; y++)
-            for(int x=0; x<width; x++)
-            {
-                swap((x + y             *width)*3 + 0,
-                     (x + (height-1 - y)*width)*3 + 0);
-                swap((x + y             *width)*3 + 1,
-                     (x + (height-1 - y)*width)*3 + 1);
-                swap((x + y             *width)*3 + 2,
-                     (x + (height-1 - y)*width)*3 + 2);
-            }
     }
-    if(ranges != NULL)
+    if(render_ranges)
     {
-        glReadPixels(0,0, width, height,
-                     GL_DEPTH_COMPONENT, GL_FLOAT, ranges);
-
-        float az_deg0, az_deg1;
-        glGetUniformfv(ctx->program, ctx->uniform_az_deg0, &az_deg0);
-        assert_opengl();
-        glGetUniformfv(ctx->program, ctx->uniform_az_deg1, &az_deg1);
-        assert_opengl();
+        ranges = malloc((size_t)tile_width*tile_height*sizeof(float));
+        if(ranges == NULL)
+        {
+            MSG("malloc() failed");
+            goto done;
+        }
+    }
 
-        float znear, zfar;
-        glGetUniformfv(ctx->program, ctx->uniform_znear, &znear);
+    // One framebuffer, reused for all the tiles
+    if(ctx->tiled.frameBufID == 0)
+    {
+        glGenFramebuffers(1, &ctx->tiled.frameBufID);
         assert_opengl();
-        glGetUniformfv(ctx->program, ctx->uniform_zfar, &zfar);
+    }
+    if(tile_width  != ctx->tiled.width ||
+       tile_height != ctx->tiled.height)
+    {
+        if(ctx->tiled.colorBufID != 0)
+            glDeleteRenderbuffers(1, &ctx->tiled.colorBufID);
+        if(ctx->tiled.depthBufID != 0)
+            glDeleteRenderbuffers(1, &ctx->tiled.depthBufID);
+        ctx->tiled.colorBufID = 0;
+        ctx->tiled.depthBufID = 0;
+        ctx->tiled.width      = tile_width;
+        ctx->tiled.height     = tile_height;
+    }
+    void make_renderbuffer(GLuint* id, GLenum format)
+    {
+        glGenRenderbuffers(1, id);
+        glBindRenderbuffer(GL_RENDERBUFFER, *id);
+        glRenderbufferStorage(GL_RENDERBUFFER, format, tile_width, tile_height);
         assert_opengl();
+    }
+    if(ctx->tiled.depthBufID == 0)
+        make_renderbuffer(&ctx->tiled.depthBufID, GL_DEPTH_COMPONENT);
+    if(!depth_only && ctx->tiled.colorBufID == 0)
+        make_renderbuffer(&ctx->tiled.colorBufID, GL_RGB);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->tiled.frameBufID);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                              GL_RENDERBUFFER, ctx->tiled.depthBufID);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER,
+                              depth_only ? 0 : ctx->tiled.colorBufID);
+    glDrawBuffer(depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0);
+    glReadBuffer(depth_only ? GL_NONE : GL_COLOR_ATTACHMENT0);
+    assert_opengl();
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        MSG("The tile framebuffer is incomplete");
+        goto done;
+    }
+    glViewport(0, 0, tile_width, tile_height);
+    glPixelStorei(GL_PACK_ALIGNMENT,  1);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+
+    // I read back whole tiles, and convert them like
+    // horizonator_render_offscreen() does. The tiles at the right and bottom
+    // edges may extend past the render. Of those I keep only the part inside
+    // the render: the top-left corner, which I pack in place
+    void pack(void* data, int size, int w, int h)
+    {
+        if(w == tile_width)
+            return;
+        for(int y=1; y<h; y++)
+            memmove(&((char*)data)[(size_t)y*w         *size],
+                    &((char*)data)[(size_t)y*tile_width*size],
+                    (size_t)w*size);
+    }
 
+    // The pixels are square, so the elevation extents follow from the
+    // azimuth extents. The center of the render is at elevation 0
+    const double deg_per_px = ((double)az_deg1 - (double)az_deg0) / (double)width;
+    ctx->view.aspect = (float)tile_width / (float)tile_height;
+    for(int y0=0; y0<height; y0 += tile_height)
+        for(int x0=0; x0<width; x0 += tile_width)
+        {
+            const int w = width  - x0 < tile_width  ? width  - x0 : tile_width;
+            const int h = height - y0 < tile_height ? height - y0 : tile_height;
 
-        // I just read the depth buffer. depth is in [0,1] and it describes
-        // gl_Position.z/gl_Position.w in the vertex shader, except THAT
-        // quantity is in [-1,1]. I convert each "depth" value to a "range"
+            ctx->view.az_deg0       = (float)(az_deg0 + deg_per_px*x0);
+            ctx->view.az_deg1       = (float)(az_deg0 + deg_per_px*(x0 + tile_width));
+            ctx->view.el_deg_center = (float)(deg_per_px * (height - 2*y0 - tile_height) / 2.);
+            ctx->view_dirty         = true;
+            ctx->seam_dirty         = true;
 
-        // In vertex.glsl we have:
-        //
-        // az = 0:     North
-        // az = 90deg: East
-        // xy coords are (e,n)
-        /*
-          en = { (lon - lon0) * Rearth * pi/180. * cos_viewer_lat,
-                 (lat - lat0) * Rearth * pi/180. };
+            if(!redraw(ctx, depth_only ? HORIZONATOR_PROGRAM_DEPTH_ONLY : 0, NULL))
+                goto done;
 
-          az = atan(en.x, en.y);
+            if(image != NULL)
+            {
+                glReadPixels(0,0, tile_width, tile_height,
+                             GL_BGR, GL_UNSIGNED_BYTE, image);
+                flip_image(image, tile_width, tile_height);
+                pack(image, 3, w, h);
+            }
+            if(ranges != NULL)
+            {
+                glReadPixels(0,0, tile_width, tile_height,
+                             GL_DEPTH_COMPONENT, GL_FLOAT, ranges);
+                ranges_from_depth(ranges, tile_width, tile_height,
+                                  ctx->view.az_deg1 - ctx->view.az_deg0,
+                                  ctx->view.el_deg_center,
+                                  ctx->view.znear, ctx->view.zfar);
+                pack(ranges, sizeof(float), w, h);
+            }
+            assert_opengl();
 
-          az_center = (az0 + az1)/2.;
-          az_ndc    = (az - az_center) * 2 / (az1 - az0);
+            if(!(*sink)(image, ranges, x0, y0, w, h, cookie))
+                goto done;
+        }
+    result = true;
 
-          aspect = width / height
-          el_ndc = atan(z, length(en)) * aspect * 2 / (az1 - az0);
+ done:
+    ctx->near_fov_deg = near_fov_deg_prev;
+    if(near_fov_rad(ctx) != near_fov_rad_prev)
+        ctx->visible_dirty = true;
+    ctx->view.az_deg0       = view_prev.az_deg0;
+    ctx->view.az_deg1       = view_prev.az_deg1;
+    ctx->view.aspect        = view_prev.aspect;
+    ctx->view.el_deg_center = view_prev.el_deg_center;
+    ctx->view_dirty         = true;
+    ctx->seam_dirty         = true;
+
+    glPixelStorei(GL_PACK_ALIGNMENT,  pack_alignment_prev);
+    glPixelStorei(GL_PACK_ROW_LENGTH, pack_row_length_prev);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_frameBufID_prev);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, read_frameBufID_prev);
+    glViewport(viewport_prev[0], viewport_prev[1],
+               viewport_prev[2], viewport_prev[3]);
+    free(image);
+    free(ranges);
+    return result;
+}
 
-          depth = ((length(en) - znear) / (zfar - znear))
-        */
+// The output files of horizonator_render_tiled_to_files(), and where the
+// pixels start in each
+typedef struct
+{
+    FILE* fp_image;
+    FILE* fp_ranges;
+    off_t image_data_offset, ranges_data_offset;
+    int   width, height;
+
+    // One row of a tile, converted from BGR to the RGB of the PPM
+    char* row_rgb;
+} tile_files_t;
+
+static bool write_tile_to_files(// input
+                                const char* image, const float* ranges,
+                                int x0, int y0, int width, int height,
+                                void* cookie)
+{
+    tile_files_t* files = (tile_files_t*)cookie;
 
-        // The viewport is "width" pixels wide. The center of the first pixel is
-        // at x=0.5. The center of the last pixel is at x=width-0.5
-        //
-        // I also flip the image vertically here
-        float aspect = (float)width / (float)height;
-        float get_tanel(int y)
+    // Each row of the tile goes to its place in the files. The PPM stores the
+    // top row first, like the tiles. The PFM stores the bottom row first
+    for(int y=0; y<height; y++)
+    {
+        if(image != NULL)
         {
-            float el_ndc = ((float)y + 0.5f) / (float)height * 2.f - 1.f;
-            float el     = el_ndc * (az_deg1-az_deg0) / 2.f / aspect * M_PI/180.0f;
-            return tanf(el);
+            const char* bgr = &image[(size_t)y*width*3];
+            for(int x=0; x<width; x++)
+            {
+                files->row_rgb[x*3 + 0] = bgr[x*3 + 2];
+                files->row_rgb[x*3 + 1] = bgr[x*3 + 1];
+                files->row_rgb[x*3 + 2] = bgr[x*3 + 0];
+            }
+            const off_t offset =
+                files->image_data_offset +
+                ((off_t)(y0 + y)*files->width + x0) * 3;
+            if(0 != fseeko(files->fp_image, offset, SEEK_SET) ||
+               (size_t)width != fwrite(files->row_rgb, 3, width, files->fp_image))
+            {
+                MSG("Couldn't write the image: %s", strerror(errno));
+                return false;
+            }
         }
-        float range(int x, int y, float tanel)
+        if(ranges != NULL)
         {
-            float depth = ranges[y*width + x];
-            if(depth == 1.0f) return -1.0f;
+            const off_t offset =
+                files->ranges_data_offset +
+                ((off_t)(files->height-1 - (y0 + y))*files->width + x0) * (off_t)sizeof(float);
+            if(0 != fseeko(files->fp_ranges, offset, SEEK_SET) ||
+               (size_t)width != fwrite(&ranges[(size_t)y*width], sizeof(float), width,
+                                       files->fp_ranges))
+            {
+                MSG("Couldn't write the ranges: %s", strerror(errno));
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
-            float length_en = depth * (zfar-znear) + znear;
+bool horizonator_render_tiled_to_files(horizonator_context_t* ctx,
+
+                                       // input
+                                       const char* filename_image,
+                                       const char* filename_ranges,
+                                       int width, int height,
+                                       float az_deg0, float az_deg1,
+                                       int tile_width, int tile_height)
+{
+    bool result = false;
+    tile_files_t files = {.width  = width,
+                          .height = height};
 
-            // float az_ndc = ((float)x + 0.5f) / (float)width * 2.f - 1.f;
-            // float az     = (az_ndc * (az_deg1-az_deg0) / 2.f + (az_deg1+az_deg0)/2.f) * M_PI/180.0f;
+    if(width <= 0 || height <= 0 || tile_width <= 0 || tile_height <= 0)
+    {
+        MSG("The render and its tiles must have a positive size. Got %dx%d and %dx%d",
+            width, height, tile_width, tile_height);
+        return false;
+    }
 
-            float z = tanel * length_en;
-            return hypotf(length_en, z);
+    if(filename_image != NULL)
+    {
+        files.row_rgb = malloc((size_t)(tile_width < width ? tile_width : width) * 3);
+        if(files.row_rgb == NULL)
+        {
+            MSG("malloc() failed");
+            goto done;
         }
-        for(int y=0; y<height/2; y++)
+
+        files.fp_image = fopen(filename_image, "w");
+        if(files.fp_image == NULL)
         {
-            float tanel = get_tanel(y);
-            for(int x=0; x<width; x++)
-            {
-                // tan(el) in the opposite row is negative. And it doesn't
-                // matter for the range computation anyway
-                float depth0 = range(x, y,           tanel);
-                float depth1 = range(x, height-1-y, -tanel);
-                ranges[y           *width + x] = depth1;
-                ranges[(height-1-y)*width + x] = depth0;
-            }
+            MSG("Couldn't open '%s' for writing: %s", filename_image, strerror(errno));
+            goto done;
         }
-        if(height&1)
+        fprintf(files.fp_image, "P6\n%d %d\n255\n", width, height);
+        files.image_data_offset = ftello(files.fp_image);
+    }
+    if(filename_ranges != NULL)
+    {
+        files.fp_ranges = fopen(filename_ranges, "w");
+        if(files.fp_ranges == NULL)
         {
-            // height is odd, so I need the depth->range for the center row
-            // separately
-            int y = height/2;
-            float tanel = get_tanel(y);
-            for(int x=0; x<width; x++)
-                ranges[y*width + x] = range(x, y, tanel);
+            MSG("Couldn't open '%s' for writing: %s", filename_ranges, strerror(errno));
+            goto done;
         }
+        // A grayscale PFM. The sign of the scale gives the byte order: <0 is
+        // little-endian
+        fprintf(files.fp_ranges, "Pf\n%d %d\n%s\n", width, height,
+                __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? "-1.0" : "1.0");
+        files.ranges_data_offset = ftello(files.fp_ranges);
     }
 
-    return true;
+    if(!horizonator_render_tiled(ctx,
+                                 width, height, az_deg0, az_deg1,
+                                 tile_width, tile_height,
+                                 filename_image  != NULL,
+                                 filename_ranges != NULL,
+                                 &write_tile_to_files, &files))
+        goto done;
+
+    result = true;
+
+ done:
+    if(files.fp_image != NULL && 0 != fclose(files.fp_image) && result)
+    {
+        MSG("Couldn't write the image to '%s': %s", filename_image, strerror(errno));
+        result = false;
+    }
+    if(files.fp_ranges != NULL && 0 != fclose(files.fp_ranges) && result)
+    {
+        MSG("Couldn't write the ranges to '%s': %s", filename_ranges, strerror(errno));
+        result = false;
+    }
+    free(files.row_rgb);
+    return result;
 }
 
 // Unwraps an angle x to lie within pi of an angle near. All angles in radians
@@ -1258,11 +5913,8 @@ bool horizonator_pick(const horizonator_context_t* ctx,
     } u;
     glGetIntegerv(GL_VIEWPORT, u.viewport);
 
-    float znear, zfar;
-    glGetUniformfv(ctx->program, ctx->uniform_znear, &znear);
-    assert_opengl();
-    glGetUniformfv(ctx->program, ctx->uniform_zfar, &zfar);
-    assert_opengl();
+    const float znear = ctx->view.znear;
+    const float zfar  = ctx->view.zfar;
 
     float depth;
     glReadPixels(x, u.height-1 - y,
@@ -1272,13 +5924,9 @@ bool horizonator_pick(const horizonator_context_t* ctx,
     if(depth >= 1.0f)
         return false;
 
-    float az_deg0, az_deg1, cos_viewer_lat;
-    glGetUniformfv(ctx->program, ctx->uniform_az_deg0,        &az_deg0);
-    assert_opengl();
-    glGetUniformfv(ctx->program, ctx->uniform_az_deg1,        &az_deg1);
-    assert_opengl();
-    glGetUniformfv(ctx->program, ctx->uniform_cos_viewer_lat, &cos_viewer_lat);
-    assert_opengl();
+    const float az_deg0        = ctx->view.az_deg0;
+    const float az_deg1        = ctx->view.az_deg1;
+    const float cos_viewer_lat = ctx->view.cos_viewer_lat;
 
     // depth is in [0,1] and it describes gl_Position.z/gl_Position.w in the
     // vertex shader, except THAT quantity is in [-1,1]
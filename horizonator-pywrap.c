@@ -44,6 +44,14 @@ do {                                                                    \
 typedef struct {
     PyObject_HEAD
     horizonator_context_t ctx;
+
+    // If true, render() uses the automatically-selected radius as the default
+    // zfar
+    bool render_radius_auto;
+
+    // The size given to the constructor. The renders use this unless asked for
+    // another size
+    int width, height;
 } py_horizonator_t;
 
 static int
@@ -57,7 +65,11 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
     int render_texture    = false;
     int SRTM1             = false;
     int allow_downloads   = true;
+    int render_radius_auto = false;
+    int async_load        = false;
+    int polar_mesh_Naz    = 0;
     const char* dir_dems  = NULL;
+    const char* dir_dems_SRTM1 = NULL;
     const char* dir_tiles = NULL;
     const char* tiles_name = NULL;
     const char* tiles_url_fmt = NULL;
@@ -65,6 +77,9 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
     const int render_radius_cells_default = 1000;
     int render_radius_cells = -1;
     double render_radius_m  = -1.;
+    double SRTM1_near_radius_m = -1.;
+    double load_az_deg0 = 0.;
+    double load_az_deg1 = 0.;
 
     char* keywords[] = {
         "lat", "lon",
@@ -76,6 +91,12 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
         "allow_downloads",
         "render_radius_cells",
         "render_radius_m",
+        "SRTM1_near_radius_m",
+        "dir_dems_SRTM1",
+        "load_az_deg0", "load_az_deg1",
+        "render_radius_auto",
+        "async_load",
+        "polar_mesh_Naz",
         NULL};
 
     if(self->ctx.offscreen.inited)
@@ -85,17 +106,31 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
     }
 
     if( !PyArg_ParseTupleAndKeywords(args, kwargs,
-                                     "ddII|ppsssspid", keywords,
+                                     "ddII|ppsssspiddsddppi", keywords,
                                      &lat, &lon, &width, &height,
                                      &render_texture, &SRTM1,
                                      &dir_dems, &dir_tiles,
                                      &tiles_name, &tiles_url_fmt,
                                      &allow_downloads,
                                      &render_radius_cells,
-                                     &render_radius_m))
+                                     &render_radius_m,
+                                     &SRTM1_near_radius_m,
+                                     &dir_dems_SRTM1,
+                                     &load_az_deg0, &load_az_deg1,
+                                     &render_radius_auto,
+                                     &async_load,
+                                     &polar_mesh_Naz))
         goto done;
 
-    if(render_radius_cells<0 && render_radius_m<0)
+    if(render_radius_auto)
+    {
+        if(render_radius_cells>0 || render_radius_m>0)
+        {
+            BARF("render_radius_auto is exclusive with render_radius_cells,render_radius_m");
+            goto done;
+        }
+    }
+    else if(render_radius_cells<0 && render_radius_m<0)
         render_radius_cells = render_radius_cells_default;
     else if(render_radius_cells>0 && render_radius_m>0)
     {
@@ -109,14 +144,21 @@ py_horizonator_init(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
                            NULL,
                            width, height,
                            render_radius_cells, render_radius_m,
+                           load_az_deg0, load_az_deg1,
                            true,
                            render_texture, SRTM1,
-                           dir_dems, dir_tiles,
+                           SRTM1_near_radius_m,
+                           polar_mesh_Naz,
+                           dir_dems, dir_dems_SRTM1, dir_tiles,
                            tiles_name,
                            tiles_url_fmt,
-                           allow_downloads ) )
+                           allow_downloads,
+                           async_load ) )
         goto done;
 
+    self->render_radius_auto = render_radius_auto;
+    self->width              = (int)width;
+    self->height             = (int)height;
     result = 0;
 
  done:
@@ -155,20 +197,88 @@ static PyObject* py_horizonator_str(py_horizonator_t* self)
     return string;
 }
 
+// The common setup of render() and render_panorama(): loads whatever has
+// come in, moves the viewer (unless lat <= -1000), and sets the clipping
+// planes. zfar, znear_color, zfar_color < 0 select the defaults. Returns false,
+// with a Python exception set, on error
+static bool update_view(py_horizonator_t* self,
+                        double lat, double lon,
+                        double znear, double zfar,
+                        double znear_color, double zfar_color,
+                        bool wait_for_load)
+{
+    if( !horizonator_update( &self->ctx, NULL, wait_for_load ) )
+    {
+        BARF("horizonator_update() failed");
+        return false;
+    }
+
+    // If we're still loading, the automatically-selected radius may not be
+    // known yet
+    if(zfar < 0.)
+        zfar = (self->render_radius_auto && self->ctx.Nlayers > 0) ?
+            self->ctx.layers[0].dems.radius_m :
+            HORIZONATOR_ZFAR_DEFAULT;
+    if(znear_color < 0.) znear_color = znear;
+    if(zfar_color  < 0.) zfar_color  = zfar;
+
+    if(lat > -1000.)
+        if( !horizonator_move( &self->ctx, NULL, lat, lon ) )
+        {
+            BARF("horizonator_move() failed");
+            return false;
+        }
+
+    if( !horizonator_set_zextents( &self->ctx,
+                                   znear, zfar, znear_color, zfar_color))
+    {
+        BARF("horizonator_set_zextents() failed");
+        return false;
+    }
+    return true;
+}
+
+// Returns the non-NULL outputs, in order. A single one is returned by itself;
+// several are returned in a tuple. On success the references to the outputs
+// are stolen. On failure NULL is returned, and the caller still owns them
+static PyObject* pack_outputs(PyObject** outputs, int Noutputs_max)
+{
+    int Noutputs = 0;
+    for(int i=0; i<Noutputs_max; i++)
+        if(outputs[i] != NULL)
+            outputs[Noutputs++] = outputs[i];
+
+    if(Noutputs == 1)
+        return outputs[0];
+
+    PyObject* result = PyTuple_New(Noutputs);
+    if(result == NULL)
+        return NULL;
+    // The tuple steals the references
+    for(int i=0; i<Noutputs; i++)
+        PyTuple_SET_ITEM(result, i, outputs[i]);
+    return result;
+}
+
 static PyObject*
 render(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
 {
     // error by default
-    PyObject* result = NULL;
-    PyObject* image  = NULL;
-    PyObject* ranges = NULL;
+    PyObject* result    = NULL;
+    PyObject* image     = NULL;
+    PyObject* ranges    = NULL;
+    PyObject* latlon    = NULL;
+    PyObject* elevation = NULL;
 
     double lat = -1000., lon = -1000.;
     double az_deg0, az_deg1;
+    int width = 0, height = 0;
     int return_image = true, return_range = true;
+    int return_latlon = false, return_elevation = false;
     int az_extents_use_pixel_centers = false;
+    int wait_for_load = true;
     double znear       = HORIZONATOR_ZNEAR_DEFAULT;
-    double zfar        = HORIZONATOR_ZFAR_DEFAULT;
+    double zfar        = -1.;
     double znear_color = -1.;
     double zfar_color  = -1.;
 
@@ -179,23 +289,41 @@ render(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
         "az_extents_use_pixel_centers",
         "znear", "zfar",
         "znear_color", "zfar_color",
+        "wait_for_load",
+        "return_latlon", "return_elevation",
+        "width", "height",
         NULL};
 
     if( !PyArg_ParseTupleAndKeywords(args, kwargs,
-                                     "dd|ddpppdddd", keywords,
+                                     "dd|ddpppddddpppii", keywords,
                                      &az_deg0, &az_deg1,
                                      &lat, &lon,
                                      &return_image, &return_range,
                                      &az_extents_use_pixel_centers,
                                      &znear, &zfar,
-                                     &znear_color, &zfar_color) )
+                                     &znear_color, &zfar_color,
+                                     &wait_for_load,
+                                     &return_latlon, &return_elevation,
+                                     &width, &height) )
         goto done;
 
-    if(znear_color < 0.) znear_color = znear;
-    if(zfar_color  < 0.) zfar_color  = zfar;
+    // The context keeps the framebuffers of a few recent sizes, so switching
+    // between sizes is cheap
+    if(width  <= 0) width  = self->width;
+    if(height <= 0) height = self->height;
+    if((width  != self->ctx.offscreen.width ||
+        height != self->ctx.offscreen.height) &&
+       !horizonator_resized(&self->ctx, width, height))
+    {
+        BARF("horizonator_resized(%d,%d) failed", width, height);
+        goto done;
+    }
 
+    if(!update_view(self, lat, lon, znear, zfar, znear_color, zfar_color,
+                    wait_for_load))
+        goto done;
 
-    if(!return_image && !return_range)
+    if(!return_image && !return_range && !return_latlon && !return_elevation)
     {
         result = PyTuple_New(0);
         goto done;
@@ -217,20 +345,6 @@ render(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
         goto done;
     }
 
-    if(lat > -1000.)
-        if( !horizonator_move( &self->ctx, NULL, lat, lon ) )
-        {
-            BARF("horizonator_move() failed");
-            goto done;
-        }
-
-    if( !horizonator_set_zextents( &self->ctx,
-                                   znear, zfar, znear_color, zfar_color))
-    {
-        BARF("horizonator_set_zextents() failed");
-        goto done;
-    }
-
     if(return_image)
     {
         image =
@@ -248,25 +362,137 @@ render(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
                 NPY_FLOAT32);
         if(ranges == NULL) goto done;
     }
+    if(return_latlon)
+    {
+        latlon =
+            PyArray_SimpleNew(3, ((npy_intp[]){self->ctx.offscreen.height,
+                                               self->ctx.offscreen.width,
+                                               2}),
+                NPY_FLOAT64);
+        if(latlon == NULL) goto done;
+    }
+    if(return_elevation)
+    {
+        elevation =
+            PyArray_SimpleNew(2, ((npy_intp[]){self->ctx.offscreen.height,
+                                               self->ctx.offscreen.width}),
+                NPY_FLOAT32);
+        if(elevation == NULL) goto done;
+    }
 
     if( !horizonator_render_offscreen( &self->ctx,
                                        image  == NULL ? NULL :
                                          (char *)PyArray_DATA((PyArrayObject*)image),
                                        ranges == NULL ? NULL :
-                                         (float*)PyArray_DATA((PyArrayObject*)ranges) ))
+                                         (float*)PyArray_DATA((PyArrayObject*)ranges),
+                                       latlon == NULL ? NULL :
+                                         (double*)PyArray_DATA((PyArrayObject*)latlon),
+                                       elevation == NULL ? NULL :
+                                         (float*)PyArray_DATA((PyArrayObject*)elevation) ))
     {
         BARF("horizonator_render_offscreen() failed");
         goto done;
     }
 
-    if(      return_image && !return_range) result = image;
-    else if(!return_image &&  return_range) result = ranges;
-    else
     {
-        result = PyTuple_Pack(2, image, ranges);
+        PyObject* outputs[] = { image, ranges, latlon, elevation };
+        result = pack_outputs(outputs, (int)(sizeof(outputs)/sizeof(outputs[0])));
+        if(result == NULL) goto done;
+        image = ranges = latlon = elevation = NULL;
+    }
+
+ done:
+    if(result == NULL)
+    {
+        Py_XDECREF(image);
+        Py_XDECREF(ranges);
+        Py_XDECREF(latlon);
+        Py_XDECREF(elevation);
+    }
+    return result;
+}
+
+static PyObject*
+render_panorama(py_horizonator_t* self, PyObject* args, PyObject* kwargs)
+{
+    // error by default
+    PyObject* result = NULL;
+    PyObject* image  = NULL;
+    PyObject* ranges = NULL;
+
+    double az_deg0 = 0.;
+    double lat = -1000., lon = -1000.;
+    int width = 0, height = 0;
+    int return_image = true, return_range = true;
+    int wait_for_load = true;
+    double znear       = HORIZONATOR_ZNEAR_DEFAULT;
+    double zfar        = -1.;
+    double znear_color = -1.;
+    double zfar_color  = -1.;
+
+    char* keywords[] = {
+        "az_deg0",
+        "lat", "lon",
+        "width", "height",
+        "return_image", "return_range",
+        "znear", "zfar",
+        "znear_color", "zfar_color",
+        "wait_for_load",
+        NULL};
+
+    if( !PyArg_ParseTupleAndKeywords(args, kwargs,
+                                     "|dddiippddddp", keywords,
+                                     &az_deg0,
+                                     &lat, &lon,
+                                     &width, &height,
+                                     &return_image, &return_range,
+                                     &znear, &zfar,
+                                     &znear_color, &zfar_color,
+                                     &wait_for_load) )
+        goto done;
+
+    if(width  <= 0) width  = self->width;
+    if(height <= 0) height = self->height;
+
+    if(!update_view(self, lat, lon, znear, zfar, znear_color, zfar_color,
+                    wait_for_load))
+        goto done;
+
+    if(!return_image && !return_range)
+    {
+        result = PyTuple_New(0);
+        goto done;
+    }
+
+    if(return_image)
+    {
+        image = PyArray_SimpleNew(3, ((npy_intp[]){height, width, 3}),
+                                  NPY_UINT8);
+        if(image == NULL) goto done;
+    }
+    if(return_range)
+    {
+        ranges = PyArray_SimpleNew(2, ((npy_intp[]){height, width}),
+                                   NPY_FLOAT32);
+        if(ranges == NULL) goto done;
+    }
+
+    if( !horizonator_render_panorama( &self->ctx,
+                                      image  == NULL ? NULL :
+                                        (char *)PyArray_DATA((PyArrayObject*)image),
+                                      ranges == NULL ? NULL :
+                                        (float*)PyArray_DATA((PyArrayObject*)ranges),
+                                      width, height, az_deg0 ))
+    {
+        BARF("horizonator_render_panorama() failed");
+        goto done;
+    }
+
+    {
+        PyObject* outputs[] = { image, ranges };
+        result = pack_outputs(outputs, (int)(sizeof(outputs)/sizeof(outputs[0])));
         if(result == NULL) goto done;
-        Py_DECREF(image);
-        Py_DECREF(ranges);
+        image = ranges = NULL;
     }
 
  done:
@@ -284,10 +510,14 @@ static const char py_horizonator_docstring[] =
 static const char render_docstring[] =
 #include "render.docstring.h"
     ;
+static const char render_panorama_docstring[] =
+#include "render_panorama.docstring.h"
+    ;
 
 static PyMethodDef py_horizonator_methods[] =
     {
-        PYMETHODDEF_ENTRY(, render, METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, render,          METH_VARARGS | METH_KEYWORDS),
+        PYMETHODDEF_ENTRY(, render_panorama, METH_VARARGS | METH_KEYWORDS),
         {}
     };
 
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <getopt.h>
+#include <time.h>
 
 #include <FL/Fl.H>
 #include <FL/Fl_Double_Window.H>
@@ -26,6 +27,12 @@ extern "C"
 #define STATUS_H      20
 #define COPY_BUTTON_W 150
 
+// While the user is panning and zooming, the render is made coarser until it
+// takes at most FRAME_TIME_TARGET_S. Once the input stops for REFINE_DELAY_S,
+// the full-detail render is made
+#define FRAME_TIME_TARGET_S 0.03
+#define REFINE_DELAY_S      0.15
+
 class GLWidget;
 
 
@@ -122,6 +129,8 @@ class GLWidget : public Fl_Gl_Window
 {
     horizonator_context_t m_ctx;
     bool render_texture, SRTM1;
+    float SRTM1_near_radius_m;
+    int   polar_mesh_Naz;
     float znear;
     float zfar;
     float znear_color;
@@ -131,6 +140,11 @@ class GLWidget : public Fl_Gl_Window
     int    m_polygon_mode_idx;
     int    m_last_drag_update_xy[2];
 
+    // The level of detail used while the user is panning and zooming: see
+    // FRAME_TIME_TARGET_S
+    bool   m_interacting;
+    int    m_lod;
+
 
     void clip_az_radius_deg(void)
     {
@@ -162,15 +176,38 @@ class GLWidget : public Fl_Gl_Window
 
         update_status_text();
 
+        // This render may be coarse. I come back for the full-detail one once
+        // the input stops
+        m_interacting = true;
+        Fl::remove_timeout(refine_timeout, this);
+        Fl::add_timeout(REFINE_DELAY_S, refine_timeout, this);
+
         redraw();
         g_slippymap->redraw();
         return true;
     }
 
+    static void refine_timeout(void* cookie)
+    {
+        GLWidget* w = (GLWidget*)cookie;
+        w->m_interacting = false;
+        if(w->m_ctx.lod != 0)
+            w->redraw();
+    }
+
+    static double seconds_now(void)
+    {
+        struct timespec t;
+        clock_gettime(CLOCK_MONOTONIC, &t);
+        return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+    }
+
 public:
     GLWidget(int x, int y, int w, int h,
              bool _render_texture,
              bool _SRTM1,
+             float _SRTM1_near_radius_m,
+             int   _polar_mesh_Naz,
              float _znear,
              float _zfar,
              float _znear_color,
@@ -178,6 +215,8 @@ public:
         Fl_Gl_Window(x, y, w, h),
         render_texture (_render_texture),
         SRTM1          (_SRTM1),
+        SRTM1_near_radius_m(_SRTM1_near_radius_m),
+        polar_mesh_Naz (_polar_mesh_Naz),
         znear          (_znear),
         zfar           (_zfar),
         znear_color    (_znear_color),
@@ -193,8 +232,8 @@ public:
           nothing or an out-of-date frame. Turning FL_DOUBLE off fixes THAT, but
           then the horizonator point picking doesn't work: glReadPixels(...,
           GL_DEPTH_COMPONENT, ...) returns an error. For some reason, omitting
-          FL_OPENGL3 fixes the issues. That is despite the horizonator using a
-          geometry shader, which requires at LEAST opengl 3.2. There's a
+          FL_OPENGL3 fixes the issues. That is despite the horizonator using
+          #version 420 shaders, which require at LEAST opengl 4.2. There's a
           related-looking bug report:
 
             https://github.com/fltk/fltk/issues/1005
@@ -214,6 +253,8 @@ public:
 
         m_winding          = GL_CCW;
         m_polygon_mode_idx = 0;
+        m_interacting      = false;
+        m_lod              = 0;
     }
 
     horizonator_context_t* ctx(void)
@@ -232,10 +273,17 @@ public:
                                   NULL,
                                   -1, -1,
                                   -1, zfar,
+                                  // The user can pan around, so I load all
+                                  // azimuths
+                                  0, 0,
                                   false,
                                   render_texture, SRTM1,
+                                  SRTM1_near_radius_m,
+                                  polar_mesh_Naz,
+                                  NULL,NULL,NULL,
                                   NULL,NULL,
-                                  NULL,NULL,
+                                  true,
+                                  // Show what we have while loading
                                   true))
             {
                 MSG("horizonator_init() failed. Giving up");
@@ -249,6 +297,10 @@ public:
                 exit(1);
             }
 
+            // Panning and zooming resample a cached 360deg render, so they
+            // don't re-render the mesh
+            m_ctx.use_panorama_cache = true;
+
             if(!horizonator_pan_zoom(&m_ctx,
                                  g_view.az_center_deg - g_view.az_radius_deg,
                                  g_view.az_center_deg + g_view.az_radius_deg))
@@ -258,9 +310,47 @@ public:
             }
         }
 
+        bool loading;
+        if(!horizonator_update(&m_ctx, &loading, false))
+        {
+            MSG("Loading the data failed. Giving up");
+            exit(1);
+        }
+
         if(!valid())
             horizonator_resized(&m_ctx, pixel_w(), pixel_h());
+
+        m_ctx.lod = m_interacting ? m_lod : 0;
+        const double t0 = seconds_now();
         horizonator_redraw(&m_ctx);
+        if(m_interacting)
+        {
+            // I time the render, and pick the level of detail for the next
+            // one. Each level is 2-4 times faster than the one before it, so I
+            // go finer only if there's plenty of time left over
+            glFinish();
+            const double dt = seconds_now() - t0;
+            if     (dt > FRAME_TIME_TARGET_S       && m_lod < HORIZONATOR_NLODS-1)
+                m_lod++;
+            else if(dt < FRAME_TIME_TARGET_S / 4.0 && m_lod > 0)
+                m_lod--;
+        }
+
+        // If we're still loading, I come back soon to show more. Each
+        // horizonator_update() call uploads a bounded amount of data, so I
+        // come back often
+        if(loading && !Fl::has_timeout(loading_timeout, this))
+            Fl::add_timeout(0.02, loading_timeout, this);
+    }
+
+    static void loading_timeout(void* cookie)
+    {
+        GLWidget* w = (GLWidget*)cookie;
+        w->redraw();
+
+        // The rectangle showing the loaded data in the slippy-map is updated
+        // too
+        g_slippymap->redraw();
     }
 
     virtual int handle(int event)
@@ -296,6 +386,8 @@ public:
                 if(++m_polygon_mode_idx == sizeof(polygon_modes)/sizeof(polygon_modes[0]))
                     m_polygon_mode_idx = 0;
                 glPolygonMode(GL_FRONT_AND_BACK, polygon_modes[ m_polygon_mode_idx ] );
+                // The cached panorama was drawn in the old mode
+                m_ctx.panorama_cache.valid = false;
                 redraw();
                 return 1;
             }
@@ -304,6 +396,7 @@ public:
                 if (m_winding == GL_CCW) m_winding = GL_CW;
                 else                   m_winding = GL_CCW;
                 glFrontFace(m_winding);
+                m_ctx.panorama_cache.valid = false;
                 redraw();
                 return 1;
             }
@@ -409,6 +502,10 @@ static void callback_slippymap(Fl_Widget* slippymap,
 
     GLWidget* w = (GLWidget*)cookie;
     horizonator_context_t* ctx = w->ctx();
+
+    // Moving the viewer far enough updates the mesh, so the GL context must be
+    // current
+    w->make_current();
     newrender(ctx, lat, lon);
     w->redraw();
     slippymap->redraw();
@@ -417,7 +514,8 @@ static void callback_slippymap(Fl_Widget* slippymap,
 int main(int argc, char** argv)
 {
     const char* usage =
-        "%s [--texture] [--SRTM1]\n"
+        "%s [--texture] [--SRTM1 | --SRTM1-near-radius RADIUS_M]\n"
+        "   [--polar-mesh NAZ]\n"
         "   [--zfar        ZFAR]\n"
         "   [--znear-color ZNEARCOLOR]\n"
         "   [--zfar-color  ZFARCOLOR]\n"
@@ -443,11 +541,20 @@ int main(int argc, char** argv)
         "By default we use 3\" SRTM data. Currently every triangle in the grid is\n"
         "rendered. This is inefficient, but the higher-resolution 1\" SRTM tiles\n"
         "would make it use 9 times more memory and computational resources, so\n"
-        "sticking with the lower-resolution 3\" SRTM data is recommended for now\n";
+        "sticking with the lower-resolution 3\" SRTM data is recommended for now.\n"
+        "A compromise is available with --SRTM1-near-radius: the 1\" data is used\n"
+        "within this many meters of the viewer, and the 3\" data further out\n"
+        "\n"
+        "By default we render the DEM grid directly. With --polar-mesh NAZ the\n"
+        "DEMs are instead resampled on rings around the viewer: NAZ samples in a\n"
+        "full circle, with the ring radii growing geometrically. As the viewer\n"
+        "moves, only the nearby rings are resampled\n";
 
     struct option opts[] = {
         { "texture",           no_argument,       NULL, 'T' },
         { "SRTM1",             no_argument,       NULL, 'S' },
+        { "SRTM1-near-radius", required_argument, NULL, 'N' },
+        { "polar-mesh",        required_argument, NULL, 'P' },
         { "znear",             required_argument, NULL, '1' },
         { "zfar",              required_argument, NULL, '2' },
         { "znear-color",       required_argument, NULL, '3' },
@@ -460,6 +567,9 @@ int main(int argc, char** argv)
     bool render_texture = false;
     bool SRTM1          = false;
 
+    float SRTM1_near_radius_m = -1.f;
+    int   polar_mesh_Naz      = 0;
+
     float znear       = HORIZONATOR_ZNEAR_DEFAULT;
     float zfar        = HORIZONATOR_ZFAR_DEFAULT;
     float znear_color = -1.f;
@@ -487,6 +597,24 @@ int main(int argc, char** argv)
             SRTM1 = true;
             break;
 
+        case 'N':
+            SRTM1_near_radius_m = (float)atof(optarg);
+            if(SRTM1_near_radius_m <= 0.0f)
+            {
+                fprintf(stderr, "--SRTM1-near-radius must have an float argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'P':
+            polar_mesh_Naz = atoi(optarg);
+            if(polar_mesh_Naz <= 0)
+            {
+                fprintf(stderr, "--polar-mesh must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
         case '1':
             znear = (float)atof(optarg);
             if(znear <= 0.0f)
@@ -535,6 +663,13 @@ int main(int argc, char** argv)
         return 1;
     }
 
+    if(SRTM1 && SRTM1_near_radius_m > 0.f)
+    {
+        fprintf(stderr, "--SRTM1 and --SRTM1-near-radius are mutually exclusive\n\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
     if(znear_color < 0.f) znear_color = znear;
     if(zfar_color  < 0.f) zfar_color  = zfar;
 
@@ -579,7 +714,8 @@ int main(int argc, char** argv)
     {
         g_gl_widget = new GLWidget(0, map_h,
                                    g_window->w(), g_window->h()-map_h-STATUS_H,
-                                   render_texture, SRTM1,
+                                   render_texture, SRTM1, SRTM1_near_radius_m,
+                                   polar_mesh_Naz,
                                    znear,zfar,znear_color,zfar_color);
     }
     map_and_render->end();
@@ -9,6 +9,334 @@
 #define HORIZONATOR_ZNEAR_DEFAULT 100.0f
 #define HORIZONATOR_ZFAR_DEFAULT  40000.0f
 
+// The mesh is split into square chunks, each one this many cells on a side.
+// All the chunks share one index buffer; each is drawn from its own range of the
+// vertex buffer
+#define HORIZONATOR_CHUNK_CELLS 64
+
+// When loading asynchronously, horizonator_update() uploads at most this many
+// mesh chunks or texture tiles per call, so that each frame stays quick
+#define HORIZONATOR_MAX_UPLOADS_PER_UPDATE 32
+
+// Normally all the data comes from one set of DEMs. In the mixed-resolution
+// mode there's one more: 1" data near the viewer
+#define HORIZONATOR_MAX_NLAYERS 2
+
+typedef struct
+{
+    // The SW cell of this chunk, relative to the anchor of its layer. The chunk
+    // contains HORIZONATOR_CHUNK_CELLS+1 vertices on each side. Any vertices past
+    // the edge of the layer duplicate the edge, producing degenerate triangles.
+    // i1,j1 is the last cell before we start duplicating
+    int i0, j0, i1, j1;
+
+    // The elevation extents of the vertices
+    int16_t zmin, zmax;
+
+    // The DEM overview level the vertices were sampled from, or -1 if it varies
+    // across the chunk. Then it depends on where the center of the DEMs was,
+    // so I also keep that, relative to the anchor. See rect_overview_levels() in
+    // horizonator-lib.c
+    int level;
+    int center_i, center_j;
+
+    // Whether this slot of the vertex buffer contains this chunk
+    bool built;
+} horizonator_chunk_t;
+
+// The extents of one entry in the draw list of a layer, used to skip the
+// entries hidden behind nearer terrain
+typedef struct
+{
+    // The cells covered by this entry, relative to the anchor of the layer
+    int i0, j0, i1, j1;
+
+    // The elevation extents of the vertices
+    int16_t zmin, zmax;
+
+    // The widest triangle in this entry is at most this many cells across
+    int16_t triangle_cells;
+
+    // The mesh may lie up to this far below the DEM samples
+    float zerror_m;
+} horizonator_draw_bounds_t;
+
+// A cache of the viewer-relative coordinates of the vertices of a mesh: the
+// azimuth, the elevation angle, the range and the horizontal range. These
+// depend only on the vertex and on the viewer, so they're captured with
+// transform feedback when either changes, and the redraws after a pan or a
+// zoom read them from here instead of redoing the math. See
+// horizonator_context_t.feedback_cache
+typedef struct
+{
+    // These should be GLuint, but I don't want to #include <GL.h>.
+    // I will static_assert() this in the .c to make sure they are compatible
+    uint32_t bufID;
+    // These draw from bufID. Each one reads the same vertices and indices as
+    // the corresponding vertex array of the mesh
+    uint32_t vertexArrayID, near_vertexArrayID;
+
+    // bufID has room for this many vertices
+    int Nvertices;
+    // The vertices [dirty0,dirty1) are out of date
+    int dirty0, dirty1;
+} horizonator_feedback_t;
+
+// A mesh built from one set of DEMs
+typedef struct
+{
+    horizonator_dem_context_t dems;
+
+    // These should be GLuint, but I don't want to #include <GL.h>.
+    // I will static_assert() this in the .c to make sure they are compatible
+    uint32_t vertexArrayID, vertexBufID;
+    // vertexBufID holds this many vertices
+    int      Nvertices;
+
+    horizonator_feedback_t feedback;
+
+    // One per slot in the vertex buffer
+    horizonator_chunk_t* chunks;
+    int                  Nslots;
+    // The layer is Nchunks_side chunks on each side
+    int                  Nchunks_side;
+
+    // If sliding, the DEMs and the mesh follow the viewer in horizonator_move()
+    bool sliding;
+    // The global cell index (lon,lat) of the cell the vertex coordinates are
+    // relative to. This is the DEM origin at init time. The DEM origin moves
+    // when sliding; this doesn't
+    int  anchor_cell[2];
+
+    // The arguments to glMultiDrawElementsBaseVertex(). Nchunks of these are
+    // drawn. These should be GLsizei and GLint
+    int                        Nchunks;
+    int32_t*                   draw_counts;
+    const void**               draw_offsets;
+    int32_t*                   draw_basevertex;
+    horizonator_draw_bounds_t* draw_bounds;
+
+    // The draw list in front-to-back order: indices into draw_...[]. Drawing
+    // the near chunks first lets the depth test reject the hidden fragments of
+    // the far ones before they're shaded
+    int32_t*     draw_order;
+
+    // The subset of the draw list that isn't hidden behind nearer terrain, in
+    // the same format, in front-to-back order. Updated in horizonator_redraw()
+    // if anything changed
+    int          Nchunks_visible;
+    int32_t*     visible_counts;
+    const void** visible_offsets;
+    int32_t*     visible_basevertex;
+    // The index into draw_...[] of each visible entry
+    int32_t*     visible_entry;
+
+    // The visible list, split at the azimuth seam behind the viewer. A
+    // triangle straddling the seam would be stretched across the whole view,
+    // so the entries crossing the seam are drawn twice instead: unwrapped to
+    // either side of it. The first Nchunks_once entries are drawn once, and
+    // the next Nchunks_seam are drawn twice. The entries near the viewer
+    // aren't in this list: see below. Updated in horizonator_redraw() if the
+    // view changed
+    int          Nchunks_once, Nchunks_seam;
+    int32_t*     split_counts;
+    const void** split_offsets;
+    int32_t*     split_basevertex;
+
+    // Near the viewer the triangles span wide azimuth ranges, and some
+    // surround the viewer. So the visible entries near the viewer are drawn
+    // triangle-by-triangle from near_indexBufID, leaving out the triangles
+    // spanning more than a quarter of the view. These are Nnear_once indices
+    // drawn once followed by Nnear_seam indices drawn twice, like the split
+    // list. near_vertexArrayID uses the same vertices as vertexArrayID
+    uint32_t near_vertexArrayID, near_indexBufID;
+    int      Nnear_once, Nnear_seam;
+
+    // The lowest elevation in blocks of 2^k cells, for the occlusion culling.
+    // Built when first needed, and thrown out when the DEMs move. NULL if not
+    // built
+    int16_t* zmin_pyramid;
+
+    // Where the viewer is, in the cell coordinates relative to the anchor. Set
+    // by horizonator_move()
+    float viewer_cell_i, viewer_cell_j;
+
+    // If tin, the mesh isn't made of chunks, but of blocks of HZTIN_BLOCK_CELLS
+    // cells, aligned with the DEM tiles. Each block comes from the .hztin
+    // simplified mesh of its tile (see hztin.h), if there is one, and from the
+    // dense grid otherwise. The blocks near the viewer always come from the
+    // dense grid: the simplified triangles would be too large there. The draw
+    // list describes the blocks, and they're indexed by tin_indexBufID. The
+    // whole mesh is rebuilt when the viewer moves away from tin_center (in
+    // the cell coordinates relative to the anchor), or when the DEMs move
+    bool     tin;
+    bool     tin_built;
+    uint32_t tin_indexBufID;
+    float    tin_center[2];
+    int      tin_Ntriangles;
+} horizonator_layer_t;
+
+// The polar mesh: an alternative to the chunked grids of the layers. The DEMs
+// are resampled on rings around the viewer: uniformly in azimuth, and spaced
+// geometrically in range. See horizonator_init()
+typedef struct
+{
+    // These should be GLuint, but I don't want to #include <GL.h>.
+    // I will static_assert() this in the .c to make sure they are compatible
+    uint32_t vertexArrayID, vertexBufID, indexBufID;
+
+    horizonator_feedback_t feedback;
+
+    // Each ring has Naz vertices, at azimuths az_rad0 + i*daz_rad. If wrap,
+    // the rings cover the full circle, and the last vertex connects to the
+    // first
+    int   Naz;
+    float az_rad0, daz_rad;
+    bool  wrap;
+
+    // The radius of each ring, in meters. Nrings of these
+    int    Nrings;
+    float* ring_r_m;
+
+    // The viewer position each ring was sampled around, in the cell
+    // coordinates of layers[0], relative to its anchor. Nrings (i,j) pairs. The
+    // rings are resampled as the viewer moves away from these
+    float* ring_centers;
+    bool   built;
+
+    int Nindices;
+
+    // Scratch space for the draw list, split at the azimuth seam like the
+    // split list of the layers. Up to 4 entries per ring: 2 drawn once, and 2
+    // drawn twice
+    int32_t*     split_counts;
+    const void** split_offsets;
+} horizonator_polar_mesh_t;
+
+// The view state: the uniform block "horizonator_view" in vertex.glsl, with
+// the same std140 layout. The context keeps this CPU-side copy, and
+// horizonator_redraw() uploads it in one piece if it changed. Anything that
+// needs these values reads them from here, not from GL
+typedef struct
+{
+    // The azimuth bounds of the view, from horizonator_pan_zoom()
+    float az_deg0, az_deg1;
+    // The aspect ratio of the viewport: width/height
+    float aspect;
+    // The viewer, from horizonator_move(). viewer_lat is in radians
+    float viewer_z;
+    float viewer_lat, cos_viewer_lat;
+    // The coefficients mapping latlon to the texture. See texture_coeffs() in
+    // horizonator_move()
+    float texturemap_lon0,  texturemap_lon1;
+    float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
+    // From horizonator_set_zextents()
+    float znear, zfar;
+    float znear_color, zfar_color;
+
+    // The OSM tiles in the texture, if we're texturing. Set once the texture
+    // is made
+    int32_t NtilesX, NtilesY;
+    int32_t osmtile_lowestX, osmtile_lowestY;
+
+    // The elevation of the center of the view. 0, except in the tiles of
+    // horizonator_render_tiled(). This also fills the std140 block up to a
+    // multiple of 16 bytes
+    float el_deg_center;
+} horizonator_view_t;
+
+// The shader programs. Each is a variant of vertex.glsl and fragment.glsl,
+// specialized at compile time with #defines. A variant is a combination of
+// these flags, which index horizonator_context_t.programs:
+//
+// - TEXTURED:   texture the terrain, instead of coloring it by range
+// - CACHED:     read the viewer-relative coordinates of each vertex from the
+//               feedback cache, instead of computing them
+// - DEPTH_ONLY: write no color, for renders that return only the ranges
+// - GEO:        also write the position of each pixel to a second render
+//               target. See horizonator_render_offscreen()
+// - CAPTURE:    fill the feedback caches, and draw nothing. Used alone
+// - PANORAMA:   project each triangle in a geometry shader into its sector of
+//               a 360deg panorama, each sector a layer of the framebuffer. See
+//               horizonator_render_panorama(). Not used with GEO
+// - RESAMPLE:   draw the view by resampling the panorama cache instead of the
+//               mesh. Used alone. See use_panorama_cache below
+//
+// The variants are compiled when they're first needed
+#define HORIZONATOR_PROGRAM_TEXTURED   1
+#define HORIZONATOR_PROGRAM_CACHED     2
+#define HORIZONATOR_PROGRAM_DEPTH_ONLY 4
+#define HORIZONATOR_PROGRAM_GEO        8
+#define HORIZONATOR_PROGRAM_CAPTURE    16
+#define HORIZONATOR_PROGRAM_PANORAMA   32
+#define HORIZONATOR_PROGRAM_RESAMPLE   64
+#define HORIZONATOR_NPROGRAMS          128
+
+// horizonator_render_panorama() splits the full circle into this many sectors
+// of equal width, each a layer of the framebuffer. The sectors are stitched
+// together when they're read back, so the panorama may be up to this many times
+// wider than the largest texture
+#define HORIZONATOR_PANORAMA_NSECTORS 8
+
+// The width of the panorama cache, in pixels, if the GPU allows it. See
+// use_panorama_cache
+#define HORIZONATOR_PANORAMA_CACHE_WIDTH 8192
+
+// The levels of detail of the chunked grids. Level k draws every 2^k-th vertex
+// of each chunk. See lod in horizonator_context_t
+#define HORIZONATOR_NLODS 4
+
+typedef struct
+{
+    // These should be GLuint and GLint, but I don't want to #include <GL.h>.
+    // I will static_assert() this in the .c to make sure they are compatible
+    uint32_t id;
+
+    // The uniforms set per draw. The rest of the view state lives in the
+    // "view" of the context
+    int32_t uniform_DEG_PER_CELL;
+    int32_t uniform_origin_cell_lon_deg;
+    int32_t uniform_origin_cell_lat_deg;
+    int32_t uniform_viewer_cell_i;
+    int32_t uniform_viewer_cell_j;
+    int32_t uniform_seam_side;
+    int32_t uniform_panorama_cache;
+} horizonator_program_t;
+
+// horizonator_resized() on an offscreen context keeps the framebuffers of up
+// to this many sizes
+#define HORIZONATOR_OFFSCREEN_NFRAMEBUFFERS 4
+
+// One offscreen framebuffer
+typedef struct
+{
+    // These should be GLuint, but I don't want to #include <GL.h>.
+    // I will static_assert() this in the .c to make sure they are compatible
+    uint32_t frameBufID;
+    uint32_t depthBufID;
+    // The color buffer. Made the first time an image is requested. See
+    // horizonator_render_offscreen()
+    uint32_t renderBufID;
+    // The second render target, for the lat/lon/elevation outputs of
+    // horizonator_render_offscreen(). Made when first needed
+    uint32_t geoBufID;
+
+    int width, height;
+
+    // The offscreen.use_count when this was last selected. 0 if this is
+    // unused
+    uint64_t last_used;
+
+    // What the last render left in this framebuffer: the view it was rendered
+    // with, the scene_serial of the context at the time, and which outputs
+    // are valid. A render that differs from it only by a pan reuses it. See
+    // horizonator_render_offscreen()
+    bool               frame_valid;
+    bool               frame_has_color;
+    int                frame_lod;
+    uint64_t           frame_serial;
+    horizonator_view_t frame_view;
+} horizonator_framebuffer_t;
 
 typedef struct
 {
@@ -18,46 +346,181 @@ typedef struct
     // meaningful only if use_glut. 0 means "invalid" or "closed"
     int glut_window;
 
-    // These should be GLint, but I don't want to #include <GL.h>.
-    // I will static_assert() this in the .c to make sure they are compatible
-    int32_t uniform_aspect, uniform_az_deg0, uniform_az_deg1;
-    int32_t uniform_viewer_cell_i;
-    int32_t uniform_viewer_cell_j;
-    int32_t uniform_viewer_z;
-    int32_t uniform_viewer_lat;
-    int32_t uniform_cos_viewer_lat;
-    int32_t uniform_texturemap_lon0;
-    int32_t uniform_texturemap_lon1;
-    int32_t uniform_texturemap_dlat0;
-    int32_t uniform_texturemap_dlat1;
-    int32_t uniform_texturemap_dlat2;
-    int32_t uniform_znear, uniform_zfar;
-    int32_t uniform_znear_color, uniform_zfar_color;
-
-    uint32_t program;
+    horizonator_program_t programs[HORIZONATOR_NPROGRAMS];
+    uint32_t indexBufID;
 
-    float viewer_lat, viewer_lon;
+    // The view state, and the uniform buffer it's uploaded to. view_dirty is
+    // set when the two differ
+    horizonator_view_t view;
+    bool               view_dirty;
+    uint32_t           viewBufID;
 
-    horizonator_dem_context_t dems;
+    // Non-NULL while the data is still being loaded. Private to
+    // horizonator-lib.c
+    struct horizonator_loader_t* loader;
+
+    float viewer_lat, viewer_lon;
 
+    // If occlusion_culling, horizonator_redraw() skips the parts of the mesh
+    // hidden behind nearer terrain. On by default. visible_dirty is set when
+    // anything that affects this or the draw order changes. seam_dirty is set
+    // when the split at the azimuth seam changes
+    bool occlusion_culling;
+    bool visible_dirty;
+    bool seam_dirty;
+
+    // The triangles near the viewer that are too wide for the view are left
+    // out; see split_at_seam(). "Too wide" is relative to the width of the
+    // view, unless near_fov_deg > 0: then it's relative to near_fov_deg.
+    // horizonator_render_tiled() sets this to the width of the whole render,
+    // so that each tile leaves out the same triangles
+    float near_fov_deg;
+
+    // If feedback_cache, horizonator_redraw() draws the meshes from their
+    // feedback caches, which are recaptured only after the viewer moves or
+    // the vertices change. This saves most of the vertex work when panning
+    // and zooming, at the cost of 16 bytes per vertex. On by default
+    bool feedback_cache;
+
+    // If reuse_pans, horizonator_render_offscreen() reuses the previous render
+    // if the view has only been panned by a whole number of pixels since: the
+    // previous render is shifted over, and only the newly-exposed strip is
+    // drawn. On by default. The shifted depths are only approximately equal to
+    // those of a fresh render, so this is done only for the renders that
+    // request no ranges, latlon or elevation. scene_serial is incremented
+    // whenever anything other than the view changes what's rendered, such as
+    // the viewer moving or new data coming in: the previous render can't be
+    // reused then
+    bool     reuse_pans;
+    uint64_t scene_serial;
+
+    // If use_panorama_cache, horizonator_redraw() renders the full circle
+    // once, into the framebuffer of horizonator_render_panorama(), and then
+    // draws each view by resampling it. Panning and zooming then cost the
+    // same, however large the mesh is. The cache is made when the view
+    // changes, but the scene hasn't changed since the previous redraw. It is
+    // thrown out when the scene or the z extents change, or by
+    // horizonator_render_panorama(). Views zoomed in past the resolution of
+    // the cache, or taller than it, are rendered from the mesh, as usual. Off
+    // by default
+    bool use_panorama_cache;
+
+    // The level of detail: in [0, HORIZONATOR_NLODS). 0 (the default) draws
+    // the full mesh. Level k draws the chunks of the grids with every 2^k-th
+    // vertex, for roughly 4^k times fewer triangles, to render quickly while
+    // the view is changing. The edges of each chunk keep every vertex, so the
+    // chunks drawn at different levels meet without cracks. The chunks near
+    // the viewer, where the coarse triangles would be too wide, are drawn in
+    // full. The simplified meshes, the polar mesh and the panoramas are always
+    // drawn in full. The pattern of each level lives in indexBufID, at
+    // lod_offsets[k], with lod_counts[k] indices. split_lod is the level the
+    // split lists were made with
+    int         lod;
+    int         split_lod;
+    int32_t     lod_counts [HORIZONATOR_NLODS];
+    const void* lod_offsets[HORIZONATOR_NLODS];
+
+    // If count_overdraw, horizonator_redraw() counts the fragments that pass
+    // the depth test, and stores the count in overdraw_samples. Divided by the
+    // number of pixels, this is the overdraw. Reading the count waits for the
+    // render to finish, so this is off by default
+    bool     count_overdraw;
+    uint32_t overdraw_queryID;
+    uint64_t overdraw_samples;
+
+    // layers[0] covers the whole render area. If we're in the mixed-resolution
+    // mode, layers[1] contains the 1" data near the viewer, and layers[0] omits
+    // the chunks that layers[1] covers
+    horizonator_layer_t layers[HORIZONATOR_MAX_NLAYERS];
+    int                 Nlayers;
+
+    // If polar_mesh, the layers provide only the DEMs, and this mesh is drawn
+    // instead of their grids
+    bool                     polar_mesh;
+    horizonator_polar_mesh_t polar;
+
+    // The offscreen rendering. Each size has its own framebuffer. A pool of
+    // them is kept, so switching between a few sizes with
+    // horizonator_resized() doesn't remake anything. If the pool is full, the
+    // least-recently-used framebuffer is remade at the new size
     struct
     {
         bool inited;
+        horizonator_framebuffer_t framebuffers[HORIZONATOR_OFFSCREEN_NFRAMEBUFFERS];
+
+        // framebuffers[current] is in use. It is width x height pixels
+        int current;
+        int width, height;
+
+        // A panned render is shifted into this framebuffer, which then swaps
+        // places with framebuffers[current]. Remade if the size changes
+        horizonator_framebuffer_t pan;
+
+        // Incremented each time a framebuffer is selected. The framebuffers
+        // remember this in last_used, to find the least-recently-used one
+        uint64_t use_count;
+
+        // Scratch space for reading back the positions in
+        // horizonator_render_offscreen(). Has room for geo_Npixels pixels, and
+        // is grown as needed
+        float* geo;
+        int    geo_Npixels;
+    } offscreen;
+
+    // The layered framebuffer of horizonator_render_panorama(). Made when first
+    // needed, and remade if the size changes. The color texture is made only if
+    // an image is requested
+    struct
+    {
+        // These should be GLuint, but I don't want to #include <GL.h>.
+        // I will static_assert() this in the .c to make sure they are compatible
+        uint32_t frameBufID, readFrameBufID;
+        uint32_t colorTexID, depthTexID;
+
+        // Each of the HORIZONATOR_PANORAMA_NSECTORS layers is sector_width x
+        // height pixels
+        int sector_width, height;
+    } panorama;
+
+    // The state of the panorama cache: see use_panorama_cache. The panorama
+    // starts at az_deg0 and spans width x ctx->panorama.height pixels. It was
+    // made with scene_serial and with view; only the azimuths and the aspect
+    // of the view may differ when it's used. redraw_serial is the
+    // scene_serial of the previous horizonator_redraw()
+    struct
+    {
+        bool               valid;
+        uint64_t           scene_serial;
+        horizonator_view_t view;
+        float              az_deg0;
+        int                width;
+        uint64_t           redraw_serial;
+
+        // The resampling draws with no vertex data, but a vertex array must
+        // be bound anyway
+        uint32_t vertexArrayID;
+    } panorama_cache;
+
+    // The framebuffer of horizonator_render_tiled(), reused for each tile.
+    // Made when first needed, and remade if the tile size changes. The color
+    // buffer is made only if an image is requested
+    struct
+    {
         // These should be GLuint, but I don't want to #include <GL.h>.
         // I will static_assert() this in the .c to make sure they are compatible
         uint32_t frameBufID;
-        uint32_t renderBufID;
-        uint32_t depthBufID;
+        uint32_t colorBufID, depthBufID;
 
         int width, height;
-    } offscreen;
+    } tiled;
 } horizonator_context_t;
 
 
 __attribute__((unused))
 static bool horizonator_context_isvalid(const horizonator_context_t* ctx)
 {
-    return ctx->Ntriangles > 0;
+    // The data may still be loading
+    return ctx->programs[HORIZONATOR_PROGRAM_CAPTURE].id != 0;
 }
 
 // The main init routine. We support 3 modes:
@@ -74,13 +537,58 @@ static bool horizonator_context_isvalid(const horizonator_context_t* ctx)
 // and then
 // - horizonator_redraw()
 //
-// If rendering off-screen, horizonator_resized() is not allowed.
+// If rendering off-screen, horizonator_resized() changes the size of the
+// offscreen render: the size of the next horizonator_render_offscreen().
 // horizonator_pan_zoom() must be called to update the azimuth extents.
 // Completely arbitrarily, these are set to -45deg - 45deg initially
 //
 // SRTM1 selects between 1" SRTM and 3" SRTM. Currently every triangle is
 // rendered, so 1" SRTM tiles can easily overload the machine. Unless you need
 // the extra resolution, stick with 3" SRTM tiles for now
+//
+// If SRTM1_near_radius_m > 0 we use a mixed-resolution mode: 1" data is loaded
+// within this radius of the viewer, and 3" data beyond it, out to the render
+// radius. The two meshes are drawn in two depth-composited passes. This gives
+// us the fidelity of the 1" data near the viewer, where it matters, at close
+// to the cost of the 3" data. In this mode SRTM1 must be false, dir_dems refers
+// to the 3" data, and dir_dems_SRTM1 to the 1" data. dir_dems_SRTM1 may be
+// NULL to use the default
+//
+// If both render_radius_cells and render_radius_m are <= 0, the radius is
+// selected automatically: we load out to the furthest distance where terrain
+// could still poke above the horizon of the curved earth, given the viewer
+// height and the highest terrain in range. zfar is then set to this radius. The
+// rendering itself ignores the curvature
+//
+// If the azimuth bounds of the view are known ahead of time, and won't change,
+// pass them in load_az_deg0, load_az_deg1. Then only the DEM tiles and mesh
+// chunks inside that wedge (plus a margin) are loaded. This is much faster and
+// takes much less memory for narrow fields of view. Anything outside the wedge
+// is not rendered at all
+//
+// If polar_mesh_Naz > 0, the DEM grid isn't drawn directly. Instead, the DEMs
+// are resampled on rings around the viewer, with polar_mesh_Naz samples in a
+// full circle, and with the ring radii growing geometrically (but spaced no
+// closer than one DEM cell). This gives roughly constant triangle density on
+// the screen, using far fewer triangles far away, where the grid is needlessly
+// dense, and more nearby, where the grid triangles are huge on the screen.
+// Nothing closer than one DEM cell to the viewer is drawn. As
+// the viewer moves, only the rings whose sampling is noticeably off-center are
+// resampled: the near ones
+//
+// If the DEM directory contains .hztin files (made by the hgt2hztin tool), the
+// simplified meshes in those are drawn instead of the DEM grid. The area around
+// the viewer, and any tiles without a .hztin file, are still drawn from the
+// full-resolution grid. polar_mesh_Naz > 0 takes precedence over this
+//
+// The data is loaded in a separate thread: the DEMs, then the mesh chunks
+// (nearest to the viewer first), then the texture tiles. If !async_load,
+// horizonator_init() waits for all of it. Otherwise it returns as soon as the
+// OpenGL state is set up, and the caller must then call horizonator_update()
+// periodically to upload the data that has come in. Until it has all come in,
+// each render shows whatever is available. In this mode the auto-selected
+// viewer_z (and zfar, if the radius is automatic) can't be known when
+// horizonator_init() returns; they're set when the DEMs come in
 bool horizonator_init( // output
                        horizonator_context_t* ctx,
 
@@ -93,23 +601,51 @@ bool horizonator_init( // output
                        float* viewer_z,
                        int offscreen_width, int offscreen_height,
                        int render_radius_cells, // This should be given >0
-                       float render_radius_m,   // or this, but not both
+                       float render_radius_m,   // or this, but not both. If
+                                                // neither, the radius is
+                                                // selected automatically
+                       // Load only the data visible through this azimuth
+                       // wedge. If load_az_deg1 <= load_az_deg0, load all
+                       // azimuths
+                       float load_az_deg0, float load_az_deg1,
 
                        bool use_glut,
                        bool render_texture,
                        bool SRTM1,
+                       float SRTM1_near_radius_m,
+                       int polar_mesh_Naz,
                        const char* dir_dems,
+                       const char* dir_dems_SRTM1,
                        const char* dir_tiles,
                        const char* tiles_name,
                        const char* tiles_url_fmt,
-                       bool allow_downloads);
+                       bool allow_downloads,
+                       bool async_load);
+
+// Uploads the data loaded since the last call. Needed only if
+// horizonator_init() was called with async_load. The chunks are loaded in
+// order of urgency: the ones inside the current azimuth bounds first, nearest
+// to the viewer first; horizonator_move() and horizonator_pan_zoom() update
+// this ordering. Unless wait, at most HORIZONATOR_MAX_UPLOADS_PER_UPDATE chunks
+// or tiles are uploaded per call; call this once per frame. *loading is set to
+// true if anything is still being loaded; it may be NULL. If wait: we wait for
+// everything to load before returning. Returns false if the loading failed
+bool horizonator_update(horizonator_context_t* ctx,
+                        // output
+                        bool* loading,
+                        // input
+                        bool wait);
 
 void horizonator_deinit( horizonator_context_t* ctx );
 
-bool horizonator_resized(const horizonator_context_t* ctx, int width, int height);
+// Sets the size of the render. For a window, this is called when the window is
+// resized. For an offscreen context, this selects the framebuffer of that size
+// from the pool in offscreen.framebuffers, making it if it doesn't exist yet.
+// So one context, with its loaded data, can render at any size
+bool horizonator_resized(horizonator_context_t* ctx, int width, int height);
 
 // Must be called at least once before horizonator_redraw()
-bool horizonator_pan_zoom(const horizonator_context_t* ctx,
+bool horizonator_pan_zoom(horizonator_context_t* ctx,
                       // Bounds of the view. We expect az_deg1 > az_deg0. The azimuth
                       // edges lie at the edges of the image. So for an image that's
                       // W pixels wide, az0 is at x = -0.5 and az1 is at W-0.5. The
@@ -117,9 +653,12 @@ bool horizonator_pan_zoom(const horizonator_context_t* ctx,
                       // square.
                       float az_deg0, float az_deg1);
 
-// Called after horizonator_init(). Moves the viewer around in the space of
-// loaded DEMs. If the viewer moves a LOT, new DEMs should be loaded, and this
-// function is no longer appropriate
+// Called after horizonator_init(). Moves the viewer around. If the viewer moves
+// far enough from the center of the loaded DEMs, the loaded area is moved to
+// follow: the newly-exposed DEMs are loaded, and only the newly-exposed parts of
+// the mesh are built. This doesn't happen if we're texturing or if a load wedge
+// was given to horizonator_init(). Then the viewer must stay within the
+// initially-loaded area
 bool horizonator_move(horizonator_context_t* ctx,
                       // output/input
                       // if viewer_z==NULL, auto-select a value; if *viewer_z >=
@@ -139,7 +678,11 @@ bool horizonator_set_zextents(horizonator_context_t* ctx,
                               float znear,       float zfar,
                               float znear_color, float zfar_color);
 
-bool horizonator_redraw(const horizonator_context_t* ctx);
+// Draws the scene. Unless occlusion_culling was turned off in the context, the
+// parts of the mesh hidden behind nearer terrain are skipped. Finding those
+// takes a bit of CPU time after the viewer moves. If use_panorama_cache is set
+// in the context, the view may be resampled from a cached panorama instead
+bool horizonator_redraw(horizonator_context_t* ctx);
 
 // returns true if an intersection is found
 bool horizonator_pick(const horizonator_context_t* ctx,
@@ -152,21 +695,109 @@ bool horizonator_pick(const horizonator_context_t* ctx,
                       int x, int y );
 
 
-// Renders a given scene to an RGB image and/or a range image.
-// horizonator_init() must have been called first with use_glut=true and
-// offscreen_width,height > 0. Then the viewer and camera must have been
-// configured with horizonator_move() and horizonator_pan_zoom()
+// Renders a given scene to an RGB image and/or a range image, and optionally
+// the position of the terrain seen in each pixel. horizonator_init() must have
+// been called first with use_glut=true and offscreen_width,height > 0. Then the
+// viewer and camera must have been configured with horizonator_move() and
+// horizonator_pan_zoom()
 //
 // Returns true on success. The image and ranges buffers must be large-enough to
-// contain packed 24-bits-per-pixel BGR data and 32-bit floats respectively. The
-// images are returned using the usual convention: the top row is stored first.
-// This is opposite of the OpenGL convention: bottom row is first. Invisible
-// points have ranges <0
-bool horizonator_render_offscreen(const horizonator_context_t* ctx,
+// contain packed 24-bits-per-pixel BGR data and 32-bit floats respectively.
+// latlon gets (lat,lon) pairs of doubles, in degrees, and elevation gets the
+// elevation of the terrain, in meters, as floats. The positions come from the
+// same draw, written to a second render target, so no unprojection is needed.
+// The images are returned using the usual convention: the top row is stored
+// first. This is opposite of the OpenGL convention: bottom row is first.
+// Invisible points have ranges <0, and NAN positions. If image is NULL, no color
+// is rendered, which is cheaper
+bool horizonator_render_offscreen(horizonator_context_t* ctx,
 
                                   // output
-                                  // either may be NULL
-                                  char* image, float* ranges);
+                                  // any of these may be NULL
+                                  char* image, float* ranges,
+                                  double* latlon, float* elevation);
+
+// Renders a full 360deg panorama to an RGB image and/or a range image, in one
+// draw. The panorama is width x height pixels, and it starts at az_deg0: for a
+// panorama W pixels wide, az_deg0 is at x = -0.5 and az_deg0+360 is at W-0.5.
+// The elevation extents are chosen to keep the aspect ratio square, like in
+// horizonator_pan_zoom(). The outputs have the format of the outputs of
+// horizonator_render_offscreen(), and either may be NULL
+//
+// The circle is split into HORIZONATOR_PANORAMA_NSECTORS sectors. A geometry
+// shader projects each triangle into the sector it lies in, and writes it to
+// that layer of a layered framebuffer. So the mesh is submitted once, no
+// matter how many sectors there are, and the seam behind the viewer needs no
+// special handling. The triangles near the viewer spanning more than a quarter
+// of a sector are left out, like they are in a regular render with the
+// field of view of one sector. This matches rendering the sectors one at a
+// time with horizonator_render_offscreen()
+//
+// This works with any context, windowed or offscreen. The panorama has its own
+// framebuffer, and the framebuffer, viewport and view of the regular renders
+// are restored afterwards
+bool horizonator_render_panorama(horizonator_context_t* ctx,
+
+                                 // output
+                                 // any of these may be NULL
+                                 char* image, float* ranges,
+
+                                 // input
+                                 int width, int height,
+                                 float az_deg0);
+
+// Receives the tiles of horizonator_render_tiled(), one at a time. The tile is
+// width x height pixels, and its top-left pixel is at (x0,y0) in the full
+// render. The image and ranges have the format of the outputs of
+// horizonator_render_offscreen(), packed: the rows are width pixels apart.
+// Either is NULL if it wasn't requested. The buffers are reused for the next
+// tile, so the sink must copy out anything it wants to keep. Returns false to
+// stop the render
+typedef bool (horizonator_tile_sink_t)(// input
+                                       const char* image, const float* ranges,
+                                       int x0, int y0, int width, int height,
+                                       void* cookie);
+
+// Renders a view of any size: width x height pixels, from az_deg0 on the left
+// edge to az_deg1 on the right edge, with the elevation extents chosen to keep
+// the aspect ratio square, like in horizonator_pan_zoom(). The view may be up
+// to 360deg wide. This isn't limited by the size of the framebuffers or by
+// memory: the view is rendered in tiles of at most tile_width x tile_height
+// pixels, one at a time, through one reused framebuffer. Each tile is passed
+// to the sink as soon as it's read back, so only one tile is in memory at any
+// time. The tiles are passed in rows, from the top row down, and left to right
+// within each row
+//
+// The result is the same as rendering the whole view at once with
+// horizonator_render_offscreen(), if that was possible: each tile is a view
+// of its own, but the triangles near the viewer are left out based on the
+// width of the whole view, not of the tile
+//
+// If !render_image, only the depth is rendered, which is cheaper. This works
+// with any context, windowed or offscreen, and the framebuffer, viewport and
+// view of the regular renders are restored afterwards. Returns false if
+// anything failed, or if the sink returned false
+bool horizonator_render_tiled(horizonator_context_t* ctx,
+
+                              // input
+                              int width, int height,
+                              float az_deg0, float az_deg1,
+                              int tile_width, int tile_height,
+                              bool render_image, bool render_ranges,
+                              horizonator_tile_sink_t* sink, void* cookie);
+
+// horizonator_render_tiled(), writing the outputs straight to disk: the image
+// to a binary PPM file, and the ranges to a PFM file. Each tile is written to
+// its place in the files as it's rendered, so the memory use doesn't depend on
+// the size of the render. Either filename may be NULL to skip that output
+bool horizonator_render_tiled_to_files(horizonator_context_t* ctx,
+
+                                       // input
+                                       const char* filename_image,
+                                       const char* filename_ranges,
+                                       int width, int height,
+                                       float az_deg0, float az_deg1,
+                                       int tile_width, int tile_height);
 
 bool horizonator_x_from_az( // output
                             double* x,
@@ -0,0 +1,97 @@
+#pragma once
+
+// The horizonator-native DEM container. There's one file per 1deg x 1deg tile,
+// named like the .hgt tiles, but with a .hzdem extension: N34W118.hzdem. These
+// are created from .hgt files by the hgt2hzdem tool, and they're read by dem.c
+// in preference to the .hgt files, if they exist.
+//
+// The file is meant to be mmap-ed. It contains a header, an index, and then the
+// data blocks. The data is stored in multiple levels: level 0 is the full
+// resolution. Each subsequent level is an overview, decimated by 2x in each
+// direction from the previous one: the samples at level L are the full-res
+// samples at tile coordinates that are multiples of 2^L. So a 3" tile has
+// 1201x1201 samples at level 0, 601x601 samples at level 1, and so on.
+//
+// Each level is split into square blocks of HZDEM_BLOCK_WIDTH x
+// HZDEM_BLOCK_WIDTH samples. Blocks at the N and E edges are padded to the full
+// size. Within each block the samples are stored as int16_t, row-major, with the
+// rows going from S to N (the opposite of .hgt files). Each block starts at a
+// page-aligned offset, so touching one block reads only that block from disk.
+// The index stores the elevation bounds of each block, so the highest terrain
+// in an area can be found without reading its samples. Negative (void) samples
+// are stored as 0, which is what horizonator_dem_sample() would return for them
+// anyway.
+//
+// Everything is native-endian: the files aren't portable between machines of
+// different endianness
+
+#include <stdint.h>
+
+#define HZDEM_MAGIC        "hzdem01"
+#define HZDEM_BLOCK_WIDTH  256
+#define HZDEM_NLEVELS      4
+#define HZDEM_ALIGNMENT    4096
+
+typedef struct
+{
+    // The elevation extents of all the full-res samples covered by this block
+    int16_t  zmin, zmax;
+    uint32_t reserved;
+
+    // Offset of the block data from the start of the file
+    uint64_t offset;
+} hzdem_block_t;
+
+typedef struct
+{
+    char     magic[8];
+
+    // 1200 for SRTM3 or 3600 for SRTM1
+    uint32_t cells_per_deg;
+    uint32_t block_width;
+    uint32_t Nlevels;
+
+    // The elevation extents of the whole tile
+    int16_t  zmin, zmax;
+
+    // The index: an hzdem_block_t for each block at each level. Level 0 comes
+    // first. Within each level the blocks are ordered by increasing latlon, with
+    // lon varying faster
+    hzdem_block_t blocks[];
+} hzdem_header_t;
+
+// How many samples there are along each side of the given level
+static inline int hzdem_Nsamples(int cells_per_deg, int level)
+{
+    return (cells_per_deg >> level) + 1;
+}
+
+// How many blocks there are along each side of the given level
+static inline int hzdem_Nblocks(int cells_per_deg, int level)
+{
+    return (hzdem_Nsamples(cells_per_deg, level) + HZDEM_BLOCK_WIDTH-1) / HZDEM_BLOCK_WIDTH;
+}
+
+// The index of the first block of the given level in hzdem_header_t.blocks[].
+// Passing level = HZDEM_NLEVELS returns the total number of blocks
+static inline int hzdem_iblock0(int cells_per_deg, int level)
+{
+    int iblock0 = 0;
+    for(int l=0; l<level; l++)
+    {
+        int Nblocks = hzdem_Nblocks(cells_per_deg, l);
+        iblock0 += Nblocks*Nblocks;
+    }
+    return iblock0;
+}
+
+// Returns the block containing the sample (x,y) at the given level. x,y are
+// the sample coordinates at that level: 0 at the SW corner of the tile
+static inline const hzdem_block_t* hzdem_block(const hzdem_header_t* header,
+                                               int x, int y, int level)
+{
+    int cells_per_deg = (int)header->cells_per_deg;
+    return &header->blocks[ hzdem_iblock0(cells_per_deg, level) +
+                            (y / HZDEM_BLOCK_WIDTH) * hzdem_Nblocks(cells_per_deg, level) +
+                            x / HZDEM_BLOCK_WIDTH ];
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+// The horizonator-native simplified mesh. There's one file per 1deg x 1deg
+// tile, named like the .hgt tiles, but with a .hztin extension: N34W118.hztin.
+// These are created from .hgt files by the hgt2hztin tool, and they're read by
+// dem.c alongside the DEMs, if they exist. If a layer has any of these,
+// horizonator-lib.c draws them instead of the dense grid
+//
+// Each tile is split into square blocks of HZTIN_BLOCK_CELLS x
+// HZTIN_BLOCK_CELLS cells. Each block is a triangulated irregular network: an
+// RTIN (right-triangulated irregular network, like Martini) computed from the
+// full-res samples. The triangles are split until the vertical error of the
+// mesh is within max_error_m of the DEM. Triangles more than
+// HZTIN_MAX_TRIANGLE_CELLS across are always split: huge triangles close to
+// the viewer would be badly distorted in the render. The edges of each block are
+// kept at full resolution, so the blocks fit together without cracks, with
+// each other and with blocks of the dense grid. Blocks at the N and E edges
+// are cut off at the edge of the tile
+//
+// The file is meant to be mmap-ed. It contains a header, an index, and then the
+// data blocks, each starting at a page-aligned offset. Each block contains
+// Nvertices hztin_vertex_t followed by Ntriangles*3 uint16_t indices into those
+// vertices. The triangles are counter-clockwise, looking down from above.
+// Negative (void) samples are stored as 0, which is what
+// horizonator_dem_sample() would return for them anyway.
+//
+// Everything is native-endian: the files aren't portable between machines of
+// different endianness
+
+#include <stdint.h>
+
+#define HZTIN_MAGIC              "hztin01"
+#define HZTIN_BLOCK_CELLS        128
+#define HZTIN_MAX_TRIANGLE_CELLS 32
+#define HZTIN_ALIGNMENT          4096
+
+typedef struct
+{
+    // Sample coordinates in the tile: 0 at the SW corner
+    uint16_t x, y;
+    int16_t  z;
+} hztin_vertex_t;
+
+typedef struct
+{
+    // Offset of the block data from the start of the file
+    uint64_t offset;
+    uint32_t Nvertices, Ntriangles;
+
+    // The elevation extents of the vertices in this block
+    int16_t  zmin, zmax;
+    uint32_t reserved;
+} hztin_block_t;
+
+typedef struct
+{
+    char     magic[8];
+
+    // 1200 for SRTM3 or 3600 for SRTM1
+    uint32_t cells_per_deg;
+    uint32_t block_cells;
+
+    // The vertical error bound the tile was simplified to
+    float    max_error_m;
+    uint32_t reserved;
+
+    // The index: an hztin_block_t for each block, ordered by increasing
+    // latlon, with lon varying faster
+    hztin_block_t blocks[];
+} hztin_header_t;
+
+// How many blocks there are along each side of the tile
+static inline int hztin_Nblocks(int cells_per_deg)
+{
+    return (cells_per_deg + HZTIN_BLOCK_CELLS-1) / HZTIN_BLOCK_CELLS;
+}
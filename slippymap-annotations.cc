@@ -39,24 +39,28 @@ void SlippymapAnnotations::draw(const orb_viewport &viewport)
 
     fl_color( FL_RED );
 
-    // The lat/lon of the first and last cells. These are INCLUSIVE
-    float lat0, lon0, lat1, lon1;
-    horizonator_dem_bounds_latlon_deg(&ctx->dems,
-                                      &lat0, &lon0, &lat1, &lon1);
-
-    orb_viewport::gps2px(viewport.z(), orb_point<double>(lon0, lat0), px);
-    int x0 = px.get_x() - viewport.x();
-    int y0 = px.get_y() - viewport.y();
-    orb_viewport::gps2px(viewport.z(), orb_point<double>(lon1, lat1), px);
-    int x1 = px.get_x() - viewport.x();
-    int y1 = px.get_y() - viewport.y();
-
-    fl_begin_loop();
-    fl_vertex(x0, y0);
-    fl_vertex(x0, y1);
-    fl_vertex(x1, y1);
-    fl_vertex(x1, y0);
-    fl_end_loop();
+    // The DEMs may not have been loaded yet
+    if(ctx->Nlayers > 0)
+    {
+        // The lat/lon of the first and last cells. These are INCLUSIVE
+        float lat0, lon0, lat1, lon1;
+        horizonator_dem_bounds_latlon_deg(&ctx->layers[0].dems,
+                                          &lat0, &lon0, &lat1, &lon1);
+
+        orb_viewport::gps2px(viewport.z(), orb_point<double>(lon0, lat0), px);
+        int x0 = px.get_x() - viewport.x();
+        int y0 = px.get_y() - viewport.y();
+        orb_viewport::gps2px(viewport.z(), orb_point<double>(lon1, lat1), px);
+        int x1 = px.get_x() - viewport.x();
+        int y1 = px.get_y() - viewport.y();
+
+        fl_begin_loop();
+        fl_vertex(x0, y0);
+        fl_vertex(x0, y1);
+        fl_vertex(x1, y1);
+        fl_vertex(x1, y0);
+        fl_end_loop();
+    }
 
     if( pick_lat > MIN_VALID_ANGLE )
     {
@@ -12,7 +12,18 @@
 #include "annotator.h"
 #include "util.h"
 
+// With --radius-auto, zfar defaults to the radius we loaded. These are <0 if
+// they still need to be filled in
+static void resolve_zfar(const horizonator_context_t* ctx,
+                         float* zfar, float* zfar_color)
+{
+    if(*zfar       < 0.f) *zfar       = ctx->layers[0].dems.radius_m;
+    if(*zfar_color < 0.f) *zfar_color = *zfar;
+}
+
 static bool glut_loop( bool render_texture, bool SRTM1,
+                       float SRTM1_near_radius_m,
+                       int polar_mesh_Naz,
                        float viewer_lat, float viewer_lon,
 
                        // Bounds of the view. We expect az_deg1 > az_deg0. The azimuth
@@ -26,12 +37,15 @@ static bool glut_loop( bool render_texture, bool SRTM1,
                        // defaults
                        float znear,       float zfar,
                        float znear_color, float zfar_color,
+                       bool radius_auto,
 
                        const char* dir_dems,
+                       const char* dir_dems_SRTM1,
                        const char* dir_tiles,
                        const char* tiles_name,
                        const char* tiles_url_fmt,
-                       bool allow_downloads)
+                       bool allow_downloads,
+                       bool report_overdraw)
 {
     horizonator_context_t ctx;
 
@@ -39,16 +53,23 @@ static bool glut_loop( bool render_texture, bool SRTM1,
                            viewer_lat, viewer_lon,
                            NULL,
                            -1, -1,
-                           -1, zfar,
+                           -1, radius_auto ? -1.f : zfar,
+                           // This window can't pan, so I only need this wedge
+                           az_deg0, az_deg1,
                            true,
                            render_texture, SRTM1,
+                           SRTM1_near_radius_m,
+                           polar_mesh_Naz,
                            dir_dems,
+                           dir_dems_SRTM1,
                            dir_tiles,
                            tiles_name,
                            tiles_url_fmt,
-                           allow_downloads) )
+                           allow_downloads,
+                           false) )
         return false;
 
+    resolve_zfar(&ctx, &zfar, &zfar_color);
     if(!horizonator_set_zextents(&ctx,
                                  znear, zfar, znear_color, zfar_color))
        return false;
@@ -56,9 +77,18 @@ static bool glut_loop( bool render_texture, bool SRTM1,
     if(!horizonator_pan_zoom( &ctx, az_deg0, az_deg1))
         return false;
 
+    ctx.count_overdraw = report_overdraw;
+
     void window_display(void)
     {
         horizonator_redraw(&ctx);
+        if(report_overdraw)
+        {
+            GLint viewport[4];
+            glGetIntegerv(GL_VIEWPORT, viewport);
+            fprintf(stderr, "overdraw: %.2f fragments per pixel\n",
+                    (double)ctx.overdraw_samples / (double)(viewport[2]*viewport[3]));
+        }
         glutSwapBuffers();
     }
 
@@ -110,18 +140,92 @@ static bool glut_loop( bool render_texture, bool SRTM1,
     return true;
 }
 
+// Renders an image of any size in tiles, writing each tile to disk as it's
+// rendered. Only one tile is in memory at a time
+static bool render_tiled( bool render_texture, bool SRTM1,
+                          float SRTM1_near_radius_m,
+                          int polar_mesh_Naz,
+                          float viewer_lat, float viewer_lon,
+
+                          // The edges of the render, like in glut_loop()
+                          float az_deg0, float az_deg1,
+                          int width, int height, int tile_size,
+
+                          float znear,       float zfar,
+                          float znear_color, float zfar_color,
+                          bool radius_auto,
+
+                          const char* dir_dems,
+                          const char* dir_dems_SRTM1,
+                          const char* dir_tiles,
+                          const char* tiles_name,
+                          const char* tiles_url_fmt,
+                          bool allow_downloads,
+
+                          // output files. filename_ranges may be NULL
+                          const char* filename_image,
+                          const char* filename_ranges)
+{
+    horizonator_context_t ctx;
+
+    // The offscreen framebuffer isn't used: the tiles have their own. So I
+    // keep it small
+    if( !horizonator_init( &ctx,
+                           viewer_lat, viewer_lon,
+                           NULL,
+                           1, 1,
+                           -1, radius_auto ? -1.f : zfar,
+                           az_deg0, az_deg1,
+                           true,
+                           render_texture, SRTM1,
+                           SRTM1_near_radius_m,
+                           polar_mesh_Naz,
+                           dir_dems,
+                           dir_dems_SRTM1,
+                           dir_tiles,
+                           tiles_name,
+                           tiles_url_fmt,
+                           allow_downloads,
+                           false) )
+    {
+        fprintf(stderr, "horizonator_init() failed\n");
+        return false;
+    }
+
+    resolve_zfar(&ctx, &zfar, &zfar_color);
+    if(!horizonator_set_zextents(&ctx,
+                                 znear, zfar, znear_color, zfar_color))
+        return false;
+
+    if(!horizonator_render_tiled_to_files(&ctx,
+                                          filename_image, filename_ranges,
+                                          width, height,
+                                          az_deg0, az_deg1,
+                                          tile_size, tile_size))
+    {
+        fprintf(stderr, "render failed\n");
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char* argv[])
 {
     const char* usage =
         "%s [--width WIDTH_PIXELS] [--height HEIGHT_PIXELS]\n"
-        "   [--image OUT.png|OUT.pdf|OUT.svg]\n"
-        "   [--texture] [--SRTM1]\n"
+        "   [--image OUT.png|OUT.pdf|OUT.svg|OUT.ppm]\n"
+        "   [--ranges OUT.pfm] [--tile-size PIXELS]\n"
+        "   [--texture] [--SRTM1 | --SRTM1-near-radius RADIUS_M]\n"
+        "   [--polar-mesh NAZ]\n"
         "   [--allow-tile-downloads]\n"
+        "   [--overdraw]\n"
         "   [--znear       ZNEAR]\n"
         "   [--zfar        ZFAR]\n"
+        "   [--radius-auto]\n"
         "   [--znear-color ZNEARCOLOR]\n"
         "   [--zfar-color  ZFARCOLOR]\n"
         "   [--dirdems DIRECTORY]\n"
+        "   [--dirdems-SRTM1 DIRECTORY]\n"
         "   [--dirtiles DIRECTORY]\n"
         "   [--tiles NAME=FMT]\n"
         "   LAT LON AZ_CENTER_DEG AZ_RADIUS_DEG\n"
@@ -136,6 +240,14 @@ int main(int argc, char* argv[])
         "\n"
         "The image filename MUST be a .png file (the render will be written)\n"
         "OR a .pdf or .svg file (the annotated render will be written)\n"
+        "OR a .ppm file (the render will be written in tiles; see below)\n"
+        "\n"
+        "A .ppm image is rendered in tiles of --tile-size x --tile-size pixels\n"
+        "(1024 by default), and each tile is written to the file as soon as it's\n"
+        "rendered. So the image may be far larger than the largest render the\n"
+        "GPU allows, or than fits in memory: a 360deg panorama 100000 pixels wide\n"
+        "is fine. With --ranges, the ranges of this render are written to the\n"
+        "given .pfm file as well\n"
         "\n"
         "When plotting to a window, AZ_..._DEG refers to the azimuth bounds of the\n"
         "VIEWPORT. When rendering to an image, to the\n"
@@ -151,6 +263,12 @@ int main(int argc, char* argv[])
         "as --zfar/--znear. --znear and --zfar have  reasonable defaults, and may also\n"
         "be omitted\n"
         "\n"
+        "By default we load the DEMs out to --zfar. With --radius-auto we load them\n"
+        "out to the furthest distance where the terrain could still poke above the\n"
+        "horizon of the curved earth. This depends on the viewer height and on the\n"
+        "highest terrain nearby. If --zfar is omitted, it then defaults to that\n"
+        "distance\n"
+        "\n"
         "By default we colorcode the renders by range. If --texture, we\n"
         "use a set of image tiles to texture the render instead\n"
         "\n"
@@ -158,31 +276,52 @@ int main(int argc, char* argv[])
         "rendered. This is inefficient, but the higher-resolution 1\" SRTM tiles\n"
         "would make it use 9 times more memory and computational resources, so\n"
         "sticking with the lower-resolution 3\" SRTM data is recommended for now.\n"
+        "A compromise is available with --SRTM1-near-radius: the 1\" data is used\n"
+        "within this many meters of the viewer, and the 3\" data further out.\n"
+        "\n"
+        "By default we render the DEM grid directly. With --polar-mesh NAZ the\n"
+        "DEMs are instead resampled on rings around the viewer: NAZ samples in a\n"
+        "full circle, with the ring radii growing geometrically. This keeps the\n"
+        "triangle density on the screen roughly constant, and usually needs far\n"
+        "fewer triangles\n"
         "\n"
         "The DEMs are in the directory given by --dirdems, or in\n"
-        "~/.horizonator/DEMs_SRTM3/ (or DEMs_SRTM1) if omitted.\n"
+        "~/.horizonator/DEMs_SRTM3/ (or DEMs_SRTM1) if omitted. With\n"
+        "--SRTM1-near-radius, the 1\" DEMs are in the directory given by\n"
+        "--dirdems-SRTM1, or in ~/.horizonator/DEMs_SRTM1/ if omitted.\n"
         "\n"
         "The tiles are in the directory given by --dirtiles, or in\n"
         "~/.horizonator/tiles if omitted. This is the BASE directory for ALL the\n"
         "available tile sets. By default we use the OSM mapnik tiles. To specify\n"
         "different tiles, pass '--tiles NAME=FMT'. Where NAME is the identifier of\n"
-        "this set and FMT is the URL format string to use for this set\n";
+        "this set and FMT is the URL format string to use for this set\n"
+        "\n"
+        "With --overdraw, we report the overdraw of each render on stderr: the\n"
+        "number of fragments that passed the depth test per pixel. 1.0 is ideal.\n"
+        "Measuring this slows down the rendering a bit\n";
 
     struct option opts[] = {
         { "width",             required_argument, NULL, 'w' },
         { "height",            required_argument, NULL, 'H' },
         { "cut-off-bottom-px", required_argument, NULL, 'c' },
         { "image",             required_argument, NULL, 'i' },
+        { "ranges",            required_argument, NULL, 'r' },
+        { "tile-size",         required_argument, NULL, 's' },
         { "dirdems",           required_argument, NULL, 'd' },
+        { "dirdems-SRTM1",     required_argument, NULL, 'D' },
         { "dirtiles",          required_argument, NULL, 't' },
         { "tiles",             required_argument, NULL, 'I' },
         { "texture",           no_argument,       NULL, 'T' },
         { "SRTM1",             no_argument,       NULL, 'S' },
+        { "SRTM1-near-radius", required_argument, NULL, 'N' },
+        { "polar-mesh",        required_argument, NULL, 'P' },
         { "allow-tile-downloads",no_argument,     NULL, 'a' },
+        { "overdraw",          no_argument,       NULL, 'o' },
         { "znear",             required_argument, NULL, '1' },
         { "zfar",              required_argument, NULL, '2' },
         { "znear-color",       required_argument, NULL, '3' },
         { "zfar-color",        required_argument, NULL, '4' },
+        { "radius-auto",       no_argument,       NULL, 'R' },
         { "help",              no_argument,       NULL, 'h' },
         {}
     };
@@ -191,18 +330,25 @@ int main(int argc, char* argv[])
     int         height              = 0;
     int         cut_off_bottom_px   = 0;
     const char* filename_image      = NULL;
+    const char* filename_ranges     = NULL;
+    int         tile_size           = 1024;
     const char* dir_dems            = NULL;
+    const char* dir_dems_SRTM1      = NULL;
     const char* dir_tiles           = NULL;
     const char* tiles_name          = NULL;
     const char* tiles_url_fmt       = NULL;
     bool        render_texture      = false;
     bool        SRTM1               = false;
+    float       SRTM1_near_radius_m = -1.f;
+    int         polar_mesh_Naz      = 0;
     bool        allow_downloads     = false;
+    bool        report_overdraw     = false;
 
     float znear       = HORIZONATOR_ZNEAR_DEFAULT;
-    float zfar        = HORIZONATOR_ZFAR_DEFAULT;
+    float zfar        = -1.f;
     float znear_color = -1.f;
     float zfar_color  = -1.f;
+    bool  radius_auto = false;
 
     int opt;
     do
@@ -269,6 +415,10 @@ int main(int argc, char* argv[])
                 return 1;
             }
             break;
+        case 'R':
+            radius_auto = true;
+            break;
+
         case '4':
             zfar_color = (float)atof(optarg);
             if(zfar_color <= 0.0f)
@@ -282,10 +432,27 @@ int main(int argc, char* argv[])
             filename_image = optarg;
             break;
 
+        case 'r':
+            filename_ranges = optarg;
+            break;
+
+        case 's':
+            tile_size = atoi(optarg);
+            if(tile_size <= 0)
+            {
+                fprintf(stderr, "--tile-size must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
         case 'd':
             dir_dems = optarg;
             break;
 
+        case 'D':
+            dir_dems_SRTM1 = optarg;
+            break;
+
         case 't':
             dir_tiles = optarg;
             break;
@@ -311,10 +478,32 @@ int main(int argc, char* argv[])
             SRTM1 = true;
             break;
 
+        case 'N':
+            SRTM1_near_radius_m = (float)atof(optarg);
+            if(SRTM1_near_radius_m <= 0.0f)
+            {
+                fprintf(stderr, "--SRTM1-near-radius must have an float argument > 0\n");
+                return 1;
+            }
+            break;
+
+        case 'P':
+            polar_mesh_Naz = atoi(optarg);
+            if(polar_mesh_Naz <= 0)
+            {
+                fprintf(stderr, "--polar-mesh must have an integer argument > 0\n");
+                return 1;
+            }
+            break;
+
         case 'a':
             allow_downloads = true;
             break;
 
+        case 'o':
+            report_overdraw = true;
+            break;
+
         case '?':
             fprintf(stderr, "Unknown option\n\n");
             fprintf(stderr, usage, argv[0]);
@@ -330,8 +519,18 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    if(SRTM1 && SRTM1_near_radius_m > 0.f)
+    {
+        fprintf(stderr, "--SRTM1 and --SRTM1-near-radius are mutually exclusive\n\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
     if(znear_color < 0.f) znear_color = znear;
-    if(zfar_color  < 0.f) zfar_color  = zfar;
+    // In the --radius-auto mode, the default zfar is known only after we load
+    // the DEMs
+    if(zfar < 0.f && !radius_auto) zfar = HORIZONATOR_ZFAR_DEFAULT;
+    if(zfar_color < 0.f && zfar > 0.f) zfar_color = zfar;
 
     if(width >  0 && filename_image == NULL)
     {
@@ -372,14 +571,17 @@ int main(int argc, char* argv[])
 
     if(filename_image == NULL)
     {
-        glut_loop(render_texture, SRTM1,
+        glut_loop(render_texture, SRTM1, SRTM1_near_radius_m,
+                  polar_mesh_Naz,
                   lat, lon,
                   az_center_deg-az_radius_deg,
                   az_center_deg+az_radius_deg,
                   znear,zfar,znear_color,zfar_color,
-                  dir_dems, dir_tiles,
+                  radius_auto,
+                  dir_dems, dir_dems_SRTM1, dir_tiles,
                   tiles_name, tiles_url_fmt,
-                  allow_downloads);
+                  allow_downloads,
+                  report_overdraw);
         return 0;
     }
 
@@ -389,13 +591,22 @@ int main(int argc, char* argv[])
         if(!(strlen_filename_image >= 5 &&
              (0 == strcasecmp(".png", &filename_image[strlen_filename_image-4]) ||
               0 == strcasecmp(".pdf", &filename_image[strlen_filename_image-4]) ||
-              0 == strcasecmp(".svg", &filename_image[strlen_filename_image-4]))))
+              0 == strcasecmp(".svg", &filename_image[strlen_filename_image-4]) ||
+              0 == strcasecmp(".ppm", &filename_image[strlen_filename_image-4]))))
         {
-            fprintf(stderr, "--image MUST be given a '.png' or '.pdf' or '.svg' filename\n\n");
+            fprintf(stderr, "--image MUST be given a '.png' or '.pdf' or '.svg' or '.ppm' filename\n\n");
             fprintf(stderr, usage, argv[0]);
             return 1;
         }
     }
+    const bool tiled =
+        0 == strcasecmp(".ppm", &filename_image[strlen_filename_image-4]);
+    if(filename_ranges != NULL && !tiled)
+    {
+        fprintf(stderr, "--ranges makes sense only with a '.ppm' --image\n\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
 
     // The user gave me az referring to the center of the pixels at the
     // edge. I need to convert them to represent the edges of the viewport.
@@ -410,9 +621,26 @@ int main(int argc, char* argv[])
         height = (int)roundf( (float)width * fovy_deg / az_radius_deg);
     }
 
-    uint8_t* pool = NULL;
+    if(tiled)
+        return render_tiled(render_texture, SRTM1, SRTM1_near_radius_m,
+                            polar_mesh_Naz,
+                            lat, lon,
+                            az_center_deg-az_radius_deg,
+                            az_center_deg+az_radius_deg,
+                            width, height, tile_size,
+                            znear,zfar,znear_color,zfar_color,
+                            radius_auto,
+                            dir_dems, dir_dems_SRTM1, dir_tiles,
+                            tiles_name, tiles_url_fmt,
+                            allow_downloads,
+                            filename_image, filename_ranges) ? 0 : 1;
+
+    uint8_t* pool   = NULL;
     char*    image;
-    float* ranges;
+    float*   ranges;
+    // The annotated output links each part of the render to the map, so it
+    // wants the position of each pixel
+    double*  latlon = NULL;
     if(filename_image != NULL)
     {
         // rgb for the image and float for the depth
@@ -425,6 +653,16 @@ int main(int argc, char* argv[])
 
         ranges = (float*)pool;
         image  = (char*)&pool[width*height*sizeof(float)];
+
+        if(0 != strcasecmp(".png", &filename_image[strlen_filename_image-4]))
+        {
+            latlon = malloc(width*height*2*sizeof(double));
+            if(latlon == NULL)
+            {
+                MSG("latlon buffer malloc() failed");
+                return 1;
+            }
+        }
     }
 
 
@@ -434,17 +672,23 @@ int main(int argc, char* argv[])
                            lat, lon,
                            &viewer_z,
                            width, height,
-                           -1, zfar,
+                           -1, radius_auto ? -1.f : zfar,
+                           az_center_deg-az_radius_deg,
+                           az_center_deg+az_radius_deg,
                            true,
                            render_texture, SRTM1,
-                           dir_dems, dir_tiles,
+                           SRTM1_near_radius_m,
+                           polar_mesh_Naz,
+                           dir_dems, dir_dems_SRTM1, dir_tiles,
                            tiles_name, tiles_url_fmt,
-                           allow_downloads) )
+                           allow_downloads,
+                           false) )
     {
         fprintf(stderr, "horizonator_init() failed\n");
         return false;
     }
 
+    resolve_zfar(&ctx, &zfar, &zfar_color);
     if(!horizonator_set_zextents(&ctx,
                                  znear, zfar, znear_color, zfar_color))
         return false;
@@ -457,11 +701,15 @@ int main(int argc, char* argv[])
         return false;
     }
 
-    if(!horizonator_render_offscreen(&ctx, image, ranges))
+    ctx.count_overdraw = report_overdraw;
+    if(!horizonator_render_offscreen(&ctx, image, ranges, latlon, NULL))
     {
         fprintf(stderr, "render failed\n");
         return 1;
     }
+    if(report_overdraw)
+        fprintf(stderr, "overdraw: %.2f fragments per pixel\n",
+                (double)ctx.overdraw_samples / (double)(width*height));
 
     if(filename_image != NULL)
     {
@@ -497,7 +745,8 @@ int main(int argc, char* argv[])
             const int N_pois = (int)(sizeof(pois) / sizeof(pois[0]));
 
             annotate(filename_image,
-                     (uint8_t*)image, ranges, width, height, cut_off_bottom_px,
+                     (uint8_t*)image, ranges, latlon,
+                     width, height, cut_off_bottom_px,
                      pois, N_pois,
                      lat, lon,
                      az_center_deg-az_radius_deg,
@@ -506,6 +755,7 @@ int main(int argc, char* argv[])
         }
 
         free(pool);
+        free(latlon);
     }
 
     return 0;
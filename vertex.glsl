@@ -1,31 +1,94 @@
 /* -*- c -*- */
 
-#version 420
+// The #version and the #defines selecting the variant are prepended by
+// compile_program() in horizonator-lib.c. The variants:
+//
+// - HORIZONATOR_TEXTURED: texture the terrain with the OSM tiles. Otherwise
+//   it's colored by range
+// - HORIZONATOR_CACHED: read the viewer-relative coordinates of each vertex
+//   from polar_cached instead of computing them
+// - HORIZONATOR_DEPTH_ONLY: only the depth is rendered, with no color. Without
+//   HORIZONATOR_GEO there's no fragment shader at all
+// - HORIZONATOR_GEO: the fragment shader also writes the position of the
+//   terrain in each pixel to a second render target: the lat, lon offsets from
+//   the viewer, in degrees, and the elevation, in meters
+// - HORIZONATOR_CAPTURE: compute the viewer-relative coordinates of each
+//   vertex into polar_feedback, which the CPU code captures with transform
+//   feedback to fill the cache. Nothing is drawn
+// - HORIZONATOR_PANORAMA: don't project the vertices. geometry.glsl projects
+//   each triangle into each sector of the panorama. The per-vertex outputs go
+//   to the geometry shader, which passes them on to the fragment shader
+// - HORIZONATOR_RESAMPLE: draw one triangle covering the viewport, with no
+//   vertex data. The fragment shader fills it in from the panorama cache
+//
+// The viewer-relative coordinates are (azimuth, elevation angle, range,
+// horizontal range)
 
 layout (location = 0) in vec3 vertex;
 
-// We receive these from the CPU code
+#if defined HORIZONATOR_CACHED
+layout (location = 1) in vec4 polar_cached;
+#elif defined HORIZONATOR_CAPTURE
+out vec4 polar_feedback;
+#endif
+
+// We receive these from the CPU code. The view state is in a uniform block,
+// mirrored by horizonator_view_t in horizonator.h: the two must match. The
+// rest are set per draw
+layout (std140, binding = 0) uniform horizonator_view
+{
+    float az_deg0, az_deg1;
+    float aspect;
+    float viewer_z;
+    float viewer_lat, cos_viewer_lat;
+    float texturemap_lon0,  texturemap_lon1;
+    float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
+    float znear, zfar;
+    float znear_color, zfar_color;
+    int   NtilesX, NtilesY;
+    int   osmtile_lowestX, osmtile_lowestY;
+    float el_deg_center;
+};
 uniform float viewer_cell_i, viewer_cell_j;
-uniform float viewer_z;
 uniform float DEG_PER_CELL;
-uniform float cos_viewer_lat;
-uniform float az_deg0, az_deg1;
-uniform float aspect;
 
-// For texturing. If we're not texturing, NtilesX will be 0
-uniform float viewer_lat;
-uniform float origin_cell_lon_deg, origin_cell_lat_deg;
-uniform float texturemap_lon0,  texturemap_lon1;
-uniform float texturemap_dlat0, texturemap_dlat1, texturemap_dlat2;
-uniform int NtilesX, NtilesY;
-uniform int osmtile_lowestX, osmtile_lowestY;
+// The azimuths are unwrapped to lie within pi of the center of the view. The
+// triangles straddling the seam behind the viewer would then span the whole
+// view. The CPU code draws those with seam_side = -1 or 1 instead: the
+// azimuths are then unwrapped around the seam, and the triangles end up on
+// the left or on the right of the view
+uniform int seam_side;
 
-uniform float znear, zfar;
-uniform float znear_color, zfar_color;
+#ifdef HORIZONATOR_PANORAMA
+out vec4 polar_vertex;
+// geometry.glsl receives these, and sends the fragment shader its own
+#define rgb_fragment rgb_vertex
+#define tex_fragment tex_vertex
+#endif
 
 // We send these to the fragment shader
-out vec3 rgb;
-out vec2 tex;
+#ifndef HORIZONATOR_DEPTH_ONLY
+out vec3 rgb_fragment;
+#endif
+
+#ifdef HORIZONATOR_GEO
+// The azimuth and elevation angle are linear in the screen coordinates, so
+// their interpolated values are exactly those of each pixel. The horizontal
+// range is interpolated like the depth. The fragment shader computes the
+// position from these, and from geo_viewer: (cos_viewer_lat, viewer_z)
+out vec3 geo_fragment;
+flat out vec2 geo_viewer;
+#endif
+
+#ifdef HORIZONATOR_TEXTURED
+uniform float origin_cell_lon_deg, origin_cell_lat_deg;
+out vec2 tex_fragment;
+#endif
+
+#ifdef HORIZONATOR_RESAMPLE
+// The normalized device coordinates of each pixel
+out vec2 resample_ndc;
+#endif
 
 const float Rearth = 6371000.0;
 const float pi     = 3.14159265358979;
@@ -38,6 +101,7 @@ float unwrap_near_rad(float x, float near)
 }
 
 
+#ifdef HORIZONATOR_TEXTURED
 // OSM tiles (and everybody else's too) use the spherical equirectangular
 // projection to map corners of each tile to lat/lon coords. Inside each tile,
 // the pixel coords are linear with lat/lon.
@@ -59,9 +123,18 @@ float get_ytexture( float dlat )
     float y_texture = dlat * (dlat*texturemap_dlat2 + texturemap_dlat1) + texturemap_dlat0;
     return 1.0 - (y_texture - float(osmtile_lowestY)) / float(NtilesY);
 }
+#endif
 
 void main(void)
 {
+#ifdef HORIZONATOR_RESAMPLE
+    // Vertices 0,1,2 are at (-1,-1), (3,-1), (-1,3)
+    resample_ndc = vec2( float((gl_VertexID & 1) << 2) - 1.,
+                         float((gl_VertexID & 2) << 1) - 1. );
+    gl_Position  = vec4(resample_ndc, 0., 1.);
+    return;
+#endif
+
     /*
       I do this in the tangent plane, ignoring the spherical (and even
       ellipsoidal) nature of the Earth. It is close-enough. Python script to
@@ -87,77 +160,78 @@ void main(void)
       better, but in the near-term this is more than good-enough.
      */
 
-    float distance_ne;
-
-    // Several different paths exist for the data processing, with different
-    // amounts of the math done in the CPU or GPU. The corresponding path must
-    // be selected in the CPU code in horizonator_init()
-    if(false)
-    {
-        distance_ne = vertex.z;
-        gl_Position = vec4( vertex.x,
-                            vertex.y * aspect,
-                            (distance_ne - znear) / (zfar - znear) * 2. - 1.,
-                            1.0 );
-    }
-    else if(false)
+    float i = vertex.x;
+    float j = vertex.y;
+
+#ifdef HORIZONATOR_CACHED
+    vec4 polar = polar_cached;
+#else
+    vec2 en =
+        vec2( (i - viewer_cell_i) * DEG_PER_CELL * Rearth * pi/180. * cos_viewer_lat,
+              (j - viewer_cell_j) * DEG_PER_CELL * Rearth * pi/180. );
+    vec3 enh = vec3( en.x, en.y, vertex.z - viewer_z );
+
+    vec4 polar = vec4( atan(en.x, en.y),
+                       atan(enh.z, length(en)),
+                       length(enh),
+                       length(en) );
+#ifdef HORIZONATOR_CAPTURE
+    polar_feedback = polar;
+    return;
+#endif
+#endif
+
+#ifdef HORIZONATOR_TEXTURED
     {
-        distance_ne = length(vertex.xy);
-        gl_Position = vec4( atan(vertex.x, vertex.y) / pi,
-                            atan(vertex.z, distance_ne) / pi * aspect,
-                            (distance_ne - znear) / (zfar - znear) * 2. - 1.,
-                            1.0 );
-    }
-    else
-    {
-        float i = vertex.x;
-        float j = vertex.y;
+        float lon  = radians( origin_cell_lon_deg + i * DEG_PER_CELL );
+        float lat  = radians( origin_cell_lat_deg + j * DEG_PER_CELL );
 
-        if(NtilesX != 0)
-        {
-            // we're texturing
-            float lon  = radians( origin_cell_lon_deg + i * DEG_PER_CELL );
-            float lat  = radians( origin_cell_lat_deg + j * DEG_PER_CELL );
+        float dlat = lat - viewer_lat;
+        float x_texture = get_xtexture( lon );
+        float y_texture = get_ytexture( dlat );
+        tex_fragment = vec2(x_texture, y_texture);
+    }
+#endif
 
-            float dlat = lat - viewer_lat;
-            float x_texture = get_xtexture( lon );
-            float y_texture = get_ytexture( dlat );
-            tex = vec2(x_texture, y_texture);
-        }
+    float distance_ne = polar.w;
 
-        vec2 en =
-            vec2( (i - viewer_cell_i) * DEG_PER_CELL * Rearth * pi/180. * cos_viewer_lat,
-                  (j - viewer_cell_j) * DEG_PER_CELL * Rearth * pi/180. );
-        vec3 enh = vec3( en.x, en.y, vertex.z - viewer_z );
+#ifdef HORIZONATOR_PANORAMA
+    polar_vertex = polar;
+#else
+    float az_rad      = polar.x;
 
-        distance_ne = length(en);
-        float az_rad = atan(en.x, en.y);
+    // az = 0:     North
+    // az = 90deg: East
 
-        // az = 0:     North
-        // az = 90deg: East
+    float az_rad0 = radians(az_deg0);
+    float az_rad1 = radians(az_deg1);
 
-        float az_rad0 = radians(az_deg0);
-        float az_rad1 = radians(az_deg1);
+    // az_rad1 should be within 2pi of az_rad0 and az_rad1 > az_rad0
+    az_rad1 = unwrap_near_rad(az_rad1-az_rad0, pi) + az_rad0;
 
-        // az_rad1 should be within 2pi of az_rad0 and az_rad1 > az_rad0
-        az_rad1 = unwrap_near_rad(az_rad1-az_rad0, pi) + az_rad0;
+    // in [0,2pi]
+    float az_rad_center = (az_rad0 + az_rad1)/2.;
 
-        // in [0,2pi]
-        float az_rad_center = (az_rad0 + az_rad1)/2.;
+    az_rad = unwrap_near_rad(az_rad, az_rad_center + float(seam_side)*pi);
 
-        az_rad = unwrap_near_rad(az_rad, az_rad_center);
+#ifdef HORIZONATOR_GEO
+    geo_fragment = vec3(az_rad, polar.y, distance_ne);
+    geo_viewer   = vec2(cos_viewer_lat, viewer_z);
+#endif
 
-        float az_ndc_per_rad = 2.0 / (az_rad1 - az_rad0);
+    float az_ndc_per_rad = 2.0 / (az_rad1 - az_rad0);
 
-        float az_ndc = (az_rad - az_rad_center) * az_ndc_per_rad;
-        float el_ndc = atan(enh.z, distance_ne) * aspect * az_ndc_per_rad;
-        gl_Position = vec4( az_ndc, el_ndc,
-                            ((length(enh) - znear) / (zfar - znear) * 2. - 1.),
-                            1.0 );
-    }
+    float az_ndc = (az_rad - az_rad_center) * az_ndc_per_rad;
+    float el_ndc = (polar.y - radians(el_deg_center)) * aspect * az_ndc_per_rad;
+    gl_Position = vec4( az_ndc, el_ndc,
+                        ((polar.z - znear) / (zfar - znear) * 2. - 1.),
+                        1.0 );
+#endif
 
-    rgb.r = max(min((distance_ne - znear_color) / (zfar_color - znear_color),
-                    1.0), 0.0);
-    rgb.g = 0.;
-    rgb.b = 0.;
+#ifndef HORIZONATOR_DEPTH_ONLY
+    rgb_fragment.r = max(min((distance_ne - znear_color) / (zfar_color - znear_color),
+                             1.0), 0.0);
+    rgb_fragment.g = 0.;
+    rgb_fragment.b = 0.;
+#endif
 }